@@ -0,0 +1,55 @@
+#pragma once
+
+// counts every heap allocation the program makes, by replacing the global operator new; include
+// in exactly one translation unit of a program (eg. bench.cpp, alloc_test.cpp)
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+inline std::atomic_uint64_t heap_allocs = 0;
+
+void* operator new(size_t size) {
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// eg. std::stable_sort's temporary buffer
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& nt) noexcept {
+    return operator new(size, nt);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
@@ -0,0 +1,255 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include "wms_server/cbor.h"
+#include "wms_server/wms.h"
+#include "wms_server/chunk_manager.h"
+#include "wms_server/chunk_store.h"
+#include "wms_server/packet_pool.h"
+#include "wms_server/send_queue.h"
+#include "wms_server/shm_cache.h"
+#include "wms_server/constants.h"
+#include "alloc_counter.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// checks that the steady state hot paths make no heap allocations once warm: encoding & decoding
+// packets through the packet pool, sending them through a client's send queue (encoded on one
+// thread & freed on its writer thread, as the server does), and serving chunks from the shared
+// chunk cache as the server's handlers do (reading the encoded chunk out of the cache & wrapping
+// it in a CHUNK packet). as
+// json_to_cbor() stands in for json::to_cbor() on those paths, it is also checked to encode the
+// geojson shipped with the repo exactly as json::to_cbor() does
+//
+// each case is run ALLOC_TEST_WARMUP times to fill the pool & scratch buffers, then
+// ALLOC_TEST_ITERATIONS more times, during which neither the process' allocation count nor the
+// pool's heap_allocs may grow. exits non zero if any case allocates; run with `make test`
+
+#define ALLOC_TEST_WARMUP 16
+#define ALLOC_TEST_ITERATIONS 1000
+
+static int failures = 0;
+
+// runs step until warm, then counts the allocations of ALLOC_TEST_ITERATIONS more runs
+static void check_no_allocs(const char* name, const function<int()>& step) {
+    for (int i = 0; i < ALLOC_TEST_WARMUP; i++) {
+        if (step()) {
+            printf("FAIL %s: error while warming up\n", name);
+            failures++;
+            return;
+        }
+    }
+
+    struct packet_pool_stats before, after;
+    get_packet_pool_stats(&before);
+    uint64_t start = heap_allocs.load(memory_order_relaxed);
+    int err = 0;
+    for (int i = 0; i < ALLOC_TEST_ITERATIONS && !err; i++)
+        err = step();
+    uint64_t allocs = heap_allocs.load(memory_order_relaxed) - start;
+    get_packet_pool_stats(&after);
+    uint64_t pool_allocs = after.heap_allocs - before.heap_allocs;
+
+    bool ok = !err && !allocs && !pool_allocs;
+    printf("%s %s: %lu heap allocations, %lu pool misses over %d iterations%s\n", ok ? "ok  " : "FAIL",
+           name, allocs, pool_allocs, ALLOC_TEST_ITERATIONS, err ? " (step failed)" : "");
+    if (!ok)
+        failures++;
+}
+
+// ----- json_to_cbor -----
+
+static void check_same_cbor(const string& name, const json& data) {
+    vector<uint8_t> ours;
+    json_to_cbor(data, &ours);
+    if (ours != json::to_cbor(data)) {
+        printf("FAIL json_to_cbor differs from json::to_cbor for %s\n", name.c_str());
+        failures++;
+    }
+}
+
+static void test_json_to_cbor() {
+    check_same_cbor("edge values", json::parse(R"([null, true, false, 0, 23, 24, 255, 256, 65535,
+        65536, 4294967295, 4294967296, -1, -24, -25, -256, -257, -4294967297, 18446744073709551615,
+        0.5, 11.545, -48.1, 1e300, 3.4e38, "", "a string longer than twenty three bytes", [], {},
+        {"b": 1, "a": [1, {"c": null}]}])"));
+
+    size_t files = 0;
+    for (const char* dir : { "demo", "godot_project/geo_json" }) {
+        error_code ec;
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(dir, ec)) {
+            if (!entry.is_regular_file() || entry.path().extension() != ".geojson")
+                continue;
+            ifstream f(entry.path());
+            json data = json::parse(f, NULL, false);
+            if (data.is_discarded())
+                continue;
+            check_same_cbor(entry.path().generic_string(), data);
+            files++;
+        }
+    }
+    printf("json_to_cbor checked against json::to_cbor on %zu geojson files\n", files);
+}
+
+// ----- packet codec -----
+
+static void test_packets() {
+    struct bbox bbox = { .minx = 11.54, .miny = 48.14, .maxx = 11.55, .maxy = 48.15 };
+    check_no_allocs("encode_packet_bbox", [&bbox]() {
+        struct packet packet;
+        return encode_packet_bbox(&bbox, &packet);
+    });
+
+    vector<struct chunk_id> ids;
+    for (int32_t i = 0; i < 25; i++)
+        ids.push_back({ .x = 1154 + i % 5, .y = 4814 + i / 5 });
+    check_no_allocs("encode_packet_chunk_request", [&ids]() {
+        struct packet packet;
+        return encode_packet_chunk_request(ids.data(), ids.size(), &packet, 0,
+                                           CHUNK_REQUEST_STREAM_LAYERS, 200);
+    });
+
+    struct packet request;
+    encode_packet_chunk_request(ids.data(), ids.size(), &request);
+    vector<struct chunk_id> decoded;
+    check_no_allocs("decode_packet_chunk_request", [&request, &decoded]() {
+        return decode_packet_chunk_request(&decoded, &request);
+    });
+
+    check_no_allocs("encode_packet_chunk (status only)", []() {
+        struct packet packet;
+        return encode_packet_chunk_cbor(&packet, { .x = 1154, .y = 4814 }, CHUNK_STATUS_PENDING);
+    });
+
+    json geojson = json::parse(R"({"type": "FeatureCollection", "features": [{"type": "Feature",
+        "geometry": {"type": "Point", "coordinates": [11.545, 48.145]}, "properties": {"name": "x"}}]})");
+    check_no_allocs("encode_packet_geojson", [&geojson]() {
+        struct packet packet;
+        return encode_packet_geojson(geojson, &packet);
+    });
+}
+
+// ----- send queue -----
+//
+// every allocation made by the writer thread is counted along with the test's own, as the
+// process' count is global
+
+static void test_send_queue() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        printf("FAIL could not create a socket pair for the send queue\n");
+        failures++;
+        return;
+    }
+    sockpp::stream_socket sock(fds[0]);
+    struct send_queue q;
+    thread writer(send_queue_run, &q, &sock);
+    // stands in for the client, reading everything sent
+    thread reader([fd = fds[1]]() {
+        char buf[4096];
+        while (read(fd, buf, sizeof(buf)) > 0) {}
+    });
+
+    struct bbox bbox = { .minx = 11.54, .miny = 48.14, .maxx = 11.55, .maxy = 48.15 };
+    check_no_allocs("send_queue (freed on the writer thread)", [&q, &bbox]() {
+        struct packet_pool_stats before, after;
+        get_packet_pool_stats(&before);
+        struct packet packet;
+        encode_packet_bbox(&bbox, &packet);
+        if (send_queue_push_chunk(&q, &packet, { .x = 1154, .y = 4814 }, SLOW_CLIENT_DROP))
+            return 1;
+        // waits for the writer to free the payload, handing it back to this thread's pool, so
+        // the next packet can be drawn from it
+        do {
+            this_thread::yield();
+            get_packet_pool_stats(&after);
+        } while (after.remote_returns == before.remote_returns);
+        return 0;
+    });
+
+    send_queue_close(&q);
+    writer.join();
+    shutdown(fds[0], SHUT_RDWR);
+    reader.join();
+    sock.close();
+    close(fds[1]);
+}
+
+// ----- serving cached chunks -----
+//
+// as in bench.cpp, GEOJSON_PATH is relative to the working directory, so the test's one chunk is
+// written to a store in a directory of its own under the system temp directory
+
+static const char* const layer_json[][2] = {
+    { "points", R"({"type": "FeatureCollection", "features": [{"type": "Feature", "geometry":
+        {"type": "Point", "coordinates": [11.545, 48.145]}, "properties": {"name": "a"}}]})" },
+    { "lines", R"({"type": "FeatureCollection", "features": [{"type": "Feature", "geometry":
+        {"type": "LineString", "coordinates": [[11.541, 48.141], [11.549, 48.149]]},
+        "properties": {"highway": "residential"}}]})" },
+};
+
+static void test_cached_chunks() {
+    filesystem::path root = filesystem::temp_directory_path()
+        / format("geoframework_alloc_test_{}", getpid());
+    filesystem::path cwd = filesystem::current_path();
+    error_code ec;
+    filesystem::create_directories(root / GEOJSON_PATH, ec);
+    filesystem::current_path(root);
+
+    struct chunk_id id = { .x = 1154, .y = 4814 };
+    for (const auto& [layer, body] : layer_json)
+        ofstream(filesystem::path(GEOJSON_PATH) / (get_chunk_filename(id) + "_" + layer + ".geojson")) << body;
+
+    string cache_name = format("/geo_alloc_test_{}", getpid());
+    if (chunk_store_open(0) || open_shared_chunk_cache(cache_name)) {
+        printf("FAIL could not set up the chunk store & shared chunk cache\n");
+        failures++;
+    } else {
+        // the handler's buffer, which keeps its capacity from one chunk to the next
+        vector<uint8_t> geodata;
+        check_no_allocs("serve cached chunk", [id, &geodata]() {
+            if (!get_chunk_cbor_local(id, &geodata))
+                return 1;
+            struct packet packet;
+            return encode_packet_chunk_cbor(&packet, id, CHUNK_STATUS_OK, geodata.data(), geodata.size());
+        });
+        check_no_allocs("serve cached chunk (bbox request)", [id, &geodata]() {
+            if (!get_chunk_cbor_local(id, &geodata))
+                return 1;
+            struct packet packet;
+            return encode_packet_geojson_cbor(geodata.data(), geodata.size(), &packet);
+        });
+    }
+
+    shm_unlink(format("{}_f{}_v{}", cache_name, SHM_CACHE_FORMAT, GEODATA_VERSION).c_str());
+    filesystem::current_path(cwd);
+    filesystem::remove_all(root, ec);
+}
+
+int main() {
+    test_json_to_cbor();
+    test_packets();
+    test_send_queue();
+    test_cached_chunks();
+
+    if (failures) {
+        printf("%d allocation checks failed\n", failures);
+        return 1;
+    }
+    printf("all allocation checks passed\n");
+    return 0;
+}
@@ -0,0 +1,298 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <nlohmann/json.hpp>
+
+#include "wms_server/cbor.h"
+#include "wms_server/wms.h"
+#include "wms_server/chunk_manager.h"
+#include "wms_server/chunk_store.h"
+#include "wms_server/constants.h"
+#include "alloc_counter.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// microbenchmarks for the hot paths of the server & client: the packet codec, bbox partitioning
+// and the lookup of locally stored chunks
+//
+// run with
+//   ./bench --benchmark_out=bench.json --benchmark_out_format=json
+// (or `make bench_json`) to keep results to compare over time; --benchmark_filter=<regex> runs a
+// subset, eg. the largest synthetic stores take a while to create
+
+// ----- allocation counting -----
+//
+// every heap allocation made by the process is counted (see alloc_counter.h), so benchmarks can
+// report how many each iteration makes (eg. encoding packets should make none once the packet
+// pool is warm)
+
+// records the allocations made per iteration since start as a counter on the benchmark
+static void report_allocs(benchmark::State& state, uint64_t start) {
+    state.counters["allocs_per_iter"] = benchmark::Counter(
+        (double)(heap_allocs.load(memory_order_relaxed) - start) / state.iterations());
+}
+
+// ----- packet codec -----
+
+static void bm_encode_cbor_header(benchmark::State& state) {
+    struct packet_header header = {
+        .payload_len = (uint64_t)state.range(0),
+        .type = packet_type_enum::PACKET_TYPE_GEOJSON,
+    };
+    char buf[CBOR_HEADER_BYTES];
+
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(encode_cbor_header(buf, sizeof(buf), &header));
+        benchmark::ClobberMemory();
+    }
+    report_allocs(state, start);
+}
+// payload lengths which encode as 1, 2, 4 and 8 byte integers
+BENCHMARK(bm_encode_cbor_header)->Arg(10)->Arg(1000)->Arg(100000)->Arg(10000000000LL);
+
+static void bm_decode_cbor_header(benchmark::State& state) {
+    struct packet_header header = {
+        .payload_len = (uint64_t)state.range(0),
+        .type = packet_type_enum::PACKET_TYPE_GEOJSON,
+    };
+    char buf[CBOR_HEADER_BYTES];
+    encode_cbor_header(buf, sizeof(buf), &header);
+
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        struct packet_header out;
+        benchmark::DoNotOptimize(decode_cbor_header(buf, sizeof(buf), &out));
+        benchmark::DoNotOptimize(out);
+    }
+    report_allocs(state, start);
+}
+BENCHMARK(bm_decode_cbor_header)->Arg(10)->Arg(1000)->Arg(100000)->Arg(10000000000LL);
+
+static void bm_encode_packet_bbox(benchmark::State& state) {
+    struct bbox bbox = { .minx = 11.54, .miny = 48.14, .maxx = 11.55, .maxy = 48.15 };
+
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        struct packet packet;
+        benchmark::DoNotOptimize(encode_packet_bbox(&bbox, &packet));
+        benchmark::DoNotOptimize(packet.payload.get());
+    }
+    report_allocs(state, start);
+}
+BENCHMARK(bm_encode_packet_bbox);
+
+// a square block of range(0) chunk ids
+static vector<struct chunk_id> chunk_block(size_t n) {
+    vector<struct chunk_id> ids;
+    size_t side = ceil(sqrt((double)n));
+    for (size_t i = 0; i < n; i++)
+        ids.push_back({ .x = 1154 + (int32_t)(i % side), .y = 4814 + (int32_t)(i / side) });
+    return ids;
+}
+
+static void bm_encode_packet_chunk_request(benchmark::State& state) {
+    vector<struct chunk_id> ids = chunk_block(state.range(0));
+
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        struct packet packet;
+        benchmark::DoNotOptimize(encode_packet_chunk_request(ids.data(), ids.size(), &packet));
+        benchmark::DoNotOptimize(packet.payload.get());
+    }
+    state.SetItemsProcessed(state.iterations() * ids.size());
+    report_allocs(state, start);
+}
+BENCHMARK(bm_encode_packet_chunk_request)->Arg(1)->Arg(25)->Arg(MAX_CHUNK_REQUEST_IDS);
+
+static void bm_decode_packet_chunk_request(benchmark::State& state) {
+    vector<struct chunk_id> ids = chunk_block(state.range(0));
+    struct packet packet;
+    encode_packet_chunk_request(ids.data(), ids.size(), &packet);
+
+    vector<struct chunk_id> out;
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(decode_packet_chunk_request(&out, &packet));
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * ids.size());
+    report_allocs(state, start);
+}
+BENCHMARK(bm_decode_packet_chunk_request)->Arg(1)->Arg(25)->Arg(MAX_CHUNK_REQUEST_IDS);
+
+// geojson fixtures shipped with the repo, loaded once before any benchmark runs
+struct geojson_fixture {
+    string name;
+    json data;
+    // the fixture encoded as a packet, for the decoding benchmark
+    struct packet packet;
+};
+static vector<struct geojson_fixture> fixtures;
+
+static void load_fixtures(const char* dir) {
+    error_code ec;
+    for (const filesystem::directory_entry& entry : filesystem::directory_iterator(dir, ec)) {
+        if (!entry.is_regular_file() || entry.path().extension() != ".geojson")
+            continue;
+
+        ifstream f(entry.path());
+        json data = json::parse(f, NULL, false);
+        if (data.is_discarded()) {
+            printf("skipping %s: not valid json\n", entry.path().c_str());
+            continue;
+        }
+
+        struct geojson_fixture fixture = { .name = entry.path().generic_string(), .data = std::move(data) };
+        if (encode_packet_geojson(fixture.data, &fixture.packet)) {
+            printf("skipping %s: could not be encoded\n", entry.path().c_str());
+            continue;
+        }
+        fixtures.push_back(std::move(fixture));
+    }
+}
+
+static void bm_encode_packet_geojson(benchmark::State& state, const struct geojson_fixture* fixture) {
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        struct packet packet;
+        benchmark::DoNotOptimize(encode_packet_geojson(fixture->data, &packet));
+        benchmark::DoNotOptimize(packet.payload.get());
+    }
+    state.SetBytesProcessed(state.iterations() * fixture->packet.header.payload_len);
+    report_allocs(state, start);
+}
+
+static void bm_decode_packet_geojson(benchmark::State& state, const struct geojson_fixture* fixture) {
+    uint64_t start = heap_allocs;
+    for (auto _ : state) {
+        json data = decode_packet_geojson(&fixture->packet);
+        benchmark::DoNotOptimize(data);
+    }
+    state.SetBytesProcessed(state.iterations() * fixture->packet.header.payload_len);
+    report_allocs(state, start);
+}
+
+// ----- partitioning -----
+
+// square bboxes range(0) chunks across
+static void bm_get_bbox_chunk_ids(benchmark::State& state) {
+    float side = (float)state.range(0) / BBOX_PER_DEG;
+    // a point part way into a chunk, so the bbox straddles partition boundaries
+    struct bbox bbox = { .minx = 11.543, .miny = 48.147, .maxx = 11.543f + side, .maxy = 48.147f + side };
+
+    size_t n = 0;
+    for (auto _ : state) {
+        vector<struct chunk_id> ids;
+        get_bbox_chunk_ids(&bbox, BBOX_PER_DEG_INT, &ids);
+        n = ids.size();
+        benchmark::DoNotOptimize(ids.data());
+    }
+    state.counters["chunks"] = n;
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(bm_get_bbox_chunk_ids)->RangeMultiplier(4)->Range(1, 1024);
+
+// ----- local chunk lookup -----
+//
+// the chunk store indexes GEOJSON_PATH, which is relative to the working directory, so each
+// synthetic store is created in a directory of its own under the system temp directory and the
+// benchmark changes into it while it runs. stores hold one (empty) file per layer per chunk, named
+// as the server names them
+
+static const char* const store_layers[] = { "points", "lines", "multilinestrings", "multipolygons" };
+#define STORE_LAYERS (sizeof(store_layers) / sizeof(store_layers[0]))
+
+static filesystem::path create_store(size_t nfiles) {
+    filesystem::path root = filesystem::temp_directory_path()
+        / ("geoframework_bench_store_" + to_string(nfiles));
+    filesystem::path dir = root / GEOJSON_PATH;
+
+    // reuse a store left by an earlier run
+    error_code ec;
+    if (filesystem::exists(dir / "complete", ec))
+        return root;
+
+    filesystem::remove_all(root, ec);
+    filesystem::create_directories(dir);
+
+    size_t nchunks = nfiles / STORE_LAYERS;
+    size_t side = ceil(sqrt((double)nchunks));
+    for (size_t i = 0; i < nchunks; i++) {
+        string fn = get_chunk_filename({ .x = (int32_t)(i % side), .y = (int32_t)(i / side) });
+        for (const char* layer : store_layers)
+            ofstream(dir / (fn + "_" + layer + ".geojson"));
+    }
+    // marker (without a .geojson extension) so an interrupted run isn't reused
+    ofstream(dir / "complete");
+    return root;
+}
+
+static void bm_check_chunk_local_file(benchmark::State& state) {
+    size_t nfiles = state.range(0);
+    filesystem::path root = create_store(nfiles);
+    filesystem::path cwd = filesystem::current_path();
+    filesystem::current_path(root);
+    chunk_store_open(0);
+
+    // a chunk in the middle of the store, and one that isn't stored at all
+    size_t side = ceil(sqrt((double)(nfiles / STORE_LAYERS)));
+    struct chunk_id hit = { .x = (int32_t)(side / 2), .y = (int32_t)(side / 2) };
+    struct chunk_id miss = { .x = -100, .y = -100 };
+    struct chunk_id query = state.range(1) ? hit : miss;
+
+    for (auto _ : state) {
+        vector<string> fs = check_chunk_local_file(query);
+        benchmark::DoNotOptimize(fs);
+    }
+    state.counters["files"] = nfiles;
+
+    filesystem::current_path(cwd);
+}
+// store size x whether the chunk is stored
+BENCHMARK(bm_check_chunk_local_file)
+    ->ArgsProduct({ { 1000, 10000, 100000, 1000000 }, { 1, 0 } });
+
+// listing the store into the index, as the server does as it starts
+static void bm_chunk_store_open(benchmark::State& state) {
+    size_t nfiles = state.range(0);
+    filesystem::path root = create_store(nfiles);
+    filesystem::path cwd = filesystem::current_path();
+    filesystem::current_path(root);
+
+    for (auto _ : state)
+        chunk_store_open(0);
+    state.counters["files"] = nfiles;
+
+    filesystem::current_path(cwd);
+}
+BENCHMARK(bm_chunk_store_open)
+    ->Arg(1000)->Arg(10000)->Arg(100000)->Arg(1000000)
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    load_fixtures("demo");
+    load_fixtures("godot_project/geo_json");
+    for (const struct geojson_fixture& fixture : fixtures) {
+        benchmark::RegisterBenchmark(("bm_encode_packet_geojson/" + fixture.name).c_str(),
+                                     bm_encode_packet_geojson, &fixture);
+        benchmark::RegisterBenchmark(("bm_decode_packet_geojson/" + fixture.name).c_str(),
+                                     bm_decode_packet_geojson, &fixture);
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
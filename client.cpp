@@ -37,6 +37,10 @@ int main() {
         string s;
         printf("press enter to quit:...\n");
         getline(cin, s);
+
+        // what godot would have collected each frame
+        ChunkArray delivered = client->drain_chunks(0, INT64_MAX);
+        printf("%zu chunks delivered\n", delivered.size());
         printf("quitting...\n");
     }
 
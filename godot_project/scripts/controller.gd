@@ -5,11 +5,19 @@ const GEOMETRY_SCALE = 60000
 const SCALE_SPAWN_TO_LOCATION = true
 const SCALE_SPEED_TO_LOCATION = true
 const GEOMETRY_HEIGHT = 1000
+# rough length of a degree of lattitude, for converting from metres to world units
+const METRES_PER_DEGREE = 111320.0
+# chunk geometry arrives in metres from each chunk's origin (the server reprojects it)
+const UNITS_PER_METRE = GEOMETRY_SCALE / METRES_PER_DEGREE
+# size of the marker drawn at each point, in world units
+const POINT_SIZE = 1.0
 
 var bias_speed = 0.1
 var bias_x = 0
 var bias_z = 0
-var geometry_dictionary = []
+# a degree of longitude shrinks away from the equator; world space is scaled to match around the
+# first chunk loaded, so chunks (which are in metres) line up with their neighbours
+var lon_scale = 1.0
 var bounds_set = false
 
 var collider
@@ -24,121 +32,43 @@ const color_materials : Array = [
 	preload("res://materials/grey.tres")
 	]
 
-func geojson_parse(geojson_string):
-	#create new json reader
-	var json = JSON.new()
-	#load geojson as string and parse
-	json.parse(geojson_string)
-	geometry_dictionary = []
+# chunks arrive from the client already decoded into packed arrays and built into a mesh (see
+# queue_fetch_chunk in wms_server/godot_bindings.h for the layout), so no json needs to be parsed
+# here
+func set_bounds(geometry):
 	if not bounds_set:
-		bias_x = (json.data[0].get("minx") + json.data[0].get("maxx")) / 2
-		bias_z = (json.data[0].get("miny") + json.data[0].get("maxy")) / 2
+		lon_scale = cos(deg_to_rad((geometry["miny"] + geometry["maxy"]) / 2))
+		# in world units, so the first chunk loaded ends up around the origin
+		bias_x = (geometry["minx"] + geometry["maxx"]) / 2 * GEOMETRY_SCALE * lon_scale
+		bias_z = (geometry["miny"] + geometry["maxy"]) / 2 * -1 * GEOMETRY_SCALE
 
 		bounds_set = true
-	
-	for e in json.data.slice(1):
-		geometry_dictionary.append(e.get("features"))
 
-func render_polygon(polygon, mesh, top_render_mode, side_render_mode, height):
-	var polygon_color = color_materials[randi() % 3]
-	mesh.surface_begin(side_render_mode, polygon_color)
-	for i in polygon.get("geometry").get("coordinates")[0]:
-		mesh.surface_add_vertex(scale_to_world_space(i[0],height,i[1]))
-		mesh.surface_add_vertex(scale_to_world_space(i[0],0,i[1]))
-	mesh.surface_end()
-	
-	mesh.surface_begin(side_render_mode, polygon_color)
-	for i in polygon.get("geometry").get("coordinates")[0]:
-		mesh.surface_add_vertex(scale_to_world_space(i[0],0,i[1]))
-		mesh.surface_add_vertex(scale_to_world_space(i[0],height,i[1]))
-	mesh.surface_end()
-	
-	polygon.get("geometry").get("coordinates")[0].reverse()
-	var top_geometry = polygon.get("geometry").get("coordinates")[0]
-	var top_vector2 = PackedVector2Array()
-	for i in top_geometry:
-		top_vector2.append(Vector2(i[0],i[1]))
-	var fixed = Geometry2D.triangulate_polygon (top_vector2)
-	mesh.surface_begin(top_render_mode, polygon_color)
-	for i in fixed:
-		mesh.surface_add_vertex(scale_to_world_space(top_vector2[i][0], height,top_vector2[i][1]))
-	mesh.surface_end()
-	fixed.reverse()
-	mesh.surface_begin(top_render_mode, polygon_color)
-	for i in fixed:
-		mesh.surface_add_vertex(scale_to_world_space(top_vector2[i][0], height,top_vector2[i][1]))
-	mesh.surface_end()
+# meshes are built by the client off the main thread (see wms_server/mesh_builder.h), in the same
+# units as scale_to_world_space, so all that is left here is to place each chunk's mesh
+func configure_client_meshes():
+	client.set_mesh_options(UNITS_PER_METRE, 0.01 * GEOMETRY_HEIGHT, 0.01, POINT_SIZE)
 
-func render_multipolygon(polygon, mesh, top_render_mode, render_mode, polygon_color, height):
-	for i in polygon.get("geometry").get("coordinates")[0]:
-		mesh.surface_begin(render_mode, polygon_color)
-		i.reverse()
-		for j in i:
-			mesh.surface_add_vertex(scale_to_world_space(j[0],height,j[1]))
-			mesh.surface_add_vertex(scale_to_world_space(j[0],0,j[1]))
-		mesh.surface_end()
-		mesh.surface_begin(render_mode, polygon_color)
-		var points_for_collider = []
-		for j in i:
-			mesh.surface_add_vertex(scale_to_world_space(j[0],0,j[1]))
-			mesh.surface_add_vertex(scale_to_world_space(j[0],height,j[1]))
-		mesh.surface_end()
-		collider = ConvexPolygonShape3D.new()
-		collider.points = points_for_collider
+# mesh vertices are relative to the chunk's origin (its minimum corner)
+func chunk_origin(geometry):
+	return scale_to_world_space(geometry["origin_lon"], 0, geometry["origin_lat"])
 
-
-	for i in polygon.get("geometry").get("coordinates")[0]:
-		i.reverse()
-		var top_geometry = i
-		var top_vector2 = PackedVector2Array()
-		for j in top_geometry:
-			top_vector2.append(Vector2(j[0],j[1]))
-		var fixed = Geometry2D.triangulate_polygon (top_vector2)
-		mesh.surface_begin(top_render_mode, polygon_color)
-		for j in fixed:
-			mesh.surface_add_vertex(scale_to_world_space(top_vector2[j][0], height, top_vector2[j][1]))
-		mesh.surface_end()
-		fixed.reverse()
-		mesh.surface_begin(top_render_mode, polygon_color)
-		for j in fixed:
-			mesh.surface_add_vertex(scale_to_world_space(top_vector2[j][0], height, top_vector2[j][1]))
-		mesh.surface_end()
-
-
-
-func render_line(line, mesh, render_mode):
-	mesh.surface_begin(render_mode, color_materials[3])
-	for i in line.get("geometry").get("coordinates"):
-		mesh.surface_add_vertex(scale_to_world_space(i[0],0,i[1]))
-	mesh.surface_end()
-
-func render_multiline(line, mesh, render_mode):
-	for i in line.get("geometry").get("coordinates"):
-		mesh.surface_begin(render_mode, color_materials[3])
-		for j in i:
-			mesh.surface_add_vertex(scale_to_world_space(i[0],0,i[1]))
-		mesh.surface_end()
-
-func render_point(point, mesh, render_mode):
-	mesh.surface_begin(render_mode)
-	point=point.get("geometry").get("coordinates")
-	#print(point)
-	point[1] = -1*point[1]
-	#makes triangle at point
-	mesh.surface_add_vertex(Vector3(point[0]*GEOMETRY_SCALE, 0, point[1]*GEOMETRY_SCALE+bias_x*GEOMETRY_SCALE*0.01))
-	mesh.surface_add_vertex(Vector3(point[0]*GEOMETRY_SCALE-bias_x*GEOMETRY_SCALE*0.01, 0, point[1]*GEOMETRY_SCALE))
-	mesh.surface_add_vertex(Vector3(point[0]*GEOMETRY_SCALE+bias_x*GEOMETRY_SCALE*0.01, 0, point[1]*GEOMETRY_SCALE))
-	mesh.surface_end()
+func apply_chunk_materials(instance, geometry):
+	var materials : PackedInt32Array = geometry["surface_materials"]
+	for i in range(materials.size()):
+		instance.set_surface_override_material(i, color_materials[materials[i]])
 
 func process_player_position(pos):
 	if bounds_set:
-		var x = (pos.x + bias_x) / GEOMETRY_SCALE
+		var x = (pos.x + bias_x) / (GEOMETRY_SCALE * lon_scale)
 		var y = -1 * (pos.z + bias_z) / GEOMETRY_SCALE
 		#print("current pos %f %f" % [x, y])
-		#client.move_chunk_center(x, y)
+		# called every frame; the client only does real work when the player changes chunk, and
+		# samples the position to prefetch along the player's path
+		client.move_chunk_center(x, y)
 		
 func scale_to_world_space(x_vert, y_vert, z_vert):
-	return Vector3(x_vert*GEOMETRY_SCALE-(bias_x), y_vert*GEOMETRY_HEIGHT, z_vert*-1*GEOMETRY_SCALE-(bias_z))
+	return Vector3(x_vert*GEOMETRY_SCALE*lon_scale-(bias_x), y_vert*GEOMETRY_HEIGHT, z_vert*-1*GEOMETRY_SCALE-(bias_z))
 
 func scale_to_geo_space(x_vert, y_vert, z_vert):
-	return Vector3(x_vert/GEOMETRY_SCALE+(bias_x), 0, (z_vert*-1)/GEOMETRY_SCALE+(bias_z))
+	return Vector3((x_vert+bias_x)/(GEOMETRY_SCALE*lon_scale), 0, -1*(z_vert+bias_z)/GEOMETRY_SCALE)
@@ -1,37 +1,36 @@
 extends MeshInstance3D
 
 var next_shapes = []
+# MeshInstance3D of each loaded chunk, keyed by the chunk's minimum corner
+var chunk_instances = {}
+
+# how long, and how many bytes of chunk data, each frame may spend adding newly delivered chunks
+# to the scene; chunks over budget wait in the client for the next frame
+const FRAME_BUDGET_USEC = 4000
+const FRAME_BUDGET_BYTES = 8 << 20
 
 func _notification(what):
 	if what == NOTIFICATION_WM_CLOSE_REQUEST or what == NOTIFICATION_WM_GO_BACK_REQUEST:
 		Controller.client.disconnect()
 
-var chunk_renderer_guard: Mutex = Mutex.new()
-func _on_client_chunk_loaded(x, y, geojson_string):
-	print("GODOT recieved signal from client that loaded %f %f" % [x, y])
-	#if Controller.bounds_set:
-	#	return
-	if geojson_string != null:
-		chunk_renderer_guard.lock()
-		Controller.geojson_parse(geojson_string)
-		for geometry_dataset in Controller.geometry_dictionary:
-			for shape in geometry_dataset:
-				if shape.get("geometry").get("type") == "LineString":
-					Controller.render_line(shape, mesh, Mesh.PRIMITIVE_LINE_STRIP)
-				#elif shape.get("geometry").get("type") == "MultiLineString":
-				#	Controller.render_multiline(shape, mesh, Mesh.PRIMITIVE_LINE_STRIP)
-				elif shape.get("geometry").get("type") == "Polygon":
-					Controller.render_polygon(shape, mesh, Mesh.PRIMITIVE_TRIANGLES, Mesh.PRIMITIVE_TRIANGLE_STRIP, 0.01)
-				elif shape.get("geometry").get("type") == "MultiPolygon":
-					Controller.render_multipolygon(shape, mesh, Mesh.PRIMITIVE_LINES, Mesh.PRIMITIVE_LINE_STRIP, Controller.color_materials[0], 0.014)
-				elif shape.get("geometry").get("type") == "Point":
-					Controller.render_point(shape, mesh, Mesh.PRIMITIVE_TRIANGLES)
-		chunk_renderer_guard.unlock()
+func place_chunk(key, geometry):
+	Controller.set_bounds(geometry)
+
+	var instance : MeshInstance3D = chunk_instances.get(key)
+	if instance == null:
+		instance = MeshInstance3D.new()
+		add_child(instance)
+		chunk_instances[key] = instance
+	instance.mesh = geometry["mesh"]
+	instance.position = Controller.chunk_origin(geometry)
+	Controller.apply_chunk_materials(instance, geometry)
 
 # Called when the node enters the scene tree for the first time.
 func _ready():
 	
-	Controller.client.chunk_loaded.connect(_on_client_chunk_loaded)
+	Controller.configure_client_meshes()
+	# persistent chunk cache, so the last visited area renders straight away (even offline)
+	Controller.client.open_disk_cache(ProjectSettings.globalize_path("user://chunk_cache.bin"), 0)
 	var res = Controller.client.connect_to_server("localhost", 12345)
 	print("connection result: %d" % res)
 	
@@ -43,5 +42,15 @@ func _ready():
 	
 
 # Called every frame. 'delta' is the elapsed time since the previous frame.
+# chunks are built on the client's worker threads and wait there until collected here, a few at a
+# time, so a burst of arrivals is spread over several frames
 func _process(delta):
-	pass
+	var start = Time.get_ticks_usec()
+	var bytes_left = FRAME_BUDGET_BYTES
+	while bytes_left > 0 and Time.get_ticks_usec() - start < FRAME_BUDGET_USEC:
+		var batch = Controller.client.drain_chunks(1, bytes_left)
+		if batch.is_empty():
+			break
+		for chunk in batch:
+			bytes_left -= chunk["bytes"]
+			place_chunk(Vector2(chunk["x"], chunk["y"]), chunk["geometry"])
@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+#include "wms_server/godot_bindings.h"
+#include "wms_server/constants.h"
+
+using namespace std;
+using namespace godot;
+
+// load generator: simulates a number of players moving around the map, each with its own GDClient
+// (compiled with -DNO_GODOT, like client.cpp), to measure how the server holds up
+//
+// every player calls move_chunk_center() at a fixed rate along a random walk or a recorded path,
+// and collects its delivered chunks with drain_chunks() as godot would each frame. a chunk is
+// counted as requested when it enters the player's render window, and its latency is the time
+// until it is first delivered (a streamed chunk is delivered again with each layer, which is only
+// counted as a redelivery); time to first chunk is measured from the player's first move
+//
+// to run offline, against a server built with `make server_offline` (see readme.md)
+
+typedef chrono::steady_clock steady;
+
+struct loadgen_options {
+    string host = "localhost";
+    in_port_t port = sockpp::TEST_PORT;
+    int players = 4;
+    // calls to move_chunk_center() per second, per player
+    float rate = 20;
+    float duration = 30;
+    // seconds between progress lines
+    float interval = 5;
+    // connections / fetch workers per player
+    int fetch_workers = 1;
+    int prefetch_budget = DEFAULT_PREFETCH_BUDGET;
+    // random walk: players start within spread chunks of the centre, move at speed chunks per
+    // second and turn by up to about turn radians per second
+    float centrex = 11.54, centrey = 48.14;
+    float spread = 10;
+    float speed = 0.5;
+    float turn = 1;
+    unsigned seed = 1;
+    // recorded path, replayed by every player instead of a random walk
+    string path_file;
+    // whether to silence the clients' own logging
+    bool quiet = false;
+    // where to save a trace of the run, if anywhere (see wms_server/trace.h)
+    string trace_file;
+};
+
+// a point of a recorded path, t seconds from its start
+struct path_point {
+    float t, x, y;
+};
+
+// results of one player, merged into the totals once it has finished
+struct player_result {
+    bool connected = false;
+    // seconds from the first move to the first delivered chunk, negative if none arrived
+    double first_chunk = -1;
+    vector<double> latencies;
+    uint64_t chunks = 0;
+    uint64_t bytes = 0;
+    // chunks delivered without the player having asked for them (eg. a bbox fetch covering more
+    // than the render window)
+    uint64_t unsolicited = 0;
+    // deliveries of a chunk the player already holds (each further layer of a streamed chunk, or
+    // the fresh copy of a stale one), which aren't counted in chunks or bytes
+    uint64_t redelivered = 0;
+    // chunks that left the player's window before being delivered
+    uint64_t abandoned = 0;
+    // chunks still waiting for delivery when the run ended
+    uint64_t undelivered = 0;
+    uint64_t fetch_errors = 0;
+};
+
+// live totals for the progress lines
+static atomic_int players_connected = 0;
+static atomic_uint64_t total_chunks = 0;
+static atomic_uint64_t total_bytes = 0;
+
+// where the report is written; stdout, unless the clients' logging has been silenced
+static FILE* out = stdout;
+
+static int load_path(const string& fn, vector<struct path_point>* path) {
+    ifstream f(fn);
+    if (!f)
+        return 1;
+
+    string line;
+    while (getline(f, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        struct path_point p;
+        istringstream ss(line);
+        if (!(ss >> p.t >> p.x >> p.y))
+            return 2;
+        if (!path->empty() && p.t < path->back().t)
+            return 3;
+        path->push_back(p);
+    }
+    return path->empty() ? 2 : 0;
+}
+
+// position along a recorded path t seconds in, looping back to the start once it is over
+static void path_position(const vector<struct path_point>& path, double t, float* x, float* y) {
+    double span = path.back().t - path.front().t;
+    t = span > 0 ? path.front().t + fmod(t, span) : path.front().t;
+
+    auto it = upper_bound(path.begin(), path.end(), t,
+                          [](double t, const struct path_point& p) { return t < p.t; });
+    if (it == path.begin() || it == path.end()) {
+        const struct path_point& p = it == path.end() ? path.back() : path.front();
+        *x = p.x;
+        *y = p.y;
+        return;
+    }
+
+    const struct path_point& a = *(it - 1);
+    const struct path_point& b = *it;
+    float f = b.t > a.t ? (t - a.t) / (b.t - a.t) : 0;
+    *x = a.x + (b.x - a.x) * f;
+    *y = a.y + (b.y - a.y) * f;
+}
+
+static void run_player(int idx, const struct loadgen_options* opts,
+                       const vector<struct path_point>* path, struct player_result* result) {
+    GDClient* client = new GDClient();
+    client->set_fetch_workers(opts->fetch_workers);
+    client->set_prefetch(opts->prefetch_budget, DEFAULT_PREFETCH_SECONDS);
+
+    if (client->connect_to_server(opts->host, opts->port) != 0) {
+        delete client;
+        return;
+    }
+    int res = client->get_partition_info();
+    if (res <= 0) {
+        client->disconnect();
+        delete client;
+        return;
+    }
+    result->connected = true;
+    players_connected++;
+
+    mt19937 rng(opts->seed + idx);
+    uniform_real_distribution<float> unit(-1, 1);
+    normal_distribution<float> normal(0, 1);
+
+    float x = opts->centrex + unit(rng) * opts->spread / res;
+    float y = opts->centrey + unit(rng) * opts->spread / res;
+    float heading = unit(rng) * M_PI;
+    // players replaying a path are spread out along it
+    double path_offset = 0;
+    if (!path->empty())
+        path_offset = (path->back().t - path->front().t) * idx / opts->players;
+
+    // chunks requested but not yet delivered, with when they were requested, and chunks the
+    // client has delivered and still holds in its window (by key)
+    unordered_map<uint64_t, steady::time_point> pending;
+    unordered_set<uint64_t> shown;
+    bool cell_set = false;
+    int64_t cellx = 0, celly = 0;
+
+    steady::duration tick = chrono::duration_cast<steady::duration>(chrono::duration<double>(1 / opts->rate));
+    steady::time_point start = steady::now();
+    steady::time_point end = start + chrono::duration_cast<steady::duration>(chrono::duration<double>(opts->duration));
+    steady::time_point next = start;
+    steady::time_point last = start;
+
+    while (steady::now() < end) {
+        steady::time_point now = steady::now();
+        double dt = chrono::duration<double>(now - last).count();
+        last = now;
+
+        if (path->empty()) {
+            heading += normal(rng) * opts->turn * sqrt(dt);
+            x += cos(heading) * opts->speed * dt / res;
+            y += sin(heading) * opts->speed * dt / res;
+        } else {
+            path_position(*path, path_offset + chrono::duration<double>(now - start).count(), &x, &y);
+        }
+
+        client->move_chunk_center(x, y);
+
+        // keep track of the window the client is fetching for, mirroring its render & lazy
+        // distances
+        int64_t newx = floor(x * res), newy = floor(y * res);
+        if (!cell_set || newx != cellx || newy != celly) {
+            cellx = newx;
+            celly = newy;
+            cell_set = true;
+
+            for (auto it = pending.begin(); it != pending.end();) {
+                struct chunk_id id = { .x = (int32_t)(it->first >> 32), .y = (int32_t)it->first };
+                if (abs(id.x - cellx) > DEFAULT_LAZY_DIST || abs(id.y - celly) > DEFAULT_LAZY_DIST) {
+                    result->abandoned++;
+                    it = pending.erase(it);
+                } else {
+                    it++;
+                }
+            }
+            // chunks that leave the window are delivered again when the player comes back
+            for (auto it = shown.begin(); it != shown.end();) {
+                struct chunk_id id = { .x = (int32_t)(*it >> 32), .y = (int32_t)*it };
+                if (abs(id.x - cellx) > DEFAULT_LAZY_DIST || abs(id.y - celly) > DEFAULT_LAZY_DIST)
+                    it = shown.erase(it);
+                else
+                    it++;
+            }
+            for (int64_t cx = cellx - DEFAULT_RENDER_DIST; cx <= cellx + DEFAULT_RENDER_DIST; cx++) {
+                for (int64_t cy = celly - DEFAULT_RENDER_DIST; cy <= celly + DEFAULT_RENDER_DIST; cy++) {
+                    struct chunk_id id = { .x = (int32_t)cx, .y = (int32_t)cy };
+                    uint64_t key = chunk_id_key(&id);
+                    if (!shown.count(key))
+                        pending.emplace(key, now);
+                }
+            }
+        }
+
+        // what godot would collect this frame
+        ChunkArray delivered = client->drain_chunks(0, 0);
+        now = steady::now();
+        for (const struct delivered_chunk& c : delivered) {
+            struct chunk_id id = { .x = (int32_t)round(c.x * res), .y = (int32_t)round(c.y * res) };
+            uint64_t key = chunk_id_key(&id);
+
+            // each chunk counts once, when its first geometry arrives
+            if (shown.count(key)) {
+                result->redelivered++;
+                continue;
+            }
+            if (result->first_chunk < 0)
+                result->first_chunk = chrono::duration<double>(now - start).count();
+
+            auto it = pending.find(key);
+            if (it != pending.end()) {
+                result->latencies.push_back(chrono::duration<double>(now - it->second).count());
+                pending.erase(it);
+            } else {
+                result->unsolicited++;
+            }
+            shown.insert(key);
+
+            result->chunks++;
+            result->bytes += c.bytes;
+            total_chunks++;
+            total_bytes += c.bytes;
+        }
+
+        next += tick;
+        // a player that falls behind skips ticks rather than trying to catch up
+        if (next < now)
+            next = now;
+        this_thread::sleep_until(next);
+    }
+
+    result->undelivered = pending.size();
+    result->fetch_errors = client->get_fetch_errors();
+
+    client->disconnect();
+    delete client;
+    players_connected--;
+}
+
+// value at percentile p (0 to 100) of sorted
+static double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = min(sorted.size() - 1, (size_t)ceil(p / 100 * sorted.size()) - (p > 0));
+    return sorted[i];
+}
+
+static void print_usage(const char* name) {
+    printf("usage: %s [options]\n"
+           "  -H host       server host (localhost)\n"
+           "  -p port       server port (%d)\n"
+           "  -n players    number of simulated players (4)\n"
+           "  -r rate       moves per second per player (20)\n"
+           "  -d seconds    length of the run (30)\n"
+           "  -i seconds    interval between progress lines (5)\n"
+           "  -w workers    connections / fetch workers per player (1)\n"
+           "  -b budget     prefetch budget per player, 0 to disable (%d)\n"
+           "  -c lon,lat    centre of the random walks (11.54,48.14)\n"
+           "  -R chunks     players start up to this many chunks from the centre (10)\n"
+           "  -s speed      random walk speed in chunks per second (0.5)\n"
+           "  -t turn       random walk turning rate, radians per sqrt second (1)\n"
+           "  -S seed       random seed (1)\n"
+           "  -P file       replay a recorded path instead: lines of `seconds lon lat`\n"
+           "  -q            silence the clients' own logging\n"
+           "  -T file       trace the clients, saving the trace to file at the end\n",
+           name, sockpp::TEST_PORT, DEFAULT_PREFETCH_BUDGET);
+}
+
+int main(int argc, char** argv) {
+    struct loadgen_options opts;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:n:r:d:i:w:b:c:R:s:t:S:P:qT:h")) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'n': opts.players = atoi(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'i': opts.interval = atof(optarg); break;
+        case 'w': opts.fetch_workers = atoi(optarg); break;
+        case 'b': opts.prefetch_budget = atoi(optarg); break;
+        case 'c':
+            if (sscanf(optarg, "%f,%f", &opts.centrex, &opts.centrey) != 2) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'R': opts.spread = atof(optarg); break;
+        case 's': opts.speed = atof(optarg); break;
+        case 't': opts.turn = atof(optarg); break;
+        case 'S': opts.seed = atoi(optarg); break;
+        case 'P': opts.path_file = optarg; break;
+        case 'q': opts.quiet = true; break;
+        case 'T': opts.trace_file = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (opts.players <= 0 || opts.rate <= 0 || opts.duration <= 0 || opts.interval <= 0 ||
+        opts.fetch_workers <= 0 || opts.fetch_workers > MAX_FETCH_WORKERS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    vector<struct path_point> path;
+    if (!opts.path_file.empty() && load_path(opts.path_file, &path)) {
+        printf("could not read path from %s\n", opts.path_file.c_str());
+        return 1;
+    }
+
+    if (opts.players * opts.fetch_workers > MAX_CLIENTS)
+        printf("warning: %d connections is more than the server's limit of %d clients\n",
+               opts.players * opts.fetch_workers, MAX_CLIENTS);
+
+    // the clients log as they go (every chunk they handle, in debug builds); keep the report
+    // readable by sending their output to /dev/null and the report to a copy of stdout
+    if (opts.quiet) {
+        fflush(stdout);
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+            printf("could not silence client logging\n");
+            return 1;
+        }
+    }
+
+    fprintf(out, "%d players at %.1f moves/s for %.0fs against %s:%d (%s)\n", opts.players,
+            opts.rate, opts.duration, opts.host.c_str(), opts.port,
+            path.empty() ? "random walk" : opts.path_file.c_str());
+
+    // tracing is process wide, so covers every player
+    if (!opts.trace_file.empty())
+        trace_set_enabled(true);
+
+    vector<struct player_result> results(opts.players);
+    vector<thread> threads;
+    steady::time_point start = steady::now();
+    for (int i = 0; i < opts.players; i++)
+        threads.emplace_back(run_player, i, &opts, &path, &results[i]);
+
+    // progress, until every player has finished
+    steady::duration interval = chrono::duration_cast<steady::duration>(chrono::duration<double>(opts.interval));
+    steady::time_point end = start + chrono::duration_cast<steady::duration>(chrono::duration<double>(opts.duration));
+    steady::time_point last = start;
+    uint64_t last_chunks = 0, last_bytes = 0;
+    while (last < end) {
+        this_thread::sleep_until(min(last + interval, end));
+
+        steady::time_point now = steady::now();
+        uint64_t chunks = total_chunks, bytes = total_bytes;
+        double span = chrono::duration<double>(now - last).count();
+        fprintf(out, "[%6.1fs] %d players connected, %lu chunks (%.1f chunks/s, %.2f MiB/s)\n",
+                chrono::duration<double>(now - start).count(), (int)players_connected, chunks,
+                (chunks - last_chunks) / span, (bytes - last_bytes) / span / (1 << 20));
+        fflush(out);
+        last = now;
+        last_chunks = chunks;
+        last_bytes = bytes;
+    }
+
+    for (thread& t : threads)
+        t.join();
+    double elapsed = chrono::duration<double>(steady::now() - start).count();
+
+    // merge the results of every player
+    struct player_result total;
+    vector<double> first_chunks;
+    int connected = 0, starved = 0;
+    for (struct player_result& r : results) {
+        if (!r.connected)
+            continue;
+        connected++;
+        if (r.first_chunk >= 0)
+            first_chunks.push_back(r.first_chunk);
+        else
+            starved++;
+        total.latencies.insert(total.latencies.end(), r.latencies.begin(), r.latencies.end());
+        total.chunks += r.chunks;
+        total.bytes += r.bytes;
+        total.unsolicited += r.unsolicited;
+        total.redelivered += r.redelivered;
+        total.abandoned += r.abandoned;
+        total.undelivered += r.undelivered;
+        total.fetch_errors += r.fetch_errors;
+    }
+    sort(first_chunks.begin(), first_chunks.end());
+    sort(total.latencies.begin(), total.latencies.end());
+
+    fprintf(out, "\n%d of %d players connected\n", connected, opts.players);
+
+    fprintf(out, "time to first chunk (ms):  ");
+    if (first_chunks.empty())
+        fprintf(out, "no chunks delivered\n");
+    else
+        fprintf(out, "min %.1f  p50 %.1f  p90 %.1f  max %.1f\n", first_chunks.front() * 1000,
+                percentile(first_chunks, 50) * 1000, percentile(first_chunks, 90) * 1000,
+                first_chunks.back() * 1000);
+
+    fprintf(out, "chunk latency (ms):        ");
+    if (total.latencies.empty())
+        fprintf(out, "no requested chunks delivered\n");
+    else
+        fprintf(out, "p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  (%zu chunks)\n",
+                percentile(total.latencies, 50) * 1000, percentile(total.latencies, 90) * 1000,
+                percentile(total.latencies, 99) * 1000, percentile(total.latencies, 99.9) * 1000,
+                total.latencies.back() * 1000, total.latencies.size());
+
+    fprintf(out, "throughput:                %.1f chunks/s, %.2f MiB/s (%lu chunks, %.1f MiB)\n",
+            total.chunks / elapsed, total.bytes / elapsed / (1 << 20), total.chunks,
+            (double)total.bytes / (1 << 20));
+
+    fprintf(out, "errors:                    %d connection failures, %lu fetch errors, "
+            "%d players without any chunk\n", opts.players - connected, total.fetch_errors, starved);
+    fprintf(out, "left undelivered:          %lu abandoned when the player moved on, %lu still "
+            "pending at the end\n", total.abandoned, total.undelivered);
+    fprintf(out, "unsolicited deliveries:    %lu\n", total.unsolicited);
+    fprintf(out, "redeliveries:              %lu (further layers of streamed chunks, fresh copies of "
+            "stale ones)\n", total.redelivered);
+
+    if (!opts.trace_file.empty()) {
+        GDClient client;
+        if (client.write_trace(opts.trace_file))
+            fprintf(out, "could not write trace to %s\n", opts.trace_file.c_str());
+        else
+            fprintf(out, "trace written to %s\n", opts.trace_file.c_str());
+    }
+    fflush(out);
+
+    return connected == opts.players && total.fetch_errors == 0 ? 0 : 2;
+}
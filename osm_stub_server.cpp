@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "sockpp/tcp_acceptor.h"
+
+#include "wms_server/constants.h"
+
+using namespace std;
+
+// stand in for the osm api's /api/0.6/map call, answering from a local osm xml extract so the
+// server's whole fetch -> gdal -> store path can be run & benchmarked without a network
+//
+//   ./osm_stub_server -p 8080 extract.osm
+//   OSM_API_URL=http://localhost:8080/api/0.6/map ./server
+//
+// a map request returns what the real api would for the extract: every node in the bbox, every
+// way using one of those nodes (with all of their nodes, even outside the bbox), and every
+// relation with one of those nodes or ways as a member, along with the relations that contain
+// those. the api's bbox area & node limits are enforced too
+//
+// latency, errors and a rate limit can be injected to see how the server copes with a slow or
+// unreliable api
+//
+// the extract is read line by line, which works for the xml written by the osm api, josm, osmium
+// & osmosis (one element or child tag per line); it is held in memory, so keep it to a city or
+// so
+
+// limits of the real api
+#define MAX_BBOX_AREA 0.25
+#define MAX_NODES 50000
+
+// largest request head accepted
+#define MAX_REQUEST_BYTES 16384
+
+#define DEFAULT_STUB_PORT 8080
+
+// an element of the extract, kept as its original xml text
+struct osm_node {
+    int64_t id;
+    double lat, lon;
+    string xml;
+};
+
+struct osm_way {
+    int64_t id;
+    vector<int64_t> refs;
+    string xml;
+};
+
+struct osm_member {
+    // 'n'ode, 'w'ay or 'r'elation
+    char type;
+    int64_t ref;
+};
+
+struct osm_relation {
+    int64_t id;
+    vector<struct osm_member> members;
+    string xml;
+};
+
+struct osm_extract {
+    vector<struct osm_node> nodes;
+    vector<struct osm_way> ways;
+    vector<struct osm_relation> relations;
+
+    // index of each node in nodes, by id
+    unordered_map<int64_t, uint32_t> node_index;
+    // ways each node is used by, and relations each element is a member of (keyed by member_key)
+    unordered_map<int64_t, vector<uint32_t>> node_ways;
+    unordered_map<uint64_t, vector<uint32_t>> member_relations;
+    // nodes in each cell of the partition grid, by chunk_key
+    unordered_map<uint64_t, vector<uint32_t>> grid;
+};
+
+struct stub_options {
+    in_port_t port = DEFAULT_STUB_PORT;
+    // added to every response: latency plus a uniformly random extra of up to jitter, in ms
+    int latency = 0;
+    int jitter = 0;
+    // fraction of requests answered with error_status instead
+    float error_rate = 0;
+    int error_status = 500;
+    // requests per second allowed, with bursts of up to burst (0 for no limit); requests over
+    // the limit get 429
+    float rate_limit = 0;
+    float burst = 1;
+    unsigned seed = 1;
+};
+
+static struct osm_extract extract;
+static struct stub_options opts;
+
+// shared by the connection threads for injecting faults
+static mutex fault_mutex;
+static mt19937 rng;
+// token bucket for the rate limit (under fault_mutex)
+static float tokens;
+static chrono::steady_clock::time_point tokens_time;
+
+static uint64_t member_key(char type, int64_t ref) {
+    return ((uint64_t)ref << 2) | (type == 'n' ? 0 : type == 'w' ? 1 : 2);
+}
+
+static uint64_t chunk_key(int64_t x, int64_t y) {
+    return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+}
+
+// value of attribute name in an xml element line, false if the line has no such attribute
+static bool get_attr(const string& line, const char* name, string* value) {
+    string pat = string(" ") + name + "=\"";
+    size_t start = line.find(pat);
+    if (start == string::npos)
+        return false;
+    start += pat.size();
+    size_t end = line.find('"', start);
+    if (end == string::npos)
+        return false;
+    *value = line.substr(start, end - start);
+    return true;
+}
+
+static bool get_attr_int(const string& line, const char* name, int64_t* value) {
+    string s;
+    if (!get_attr(line, name, &s))
+        return false;
+    *value = strtoll(s.c_str(), NULL, 10);
+    return true;
+}
+
+static bool get_attr_double(const string& line, const char* name, double* value) {
+    string s;
+    if (!get_attr(line, name, &s))
+        return false;
+    *value = strtod(s.c_str(), NULL);
+    return true;
+}
+
+static bool starts_with(const string& s, size_t off, const char* prefix) {
+    return s.compare(off, strlen(prefix), prefix) == 0;
+}
+
+// reads the extract at fn into extract
+// returns 0 on success, otherwise an error code
+static int load_extract(const char* fn) {
+    ifstream f(fn);
+    if (!f)
+        return 1;
+
+    string line;
+    // the element currently being read, if it has children; 0 for none
+    char open = 0;
+    while (getline(f, line)) {
+        size_t off = line.find_first_not_of(" \t");
+        if (off == string::npos)
+            continue;
+        bool closed = line.find("/>") != string::npos;
+
+        if (open) {
+            string* xml = open == 'n' ? &extract.nodes.back().xml
+                : open == 'w' ? &extract.ways.back().xml : &extract.relations.back().xml;
+            *xml += line;
+            *xml += '\n';
+
+            int64_t ref;
+            string type;
+            if (open == 'w' && starts_with(line, off, "<nd ") && get_attr_int(line, "ref", &ref)) {
+                extract.ways.back().refs.push_back(ref);
+            } else if (open == 'r' && starts_with(line, off, "<member ") &&
+                       get_attr(line, "type", &type) && get_attr_int(line, "ref", &ref)) {
+                extract.relations.back().members.push_back({ .type = type[0], .ref = ref });
+            } else if (starts_with(line, off, "</node") || starts_with(line, off, "</way") ||
+                       starts_with(line, off, "</relation")) {
+                open = 0;
+            }
+            continue;
+        }
+
+        if (starts_with(line, off, "<node ")) {
+            struct osm_node n;
+            if (!get_attr_int(line, "id", &n.id) || !get_attr_double(line, "lat", &n.lat) ||
+                !get_attr_double(line, "lon", &n.lon))
+                return 2;
+            n.xml = line + '\n';
+            extract.nodes.push_back(std::move(n));
+            if (!closed)
+                open = 'n';
+        } else if (starts_with(line, off, "<way ")) {
+            struct osm_way w;
+            if (!get_attr_int(line, "id", &w.id))
+                return 2;
+            w.xml = line + '\n';
+            extract.ways.push_back(std::move(w));
+            if (!closed)
+                open = 'w';
+        } else if (starts_with(line, off, "<relation ")) {
+            struct osm_relation r;
+            if (!get_attr_int(line, "id", &r.id))
+                return 2;
+            r.xml = line + '\n';
+            extract.relations.push_back(std::move(r));
+            if (!closed)
+                open = 'r';
+        }
+        // <?xml, <osm>, <bounds> etc. are regenerated for each response
+    }
+    if (open)
+        return 3;
+
+    for (uint32_t i = 0; i < extract.nodes.size(); i++) {
+        const struct osm_node& n = extract.nodes[i];
+        extract.node_index[n.id] = i;
+        extract.grid[chunk_key(floor(n.lon * BBOX_PER_DEG_INT), floor(n.lat * BBOX_PER_DEG_INT))].push_back(i);
+    }
+    for (uint32_t i = 0; i < extract.ways.size(); i++) {
+        for (int64_t ref : extract.ways[i].refs)
+            extract.node_ways[ref].push_back(i);
+    }
+    for (uint32_t i = 0; i < extract.relations.size(); i++) {
+        for (const struct osm_member& m : extract.relations[i].members)
+            extract.member_relations[member_key(m.type, m.ref)].push_back(i);
+    }
+    return 0;
+}
+
+static void sort_unique(vector<uint32_t>* v) {
+    sort(v->begin(), v->end());
+    v->erase(unique(v->begin(), v->end()), v->end());
+}
+
+// builds the response to a map request for the given bbox into body
+// returns the http status
+static int answer_map(double minlon, double minlat, double maxlon, double maxlat, string* body) {
+    if (!(minlon < maxlon && minlat < maxlat) || minlon < -180 || maxlon > 180 || minlat < -90 ||
+        maxlat > 90) {
+        *body = "The latitudes must be between -90 and 90, longitudes between -180 and 180 and "
+            "the minima must be less than the maxima.";
+        return 400;
+    }
+    if ((maxlon - minlon) * (maxlat - minlat) > MAX_BBOX_AREA) {
+        *body = "The maximum bbox size is 0.25, and your request was too large. Either request a "
+            "smaller area, or use planet.osm";
+        return 400;
+    }
+
+    vector<uint32_t> nodes, ways, relations;
+
+    // nodes in the bbox
+    for (int64_t x = floor(minlon * BBOX_PER_DEG_INT); x <= floor(maxlon * BBOX_PER_DEG_INT); x++) {
+        for (int64_t y = floor(minlat * BBOX_PER_DEG_INT); y <= floor(maxlat * BBOX_PER_DEG_INT); y++) {
+            auto cell = extract.grid.find(chunk_key(x, y));
+            if (cell == extract.grid.end())
+                continue;
+            for (uint32_t i : cell->second) {
+                const struct osm_node& n = extract.nodes[i];
+                if (n.lon >= minlon && n.lon <= maxlon && n.lat >= minlat && n.lat <= maxlat)
+                    nodes.push_back(i);
+            }
+        }
+    }
+    if (nodes.size() > MAX_NODES) {
+        *body = "You requested too many nodes (limit is " + to_string(MAX_NODES) + "). Either "
+            "request a smaller area, or use planet.osm";
+        return 400;
+    }
+
+    // ways using them, and the rest of those ways' nodes
+    for (uint32_t i : nodes) {
+        auto it = extract.node_ways.find(extract.nodes[i].id);
+        if (it != extract.node_ways.end())
+            ways.insert(ways.end(), it->second.begin(), it->second.end());
+    }
+    sort_unique(&ways);
+    size_t in_bbox = nodes.size();
+    for (uint32_t w : ways) {
+        for (int64_t ref : extract.ways[w].refs) {
+            auto it = extract.node_index.find(ref);
+            if (it != extract.node_index.end())
+                nodes.push_back(it->second);
+        }
+    }
+    sort_unique(&nodes);
+
+    // relations with any of the nodes in the bbox or ways as members, then the relations
+    // containing those
+    auto add_relations = [&relations](uint64_t key) {
+        auto it = extract.member_relations.find(key);
+        if (it != extract.member_relations.end())
+            relations.insert(relations.end(), it->second.begin(), it->second.end());
+    };
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const struct osm_node& n = extract.nodes[nodes[i]];
+        if (n.lon >= minlon && n.lon <= maxlon && n.lat >= minlat && n.lat <= maxlat)
+            add_relations(member_key('n', n.id));
+    }
+    for (uint32_t w : ways)
+        add_relations(member_key('w', extract.ways[w].id));
+    sort_unique(&relations);
+    size_t direct = relations.size();
+    for (size_t i = 0; i < direct; i++)
+        add_relations(member_key('r', extract.relations[relations[i]].id));
+    sort_unique(&relations);
+
+    char bounds[256];
+    snprintf(bounds, sizeof(bounds),
+             " <bounds minlat=\"%.7f\" minlon=\"%.7f\" maxlat=\"%.7f\" maxlon=\"%.7f\"/>\n",
+             minlat, minlon, maxlat, maxlon);
+
+    *body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<osm version=\"0.6\" generator=\"osm_stub_server\">\n";
+    *body += bounds;
+    for (uint32_t i : nodes)
+        *body += extract.nodes[i].xml;
+    for (uint32_t i : ways)
+        *body += extract.ways[i].xml;
+    for (uint32_t i : relations)
+        *body += extract.relations[i].xml;
+    *body += "</osm>\n";
+
+    printf("map %f,%f,%f,%f: %zu nodes in bbox, %zu nodes, %zu ways, %zu relations\n", minlon,
+           minlat, maxlon, maxlat, in_bbox, nodes.size(), ways.size(), relations.size());
+    return 200;
+}
+
+// decodes %XX escapes & '+' in a query string value
+static string url_decode(const string& s) {
+    string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) && isxdigit(s[i + 2])) {
+            out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else {
+            out += s[i] == '+' ? ' ' : s[i];
+        }
+    }
+    return out;
+}
+
+static const char* status_text(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Error";
+    }
+}
+
+static void send_response(sockpp::tcp_socket& sock, int status, const string& body) {
+    string head = "HTTP/1.1 " + to_string(status) + " " + status_text(status) + "\r\n"
+        "Content-Type: " + (status == 200 ? "text/xml" : "text/plain") + "; charset=utf-8\r\n"
+        "Content-Length: " + to_string(body.size()) + "\r\n";
+    if (status == 429)
+        head += "Retry-After: 1\r\n";
+    head += "Connection: close\r\n\r\n";
+
+    if (sock.write_n(head.data(), head.size()))
+        sock.write_n(body.data(), body.size());
+}
+
+// whether the request fits in the rate limit, taking a token if it does
+static bool take_token() {
+    if (opts.rate_limit <= 0)
+        return true;
+
+    lock_guard<mutex> guard(fault_mutex);
+    auto now = chrono::steady_clock::now();
+    tokens = min(opts.burst, tokens + opts.rate_limit * chrono::duration<float>(now - tokens_time).count());
+    tokens_time = now;
+    if (tokens < 1)
+        return false;
+    tokens--;
+    return true;
+}
+
+// handles the single request of a connection
+static void handler(sockpp::tcp_socket sock) {
+    string req;
+    char buf[4096];
+    while (req.find("\r\n\r\n") == string::npos) {
+        sockpp::result<size_t> res = sock.read(buf, sizeof(buf));
+        if (!res || res.value() == 0 || req.size() > MAX_REQUEST_BYTES)
+            return;
+        req.append(buf, res.value());
+    }
+
+    // request line: GET /api/0.6/map?bbox=... HTTP/1.1
+    size_t sp1 = req.find(' '), sp2 = req.find(' ', sp1 + 1);
+    if (sp1 == string::npos || sp2 == string::npos) {
+        send_response(sock, 400, "Malformed request");
+        return;
+    }
+    string method = req.substr(0, sp1);
+    string target = req.substr(sp1 + 1, sp2 - sp1 - 1);
+    string path = target.substr(0, target.find('?'));
+    string query = target.find('?') == string::npos ? "" : target.substr(target.find('?') + 1);
+
+    if (method != "GET") {
+        send_response(sock, 405, "Only GET is supported");
+        return;
+    }
+    if (path != "/api/0.6/map") {
+        send_response(sock, 404, "Not found");
+        return;
+    }
+    if (!take_token()) {
+        printf("rate limited %s\n", target.c_str());
+        send_response(sock, 429, "You have downloaded too much data. Please try again later.");
+        return;
+    }
+
+    int delay;
+    bool fail;
+    {
+        lock_guard<mutex> guard(fault_mutex);
+        delay = opts.latency + (opts.jitter > 0 ? uniform_int_distribution<int>(0, opts.jitter)(rng) : 0);
+        fail = opts.error_rate > 0 && uniform_real_distribution<float>(0, 1)(rng) < opts.error_rate;
+    }
+    if (delay > 0)
+        this_thread::sleep_for(chrono::milliseconds(delay));
+    if (fail) {
+        printf("injecting %d for %s\n", opts.error_status, target.c_str());
+        send_response(sock, opts.error_status, "Injected error");
+        return;
+    }
+
+    string bbox;
+    for (size_t start = 0; start <= query.size();) {
+        size_t end = query.find('&', start);
+        if (end == string::npos)
+            end = query.size();
+        string param = query.substr(start, end - start);
+        if (param.compare(0, 5, "bbox=") == 0)
+            bbox = url_decode(param.substr(5));
+        start = end + 1;
+    }
+
+    double minlon, minlat, maxlon, maxlat;
+    if (sscanf(bbox.c_str(), "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat) != 4) {
+        send_response(sock, 400, "The parameter bbox is required, and must be of the form "
+                      "min_lon,min_lat,max_lon,max_lat.");
+        return;
+    }
+
+    string body;
+    int status = answer_map(minlon, minlat, maxlon, maxlat, &body);
+    send_response(sock, status, body);
+}
+
+static void print_usage(const char* name) {
+    printf("usage: %s [options] extract.osm\n"
+           "  -p port       port to listen on (%d)\n"
+           "  -l ms         latency added to every request (0)\n"
+           "  -j ms         extra random latency of up to this much (0)\n"
+           "  -e fraction   fraction of requests to fail (0)\n"
+           "  -E status     http status of failed requests (500)\n"
+           "  -r rate       requests per second allowed before answering 429, 0 for no limit (0)\n"
+           "  -b burst      requests allowed in a burst over the rate limit (1)\n"
+           "  -S seed       random seed for injected faults (1)\n",
+           name, DEFAULT_STUB_PORT);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:j:e:E:r:b:S:h")) != -1) {
+        switch (opt) {
+        case 'p': opts.port = atoi(optarg); break;
+        case 'l': opts.latency = atoi(optarg); break;
+        case 'j': opts.jitter = atoi(optarg); break;
+        case 'e': opts.error_rate = atof(optarg); break;
+        case 'E': opts.error_status = atoi(optarg); break;
+        case 'r': opts.rate_limit = atof(optarg); break;
+        case 'b': opts.burst = max(1.0, atof(optarg)); break;
+        case 'S': opts.seed = atoi(optarg); break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int res = load_extract(argv[optind]);
+    if (res) {
+        printf("could not read osm extract %s (%d)\n", argv[optind], res);
+        return 1;
+    }
+    printf("loaded %zu nodes, %zu ways, %zu relations from %s\n", extract.nodes.size(),
+           extract.ways.size(), extract.relations.size(), argv[optind]);
+
+    rng.seed(opts.seed);
+    tokens = opts.burst;
+    tokens_time = chrono::steady_clock::now();
+
+    sockpp::initialize();
+    error_code ec;
+    sockpp::tcp_acceptor acc{opts.port, 16, ec};
+    if (ec) {
+        printf("%s\n", ec.message().c_str());
+        return 1;
+    }
+    printf("serving /api/0.6/map on %d\n", opts.port);
+
+    while (1) {
+        sockpp::inet_address peer;
+        sockpp::result res = acc.accept(&peer);
+        if (!res) {
+            printf("error %s\n", res.error_message().c_str());
+            continue;
+        }
+        thread thr(handler, res.release());
+        thr.detach();
+    }
+}
@@ -1,9 +1,16 @@
-#include <iostream>
+#include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
+#include <unordered_set>
 #include <thread>
 #include <memory>
+#include <mutex>
 #include <atomic>
+#include <chrono>
+#include <filesystem>
 
+#include <unistd.h>
 #include <gdal.h>
 #include "sockpp/tcp_acceptor.h"
 
@@ -11,7 +18,15 @@
 #include "wms_server/cbor.h"
 #include "wms_server/osm_api.h"
 #include "wms_server/chunk_manager.h"
+#include "wms_server/shard_map.h"
+#include "wms_server/shm_cache.h"
+#include "wms_server/prewarm.h"
+#include "wms_server/chunk_store.h"
+#include "wms_server/send_queue.h"
 #include "wms_server/socket.h"
+#include "wms_server/stats.h"
+#include "wms_server/trace.h"
+#include "wms_server/log.h"
 
 // server keeps track of number of connected clients so threads created to manage connection to
 // individual clients can be given the counter, allowing them to update when server has completed
@@ -26,93 +41,443 @@ uint8_t total_connection_count = 0;
 using namespace std;
 using json = nlohmann::json;
 
+// how often the shard file is checked for changes, at most
+#define SHARD_FILE_CHECK_MS 1000
+
+// shards this server is part of (see shard_map.h), when started with -S; the shard file is
+// reloaded whenever it changes, so shards can be added & removed without restarting the others
+struct server_shards {
+    std::shared_ptr<const struct shard_map> map = make_shared<const struct shard_map>();
+    // index of this server in map, -1 if it isn't listed (eg. while being removed); it then owns
+    // no chunks
+    int self = -1;
+};
+
+string shard_file;
+// address this server is listed under in the shard file
+struct shard_address shard_self;
+mutex shard_guard;
+struct server_shards shards;
+chrono::steady_clock::time_point shard_file_checked;
+filesystem::file_time_type shard_file_time;
+
+// loads the shard file if it has changed since it was last loaded
+// returns 0 on success (including when nothing has changed), otherwise an error code
+int reload_shard_file() {
+    error_code ec;
+    filesystem::file_time_type t = filesystem::last_write_time(shard_file, ec);
+    if (ec)
+        return 1;
+    if (t == shard_file_time)
+        return 0;
+
+    shared_ptr<struct shard_map> map = make_shared<struct shard_map>();
+    if (shard_map_load_file(shard_file, map.get()))
+        return 2;
+
+    shard_file_time = t;
+    int self = shard_map_find(map.get(), shard_self.host, shard_self.port);
+    LOG_INFO("loaded %zu shards from %s (epoch %08x)%s", map->shards.size(), shard_file.c_str(),
+             map->epoch, self < 0 ? ", not including this server" : "");
+    shards.map = std::move(map);
+    shards.self = self;
+    return 0;
+}
+
+// the current shard map, with this server's index in it
+struct server_shards get_shards() {
+    lock_guard<mutex> guard(shard_guard);
+    if (!shard_file.empty()
+        && chrono::steady_clock::now() - shard_file_checked > chrono::milliseconds(SHARD_FILE_CHECK_MS)) {
+        shard_file_checked = chrono::steady_clock::now();
+        if (reload_shard_file())
+            LOG_WARN("could not reload shard file %s; keeping the previous shards", shard_file.c_str());
+    }
+    return shards;
+}
+
+// what is done with chunks for clients that don't read them as fast as they are sent
+static enum slow_client_policy slow_client_policy = SLOW_CLIENT_DROP;
+
+// whether this server serves a chunk, so only its own chunks are pre-warmed
+static bool owns_chunk(struct chunk_id id) {
+    struct server_shards owners = get_shards();
+    return !owners.map->epoch || shard_map_owner(owners.map.get(), id) == owners.self;
+}
+
+// answers a chunk of a chunk request, either stored already or as the loader finished it
+// returns 0 on success, or 1 if the client should be disconnected
+static int send_chunk_result(struct send_queue* out, struct chunk_result result, vector<uint8_t>* geodata,
+                             uint8_t connection_counter) {
+    TRACE_SPAN("send_chunk");
+    // the loader has already queued its layers, ahead of this
+    if (result.streamed)
+        result.status = CHUNK_STATUS_STREAMED;
+    // removed from the store since it was found
+    if (result.status == CHUNK_STATUS_OK && !get_chunk_cbor_local(result.id, geodata))
+        result.status = CHUNK_STATUS_ERROR;
+    if (result.status == CHUNK_STATUS_ERROR)
+        stats_add(STAT_CHUNKS_FAILED);
+
+    struct packet out_packet;
+    encode_packet_chunk_cbor(&out_packet, result.id, result.status, geodata->data(), geodata->size());
+    if (send_queue_push_chunk(out, &out_packet, result.id, slow_client_policy))
+        return 1;
+    stats_add(STAT_CHUNKS_SENT);
+    stats_add(STAT_BYTES_SENT, CBOR_HEADER_BYTES + out_packet.header.payload_len);
+    stats_client_backlog_add(connection_counter, -1);
+    return 0;
+}
+
 // main running thread for each connection to a client
 void handler(sockpp::tcp_socket sock, const uint8_t connection_counter) {
     sockpp::result<size_t> res;
 
+    stats_add(STAT_CONNECTIONS);
+    stats_gauge_add(STAT_GAUGE_CLIENTS, 1);
+    trace_set_thread_name("client handler");
+
+    // answers are queued for a writer thread of the connection's own, so a client that is slow to
+    // read them holds up only itself (see send_queue.h)
+    struct send_queue out;
+    thread writer(send_queue_run, &out, &sock);
+    set_client_send_queue(connection_counter, &out);
+    // encoded chunks are read into this, which keeps its capacity from one chunk to the next
+    vector<uint8_t> geodata;
+
     while (1) {
         struct packet packet;
         if (read_packet(sock, &packet) != 0) {
             goto disconnect_label;
         }
-        cout << "recieved packet with size: " << packet.header.payload_len << endl;
+        stats_add(STAT_PACKETS_RECIEVED);
+        LOG_DEBUG("recieved packet with size: %lu", packet.header.payload_len);
         switch(packet.header.type) {
         case packet_type_enum::PACKET_TYPE_BBOX: {
+            auto start = chrono::steady_clock::now();
+            stats_add(STAT_BBOX_REQUESTS);
+
             struct bbox data;
-            auto res = decode_packet_bbox(&data, &packet);
+            uint64_t request_id;
+            auto res = decode_packet_bbox(&data, &packet, &request_id);
             assert(!res);
-            cout << "packet decoded" << endl;
+            // requests from clients that aren't tracing are given an id here
+            struct trace_request_scope request(request_id ? request_id : trace_new_request_id());
+            TRACE_SPAN("bbox_request");
+            LOG_DEBUG("packet decoded");
             print_bbox(&data);
 
-            unique_ptr<struct bbox[]> bboxes;
-            size_t local_stored;
-            size_t nbb = load_bbox(&data, &bboxes, connection_counter, &local_stored);
-            cout << "sending " << nbb << " bounding boxes" << endl;
+            vector<struct chunk_id> ids;
+            get_bbox_chunk_ids(&data, BBOX_PER_DEG_INT, &ids);
+            size_t local_stored = load_chunks(&ids, connection_counter);
+            size_t nbb = ids.size();
+            LOG_DEBUG("sending %zu bounding boxes", nbb);
+            stats_client_backlog_set(connection_counter, nbb);
 
             struct packet out_packet;
             res = encode_packet_geojson_count(nbb, &out_packet);
             assert(!res);
-            if (send_packet(sock, &out_packet) != 0) {
+            if (send_queue_push(&out, &out_packet)) {
                 goto disconnect_label;
             }
 
             for (size_t i = 0; i < nbb; i++) {
-                json geodata;
-                if (i < local_stored) {
-                    geodata = get_chunk_json_local(&bboxes[i]);
-                } else {
-                    geodata = get_chunk_json_workqueue(connection_counter);
+                TRACE_SPAN("send_chunk");
+                // chunks the loader couldn't find are sent as null, as older clients expect
+                struct chunk_id id = i < local_stored ? ids[i] : get_chunk_workqueue(connection_counter).id;
+                auto res = get_chunk_cbor_local(id, &geodata)
+                    ? encode_packet_geojson_cbor(geodata.data(), geodata.size(), &out_packet)
+                    : encode_packet_geojson(nullptr, &out_packet);
+                assert(!res);
+                if (send_queue_push(&out, &out_packet)) {
+                    goto disconnect_label;
                 }
+                stats_add(STAT_CHUNKS_SENT);
+                stats_add(STAT_BYTES_SENT, CBOR_HEADER_BYTES + out_packet.header.payload_len);
+                stats_client_backlog_add(connection_counter, -1);
+            }
+            stats_record_since(STAT_HIST_BBOX_REQUEST, start);
+            break;
+        }
+        case packet_type_enum::PACKET_TYPE_CHUNK_REQUEST: {
+            auto start = chrono::steady_clock::now();
+            stats_add(STAT_CHUNK_REQUESTS);
 
-                auto res = encode_packet_geojson(geodata, &out_packet);
-                assert(!res);
-                if (send_packet(sock, &out_packet) != 0) {
+            vector<struct chunk_id> ids;
+            uint64_t request_id, flags, deadline_ms;
+            if (decode_packet_chunk_request(&ids, &packet, &request_id, &flags, &deadline_ms)) {
+                // the client is waiting on an answer for each id, which we can't give
+                LOG_WARN("could not decode chunk request");
+                goto disconnect_label;
+            }
+            struct trace_request_scope request(request_id ? request_id : trace_new_request_id());
+            TRACE_SPAN("chunk_request");
+            LOG_DEBUG("chunk request for %zu chunks", ids.size());
+
+            // every distinct id is answered exactly once, in whatever order the chunks become ready
+            struct server_shards owners = get_shards();
+            vector<struct chunk_id> unserved, moved, pending;
+            unordered_set<uint64_t> seen;
+            erase_if(ids, [&unserved, &moved, &pending, &seen, &owners, connection_counter](const struct chunk_id& id) {
+                if (!seen.insert(chunk_id_key(&id)).second)
+                    return true;
+                if (id.level != 0) {
+                    unserved.push_back(id);
+                    return true;
+                }
+                if (owners.map->epoch && shard_map_owner(owners.map.get(), id) != owners.self) {
+                    moved.push_back(id);
+                    return true;
+                }
+                // still loading since an earlier request's deadline passed; it is pushed once done
+                if (chunk_is_deferred(connection_counter, id)) {
+                    pending.push_back(id);
+                    return true;
+                }
+                return false;
+            });
+            size_t local_stored = load_chunks(&ids, connection_counter, flags & CHUNK_REQUEST_STREAM_LAYERS);
+            stats_client_backlog_set(connection_counter, ids.size());
+
+            struct packet out_packet;
+            for (const struct chunk_id& id : unserved) {
+                encode_packet_chunk(&out_packet, id, CHUNK_STATUS_ERROR);
+                if (send_queue_push_chunk(&out, &out_packet, id, slow_client_policy))
+                    goto disconnect_label;
+                stats_add(STAT_CHUNKS_FAILED);
+            }
+            for (const struct chunk_id& id : moved) {
+                encode_packet_chunk(&out_packet, id, CHUNK_STATUS_MOVED);
+                if (send_queue_push_chunk(&out, &out_packet, id, slow_client_policy))
+                    goto disconnect_label;
+                stats_add(STAT_CHUNKS_MOVED);
+            }
+            for (const struct chunk_id& id : pending) {
+                encode_packet_chunk(&out_packet, id, CHUNK_STATUS_PENDING);
+                if (send_queue_push_chunk(&out, &out_packet, id, slow_client_policy))
+                    goto disconnect_label;
+                stats_add(STAT_CHUNKS_PENDING);
+            }
+
+            for (size_t i = 0; i < local_stored; i++) {
+                if (send_chunk_result(&out, { .id = ids[i], .status = CHUNK_STATUS_OK }, &geodata,
+                                      connection_counter))
                     goto disconnect_label;
+            }
+
+            // the rest are answered as the loader finishes them, until the deadline (if any)
+            unordered_set<uint64_t> waiting;
+            for (size_t i = local_stored; i < ids.size(); i++)
+                waiting.insert(chunk_id_key(&ids[i]));
+            auto deadline = start + chrono::milliseconds(deadline_ms);
+            while (!waiting.empty()) {
+                struct chunk_result result;
+                if (!deadline_ms)
+                    result = get_chunk_workqueue(connection_counter);
+                else if (!get_chunk_workqueue_until(connection_counter, deadline, &result))
+                    break;
+                waiting.erase(chunk_id_key(&result.id));
+                if (send_chunk_result(&out, result, &geodata, connection_counter))
+                    goto disconnect_label;
+            }
+
+            if (!waiting.empty()) {
+                // past the deadline: chunks the loader still has are answered as stale with a copy
+                // from the shared cache if it has one, otherwise as pending, and pushed once done
+                vector<struct chunk_id> late;
+                for (size_t i = local_stored; i < ids.size(); i++) {
+                    if (waiting.contains(chunk_id_key(&ids[i])))
+                        late.push_back(ids[i]);
+                }
+                vector<vector<uint8_t>> copies(late.size());
+                for (size_t i = 0; i < late.size(); i++) {
+                    if (!get_chunk_cbor_cached(late[i], &copies[i]))
+                        copies[i].clear();
+                }
+
+                vector<struct chunk_result> arrived;
+                defer_chunks(connection_counter, late, &arrived);
+                for (const struct chunk_result& result : arrived) {
+                    waiting.erase(chunk_id_key(&result.id));
+                    if (send_chunk_result(&out, result, &geodata, connection_counter))
+                        goto disconnect_label;
+                }
+                for (size_t i = 0; i < late.size(); i++) {
+                    if (!waiting.contains(chunk_id_key(&late[i])))
+                        continue;
+                    bool stale = !copies[i].empty();
+                    encode_packet_chunk_cbor(&out_packet, late[i], stale ? CHUNK_STATUS_STALE : CHUNK_STATUS_PENDING,
+                                             copies[i].data(), copies[i].size());
+                    if (send_queue_push_chunk(&out, &out_packet, late[i], slow_client_policy))
+                        goto disconnect_label;
+                    stats_add(stale ? STAT_CHUNKS_STALE : STAT_CHUNKS_PENDING);
+                    stats_add(STAT_BYTES_SENT, CBOR_HEADER_BYTES + out_packet.header.payload_len);
+                    stats_client_backlog_add(connection_counter, -1);
                 }
+                LOG_DEBUG("%zu chunks not ready by the %lu ms deadline", waiting.size(), deadline_ms);
             }
+            stats_record_since(STAT_HIST_CHUNK_REQUEST, start);
             break;
         }
         case packet_type_enum::PACKET_TYPE_PARTITION_INFO_QUERY: {
             struct partition_info p;
             p.bbox_per_deg = BBOX_PER_DEG_INT;
+            p.data_version = GEODATA_VERSION;
+            struct server_shards owners = get_shards();
+            p.shard_epoch = owners.map->epoch;
+            p.shards = owners.map->shards;
             // TODO? &c.....
 
             struct packet out_packet;
             auto res = encode_packet_partition_info(&out_packet, &p);
             assert(!res);
-            if (send_packet(sock, &out_packet) != 0)
+            if (send_queue_push(&out, &out_packet))
+                goto disconnect_label;
+
+            break;
+        }
+        case packet_type_enum::PACKET_TYPE_STATS_QUERY: {
+            struct server_stats stats;
+            stats_snapshot(&stats);
+
+            struct packet out_packet;
+            auto res = encode_packet_stats(&out_packet, &stats);
+            assert(!res);
+            if (send_queue_push(&out, &out_packet))
+                goto disconnect_label;
+
+            break;
+        }
+        case packet_type_enum::PACKET_TYPE_TRACE_QUERY: {
+            int tracing;
+            if (decode_packet_trace_query(&packet, &tracing)) {
+                LOG_WARN("could not decode trace query");
+                continue;
+            }
+            // the spans recorded up to now are sent either way
+            string trace = trace_dump_json();
+            if (tracing != TRACE_QUERY_KEEP)
+                trace_set_enabled(tracing == TRACE_QUERY_ENABLE);
+
+            struct packet out_packet;
+            auto res = encode_packet_trace(&out_packet, trace);
+            assert(!res);
+            if (send_queue_push(&out, &out_packet))
                 goto disconnect_label;
 
             break;
         }
         default:
-            cout << "recieved unexpected packet type " << (int)packet.header.type << endl;
+            LOG_WARN("recieved unexpected packet type %d", (int)packet.header.type);
             continue;
         }
     }
  disconnect_label:
-    printf("client %hhu disconnecting...\n", connection_counter);
+    LOG_INFO("client %hhu disconnecting...", connection_counter);
+    // the loader mustn't queue layers to out once it is gone
+    set_client_send_queue(connection_counter, NULL);
+    // the writer may be blocked sending to a client that has stopped reading
+    send_queue_close(&out);
+    sock.shutdown();
+    writer.join();
+    stats_add(STAT_DISCONNECTS);
+    stats_gauge_add(STAT_GAUGE_CLIENTS, -1);
+    stats_client_backlog_set(connection_counter, 0);
+}
+
+static void print_usage(const char* name) {
+    printf("usage: %s [options]\n"
+           "  -p port       port to listen on (%d)\n"
+           "  -S file       run as one shard of several, listed in file as host:port lines\n"
+           "  -a host:port  address this server is listed under in the shard file\n"
+           "                (localhost:port)\n"
+           "  -C name       shared memory segment to share encoded chunks through with other\n"
+           "                servers on this machine (%s)\n"
+           "  -c            don't share encoded chunks\n"
+           "  -R file       regions to fetch while idle, one place name or\n"
+           "                \"minlon minlat maxlon maxlat\" per line (%s)\n"
+           "  -W            don't fetch chunks before clients ask for them\n"
+           "  -Q MiB        disk quota of the chunk store, evicting the least recently used\n"
+           "                chunks past it; 0 for none (%d)\n"
+           "  -B policy     what to do when a client falls %d MiB behind: drop its oldest\n"
+           "                unsent chunks, or disconnect it (drop)\n",
+           name, SERVER_PORT, SHM_CACHE_DEFAULT_NAME, PREWARM_REGIONS_FILE, CHUNK_STORE_DEFAULT_QUOTA_MB,
+           SEND_QUEUE_MAX_BYTES >> 20);
 }
 
 // server will create a worker thread (responsible for querying osm, see chunk_manager.cpp),
 // and then sit idle waiting for connections,
 // dispatching new threads to manage each connection as clients connect
-int main() {
+int main(int argc, char** argv) {
     in_port_t port = SERVER_PORT;
+    string self;
+    string cache_name = SHM_CACHE_DEFAULT_NAME;
+    uint64_t quota_mb = CHUNK_STORE_DEFAULT_QUOTA_MB;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:S:a:C:cR:WQ:B:h")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'S': shard_file = optarg; break;
+        case 'a': self = optarg; break;
+        case 'C': cache_name = optarg; break;
+        case 'c': cache_name.clear(); break;
+        case 'R': prewarm_set_regions_file(optarg); break;
+        case 'W': prewarm_set_enabled(false); break;
+        case 'Q': quota_mb = strtoull(optarg, NULL, 10); break;
+        case 'B':
+            if (!strcmp(optarg, "drop"))
+                slow_client_policy = SLOW_CLIENT_DROP;
+            else if (!strcmp(optarg, "disconnect"))
+                slow_client_policy = SLOW_CLIENT_DISCONNECT;
+            else {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!shard_file.empty()) {
+        if (self.empty())
+            self = "localhost:" + to_string(port);
+        if (parse_shard_address(self, &shard_self)) {
+            LOG_ERROR("could not parse shard address %s", self.c_str());
+            exit(1);
+        }
+        if (reload_shard_file()) {
+            LOG_ERROR("could not load shard file %s", shard_file.c_str());
+            exit(1);
+        }
+        shard_file_checked = chrono::steady_clock::now();
+    }
+
     sockpp::initialize();
 
     error_code ec;
     sockpp::tcp_acceptor acc{port, 4, ec};
 
     if (ec) {
-        cout << ec.message() << endl;
+        LOG_ERROR("%s", ec.message().c_str());
         exit(1);
     }
 
     GDALAllRegister();
+    if (prepare_chunk_store() || chunk_store_open(quota_mb << 20))
+        exit(1);
+    // chunks are still served without it, just encoded by every process for itself
+    if (!cache_name.empty() && open_shared_chunk_cache(cache_name))
+        LOG_WARN("not sharing encoded chunks");
+    // tracing can be started from the beginning with GEO_TRACE=1, as well as with server_trace
+    if (getenv("GEO_TRACE"))
+        trace_set_enabled(true);
+    prewarm_set_owner_filter(owns_chunk);
     start_worker_thread(&total_connection_count);
 
-    cout << "waiting for connection on " << port << endl;
+    LOG_INFO("waiting for connection on %d", port);
 
     while (1) {
         sockpp::inet_address peer;
@@ -121,20 +486,21 @@ int main() {
 
         if (res) {
             if (total_connection_count >= MAX_CLIENTS) {
-                cout << "error: too many clients" << endl; // we are hard limited at 64 until we
-                                                           // change the thread notificaiton
-                                                           // bitvector into something scalable
-                                                           // (uint64_t threads in bbox_task)
+                LOG_ERROR("too many clients"); // we are hard limited at 64 until we
+                                               // change the thread notificaiton
+                                               // bitvector into something scalable
+                                               // (uint64_t threads in chunk_task)
                 continue;
             }
-            cout << "connection with " << peer << endl;
+            LOG_INFO("connection with %s", peer.to_string().c_str());
             sockpp::tcp_socket sock = res.release();
 
             thread thr(handler, std::move(sock), total_connection_count++);
             thr.detach();
         } else
-            cout << "error " << res.error_message() << endl;
+            LOG_ERROR("accept failed: %s", res.error_message().c_str());
     }
 
     end_worker_thread();
+    chunk_store_close();
 }
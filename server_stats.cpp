@@ -0,0 +1,135 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#include "sockpp/tcp_connector.h"
+
+#include "wms_server/cbor.h"
+#include "wms_server/socket.h"
+#include "wms_server/stats.h"
+
+using namespace std;
+
+// polls a running server for its statistics (see wms_server/stats.h) and prints them
+//
+//   ./server_stats            prints the stats once
+//   ./server_stats -i 2       prints them every 2 seconds, with counter rates since the last poll
+
+static void print_usage(const char* name) {
+    printf("usage: %s [options]\n"
+           "  -H host       server host (localhost)\n"
+           "  -p port       server port (%d)\n"
+           "  -i seconds    poll every this many seconds, until interrupted\n"
+           "  -n count      stop after this many polls\n",
+           name, sockpp::TEST_PORT);
+}
+
+// requests the stats on conn
+// returns 0 on success, otherwise an error code
+static int query_stats(sockpp::tcp_connector& conn, struct server_stats* stats) {
+    struct packet packet;
+    encode_packet_stats_query(&packet);
+    if (send_packet(conn, &packet) != 0)
+        return 1;
+    if (read_packet(conn, &packet) != 0)
+        return 2;
+    return decode_packet_stats(&packet, stats) ? 3 : 0;
+}
+
+static void print_stats(const struct server_stats* stats, const struct server_stats* prev) {
+    printf("uptime %.1fs\n", stats->uptime_us / 1e6);
+
+    unordered_map<string, int64_t> last;
+    double secs = 0;
+    if (prev) {
+        for (const struct stats_value& v : prev->counters)
+            last[v.name] = v.value;
+        secs = (stats->uptime_us - prev->uptime_us) / 1e6;
+    }
+
+    printf("counters:\n");
+    for (const struct stats_value& v : stats->counters) {
+        printf("  %-24s %12ld", v.name.c_str(), v.value);
+        auto it = last.find(v.name);
+        if (it != last.end() && secs > 0)
+            printf("  %10.1f/s", (v.value - it->second) / secs);
+        printf("\n");
+    }
+
+    printf("gauges:\n");
+    for (const struct stats_value& v : stats->gauges)
+        printf("  %-24s %12ld\n", v.name.c_str(), v.value);
+
+    if (!stats->client_backlog.empty()) {
+        printf("client backlog (chunks):\n");
+        for (const pair<uint32_t, int64_t>& b : stats->client_backlog)
+            printf("  client %-17u %12ld\n", b.first, b.second);
+    }
+
+    printf("latency (ms):               count      mean       p50       p90       p99       max\n");
+    for (const struct stats_histogram& h : stats->histograms) {
+        printf("  %-20s %10lu", h.name.c_str(), h.count);
+        if (h.count)
+            printf(" %9.2f %9.2f %9.2f %9.2f %9.2f", (double)h.sum / h.count / 1000,
+                   stats_percentile(&h, 50) / 1000.0, stats_percentile(&h, 90) / 1000.0,
+                   stats_percentile(&h, 99) / 1000.0, h.max / 1000.0);
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    string host = "localhost";
+    in_port_t port = sockpp::TEST_PORT;
+    double interval = 0;
+    long count = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:i:n:h")) != -1) {
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'i': interval = atof(optarg); break;
+        case 'n': count = atol(optarg); break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (interval <= 0)
+        count = 1;
+
+    sockpp::initialize();
+    sockpp::tcp_connector conn;
+    sockpp::result res = conn.connect(host, port, chrono::seconds(10));
+    if (!res) {
+        printf("could not connect to %s:%d: %s\n", host.c_str(), port, res.error_message().c_str());
+        return 1;
+    }
+
+    struct server_stats stats, prev;
+    bool have_prev = false;
+    auto next = chrono::steady_clock::now();
+    for (long i = 0; count < 0 || i < count; i++) {
+        if (query_stats(conn, &stats)) {
+            printf("could not get stats from the server\n");
+            return 1;
+        }
+        if (i > 0)
+            printf("\n");
+        print_stats(&stats, have_prev ? &prev : NULL);
+        fflush(stdout);
+        prev = stats;
+        have_prev = true;
+
+        if (count >= 0 && i + 1 >= count)
+            break;
+        next += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(interval));
+        this_thread::sleep_until(next);
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include <unistd.h>
+
+#include "sockpp/tcp_connector.h"
+
+#include "wms_server/cbor.h"
+#include "wms_server/socket.h"
+
+using namespace std;
+
+// starts / stops tracing on a running server and saves the spans it has recorded as chrome trace
+// json (see wms_server/trace.h), to open in chrome://tracing or https://ui.perfetto.dev
+//
+//   ./server_trace -e             start tracing
+//   ./server_trace -o trace.json  save what has been recorded so far
+//   ./server_trace -d -o trace.json
+//                                 stop tracing, saving what was recorded
+//
+// a client trace (GDClient::write_trace()) taken at the same time can be loaded alongside, as both
+// use the same clock, and requests carry the same ids on both sides
+
+static void print_usage(const char* name) {
+    printf("usage: %s [options]\n"
+           "  -H host       server host (localhost)\n"
+           "  -p port       server port (%d)\n"
+           "  -e            start tracing\n"
+           "  -d            stop tracing\n"
+           "  -o file       save the spans recorded so far to file\n",
+           name, sockpp::TEST_PORT);
+}
+
+int main(int argc, char** argv) {
+    string host = "localhost";
+    in_port_t port = sockpp::TEST_PORT;
+    int tracing = TRACE_QUERY_KEEP;
+    string out;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:edo:h")) != -1) {
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'e': tracing = TRACE_QUERY_ENABLE; break;
+        case 'd': tracing = TRACE_QUERY_DISABLE; break;
+        case 'o': out = optarg; break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (tracing == TRACE_QUERY_KEEP && out.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    sockpp::initialize();
+    sockpp::tcp_connector conn;
+    sockpp::result res = conn.connect(host, port, chrono::seconds(10));
+    if (!res) {
+        printf("could not connect to %s:%d: %s\n", host.c_str(), port, res.error_message().c_str());
+        return 1;
+    }
+
+    struct packet packet;
+    string trace;
+    if (encode_packet_trace_query(&packet, tracing) || send_packet(conn, &packet) ||
+        read_packet(conn, &packet) || decode_packet_trace(&packet, &trace)) {
+        printf("could not get trace from the server\n");
+        return 1;
+    }
+
+    if (tracing != TRACE_QUERY_KEEP)
+        printf("tracing %s\n", tracing == TRACE_QUERY_ENABLE ? "started" : "stopped");
+
+    if (!out.empty()) {
+        ofstream f(out, ios::trunc);
+        f << trace;
+        if (!f.good()) {
+            printf("could not write %s\n", out.c_str());
+            return 1;
+        }
+        printf("wrote %zu bytes of trace to %s\n", trace.size(), out.c_str());
+    }
+    return 0;
+}
@@ -1,9 +1,13 @@
 #include <stdint.h>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <tinycbor/cbor.h>
 #include <nlohmann/json.hpp>
 
 #include "cbor.h"
+#include "trace.h"
 
 using namespace std;
 using json = nlohmann::json;
@@ -37,18 +41,21 @@ size_t decode_cbor_header(const char* buf, size_t buf_size, struct packet_header
     return buf_size;
 }
 
-size_t encode_bbox_cborbuf(uint8_t* buf, size_t size, const struct bbox* query) {
+// the request id is sent as an optional 5th element, which older servers ignore
+size_t encode_bbox_cborbuf(uint8_t* buf, size_t size, const struct bbox* query, uint64_t request_id) {
     CborEncoder enc, arrEnc;
     cbor_encoder_init(&enc, buf, size, 0);
-    CHECK_ERR(cbor_encoder_create_array(&enc, &arrEnc, 4));
+    CHECK_ERR(cbor_encoder_create_array(&enc, &arrEnc, request_id ? 5 : 4));
     CHECK_ERR(cbor_encode_float(&arrEnc, query->minx));
     CHECK_ERR(cbor_encode_float(&arrEnc, query->miny));
     CHECK_ERR(cbor_encode_float(&arrEnc, query->maxx));
     CHECK_ERR(cbor_encode_float(&arrEnc, query->maxy));
+    if (request_id)
+        CHECK_ERR(cbor_encode_uint(&arrEnc, request_id));
     CHECK_ERR(cbor_encoder_close_container(&enc, &arrEnc));
     return cbor_encoder_get_buffer_size(&enc, buf);
 }
-size_t decode_bbox_cborbuf(const uint8_t* buf, size_t size, struct bbox* query) {
+size_t decode_bbox_cborbuf(const uint8_t* buf, size_t size, struct bbox* query, uint64_t* request_id) {
     CborParser par;
     CborValue val, arrVal;
     cbor_parser_init(buf, size, 0, &par, &val);
@@ -60,23 +67,29 @@ size_t decode_bbox_cborbuf(const uint8_t* buf, size_t size, struct bbox* query)
     CHECK_ERR(cbor_value_get_float(&arrVal, &query->maxx));
     CHECK_ERR(cbor_value_advance(&arrVal));
     CHECK_ERR(cbor_value_get_float(&arrVal, &query->maxy));
+    CHECK_ERR(cbor_value_advance(&arrVal));
+    uint64_t id = 0;
+    if (!cbor_value_at_end(&arrVal) && cbor_value_is_unsigned_integer(&arrVal))
+        CHECK_ERR(cbor_value_get_uint64(&arrVal, &id));
+    if (request_id)
+        *request_id = id;
     return size;
 }
 
-int encode_packet_bbox(const struct bbox* data, struct packet* packet) {
+int encode_packet_bbox(const struct bbox* data, struct packet* packet, uint64_t request_id) {
     packet->header.type = packet_type_enum::PACKET_TYPE_BBOX;
-    packet->payload = make_unique<char[]>(CBOR_BBOX_BYTES);
-    size_t size = encode_bbox_cborbuf((uint8_t*)packet->payload.get(), CBOR_BBOX_BYTES, data);
+    packet->payload = acquire_packet_buffer(CBOR_BBOX_BYTES);
+    size_t size = encode_bbox_cborbuf((uint8_t*)packet->payload.get(), CBOR_BBOX_BYTES, data, request_id);
     if (!size)
         return 1;
     packet->header.payload_len = size;
     return 0;
 }
 
-int decode_packet_bbox(struct bbox* data, const struct packet* packet) {
+int decode_packet_bbox(struct bbox* data, const struct packet* packet, uint64_t* request_id) {
     assert(packet->header.type == packet_type_enum::PACKET_TYPE_BBOX);
     //assert(packet->header.payload_len >= CBOR_BBOX_BYTES);
-    return !decode_bbox_cborbuf((uint8_t*)packet->payload.get(), packet->header.payload_len, data);
+    return !decode_bbox_cborbuf((uint8_t*)packet->payload.get(), packet->header.payload_len, data, request_id);
 }
 
 size_t encode_packet_geojson_count_cborbuf(uint8_t* buf, size_t size, uint64_t n) {
@@ -96,7 +109,7 @@ size_t decode_packet_geojson_count_cborbuf(const uint8_t* buf, size_t size, uint
 
 int encode_packet_geojson_count(uint64_t n, struct packet* packet) {
     packet->header.type = packet_type_enum::PACKET_TYPE_GEOJSON_COUNT;
-    packet->payload = make_unique<char[]>(9);
+    packet->payload = acquire_packet_buffer(9);
     size_t size = encode_packet_geojson_count_cborbuf((uint8_t*)packet->payload.get(), 9, n);
     if (!size)
         return 1;
@@ -111,21 +124,136 @@ int decode_packet_geojson_count(uint64_t* n, const struct packet* packet) {
     return !decode_packet_geojson_count_cborbuf((uint8_t*)packet->payload.get(), packet->header.payload_len, n);
 }
 
+// appends n to out big endian, in bytes bytes
+static void put_be(vector<uint8_t>* out, uint64_t n, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--)
+        out->push_back(n >> (8 * i));
+}
+
+// appends the head of a cbor item: its major type & argument, in as few bytes as it fits
+static void put_cbor_head(vector<uint8_t>* out, uint8_t major, uint64_t n) {
+    major <<= 5;
+    if (n <= 0x17) {
+        out->push_back(major | n);
+    } else if (n <= numeric_limits<uint8_t>::max()) {
+        out->push_back(major | 0x18);
+        put_be(out, n, 1);
+    } else if (n <= numeric_limits<uint16_t>::max()) {
+        out->push_back(major | 0x19);
+        put_be(out, n, 2);
+    } else if (n <= numeric_limits<uint32_t>::max()) {
+        out->push_back(major | 0x1a);
+        put_be(out, n, 4);
+    } else {
+        out->push_back(major | 0x1b);
+        put_be(out, n, 8);
+    }
+}
+
+void json_to_cbor(const json& data, vector<uint8_t>* out) {
+    switch (data.type()) {
+    case json::value_t::null:
+        out->push_back(0xf6);
+        break;
+    case json::value_t::boolean:
+        out->push_back(data.get<bool>() ? 0xf5 : 0xf4);
+        break;
+    case json::value_t::number_integer: {
+        int64_t n = data.get<int64_t>();
+        if (n >= 0)
+            put_cbor_head(out, 0, n);
+        else
+            put_cbor_head(out, 1, -1 - n);
+        break;
+    }
+    case json::value_t::number_unsigned:
+        put_cbor_head(out, 0, data.get<uint64_t>());
+        break;
+    case json::value_t::number_float: {
+        // as json::to_cbor(): half precision specials, then single precision if it is exact
+        double d = data.get<double>();
+        if (isnan(d)) {
+            out->insert(out->end(), { 0xf9, 0x7e, 0x00 });
+        } else if (isinf(d)) {
+            out->insert(out->end(), { 0xf9, (uint8_t)(d > 0 ? 0x7c : 0xfc), 0x00 });
+        } else if (d >= numeric_limits<float>::lowest() && d <= numeric_limits<float>::max()
+                   && (double)(float)d == d) {
+            float f = d;
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            out->push_back(0xfa);
+            put_be(out, bits, 4);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            out->push_back(0xfb);
+            put_be(out, bits, 8);
+        }
+        break;
+    }
+    case json::value_t::string: {
+        const json::string_t& s = data.get_ref<const json::string_t&>();
+        put_cbor_head(out, 3, s.size());
+        out->insert(out->end(), s.begin(), s.end());
+        break;
+    }
+    case json::value_t::array: {
+        const json::array_t& a = data.get_ref<const json::array_t&>();
+        put_cbor_head(out, 4, a.size());
+        for (const json& item : a)
+            json_to_cbor(item, out);
+        break;
+    }
+    case json::value_t::object: {
+        const json::object_t& o = data.get_ref<const json::object_t&>();
+        put_cbor_head(out, 5, o.size());
+        for (const auto& [key, value] : o) {
+            put_cbor_head(out, 3, key.size());
+            out->insert(out->end(), key.begin(), key.end());
+            json_to_cbor(value, out);
+        }
+        break;
+    }
+    default: {
+        // binary values (with their subtype tags) never turn up in geojson
+        vector<uint8_t> v = json::to_cbor(data);
+        out->insert(out->end(), v.begin(), v.end());
+        break;
+    }
+    }
+}
+
 int encode_packet_geojson(const json & data, struct packet* packet) {
+    TRACE_SPAN("encode_packet_geojson");
     packet->header.type = packet_type_enum::PACKET_TYPE_GEOJSON;
-    vector<uint8_t> v = json::to_cbor(data);
+    // serialize into a per-thread scratch vector which keeps its capacity between calls, so after
+    // the first few chunks neither the serialization nor the payload needs a fresh allocation
+    thread_local vector<uint8_t> v;
+    v.clear();
+    json_to_cbor(data, &v);
     if (!v.size())
         return 1;
-    packet->payload = make_unique<char[]>(v.size());
+    packet->payload = acquire_packet_buffer(v.size());
     packet->header.payload_len = v.size();
     copy(v.begin(), v.end(), packet->payload.get());
     return 0;
 }
 
+int encode_packet_geojson_cbor(const uint8_t* data, size_t len, struct packet* packet) {
+    packet->header.type = packet_type_enum::PACKET_TYPE_GEOJSON;
+    if (!len)
+        return 1;
+    packet->payload = acquire_packet_buffer(len);
+    packet->header.payload_len = len;
+    copy(data, data + len, packet->payload.get());
+    return 0;
+}
+
 json decode_packet_geojson(const struct packet* packet) {
+    TRACE_SPAN("decode_packet_geojson");
     assert(packet->header.type == packet_type_enum::PACKET_TYPE_GEOJSON);
-    vector<uint8_t> v(packet->payload.get(), packet->payload.get()+packet->header.payload_len);
-    return json::from_cbor(v);
+    const uint8_t* data = (const uint8_t*)packet->payload.get();
+    return json::from_cbor(data, data + packet->header.payload_len);
 }
 
 void encode_packet_partition_info_query(struct packet* packet) {
@@ -134,25 +262,98 @@ void encode_packet_partition_info_query(struct packet* packet) {
 }
 
 size_t encode_packet_partition_info_cborbuf(uint8_t* buf, size_t size, const struct partition_info* p) {
-    CborEncoder enc;
+    CborEncoder enc, arrEnc, shardsEnc, shardEnc;
     cbor_encoder_init(&enc, buf, size, 0);
-    CHECK_ERR(cbor_encode_uint(&enc, p->bbox_per_deg));
+    // the shard fields are left off when there are none, so unsharded servers send what they
+    // always have
+    bool sharded = !p->shards.empty();
+    CHECK_ERR(cbor_encoder_create_array(&enc, &arrEnc, sharded ? 4 : 2));
+    CHECK_ERR(cbor_encode_uint(&arrEnc, p->bbox_per_deg));
+    CHECK_ERR(cbor_encode_uint(&arrEnc, p->data_version));
+    if (sharded) {
+        CHECK_ERR(cbor_encode_uint(&arrEnc, p->shard_epoch));
+        CHECK_ERR(cbor_encoder_create_array(&arrEnc, &shardsEnc, p->shards.size()));
+        for (const struct shard_address& shard : p->shards) {
+            CHECK_ERR(cbor_encoder_create_array(&shardsEnc, &shardEnc, 2));
+            CHECK_ERR(cbor_encode_text_string(&shardEnc, shard.host.data(), shard.host.size()));
+            CHECK_ERR(cbor_encode_uint(&shardEnc, shard.port));
+            CHECK_ERR(cbor_encoder_close_container(&shardsEnc, &shardEnc));
+        }
+        CHECK_ERR(cbor_encoder_close_container(&arrEnc, &shardsEnc));
+    }
+    CHECK_ERR(cbor_encoder_close_container(&enc, &arrEnc));
     return cbor_encoder_get_buffer_size(&enc, buf);
 }
 
 size_t decode_packet_partition_info_cborbuf(const uint8_t* buf, size_t size, struct partition_info* p) {
     CborParser par;
-    CborValue val;
+    CborValue val, arrVal;
     cbor_parser_init(buf, size, 0, &par, &val);
-    CHECK_ERR(cbor_value_get_int_checked(&val, (int*)&p->bbox_per_deg));
+    // older servers send just the resolution as a bare integer
+    if (!cbor_value_is_array(&val)) {
+        CHECK_ERR(cbor_value_get_int_checked(&val, (int*)&p->bbox_per_deg));
+        p->data_version = 0;
+        return size;
+    }
+    size_t fields;
+    CHECK_ERR(cbor_value_get_array_length(&val, &fields));
+    CHECK_ERR(cbor_value_enter_container(&val, &arrVal));
+    CHECK_ERR(cbor_value_get_int_checked(&arrVal, (int*)&p->bbox_per_deg));
+    CHECK_ERR(cbor_value_advance(&arrVal));
+    CHECK_ERR(cbor_value_get_int_checked(&arrVal, (int*)&p->data_version));
+
+    p->shard_epoch = 0;
+    p->shards.clear();
+    if (fields < 4)
+        return size;
+
+    CborValue shardsVal, shardVal;
+    uint64_t epoch, port;
+    size_t n, len;
+    CHECK_ERR(cbor_value_advance(&arrVal));
+    if (!cbor_value_is_unsigned_integer(&arrVal))
+        return 0;
+    CHECK_ERR(cbor_value_get_uint64(&arrVal, &epoch));
+    p->shard_epoch = epoch;
+    CHECK_ERR(cbor_value_advance(&arrVal));
+    if (!cbor_value_is_array(&arrVal))
+        return 0;
+    CHECK_ERR(cbor_value_get_array_length(&arrVal, &n));
+    CHECK_ERR(cbor_value_enter_container(&arrVal, &shardsVal));
+    for (size_t i = 0; i < n; i++) {
+        struct shard_address shard;
+        if (!cbor_value_is_array(&shardsVal))
+            return 0;
+        CHECK_ERR(cbor_value_enter_container(&shardsVal, &shardVal));
+        if (!cbor_value_is_text_string(&shardVal))
+            return 0;
+        CHECK_ERR(cbor_value_calculate_string_length(&shardVal, &len));
+        // room for the terminator tinycbor adds
+        shard.host.resize(len + 1);
+        len = shard.host.size();
+        CHECK_ERR(cbor_value_copy_text_string(&shardVal, shard.host.data(), &len, &shardVal));
+        shard.host.resize(len);
+        if (!cbor_value_is_unsigned_integer(&shardVal))
+            return 0;
+        CHECK_ERR(cbor_value_get_uint64(&shardVal, &port));
+        if (port == 0 || port > 65535)
+            return 0;
+        shard.port = port;
+        CHECK_ERR(cbor_value_advance(&shardVal));
+        CHECK_ERR(cbor_value_leave_container(&shardsVal, &shardVal));
+        p->shards.push_back(std::move(shard));
+    }
     return size;
 }
 
 int encode_packet_partition_info(struct packet* packet, const struct partition_info* p) {
     assert(p->bbox_per_deg < MAX_ENCODABLE_BBOX_PER_DEG);
     packet->header.type = packet_type_enum::PACKET_TYPE_PARTITION_INFO;
-    packet->payload = make_unique<char[]>(CBOR_PARTITION_INFO_BYTES);
-    size_t size = encode_packet_partition_info_cborbuf((uint8_t*)packet->payload.get(), CBOR_PARTITION_INFO_BYTES, p);
+    size_t capacity = p->shards.empty() ? CBOR_PARTITION_INFO_BYTES : CBOR_SHARDED_PARTITION_INFO_BYTES;
+    for (const struct shard_address& shard : p->shards)
+        capacity += CBOR_SHARD_ADDRESS_BYTES + shard.host.size();
+    packet->payload = acquire_packet_buffer(capacity);
+    size_t size = encode_packet_partition_info_cborbuf((uint8_t*)packet->payload.get(), capacity, p);
 
     if (!size)
         return 1;
@@ -164,3 +365,344 @@ int decode_packet_partition_info(const struct packet* packet, struct partition_i
     assert(packet->header.type == packet_type_enum::PACKET_TYPE_PARTITION_INFO);
     return !decode_packet_partition_info_cborbuf((uint8_t*)packet->payload.get(), packet->header.payload_len, p);
 }
+
+void encode_packet_stats_query(struct packet* packet) {
+    packet->header.type = packet_type_enum::PACKET_TYPE_STATS_QUERY;
+    packet->header.payload_len = 0;
+}
+
+// stats are sent as a cbor map of named values, so either end can have more or fewer stats than
+// the other knows about:
+// { "uptime_us", "counters": { name: value }, "gauges": { name: value },
+//   "client_backlog": [[client, backlog]], "histograms": { name: { "count", "sum", "max",
+//   "buckets": [[largest value in bucket, count]] } } }
+int encode_packet_stats(struct packet* packet, const struct server_stats* stats) {
+    json data = {
+        {"uptime_us", stats->uptime_us},
+        {"counters", json::object()},
+        {"gauges", json::object()},
+        {"client_backlog", stats->client_backlog},
+        {"histograms", json::object()},
+    };
+    for (const struct stats_value& v : stats->counters)
+        data["counters"][v.name] = v.value;
+    for (const struct stats_value& v : stats->gauges)
+        data["gauges"][v.name] = v.value;
+    for (const struct stats_histogram& h : stats->histograms)
+        data["histograms"][h.name] = {
+            {"count", h.count}, {"sum", h.sum}, {"max", h.max}, {"buckets", h.buckets},
+        };
+
+    vector<uint8_t> v = json::to_cbor(data);
+    packet->header.type = packet_type_enum::PACKET_TYPE_STATS;
+    packet->payload = acquire_packet_buffer(v.size());
+    packet->header.payload_len = v.size();
+    copy(v.begin(), v.end(), packet->payload.get());
+    return 0;
+}
+
+int decode_packet_stats(const struct packet* packet, struct server_stats* stats) {
+    if (packet->header.type != packet_type_enum::PACKET_TYPE_STATS)
+        return -1;
+
+    const uint8_t* buf = (const uint8_t*)packet->payload.get();
+    json data = json::from_cbor(buf, buf + packet->header.payload_len, true, false);
+    if (data.is_discarded() || !data.is_object())
+        return 1;
+
+    try {
+        stats->uptime_us = data.value("uptime_us", (uint64_t)0);
+        stats->counters.clear();
+        for (auto& [name, value] : data["counters"].items())
+            stats->counters.push_back({ .name = name, .value = value.get<int64_t>() });
+        stats->gauges.clear();
+        for (auto& [name, value] : data["gauges"].items())
+            stats->gauges.push_back({ .name = name, .value = value.get<int64_t>() });
+        stats->client_backlog = data["client_backlog"].get<vector<pair<uint32_t, int64_t>>>();
+        stats->histograms.clear();
+        for (auto& [name, h] : data["histograms"].items()) {
+            stats->histograms.push_back({
+                    .name = name,
+                    .count = h["count"].get<uint64_t>(),
+                    .sum = h["sum"].get<uint64_t>(),
+                    .max = h["max"].get<uint64_t>(),
+                    .buckets = h["buckets"].get<vector<pair<uint64_t, uint64_t>>>(),
+                });
+        }
+    } catch (const json::exception& e) {
+        return 2;
+    }
+    return 0;
+}
+
+int encode_packet_trace_query(struct packet* packet, int tracing) {
+    packet->header.type = packet_type_enum::PACKET_TYPE_TRACE_QUERY;
+    packet->payload = acquire_packet_buffer(9);
+    CborEncoder enc;
+    cbor_encoder_init(&enc, (uint8_t*)packet->payload.get(), 9, 0);
+    if (cbor_encode_int(&enc, tracing) != CborNoError)
+        return 1;
+    packet->header.payload_len = cbor_encoder_get_buffer_size(&enc, (uint8_t*)packet->payload.get());
+    return 0;
+}
+
+int decode_packet_trace_query(const struct packet* packet, int* tracing) {
+    if (packet->header.type != packet_type_enum::PACKET_TYPE_TRACE_QUERY)
+        return -1;
+
+    CborParser par;
+    CborValue val;
+    cbor_parser_init((const uint8_t*)packet->payload.get(), packet->header.payload_len, 0, &par, &val);
+    return cbor_value_get_int_checked(&val, tracing) != CborNoError;
+}
+
+// the json is sent as a single cbor text string
+int encode_packet_trace(struct packet* packet, const string& trace_json) {
+    size_t cap = trace_json.size() + 9;
+    packet->header.type = packet_type_enum::PACKET_TYPE_TRACE;
+    packet->payload = acquire_packet_buffer(cap);
+    CborEncoder enc;
+    cbor_encoder_init(&enc, (uint8_t*)packet->payload.get(), cap, 0);
+    if (cbor_encode_text_string(&enc, trace_json.data(), trace_json.size()) != CborNoError)
+        return 1;
+    packet->header.payload_len = cbor_encoder_get_buffer_size(&enc, (uint8_t*)packet->payload.get());
+    return 0;
+}
+
+int decode_packet_trace(const struct packet* packet, string* trace_json) {
+    if (packet->header.type != packet_type_enum::PACKET_TYPE_TRACE)
+        return -1;
+
+    CborParser par;
+    CborValue val;
+    cbor_parser_init((const uint8_t*)packet->payload.get(), packet->header.payload_len, 0, &par, &val);
+    size_t len;
+    if (!cbor_value_is_text_string(&val) || cbor_value_calculate_string_length(&val, &len) != CborNoError)
+        return 1;
+    trace_json->resize(len);
+    return cbor_value_copy_text_string(&val, trace_json->data(), &len, NULL) != CborNoError;
+}
+
+size_t encode_chunk_request_cborbuf(uint8_t* buf, size_t size, const struct chunk_id* ids, size_t n,
+                                    uint64_t request_id, uint64_t flags, uint64_t deadline_ms) {
+    CborEncoder enc, arrEnc, idEnc;
+    cbor_encoder_init(&enc, buf, size, 0);
+    size_t ntrailer = deadline_ms ? 3 : flags ? 2 : request_id ? 1 : 0;
+    CHECK_ERR(cbor_encoder_create_array(&enc, &arrEnc, n + ntrailer));
+    for (size_t i = 0; i < n; i++) {
+        CHECK_ERR(cbor_encoder_create_array(&arrEnc, &idEnc, ids[i].level ? 3 : 2));
+        CHECK_ERR(cbor_encode_int(&idEnc, ids[i].x));
+        CHECK_ERR(cbor_encode_int(&idEnc, ids[i].y));
+        if (ids[i].level)
+            CHECK_ERR(cbor_encode_uint(&idEnc, ids[i].level));
+        CHECK_ERR(cbor_encoder_close_container(&arrEnc, &idEnc));
+    }
+    uint64_t trailer[3] = { request_id, flags, deadline_ms };
+    for (size_t i = 0; i < ntrailer; i++)
+        CHECK_ERR(cbor_encode_uint(&arrEnc, trailer[i]));
+    CHECK_ERR(cbor_encoder_close_container(&enc, &arrEnc));
+    return cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+size_t decode_chunk_request_cborbuf(const uint8_t* buf, size_t size, vector<struct chunk_id>* ids,
+                                    uint64_t* request_id, uint64_t* flags, uint64_t* deadline_ms) {
+    CborParser par;
+    CborValue val, arrVal, idVal;
+    cbor_parser_init(buf, size, 0, &par, &val);
+    CHECK_ERR(cbor_value_enter_container(&val, &arrVal));
+
+    // the request id, the flags, then the deadline
+    uint64_t trailer[3] = { 0, 0, 0 };
+    size_t ntrailer = 0;
+    while (!cbor_value_at_end(&arrVal)) {
+        if (cbor_value_is_unsigned_integer(&arrVal)) {
+            if (ntrailer == 3)
+                return 0;
+            CHECK_ERR(cbor_value_get_uint64(&arrVal, &trailer[ntrailer++]));
+            CHECK_ERR(cbor_value_advance(&arrVal));
+            continue;
+        }
+        if (!cbor_value_is_array(&arrVal) || ids->size() >= MAX_CHUNK_REQUEST_IDS)
+            return 0;
+
+        int x, y, level = 0;
+        CHECK_ERR(cbor_value_enter_container(&arrVal, &idVal));
+        CHECK_ERR(cbor_value_get_int_checked(&idVal, &x));
+        CHECK_ERR(cbor_value_advance(&idVal));
+        CHECK_ERR(cbor_value_get_int_checked(&idVal, &y));
+        CHECK_ERR(cbor_value_advance(&idVal));
+        if (!cbor_value_at_end(&idVal)) {
+            CHECK_ERR(cbor_value_get_int_checked(&idVal, &level));
+            CHECK_ERR(cbor_value_advance(&idVal));
+        }
+        if (!cbor_value_at_end(&idVal) || level < 0 || level > UINT8_MAX)
+            return 0;
+        CHECK_ERR(cbor_value_leave_container(&arrVal, &idVal));
+        ids->push_back({ .x = x, .y = y, .level = (uint8_t)level });
+    }
+    if (request_id)
+        *request_id = trailer[0];
+    if (flags)
+        *flags = trailer[1];
+    if (deadline_ms)
+        *deadline_ms = trailer[2];
+    return size;
+}
+
+int encode_packet_chunk_request(const struct chunk_id* ids, size_t n, struct packet* packet,
+                                uint64_t request_id, uint64_t flags, uint64_t deadline_ms) {
+    if (n > MAX_CHUNK_REQUEST_IDS)
+        return 2;
+
+    // array header + ids + request id, flags & deadline
+    size_t cap = 9 + n * CBOR_CHUNK_ID_BYTES + 3 * 9;
+    packet->header.type = packet_type_enum::PACKET_TYPE_CHUNK_REQUEST;
+    packet->payload = acquire_packet_buffer(cap);
+    size_t size = encode_chunk_request_cborbuf((uint8_t*)packet->payload.get(), cap, ids, n,
+                                               request_id, flags, deadline_ms);
+    if (!size)
+        return 1;
+    packet->header.payload_len = size;
+    return 0;
+}
+
+int decode_packet_chunk_request(vector<struct chunk_id>* ids, const struct packet* packet,
+                                uint64_t* request_id, uint64_t* flags, uint64_t* deadline_ms) {
+    if (packet->header.type != packet_type_enum::PACKET_TYPE_CHUNK_REQUEST)
+        return -1;
+
+    ids->clear();
+    return !decode_chunk_request_cborbuf((uint8_t*)packet->payload.get(), packet->header.payload_len,
+                                         ids, request_id, flags, deadline_ms);
+}
+
+static bool chunk_status_has_data(int status) {
+    return status == CHUNK_STATUS_OK || status == CHUNK_STATUS_STALE;
+}
+
+int encode_packet_chunk(struct packet* packet, struct chunk_id id, int status, json data) {
+    TRACE_SPAN("encode_packet_chunk");
+    if (!chunk_status_has_data(status))
+        return encode_packet_chunk_cbor(packet, id, status);
+
+    // as with geojson packets, serialized into a per-thread scratch vector which keeps its capacity
+    thread_local vector<uint8_t> v;
+    v.clear();
+    json_to_cbor(data, &v);
+    return encode_packet_chunk_cbor(packet, id, status, v.data(), v.size());
+}
+
+int encode_packet_chunk_cbor(struct packet* packet, struct chunk_id id, int status,
+                             const uint8_t* data, size_t len) {
+    bool has_data = chunk_status_has_data(status);
+    if (has_data && !len)
+        return 1;
+
+    // the array is never closed; the already encoded geojson is copied in as its last item
+    uint8_t prefix[CBOR_CHUNK_PREFIX_BYTES];
+    CborEncoder enc, arrEnc;
+    cbor_encoder_init(&enc, prefix, sizeof(prefix), 0);
+    if (cbor_encoder_create_array(&enc, &arrEnc, has_data ? 5 : 4) != CborNoError
+        || cbor_encode_int(&arrEnc, id.x) != CborNoError
+        || cbor_encode_int(&arrEnc, id.y) != CborNoError
+        || cbor_encode_uint(&arrEnc, id.level) != CborNoError
+        || cbor_encode_int(&arrEnc, status) != CborNoError)
+        return 2;
+    size_t prefix_len = cbor_encoder_get_buffer_size(&arrEnc, prefix);
+    if (!has_data)
+        len = 0;
+
+    packet->header.type = packet_type_enum::PACKET_TYPE_CHUNK;
+    packet->payload = acquire_packet_buffer(prefix_len + len);
+    packet->header.payload_len = prefix_len + len;
+    copy(prefix, prefix + prefix_len, packet->payload.get());
+    if (len)
+        copy(data, data + len, packet->payload.get() + prefix_len);
+    return 0;
+}
+
+int decode_packet_chunk(const struct packet* packet, struct chunk_id* id, int* status, json* data) {
+    TRACE_SPAN("decode_packet_chunk");
+    if (packet->header.type != packet_type_enum::PACKET_TYPE_CHUNK
+        && packet->header.type != packet_type_enum::PACKET_TYPE_CHUNK_PUSH)
+        return -1;
+
+    const uint8_t* buf = (const uint8_t*)packet->payload.get();
+    json msg = json::from_cbor(buf, buf + packet->header.payload_len, true, false);
+    if (msg.is_discarded() || !msg.is_array() || msg.size() < 4)
+        return 1;
+
+    try {
+        id->x = msg[0].get<int32_t>();
+        id->y = msg[1].get<int32_t>();
+        id->level = msg[2].get<uint8_t>();
+        *status = msg[3].get<int>();
+    } catch (const json::exception& e) {
+        return 2;
+    }
+    if (chunk_status_has_data(*status)) {
+        if (msg.size() < 5)
+            return 3;
+        *data = std::move(msg[4]);
+    } else {
+        *data = nullptr;
+    }
+    return 0;
+}
+
+int encode_packet_chunk_layer(struct packet* packet, struct chunk_id id, const json& header,
+                              const json& layer) {
+    TRACE_SPAN("encode_packet_chunk_layer");
+    thread_local vector<uint8_t> v;
+    v.clear();
+    json_to_cbor(header, &v);
+    json_to_cbor(layer, &v);
+    return encode_packet_chunk_layer_cbor(packet, id, v.data(), v.size());
+}
+
+int encode_packet_chunk_layer_cbor(struct packet* packet, struct chunk_id id, const uint8_t* data,
+                                   size_t len) {
+    if (!len)
+        return 1;
+
+    // as with chunk packets, the header & layer are copied in after the unclosed array's ids
+    uint8_t prefix[CBOR_CHUNK_PREFIX_BYTES];
+    CborEncoder enc, arrEnc;
+    cbor_encoder_init(&enc, prefix, sizeof(prefix), 0);
+    if (cbor_encoder_create_array(&enc, &arrEnc, 5) != CborNoError
+        || cbor_encode_int(&arrEnc, id.x) != CborNoError
+        || cbor_encode_int(&arrEnc, id.y) != CborNoError
+        || cbor_encode_uint(&arrEnc, id.level) != CborNoError)
+        return 2;
+    size_t prefix_len = cbor_encoder_get_buffer_size(&arrEnc, prefix);
+
+    packet->header.type = packet_type_enum::PACKET_TYPE_CHUNK_LAYER;
+    packet->payload = acquire_packet_buffer(prefix_len + len);
+    packet->header.payload_len = prefix_len + len;
+    copy(prefix, prefix + prefix_len, packet->payload.get());
+    copy(data, data + len, packet->payload.get() + prefix_len);
+    return 0;
+}
+
+int decode_packet_chunk_layer(const struct packet* packet, struct chunk_id* id, json* header,
+                              json* layer) {
+    TRACE_SPAN("decode_packet_chunk_layer");
+    if (packet->header.type != packet_type_enum::PACKET_TYPE_CHUNK_LAYER)
+        return -1;
+
+    const uint8_t* buf = (const uint8_t*)packet->payload.get();
+    json msg = json::from_cbor(buf, buf + packet->header.payload_len, true, false);
+    if (msg.is_discarded() || !msg.is_array() || msg.size() != 5 || !msg[3].is_object())
+        return 1;
+
+    try {
+        id->x = msg[0].get<int32_t>();
+        id->y = msg[1].get<int32_t>();
+        id->level = msg[2].get<uint8_t>();
+    } catch (const json::exception& e) {
+        return 2;
+    }
+    *header = std::move(msg[3]);
+    *layer = std::move(msg[4]);
+    return 0;
+}
@@ -7,6 +7,9 @@
 #include <nlohmann/json.hpp>
 
 #include "wms.h"
+#include "packet_pool.h"
+#include "stats.h"
+#include "trace.h"
 
 // functions for encoding packets into binary format transmissibile between client & server
 // we use CBOR to encode data in a binary format, try https://cbor.me/ to test what these binary
@@ -28,6 +31,24 @@ enum struct packet_type_enum: uint8_t {
     PACKET_TYPE_PARTITION_INFO_QUERY = 4,
     // info on how server has partitioned chunks (... & eventually other capabilities?)
     PACKET_TYPE_PARTITION_INFO = 5,
+    // body-less request for the server's statistics
+    PACKET_TYPE_STATS_QUERY = 6,
+    // counters, gauges & latency histograms of the server (see stats.h)
+    PACKET_TYPE_STATS = 7,
+    // asks the server to start / stop tracing (see trace.h) and send the spans it has recorded
+    PACKET_TYPE_TRACE_QUERY = 8,
+    // recorded spans, as chrome trace json
+    PACKET_TYPE_TRACE = 9,
+    // request for an arbitrary set of chunks by id; answered with one CHUNK packet per id
+    PACKET_TYPE_CHUNK_REQUEST = 10,
+    // one chunk, tagged with its id and a CHUNK_STATUS_*
+    PACKET_TYPE_CHUNK = 11,
+    // one layer of a chunk still being converted, sent ahead of the chunk's CHUNK packet to
+    // clients that asked for CHUNK_REQUEST_STREAM_LAYERS
+    PACKET_TYPE_CHUNK_LAYER = 12,
+    // the answer to a chunk answered with CHUNK_STATUS_PENDING or CHUNK_STATUS_STALE, sent on its
+    // own whenever it is ready; laid out as a CHUNK packet
+    PACKET_TYPE_CHUNK_PUSH = 13,
 };
 
 #define CBOR_HEADER_BYTES 12
@@ -37,9 +58,11 @@ struct packet_header {
     packet_type_enum type;
 };
 
+// payload buffers are drawn from the thread-local pool in packet_pool.h, and are returned to it
+// when the packet is destroyed or its payload replaced
 struct packet {
     struct packet_header header;
-    std::unique_ptr<char[]> payload;
+    packet_buffer payload;
 };
 
 size_t encode_cbor_header(char* buf, size_t buf_size, const struct packet_header*header);
@@ -48,16 +71,106 @@ size_t decode_cbor_header(const char* buf, size_t buf_size, struct packet_header
 // functions for encoding & decoding various types of packet
 // generally, these return 0 on success and an error code on failure
 
-int encode_packet_bbox(const struct bbox* data, struct packet* packet);
-int decode_packet_bbox(struct bbox* data, const struct packet* packet);
+// bbox packets can carry the trace request id (see trace.h) the query is part of; it is left out
+// when 0, and decoded as 0 when absent
+int encode_packet_bbox(const struct bbox* data, struct packet* packet, uint64_t request_id = 0);
+int decode_packet_bbox(struct bbox* data, const struct packet* packet, uint64_t* request_id = NULL);
 
 int encode_packet_geojson_count(uint64_t n, struct packet* packet);
 int decode_packet_geojson_count(uint64_t* n, const struct packet* packet);
 
+// appends data to out as cbor, byte for byte as json::to_cbor() would, but without the heap
+// allocations it makes (its output adapter, and a copy of every object key); nothing is allocated
+// at all once out has the capacity, so buffers reused from one chunk to the next stay warm
+void json_to_cbor(const nlohmann::json& data, std::vector<uint8_t>* out);
+
 int encode_packet_geojson(const nlohmann::json & data, struct packet* packet);
+// as above, from geojson already encoded as cbor (eg. by the shared chunk cache, see shm_cache.h)
+int encode_packet_geojson_cbor(const uint8_t* data, size_t len, struct packet* packet);
 nlohmann::json decode_packet_geojson(const struct packet* packet);
 
 void encode_packet_partition_info_query(struct packet* packet);
 
 int encode_packet_partition_info(struct packet* packet, const struct partition_info* p);
 int decode_packet_partition_info(const struct packet* packet, struct partition_info* p);
+
+void encode_packet_stats_query(struct packet* packet);
+
+int encode_packet_stats(struct packet* packet, const struct server_stats* stats);
+int decode_packet_stats(const struct packet* packet, struct server_stats* stats);
+
+// tracing is a TRACE_QUERY_* action
+#define TRACE_QUERY_KEEP -1
+#define TRACE_QUERY_DISABLE 0
+#define TRACE_QUERY_ENABLE 1
+int encode_packet_trace_query(struct packet* packet, int tracing);
+int decode_packet_trace_query(const struct packet* packet, int* tracing);
+
+int encode_packet_trace(struct packet* packet, const std::string& trace_json);
+int decode_packet_trace(const struct packet* packet, std::string* trace_json);
+
+// chunk requests are an array of ids, each [x, y] or [x, y, level] (level is left out when 0),
+// optionally followed by the trace request id as with bbox packets, then by CHUNK_REQUEST_*
+// flags, then by a deadline in milliseconds (those before the last one given are always
+// present, as 0 if there are none); servers from before the flags take them for the request id,
+// and ignore them
+//
+// chunks the server can't answer within the deadline of it recieving the request are answered
+// with the best it has by then (see CHUNK_STATUS_PENDING & CHUNK_STATUS_STALE), rather than
+// holding up the rest
+#define MAX_CHUNK_REQUEST_IDS 4096
+// worst case size of one encoded id: 1 byte array header + 3 * 5 byte integers
+#define CBOR_CHUNK_ID_BYTES 16
+// the layers of chunks the server has to fetch are sent in CHUNK_LAYER packets as they are
+// converted, rather than only once the whole chunk is ready
+#define CHUNK_REQUEST_STREAM_LAYERS 1
+int encode_packet_chunk_request(const struct chunk_id* ids, size_t n, struct packet* packet,
+                                uint64_t request_id = 0, uint64_t flags = 0,
+                                uint64_t deadline_ms = 0);
+int decode_packet_chunk_request(std::vector<struct chunk_id>* ids, const struct packet* packet,
+                                uint64_t* request_id = NULL, uint64_t* flags = NULL,
+                                uint64_t* deadline_ms = NULL);
+
+// the chunk's geojson follows
+#define CHUNK_STATUS_OK 0
+// the chunk was loaded, but has nothing in it
+#define CHUNK_STATUS_EMPTY 1
+// the chunk could not be loaded (eg. the osm api refused), or was asked for at an unserved level
+#define CHUNK_STATUS_ERROR 2
+// the chunk belongs to another shard (see shard_map.h); the client's shard list is out of date
+#define CHUNK_STATUS_MOVED 3
+// the chunk was dropped as the client wasn't reading fast enough to keep up (see send_queue.h);
+// it should be asked for again if it is still wanted
+#define CHUNK_STATUS_DROPPED 4
+// every layer of the chunk was sent in CHUNK_LAYER packets before this one; together they are
+// the chunk's geojson
+#define CHUNK_STATUS_STREAMED 5
+// the chunk wasn't ready by the request's deadline; its answer follows in a CHUNK_PUSH packet
+// once it is, on the same connection, after answers to any number of other requests
+#define CHUNK_STATUS_PENDING 6
+// as CHUNK_STATUS_PENDING, but an older copy of the chunk's geojson the server still had follows,
+// to show until the fresh chunk is pushed
+#define CHUNK_STATUS_STALE 7
+// chunk packets are [x, y, level, status, geojson], where the geojson (as sent in GEOJSON packets)
+// is only present with CHUNK_STATUS_OK & CHUNK_STATUS_STALE
+int encode_packet_chunk(struct packet* packet, struct chunk_id id, int status,
+                        nlohmann::json data = nullptr);
+// worst case size of everything before the geojson: array header + 4 * 9 byte integers
+#define CBOR_CHUNK_PREFIX_BYTES 40
+// as above, from geojson already encoded as cbor
+int encode_packet_chunk_cbor(struct packet* packet, struct chunk_id id, int status,
+                             const uint8_t* data = NULL, size_t len = 0);
+// decodes CHUNK & CHUNK_PUSH packets alike
+int decode_packet_chunk(const struct packet* packet, struct chunk_id* id, int* status,
+                        nlohmann::json* data);
+
+// chunk layer packets are [x, y, level, header, layer], where header is the first item of the
+// chunk's geojson and layer one of the feature collections following it; a client puts the
+// layers of a chunk together in the order they arrive
+int encode_packet_chunk_layer(struct packet* packet, struct chunk_id id, const nlohmann::json& header,
+                              const nlohmann::json& layer);
+// as above, from the header & layer already encoded as cbor, back to back
+int encode_packet_chunk_layer_cbor(struct packet* packet, struct chunk_id id, const uint8_t* data,
+                                   size_t len);
+int decode_packet_chunk_layer(const struct packet* packet, struct chunk_id* id,
+                              nlohmann::json* header, nlohmann::json* layer);
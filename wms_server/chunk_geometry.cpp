@@ -0,0 +1,202 @@
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#include "chunk_geometry.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// tags a feature is classified by, in order of precedence
+static const char* const kind_keys[] = {
+    "building", "highway", "railway", "waterway", "natural", "landuse", "leisure",
+    "amenity", "man_made", "barrier", "boundary", "place",
+};
+
+// rough height of one storey, for buildings which only have building:levels tagged
+#define METRES_PER_LEVEL 3.0f
+
+// looks up a key in a gdal "other_tags" hstore string ("key"=>"value","key2"=>"value2")
+static bool hstore_get(const string& tags, const string& key, string* out) {
+    string needle = "\"" + key + "\"=>\"";
+    size_t pos = tags.find(needle);
+    if (pos == string::npos)
+        return false;
+    pos += needle.size();
+    size_t end = tags.find('"', pos);
+    if (end == string::npos)
+        return false;
+    *out = tags.substr(pos, end - pos);
+    return true;
+}
+
+// value of an osm tag of a feature, whether gdal made it a column or left it in other_tags
+static bool get_tag(const json& props, const char* key, string* out) {
+    auto it = props.find(key);
+    if (it != props.end() && it->is_string()) {
+        *out = it->get<string>();
+        return true;
+    }
+    auto other = props.find("other_tags");
+    if (other != props.end() && other->is_string())
+        return hstore_get(other->get_ref<const string&>(), key, out);
+    return false;
+}
+
+static void add_feature(const json& props, struct chunk_features* features) {
+    int64_t osm_id = 0;
+    string kind, val;
+
+    if (props.is_object()) {
+        for (const char* id_key : { "osm_id", "osm_way_id" }) {
+            auto it = props.find(id_key);
+            if (it != props.end() && it->is_string()) {
+                osm_id = strtoll(it->get_ref<const string&>().c_str(), NULL, 10);
+                break;
+            } else if (it != props.end() && it->is_number_integer()) {
+                osm_id = it->get<int64_t>();
+                break;
+            }
+        }
+
+        for (const char* key : kind_keys) {
+            if (get_tag(props, key, &val)) {
+                kind = string(key) + "=" + val;
+                break;
+            }
+        }
+    }
+
+    float height = 0;
+    if (props.is_object()) {
+        if (get_tag(props, "height", &val))
+            height = strtof(val.c_str(), NULL);
+        else if (get_tag(props, "building:levels", &val))
+            height = strtof(val.c_str(), NULL) * METRES_PER_LEVEL;
+    }
+
+    features->osm_ids.push_back(osm_id);
+    features->kinds.push_back(std::move(kind));
+    features->heights.push_back(height);
+}
+
+static bool push_coord(const json& c, vector<float>* coords) {
+    if (!c.is_array() || c.size() < 2 || !c[0].is_number() || !c[1].is_number())
+        return false;
+    coords->push_back(c[0].get<float>());
+    coords->push_back(c[1].get<float>());
+    return true;
+}
+
+static void add_line(const json& line, struct chunk_geometry* out, int32_t feature) {
+    if (!line.is_array())
+        return;
+    for (const json& c : line)
+        push_coord(c, &out->line_coords);
+    int32_t nverts = out->line_coords.size() / 2;
+    if (nverts == out->line_offsets.back())
+        return;
+    out->line_offsets.push_back(nverts);
+    out->line_features.push_back(feature);
+}
+
+static void add_polygon(const json& rings, struct chunk_geometry* out, int32_t feature) {
+    if (!rings.is_array())
+        return;
+    int32_t first_ring = out->ring_offsets.size() - 1;
+    for (const json& ring : rings) {
+        if (!ring.is_array() || ring.size() < 3)
+            continue;
+        // geojson rings repeat their first vertex at the end, which we don't need
+        size_t n = ring.size();
+        if (ring.front() == ring.back())
+            n--;
+        for (size_t i = 0; i < n; i++)
+            push_coord(ring[i], &out->polygon_coords);
+        int32_t nverts = out->polygon_coords.size() / 2;
+        if (nverts != out->ring_offsets.back())
+            out->ring_offsets.push_back(nverts);
+    }
+    int32_t nrings = out->ring_offsets.size() - 1;
+    if (nrings == first_ring)
+        return;
+    out->polygon_offsets.push_back(nrings);
+    out->polygon_features.push_back(feature);
+}
+
+int decode_chunk_geometry(const json& chunk, struct chunk_geometry* out) {
+    if (!chunk.is_array() || chunk.empty() || !chunk[0].is_object())
+        return 1;
+
+    const json& header = chunk[0];
+    out->bbox = {
+        .minx = header.value("minx", 0.0f),
+        .miny = header.value("miny", 0.0f),
+        .maxx = header.value("maxx", 0.0f),
+        .maxy = header.value("maxy", 0.0f),
+    };
+
+    // chunks from before the server reprojected them are in degrees, & can't be placed
+    auto origin = header.find("origin");
+    if (origin == header.end() || !origin->is_array() || origin->size() != 2
+        || !(*origin)[0].is_number() || !(*origin)[1].is_number())
+        return 2;
+    out->origin = { .lon = (*origin)[0].get<double>(), .lat = (*origin)[1].get<double>() };
+
+    for (size_t l = 1; l < chunk.size(); l++) {
+        auto features = chunk[l].find("features");
+        if (features == chunk[l].end() || !features->is_array())
+            continue;
+
+        for (const json& feature : *features) {
+            auto geom = feature.find("geometry");
+            if (geom == feature.end() || !geom->is_object())
+                continue;
+            auto type = geom->find("type");
+            auto coords = geom->find("coordinates");
+            if (type == geom->end() || coords == geom->end() || !type->is_string())
+                continue;
+
+            const string& t = type->get_ref<const string&>();
+            int32_t fi = out->features.osm_ids.size();
+
+            if (t == "Point") {
+                if (!push_coord(*coords, &out->point_coords))
+                    continue;
+                out->point_features.push_back(fi);
+            } else if (t == "LineString") {
+                add_line(*coords, out, fi);
+            } else if (t == "MultiLineString" && coords->is_array()) {
+                for (const json& line : *coords)
+                    add_line(line, out, fi);
+            } else if (t == "Polygon") {
+                add_polygon(*coords, out, fi);
+            } else if (t == "MultiPolygon" && coords->is_array()) {
+                for (const json& poly : *coords)
+                    add_polygon(poly, out, fi);
+            } else {
+                continue;
+            }
+
+            auto props = feature.find("properties");
+            add_feature(props != feature.end() ? *props : json(), &out->features);
+        }
+    }
+
+    return 0;
+}
+
+size_t chunk_geometry_bytes(const struct chunk_geometry* geom) {
+    size_t bytes = sizeof(*geom);
+    bytes += (geom->point_coords.size() + geom->line_coords.size()
+              + geom->polygon_coords.size() + geom->features.heights.size()) * sizeof(float);
+    bytes += (geom->point_features.size() + geom->line_offsets.size()
+              + geom->line_features.size() + geom->ring_offsets.size()
+              + geom->polygon_offsets.size() + geom->polygon_features.size()) * sizeof(int32_t);
+    bytes += geom->features.osm_ids.size() * sizeof(int64_t);
+    for (const string& k : geom->features.kinds)
+        bytes += sizeof(string) + k.size();
+    return bytes;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+// flattened, render friendly representation of the geometry in a chunk
+//
+// chunks are sent by the server as a json array of a header object followed by one geojson
+// feature collection per layer; walking that structure feature by feature is slow (especially in
+// GDScript), so the client decodes it once on its worker thread into flat arrays per geometry
+// kind, in the style of typed array / "structure of arrays" geometry formats:
+//
+// - coordinates are x, y pairs stored back to back, in metres east & north of the chunk's origin
+//   (the server reprojects them when generating the chunk, see CHUNK_PROJ_FORMAT in constants.h)
+// - for lines and polygons, offset arrays mark where each line / ring starts, with one extra
+//   entry at the end so the vertex range of item i is always [offsets[i], offsets[i + 1])
+// - every point, line and polygon records the index of the feature it came from, and attributes
+//   of each feature are held in parallel arrays
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+#include "wms.h"
+
+struct chunk_features {
+    // osm id of each feature (0 if unknown)
+    std::vector<int64_t> osm_ids;
+    // main tag of each feature as "key=value" (eg. "building=yes", "highway=residential"), or
+    // an empty string if the feature has none of the tags we classify by
+    std::vector<std::string> kinds;
+    // height of each feature in metres, taken from the height / building:levels tags; 0 if
+    // unknown
+    std::vector<float> heights;
+};
+
+struct chunk_geometry {
+    // bounds of the chunk in degrees
+    struct bbox bbox;
+    // point the coordinates are relative to, in degrees
+    struct chunk_origin origin;
+
+    // points: one coordinate pair each
+    std::vector<float> point_coords;
+    std::vector<int32_t> point_features;
+
+    // lines (linestrings, and the parts of multilinestrings)
+    std::vector<float> line_coords;
+    // vertex index each line starts at
+    std::vector<int32_t> line_offsets = { 0 };
+    std::vector<int32_t> line_features;
+
+    // polygons (polygons, and the parts of multipolygons)
+    std::vector<float> polygon_coords;
+    // vertex index each ring starts at; rings are not closed (the repeated last vertex of a
+    // geojson ring is dropped)
+    std::vector<int32_t> ring_offsets = { 0 };
+    // ring index each polygon starts at; the first ring of each polygon is its outer boundary,
+    // any following rings are holes
+    std::vector<int32_t> polygon_offsets = { 0 };
+    std::vector<int32_t> polygon_features;
+
+    struct chunk_features features;
+};
+
+// decodes a chunk as sent by the server (see get_chunk_json_local()) into out
+// returns 0 on success, otherwise an error code (out may be partially filled)
+int decode_chunk_geometry(const nlohmann::json& chunk, struct chunk_geometry* out);
+
+// rough number of bytes held by a decoded chunk
+size_t chunk_geometry_bytes(const struct chunk_geometry* geom);
@@ -5,168 +5,472 @@
 #include <vector>
 #include <set>
 #include <queue>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <chrono>
 #include <nlohmann/json.hpp>
 
 #include "wms.h"
 #include "osm_api.h"
+#include "cbor.h"
+#include "chunk_manager.h"
+#include "shm_cache.h"
+#include "prewarm.h"
+#include "chunk_store.h"
+#include "send_queue.h"
 #include "constants.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 
 using json = nlohmann::json;
 using namespace std;
 
-struct bbox_task {
-    struct bbox bbox;
+struct chunk_task {
+    struct chunk_id id;
     mutable uint64_t threads;
+    // of those, the clients which asked for its layers to be streamed
+    mutable uint64_t stream_threads;
+    // when the chunk was first queued
+    chrono::steady_clock::time_point queued;
+    // trace request id of the request that first queued the chunk
+    uint64_t request_id;
 };
 
 
-bool compare_bbox(const struct bbox_task a, const struct bbox_task b) {
-    return a.bbox.minx > b.bbox.minx || a.bbox.miny > b.bbox.miny;
+bool compare_chunk_task(const struct chunk_task& a, const struct chunk_task& b) {
+    return chunk_id_key(&a.id) < chunk_id_key(&b.id);
 }
 
 
 mutex chunk_queue_mutex;
-set<struct bbox_task, decltype(compare_bbox)*> chunk_queue(compare_bbox);
+set<struct chunk_task, decltype(compare_chunk_task)*> chunk_queue(compare_chunk_task);
+
+static struct shm_cache chunk_cache;
 
 atomic_uint8_t run_thread = 0;
 
-struct bbox_loader_queue {
-    queue<struct bbox> bboxes_found;
+struct chunk_loader_queue {
+    queue<struct chunk_result> chunks_found;
+    // where the connection's chunk layers & pushed chunks are sent (NULL when it isn't connected)
+    struct send_queue* out = NULL;
+    // chunks given up on at a request's deadline (see defer_chunks()), by key, to be pushed once
+    // done
+    unordered_set<uint64_t> deferred;
     mutex queue_guard;
+    // signalled whenever chunks_found is pushed to
+    condition_variable found;
 };
 
-struct bbox_loader_queue bbox_queues[MAX_CLIENTS];
+struct chunk_loader_queue chunk_queues[MAX_CLIENTS];
 
-void upsert_bbox_to_queue(struct bbox_task bbox) {
+void upsert_chunk_to_queue(struct chunk_task task) {
     chunk_queue_mutex.lock();
-    std::pair<set<struct bbox_task>::iterator, bool> pair = chunk_queue.insert(bbox);
+    std::pair<set<struct chunk_task>::iterator, bool> pair = chunk_queue.insert(task);
 
-    if (pair.second) {
-        pair.first->threads |= bbox.threads;
+    // already queued by another client, who then both need notifying
+    if (!pair.second) {
+        pair.first->threads |= task.threads;
+        pair.first->stream_threads |= task.stream_threads;
     }
+    stats_gauge_set(STAT_GAUGE_WORK_QUEUE, chunk_queue.size());
 
     chunk_queue_mutex.unlock();
 }
 
-vector<string> check_bbox_local_file(const struct bbox* bbox) {
-    vector<string> fs;
-    string fn = get_bbox_filename(bbox);
-    // cout << fn << endl;
-    for (const filesystem::directory_entry entry
-             : filesystem::directory_iterator(GEOJSON_PATH)) {
-        if (entry.is_regular_file() && entry.path().stem().generic_string().find(fn) != string::npos) {
-            fs.push_back(entry.path().filename());
-            // cout << entry.path().filename() << ", ";
-        }
-    }
-    // cout << endl;
-    return fs;
+vector<string> check_chunk_local_file(struct chunk_id id) {
+    TRACE_SPAN("check_chunk_local_file");
+    return chunk_store_lookup(id);
 }
 
 // -------- exported funcions -----------
 
-size_t load_bbox(const struct bbox* outer_bbox, unique_ptr<struct bbox[]>* out_bboxes, uint8_t thread_count, size_t* local_stored) {
-    unique_ptr<struct bbox[]> def_bboxes;
-    unique_ptr<struct bbox[]>* bboxes = out_bboxes ? out_bboxes : &def_bboxes;
-    size_t nbb = create_normalized_bbox(outer_bbox, bboxes);
-    *local_stored = nbb;
-    for (int i = 0; i < *local_stored; i++) {
-        vector<string> fs = check_bbox_local_file(&(*bboxes)[i]);
+int prepare_chunk_store() {
+    error_code ec;
+    filesystem::create_directories(GEOJSON_PATH, ec);
+    if (ec) {
+        LOG_ERROR("could not create %s: %s", GEOJSON_PATH, ec.message().c_str());
+        return 1;
+    }
+
+    uint32_t version = 0;
+    ifstream in(GEOJSON_PATH GEODATA_VERSION_FILE);
+    in >> version;
+    in.close();
+    if (version == GEODATA_VERSION)
+        return 0;
+
+    // the files are only a copy of osm data, so can be generated again as they are requested
+    size_t removed = 0;
+    for (const filesystem::directory_entry entry : filesystem::directory_iterator(GEOJSON_PATH, ec)) {
+        string fn = entry.path().filename().generic_string();
+        if (entry.is_regular_file() && fn.starts_with("map_bbox_")
+            && (fn.ends_with(".geojson") || fn.ends_with(CHUNK_TOMBSTONE_EXT))) {
+            filesystem::remove(entry.path(), ec);
+            removed++;
+        }
+    }
+    LOG_INFO("removed %zu chunk files from geodata version %u (now %d)", removed, version, GEODATA_VERSION);
+
+    ofstream out(GEOJSON_PATH GEODATA_VERSION_FILE, ios::trunc);
+    out << GEODATA_VERSION << endl;
+    if (!out.good()) {
+        LOG_ERROR("could not write %s", GEOJSON_PATH GEODATA_VERSION_FILE);
+        return 2;
+    }
+    return 0;
+}
+
+size_t load_chunks(vector<struct chunk_id>* ids, uint8_t thread_count, bool stream_layers) {
+    struct stats_timer timer(STAT_HIST_LOAD_CHUNKS);
+    TRACE_SPAN("load_chunks");
+    size_t n = ids->size();
+    size_t local_stored = n;
+    size_t known_missing = 0;
+    for (size_t i = 0; i < local_stored; i++) {
+        vector<string> fs = check_chunk_local_file((*ids)[i]);
         if (fs.empty()) {
-            printf("thread %hhu adding bbox %f %f to work queue\n", thread_count, (*bboxes)[i].minx, (*bboxes)[i].miny);
-            struct bbox_task bbt = {
-                .bbox = (*bboxes)[i],
+            // empty, or failed too recently to try again; answered straight away, through the
+            // connection's work queue as the loader would
+            int status = chunk_store_negative_status((*ids)[i]);
+            if (status != CHUNK_STATUS_OK) {
+                chunk_queues[thread_count].queue_guard.lock();
+                chunk_queues[thread_count].chunks_found.push({ .id = (*ids)[i], .status = status });
+                chunk_queues[thread_count].queue_guard.unlock();
+                chunk_queues[thread_count].found.notify_one();
+                known_missing++;
+                swap((*ids)[i--], (*ids)[--local_stored]);
+                continue;
+            }
+            LOG_DEBUG("thread %hhu adding chunk %d %d to work queue", thread_count, (*ids)[i].x, (*ids)[i].y);
+            struct chunk_task task = {
+                .id = (*ids)[i],
                 .threads = 1ULL << thread_count,
+                .stream_threads = stream_layers ? 1ULL << thread_count : 0,
+                .queued = chrono::steady_clock::now(),
+                .request_id = trace_current_request(),
             };
-            upsert_bbox_to_queue(bbt);
-            // swap unfound bbox to end of list to avoid waiting
-            (*bboxes)[i--] = (*bboxes)[--*local_stored];
-            (*bboxes)[*local_stored] = bbt.bbox;
+            upsert_chunk_to_queue(task);
+            // swap unfound chunk to end of list to avoid waiting
+            swap((*ids)[i--], (*ids)[--local_stored]);
         }
     }
-    return nbb;
+    prewarm_record_access(ids->data(), n);
+    stats_add(STAT_CHUNKS_REQUESTED, n);
+    stats_add(STAT_CHUNKS_LOCAL, local_stored);
+    stats_add(STAT_CHUNKS_NEGATIVE, known_missing);
+    stats_add(STAT_CHUNKS_QUEUED, n - local_stored - known_missing);
+    return local_stored;
 }
 
-json get_chunk_json_local(const struct bbox* bbox) {
-    vector<string> fns = check_bbox_local_file(bbox);
+void set_client_send_queue(uint8_t thread_count, struct send_queue* out) {
+    lock_guard<mutex> guard(chunk_queues[thread_count].queue_guard);
+    chunk_queues[thread_count].out = out;
+    if (!out)
+        chunk_queues[thread_count].deferred.clear();
+}
+
+// the first item of a chunk's json, ahead of its layers
+static json get_chunk_header(struct chunk_id id) {
+    struct bbox bbox = get_chunk_bbox(id, BBOX_PER_DEG_INT);
+    struct chunk_origin origin = get_chunk_origin(id, BBOX_PER_DEG_INT);
+    return {
+        {"minx", bbox.minx},
+        {"miny", bbox.miny},
+        {"maxx", bbox.maxx},
+        {"maxy", bbox.maxy},
+        // the layers' coordinates are metres east & north of this point
+        {"origin", {origin.lon, origin.lat}}
+    };
+}
+
+json get_chunk_json_local(struct chunk_id id) {
+    TRACE_SPAN("get_chunk_json_local");
+    vector<string> fns = check_chunk_local_file(id);
     if (fns.empty())
         return NULL;
 
-    json data = {{
-            {"minx", bbox->minx},
-            {"miny", bbox->miny},
-            {"maxx", bbox->maxx},
-            {"maxy", bbox->maxy}
-        }};// json::array();
+    json data = json::array({ get_chunk_header(id) });
     for (const string fn : fns) {
         auto ofn = filesystem::path(GEOJSON_PATH);
         ofn += fn;
         // cout << "opening " << ofn << endl;
+        TRACE_SPAN("parse_chunk_layer");
         std::ifstream f(ofn);
+        // evicted since it was looked up, or removed from outside the server
+        if (!f.is_open()) {
+            chunk_store_forget(id);
+            return NULL;
+        }
         data.emplace_back(json::parse(f));
     }
     return data;
 }
 
-json get_chunk_json_workqueue(uint8_t thread_counter) {
-    printf("fetching workqueue bbox in thread %hhu\n", thread_counter);
-    bbox_queues[thread_counter].queue_guard.lock();
-    while (bbox_queues[thread_counter].bboxes_found.empty()) {
-        bbox_queues[thread_counter].queue_guard.unlock();
+static void invalidate_cached_chunk(struct chunk_id id) {
+    shm_cache_invalidate(&chunk_cache, id);
+}
+
+int open_shared_chunk_cache(const string& name) {
+    int res = shm_cache_open(&chunk_cache, name);
+    if (!res) {
+        chunk_store_set_change_handler(invalidate_cached_chunk);
+        LOG_INFO("sharing encoded chunks through %s", chunk_cache.name.c_str());
+    }
+    return res;
+}
+
+bool get_chunk_cbor_local(struct chunk_id id, vector<uint8_t>* out) {
+    TRACE_SPAN("get_chunk_cbor_local");
+    struct shm_cache_ticket ticket;
+    enum shm_cache_lookup lookup = shm_cache_acquire(&chunk_cache, id, out, &ticket);
+    if (lookup == SHM_CACHE_HIT) {
+        stats_add(STAT_SHM_HITS);
+        return true;
+    }
+
+    json data = get_chunk_json_local(id);
+    if (data.is_null()) {
+        if (lookup == SHM_CACHE_FILL)
+            shm_cache_abandon(&chunk_cache, &ticket);
+        return false;
+    }
+    out->clear();
+    json_to_cbor(data, out);
+    if (lookup == SHM_CACHE_FILL) {
+        shm_cache_fill(&chunk_cache, &ticket, out->data(), out->size());
+        stats_add(STAT_SHM_FILLS);
+    }
+    return true;
+}
+
+bool get_chunk_cbor_fresh(struct chunk_id id, vector<uint8_t>* out) {
+    shm_cache_invalidate(&chunk_cache, id);
+    return get_chunk_cbor_local(id, out);
+}
+
+bool get_chunk_cbor_cached(struct chunk_id id, vector<uint8_t>* out) {
+    return shm_cache_peek(&chunk_cache, id, out);
+}
+
+struct chunk_result get_chunk_workqueue(uint8_t thread_counter) {
+    LOG_DEBUG("fetching workqueue chunk in thread %hhu", thread_counter);
+    uint64_t wait_start = trace_now_us();
+    struct chunk_loader_queue* q = &chunk_queues[thread_counter];
+    unique_lock<mutex> lock(q->queue_guard);
+    q->found.wait(lock, [q]() { return !q->chunks_found.empty(); });
+    struct chunk_result found = q->chunks_found.front();
+    q->chunks_found.pop();
+    lock.unlock();
+    LOG_DEBUG("found workqueue chunk in thread %hhu", thread_counter);
+    trace_record("wait_for_loader", wait_start, trace_now_us());
+
+    return found;
+}
+
+// queues a layer of a chunk the loader has just converted to the clients in *clients; clients
+// whose send queue has no room for it right now are taken out of *clients, and are sent the whole
+// chunk once it is done instead
+static void stream_layer(struct chunk_id id, const string& fn, uint64_t* clients, uint8_t total) {
+    if (!*clients)
+        return;
+    TRACE_SPAN("stream_layer");
+    ifstream f(filesystem::path(GEOJSON_PATH) / fn);
+    json layer = json::parse(f, NULL, false);
+    if (layer.is_discarded()) {
+        *clients = 0;
+        return;
+    }
+    // encoded once for all the clients
+    thread_local vector<uint8_t> body;
+    body.clear();
+    json_to_cbor(get_chunk_header(id), &body);
+    json_to_cbor(layer, &body);
+
+    for (uint8_t tc = 0; tc < total; tc++) {
+        if (!(*clients & 1ULL << tc))
+            continue;
+        struct packet packet;
+        encode_packet_chunk_layer_cbor(&packet, id, body.data(), body.size());
+        size_t bytes = CBOR_HEADER_BYTES + packet.header.payload_len;
+        lock_guard<mutex> guard(chunk_queues[tc].queue_guard);
+        if (!chunk_queues[tc].out || send_queue_try_push(chunk_queues[tc].out, &packet)) {
+            *clients &= ~(1ULL << tc);
+            continue;
+        }
+        stats_add(STAT_LAYERS_STREAMED);
+        stats_add(STAT_BYTES_SENT, bytes);
+    }
+}
 
-        std::this_thread::yield(); // TODO don't spinlock
+bool get_chunk_workqueue_until(uint8_t thread_counter, chrono::steady_clock::time_point deadline,
+                               struct chunk_result* out) {
+    uint64_t wait_start = trace_now_us();
+    struct chunk_loader_queue* q = &chunk_queues[thread_counter];
+    unique_lock<mutex> lock(q->queue_guard);
+    bool ready = q->found.wait_until(lock, deadline, [q]() { return !q->chunks_found.empty(); });
+    if (ready) {
+        *out = q->chunks_found.front();
+        q->chunks_found.pop();
+    }
+    lock.unlock();
+    trace_record("wait_for_loader", wait_start, trace_now_us());
+    return ready;
+}
 
-        bbox_queues[thread_counter].queue_guard.lock();
+void defer_chunks(uint8_t thread_counter, const vector<struct chunk_id>& ids,
+                  vector<struct chunk_result>* arrived) {
+    struct chunk_loader_queue* q = &chunk_queues[thread_counter];
+    lock_guard<mutex> guard(q->queue_guard);
+    unordered_set<uint64_t> done;
+    while (!q->chunks_found.empty()) {
+        done.insert(chunk_id_key(&q->chunks_found.front().id));
+        arrived->push_back(q->chunks_found.front());
+        q->chunks_found.pop();
     }
-    struct bbox bb = bbox_queues[thread_counter].bboxes_found.front();
-    bbox_queues[thread_counter].bboxes_found.pop();
-    bbox_queues[thread_counter].queue_guard.unlock();
-    printf("found workqueue bbox in thread %hhu\n", thread_counter);
+    for (const struct chunk_id& id : ids) {
+        if (!done.contains(chunk_id_key(&id)))
+            q->deferred.insert(chunk_id_key(&id));
+    }
+}
 
-    return get_chunk_json_local(&bb);
+bool chunk_is_deferred(uint8_t thread_counter, struct chunk_id id) {
+    struct chunk_loader_queue* q = &chunk_queues[thread_counter];
+    lock_guard<mutex> guard(q->queue_guard);
+    return q->deferred.contains(chunk_id_key(&id));
 }
 
-void server_bbox_loader_handler(const uint8_t* total_thread_count) {
+// queues a chunk the loader has finished to the connections in clients that it was deferred for.
+// they may have been sent the shared cache's copy as stale, so the chunk is encoded from the
+// files just fetched rather than taken from there
+static void push_chunk(struct chunk_result result, uint64_t clients, uint64_t streamed, uint8_t total) {
+    TRACE_SPAN("push_chunk");
+    // encoded once for all the clients, in the form each is to get
+    struct packet whole, marker;
+    vector<uint8_t> geodata;
+    if (result.status == CHUNK_STATUS_OK && clients & ~streamed
+        && !get_chunk_cbor_fresh(result.id, &geodata))
+        result.status = CHUNK_STATUS_ERROR;
+    encode_packet_chunk_cbor(&whole, result.id, result.status, geodata.data(), geodata.size());
+    encode_packet_chunk_cbor(&marker, result.id, CHUNK_STATUS_STREAMED);
+    whole.header.type = marker.header.type = packet_type_enum::PACKET_TYPE_CHUNK_PUSH;
+
+    for (uint8_t tc = 0; tc < total; tc++) {
+        if (!(clients & 1ULL << tc))
+            continue;
+        const struct packet* from = result.status == CHUNK_STATUS_OK && streamed & 1ULL << tc
+            ? &marker : &whole;
+        struct packet packet;
+        packet.header = from->header;
+        packet.payload = acquire_packet_buffer(from->header.payload_len);
+        copy(from->payload.get(), from->payload.get() + from->header.payload_len, packet.payload.get());
+
+        lock_guard<mutex> guard(chunk_queues[tc].queue_guard);
+        if (!chunk_queues[tc].out)
+            continue;
+        // the loader can't wait on one slow client, so anything that doesn't fit is dropped
+        send_queue_push_chunk(chunk_queues[tc].out, &packet, result.id, SLOW_CLIENT_DROP);
+        stats_add(STAT_CHUNKS_PUSHED);
+        stats_add(STAT_BYTES_SENT, CBOR_HEADER_BYTES + from->header.payload_len);
+    }
+}
+
+void server_chunk_loader_handler(const uint8_t* total_thread_count) {
+    trace_set_thread_name("loader");
+    // when the loader last had a client's chunk to load
+    auto idle_since = chrono::steady_clock::now();
     while (run_thread) {
         chunk_queue_mutex.lock();
-        printf("worker waiting for element\n");
+        LOG_DEBUG("worker waiting for element");
         while (chunk_queue.empty()) {
             chunk_queue_mutex.unlock();
-            // TODO don't spinlock
-            std::this_thread::yield();
+            // the queue is checked again after each pre-warmed chunk, so clients wait behind at most one
+            if (!prewarm_run_idle(idle_since))
+                std::this_thread::yield(); // TODO don't spinlock
             chunk_queue_mutex.lock();
         }
         auto ext = chunk_queue.extract(chunk_queue.begin());
-        struct bbox_task bbt = ext.value();
+        struct chunk_task task = ext.value();
+        stats_gauge_set(STAT_GAUGE_WORK_QUEUE, chunk_queue.size());
         chunk_queue_mutex.unlock();
-        printf("got element %f %f -- %f %f; notifying threads %016lx\n", bbt.bbox.minx, bbt.bbox.miny, bbt.bbox.maxx, bbt.bbox.maxy, bbt.threads);
+        stats_record_since(STAT_HIST_QUEUE_WAIT, task.queued);
+        stats_add(STAT_LOADER_TASKS);
+        auto start = chrono::steady_clock::now();
 
-        vector<string> fs = check_bbox_local_file(&bbt.bbox);
-        if (fs.empty()) {
-            printf("worker thread fetching bbox\n");
-            fetch_map_for_bounding_box(&bbt.bbox);
+        struct trace_request_scope request(task.request_id);
+        trace_record("work_queue_wait",
+                     chrono::duration_cast<chrono::microseconds>(task.queued.time_since_epoch()).count(),
+                     trace_now_us());
+        TRACE_SPAN("loader_task");
+        LOG_DEBUG("got element %d %d; notifying threads %016lx", task.id.x, task.id.y, task.threads);
+
+        struct chunk_result result = { .id = task.id, .status = CHUNK_STATUS_OK };
+        // clients every layer has been streamed to, if the chunk is fetched, and how many layers
+        uint64_t streamed = 0;
+        size_t layers = 0;
+        // looked for on disk rather than in the index, in case another server sharing the store
+        // has fetched it
+        vector<string> fs = chunk_store_refresh(task.id);
+        // found empty or failed (eg. by an earlier task for another client) since it was queued
+        int known = fs.empty() ? chunk_store_negative_status(task.id) : CHUNK_STATUS_OK;
+        if (known != CHUNK_STATUS_OK) {
+            result.status = known;
+        } else if (fs.empty()) {
+            LOG_DEBUG("worker thread fetching chunk");
+            streamed = task.stream_threads;
+            uint8_t tt = *total_thread_count;
+            int err = chunk_store_fetch(task.id, &fs, [&task, &streamed, &layers, tt](const string& fn) {
+                stream_layer(task.id, fn, &streamed, tt);
+                layers++;
+            });
+            // eg. a layer gdal failed to finish, which is still on disk
+            if (layers != fs.size())
+                streamed = 0;
+            if (err)
+                LOG_WARN("could not fetch chunk %d %d: error %d", task.id.x, task.id.y, err);
+            // a chunk with nothing in it converts to no files at all
+            if (fs.empty())
+                result.status = err ? CHUNK_STATUS_ERROR : CHUNK_STATUS_EMPTY;
+        } else {
+            stats_add(STAT_LOADER_ALREADY_STORED);
         }
 
-        printf("worker thread fetching done!\n");
+        LOG_DEBUG("worker thread fetching done!");
 
+        // clients which gave up waiting on the chunk, and so have it pushed
+        uint64_t pushes = 0;
         for (uint8_t tc = 0, tt = *total_thread_count; tc < tt; tc++) {
-            if (bbt.threads & 1ULL << tc) {
-                printf("notifying client %hhu\n", tc);
-                bbox_queues[tc].queue_guard.lock();
-                bbox_queues[tc].bboxes_found.push(bbt.bbox);
-                bbox_queues[tc].queue_guard.unlock();
+            if (task.threads & 1ULL << tc) {
+                LOG_DEBUG("notifying client %hhu", tc);
+                result.streamed = result.status == CHUNK_STATUS_OK && streamed & 1ULL << tc;
+                struct chunk_loader_queue* q = &chunk_queues[tc];
+                q->queue_guard.lock();
+                auto deferred = q->deferred.find(chunk_id_key(&task.id));
+                if (deferred == q->deferred.end()) {
+                    q->chunks_found.push(result);
+                    q->found.notify_one();
+                } else {
+                    pushes |= 1ULL << tc;
+                    q->deferred.erase(deferred);
+                }
+                q->queue_guard.unlock();
             }
         }
+        if (pushes)
+            push_chunk(result, pushes, streamed, *total_thread_count);
+        stats_record_since(STAT_HIST_LOADER_TASK, start);
+        idle_since = chrono::steady_clock::now();
     }
 }
 
 thread work_thr;
 void start_worker_thread(const uint8_t* total_thread_count) {
     if (!run_thread.fetch_or(1, std::memory_order::relaxed)) {
-        work_thr = thread(server_bbox_loader_handler, total_thread_count);
+        work_thr = thread(server_chunk_loader_handler, total_thread_count);
     }
 }
 
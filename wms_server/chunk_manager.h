@@ -1,23 +1,91 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
+#include <string>
+#include <vector>
 #include <thread>
 #include <nlohmann/json.hpp>
 
 #include "wms.h"
 
-// for a bbox, split it into chunks and for each chunk check if it is stored locally
-// if not, add a work queue entry to find it
-// returns the number of bboxes in the chunk; how many of them were found locally (as opposed to
-// being added to the the work queue) is stored in *local_stored
-size_t load_bbox(const struct bbox* outer_bbox, std::unique_ptr<struct bbox[]>* out_bboxes, uint8_t thread_count, size_t* local_stored);
+struct send_queue;
 
-// returns json data for specific chunk that exists locally (errors if not found)
-nlohmann::json get_chunk_json_local(const struct bbox* bbox);
+// a chunk the loader has finished with
+struct chunk_result {
+    struct chunk_id id;
+    // CHUNK_STATUS_* (see cbor.h)
+    int status;
+    // every layer of the chunk has already been queued to the client as it was converted, so it
+    // is answered with CHUNK_STATUS_STREAMED rather than sent again
+    bool streamed = false;
+};
+
+// makes sure the local chunk store (GEOJSON_PATH) exists & holds data of the current
+// GEODATA_VERSION, removing chunk files generated by other versions; call before serving
+// returns 0 on success, otherwise an error code
+int prepare_chunk_store();
+
+// for each chunk, check if it is stored locally; if not, add a work queue entry to find it, which
+// will be sent to this connection's work queue (thread_count) once done. with stream_layers, the
+// loader also queues each layer of the chunks it has to fetch straight to the connection's send
+// queue (see set_client_send_queue()) in a CHUNK_LAYER packet, as soon as gdal has converted it
+// the ids are reordered so those found locally come first; returns how many of them there are
+size_t load_chunks(std::vector<struct chunk_id>* ids, uint8_t thread_count, bool stream_layers = false);
+
+// sets the send queue the loader streams chunk layers & pushes deferred chunks to for a
+// connection (thread_count), or NULL once the connection is going away (which also forgets its
+// deferred chunks); the queue must outlive its registration
+void set_client_send_queue(uint8_t thread_count, struct send_queue* out);
+
+// returns the names of the locally stored files (one per layer) of a chunk, or an empty vector if
+// it isn't stored, from the store's index (see chunk_store.h)
+std::vector<std::string> check_chunk_local_file(struct chunk_id id);
+
+// returns json data for specific chunk that exists locally (NULL if not found)
+nlohmann::json get_chunk_json_local(struct chunk_id id);
+
+// opens the cache of encoded chunks shared with other server processes (see shm_cache.h); until
+// it is, get_chunk_cbor_local() encodes every chunk itself. from then on, chunks whose files
+// change in the store are invalidated in it
+// returns 0 on success, otherwise an error code
+int open_shared_chunk_cache(const std::string& name);
+
+// puts the cbor encoded json data of a chunk that exists locally into out, from the shared cache
+// if another process (or an earlier request) already encoded it
+// returns false if the chunk isn't stored
+bool get_chunk_cbor_local(struct chunk_id id, std::vector<uint8_t>* out);
+
+// as get_chunk_cbor_local(), but never from a copy the shared cache held before the call: the
+// chunk is invalidated first, so it is encoded from its files now (& the cache refilled with it)
+// unless another process has done so since
+bool get_chunk_cbor_fresh(struct chunk_id id, std::vector<uint8_t>* out);
+
+// puts the cbor encoded json data of a chunk into out if the shared cache still holds it (eg.
+// after it was evicted from the store), without loading it or waiting for another process to
+// returns false if it doesn't
+bool get_chunk_cbor_cached(struct chunk_id id, std::vector<uint8_t>* out);
 
 // waits for the next update from the server worker to this connection's work queue (thread_counter);
-// will spinlock until an update is recieved
-nlohmann::json get_chunk_json_workqueue(uint8_t thread_counter);
+// sleeps until an update is recieved. updates arrive in the order the loader finishes them,
+// not the order they were requested in
+struct chunk_result get_chunk_workqueue(uint8_t thread_counter);
+
+// as above, but gives up at deadline
+// returns false if no update arrived in time
+bool get_chunk_workqueue_until(uint8_t thread_counter, std::chrono::steady_clock::time_point deadline,
+                               struct chunk_result* out);
+
+// stops waiting on the chunks in ids, which the connection (thread_counter) has queued with
+// load_chunks(), at a request's deadline: updates the loader has already sent for them are moved
+// to arrived, and the rest are deferred. once the loader is done with a deferred chunk, it queues
+// the chunk to the connection's send queue itself in a CHUNK_PUSH packet, rather than sending an
+// update to the connection's work queue
+void defer_chunks(uint8_t thread_counter, const std::vector<struct chunk_id>& ids,
+                  std::vector<struct chunk_result>* arrived);
+
+// whether a chunk is deferred for the connection (thread_counter), and so will be pushed once done
+bool chunk_is_deferred(uint8_t thread_counter, struct chunk_id id);
 
 // only one worker thread can run at once; it takes a const pointer to the total thread count so it
 // can dispatch updates to the currently connected thread... practically there is no
@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk_store.h"
+#include "osm_api.h"
+#include "cbor.h"
+#include "constants.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+using namespace std;
+
+struct store_entry {
+    struct chunk_id id;
+    vector<string> files;
+    uint64_t bytes = 0;
+    // filesystem clock ticks
+    atomic_int64_t last_used = 0;
+};
+
+// a chunk known to have no files
+struct negative_entry {
+    // CHUNK_STATUS_EMPTY or CHUNK_STATUS_ERROR
+    int status;
+    // failed fetches in a row
+    uint32_t failures;
+    // filesystem clock ticks: when the chunk was found empty, or until when it isn't to be retried
+    int64_t time;
+};
+
+static shared_mutex index_guard;
+static unordered_map<uint64_t, struct store_entry> chunk_index;
+static unordered_map<uint64_t, struct negative_entry> negatives;
+// size of negatives past which its expired entries are next dropped
+static size_t negatives_prune_at = CHUNK_NEGATIVE_PRUNE_MIN;
+static atomic_uint64_t total_bytes = 0;
+
+// held while chunk files are being written or deleted, so eviction never deletes the files of a
+// chunk as it is fetched again
+static mutex files_guard;
+
+static void (*change_handler)(struct chunk_id id) = NULL;
+
+static uint64_t quota = 0;
+static atomic_bool run_evictor = false;
+static thread evictor;
+
+static int64_t file_now() {
+    return filesystem::file_time_type::clock::now().time_since_epoch().count();
+}
+
+template <typename D>
+static int64_t file_ticks(D d) {
+    return chrono::duration_cast<filesystem::file_time_type::duration>(d).count();
+}
+
+// layers gdal's osm driver converts each chunk into, in the order it writes them; a chunk's file
+// for each is <chunk file base>_<layer>.geojson (see write_osm_to_geojson())
+static const char* const chunk_layers[] = {
+    "points", "lines", "multilinestrings", "multipolygons", "other_relations",
+};
+
+// kinds of file in the store
+#define STORE_FILE_OTHER 0
+#define STORE_FILE_LAYER 1
+#define STORE_FILE_TOMBSTONE 2
+
+// chunk a store file belongs to, from its name, and which kind of file it is
+static int parse_chunk_filename(const string& fn, struct chunk_id* id) {
+    int32_t x, y, x1, y1;
+    int n = 0;
+    if (sscanf(fn.c_str(), "map_bbox_%d_%d_%d_%d%n", &x, &y, &x1, &y1, &n) != 4 || !n)
+        return STORE_FILE_OTHER;
+    if (x1 != x + 1 || y1 != y + 1)
+        return STORE_FILE_OTHER;
+    *id = { x, y };
+
+    string rest = fn.substr(n);
+    if (rest.starts_with("_") && rest.ends_with(".geojson"))
+        return STORE_FILE_LAYER;
+    if (rest == CHUNK_TOMBSTONE_EXT)
+        return STORE_FILE_TOMBSTONE;
+    return STORE_FILE_OTHER;
+}
+
+static filesystem::path tombstone_path(struct chunk_id id) {
+    return filesystem::path(GEOJSON_PATH) / (get_chunk_filename(id) + CHUNK_TOMBSTONE_EXT);
+}
+
+// replaces a chunk's entry (or removes it, with no files); index_guard must be held exclusively
+static void set_entry(struct chunk_id id, vector<string> files, uint64_t bytes, int64_t last_used) {
+    uint64_t key = chunk_id_key(&id);
+    auto it = chunk_index.find(key);
+    if (it != chunk_index.end()) {
+        total_bytes -= it->second.bytes;
+        chunk_index.erase(it);
+    }
+    if (files.empty())
+        return;
+
+    struct store_entry& e = chunk_index[key];
+    e.id = id;
+    e.files = std::move(files);
+    e.bytes = bytes;
+    e.last_used = last_used;
+    total_bytes += bytes;
+}
+
+static void update_gauges() {
+    stats_gauge_set(STAT_GAUGE_STORE_BYTES, total_bytes);
+}
+
+static void changed(struct chunk_id id) {
+    if (change_handler)
+        change_handler(id);
+}
+
+// evicts the least recently used chunks until the store is under target bytes
+static void evict_to(uint64_t target) {
+    TRACE_SPAN("chunk_store_evict");
+    vector<pair<int64_t, uint64_t>> lru;
+    {
+        shared_lock<shared_mutex> guard(index_guard);
+        lru.reserve(chunk_index.size());
+        for (const auto& [key, e] : chunk_index)
+            lru.push_back({ e.last_used.load(memory_order_relaxed), key });
+    }
+    sort(lru.begin(), lru.end());
+
+    // taken before the victims leave the index, so they can't be fetched & indexed again until
+    // their old files are gone
+    lock_guard<mutex> files_lock(files_guard);
+    vector<string> doomed;
+    vector<struct chunk_id> evicted;
+    {
+        unique_lock<shared_mutex> guard(index_guard);
+        for (const auto& [last_used, key] : lru) {
+            if (total_bytes <= target)
+                break;
+            auto it = chunk_index.find(key);
+            // used since the victims were picked, or already gone
+            if (it == chunk_index.end() || it->second.last_used.load(memory_order_relaxed) != last_used)
+                continue;
+            for (string& fn : it->second.files)
+                doomed.push_back(std::move(fn));
+            total_bytes -= it->second.bytes;
+            evicted.push_back(it->second.id);
+            chunk_index.erase(it);
+        }
+    }
+
+    error_code ec;
+    for (const string& fn : doomed)
+        filesystem::remove(filesystem::path(GEOJSON_PATH) / fn, ec);
+    for (struct chunk_id id : evicted)
+        changed(id);
+    stats_add(STAT_STORE_EVICTIONS, evicted.size());
+    update_gauges();
+    LOG_DEBUG("evicted %zu chunks (%zu files); store now %lu bytes", evicted.size(), doomed.size(),
+              total_bytes.load());
+}
+
+static void evictor_thread() {
+    trace_set_thread_name("store evictor");
+    while (run_evictor) {
+        this_thread::sleep_for(chrono::milliseconds(CHUNK_STORE_EVICT_INTERVAL_MS));
+        if (total_bytes > quota)
+            evict_to(quota / 100 * CHUNK_STORE_LOW_WATER_PERCENT);
+    }
+}
+
+void chunk_store_set_change_handler(void (*on_change)(struct chunk_id id)) {
+    change_handler = on_change;
+}
+
+int chunk_store_open(uint64_t quota_bytes) {
+    chunk_store_close();
+
+    // files of each chunk, with their size & newest modification time
+    struct scanned {
+        struct chunk_id id;
+        vector<string> files;
+        uint64_t bytes = 0;
+        // the filesystem clock's epoch may be in the future, so times can be negative
+        int64_t mtime = numeric_limits<int64_t>::min();
+    };
+    unordered_map<uint64_t, struct scanned> found;
+    unordered_map<uint64_t, struct negative_entry> tombstones;
+    // errors reading single files are left for the directory's error
+    error_code ec, file_ec;
+    for (const filesystem::directory_entry& entry : filesystem::directory_iterator(GEOJSON_PATH, ec)) {
+        string fn = entry.path().filename().generic_string();
+        struct chunk_id id;
+        if (!entry.is_regular_file())
+            continue;
+        int kind = parse_chunk_filename(fn, &id);
+        if (kind == STORE_FILE_TOMBSTONE) {
+            int64_t t = entry.last_write_time(file_ec).time_since_epoch().count();
+            tombstones[chunk_id_key(&id)] = { .status = CHUNK_STATUS_EMPTY, .failures = 0, .time = t };
+        }
+        if (kind != STORE_FILE_LAYER)
+            continue;
+        struct scanned& s = found[chunk_id_key(&id)];
+        s.id = id;
+        s.files.push_back(fn);
+        uintmax_t size = entry.file_size(file_ec);
+        if (!file_ec)
+            s.bytes += size;
+        s.mtime = max(s.mtime, (int64_t)entry.last_write_time(file_ec).time_since_epoch().count());
+    }
+    if (ec) {
+        LOG_ERROR("could not list %s: %s", GEOJSON_PATH, ec.message().c_str());
+        return 1;
+    }
+
+    {
+        unique_lock<shared_mutex> guard(index_guard);
+        chunk_index.clear();
+        total_bytes = 0;
+        for (auto& [key, s] : found)
+            set_entry(s.id, std::move(s.files), s.bytes, s.mtime);
+        negatives = std::move(tombstones);
+        negatives_prune_at = max((size_t)CHUNK_NEGATIVE_PRUNE_MIN, negatives.size() * 2);
+    }
+    update_gauges();
+    LOG_INFO("chunk store holds %zu chunks (& %zu empty), %lu MiB%s", found.size(), negatives.size(),
+             total_bytes.load() >> 20,
+             quota_bytes ? format(" of a {} MiB quota", quota_bytes >> 20).c_str() : "");
+
+    quota = quota_bytes;
+    if (quota) {
+        run_evictor = true;
+        evictor = thread(evictor_thread);
+    }
+    return 0;
+}
+
+void chunk_store_close() {
+    run_evictor = false;
+    if (evictor.joinable())
+        evictor.join();
+}
+
+vector<string> chunk_store_lookup(struct chunk_id id) {
+    shared_lock<shared_mutex> guard(index_guard);
+    auto it = chunk_index.find(chunk_id_key(&id));
+    if (it == chunk_index.end())
+        return {};
+    it->second.last_used.store(file_now(), memory_order_relaxed);
+    return it->second.files;
+}
+
+// files of a chunk on disk, with their total size; files_guard must be held
+// only the chunk's own layer files are looked for, so this costs the same however many files the
+// store holds
+static vector<string> scan_chunk(struct chunk_id id, uint64_t* bytes) {
+    TRACE_SPAN("scan_chunk_files");
+    vector<string> fs;
+    *bytes = 0;
+    string base = get_chunk_filename(id);
+    for (const char* layer : chunk_layers) {
+        string fn = format("{}_{}.geojson", base, layer);
+        error_code ec;
+        // fails if the file isn't there (or isn't a regular file)
+        uintmax_t size = filesystem::file_size(filesystem::path(GEOJSON_PATH) / fn, ec);
+        if (ec)
+            continue;
+        *bytes += size;
+        fs.push_back(std::move(fn));
+    }
+    return fs;
+}
+
+vector<string> chunk_store_refresh(struct chunk_id id) {
+    uint64_t bytes;
+    vector<string> fs;
+    {
+        lock_guard<mutex> guard(files_guard);
+        fs = scan_chunk(id, &bytes);
+        unique_lock<shared_mutex> index_lock(index_guard);
+        set_entry(id, fs, bytes, file_now());
+    }
+    changed(id);
+    update_gauges();
+    return fs;
+}
+
+// whether a chunk's negative entry still holds at now
+static bool negative_live(const struct negative_entry* e, int64_t now) {
+    if (e->status == CHUNK_STATUS_EMPTY)
+        return now - e->time < file_ticks(chrono::seconds(CHUNK_TOMBSTONE_TTL_S));
+    return now < e->time;
+}
+
+// drops the negative entries which have expired, with their tombstones; failed chunks are kept
+// until CHUNK_ERROR_BACKOFF_MAX_MS past their retry, so another failure still backs off further.
+// files_guard & index_guard (exclusively) must be held
+static void prune_negatives() {
+    int64_t now = file_now();
+    int64_t grace = file_ticks(chrono::milliseconds(CHUNK_ERROR_BACKOFF_MAX_MS));
+    size_t before = negatives.size();
+    erase_if(negatives, [now, grace](const auto& kv) {
+        const struct negative_entry* e = &kv.second;
+        if (e->status == CHUNK_STATUS_ERROR ? now < e->time + grace : negative_live(e, now))
+            return false;
+        if (e->status == CHUNK_STATUS_EMPTY) {
+            error_code ec;
+            struct chunk_id id = { (int32_t)(kv.first >> 32), (int32_t)kv.first };
+            filesystem::remove(tombstone_path(id), ec);
+        }
+        return true;
+    });
+    negatives_prune_at = max((size_t)CHUNK_NEGATIVE_PRUNE_MIN, negatives.size() * 2);
+    LOG_DEBUG("dropped %zu expired empty & failed chunks; %zu left", before - negatives.size(),
+              negatives.size());
+}
+
+int chunk_store_fetch(struct chunk_id id, vector<string>* files,
+                      const function<void(const string&)>& on_layer) {
+    uint64_t bytes;
+    int err;
+    {
+        lock_guard<mutex> guard(files_guard);
+        err = fetch_map_for_chunk(id, on_layer);
+        *files = scan_chunk(id, &bytes);
+
+        error_code ec;
+        // the layers written before the failure, which would be served as the whole chunk
+        if (err && !files->empty()) {
+            LOG_DEBUG("removing %zu layers of chunk %d %d, which failed part way", files->size(),
+                      id.x, id.y);
+            for (const string& fn : *files)
+                filesystem::remove(filesystem::path(GEOJSON_PATH) / fn, ec);
+            files->clear();
+            bytes = 0;
+        }
+        if (!files->empty())
+            filesystem::remove(tombstone_path(id), ec);
+        else if (!err)
+            ofstream(tombstone_path(id), ios::trunc);
+
+        unique_lock<shared_mutex> index_lock(index_guard);
+        set_entry(id, *files, bytes, file_now());
+        uint64_t key = chunk_id_key(&id);
+        if (!files->empty()) {
+            negatives.erase(key);
+        } else if (!err) {
+            negatives[key] = { .status = CHUNK_STATUS_EMPTY, .failures = 0, .time = file_now() };
+        } else {
+            auto it = negatives.find(key);
+            uint32_t failures = it != negatives.end() && it->second.status == CHUNK_STATUS_ERROR
+                ? it->second.failures + 1 : 1;
+            int64_t backoff = min((int64_t)CHUNK_ERROR_BACKOFF_MS << min(failures - 1, 20U),
+                                  (int64_t)CHUNK_ERROR_BACKOFF_MAX_MS);
+            negatives[key] = {
+                .status = CHUNK_STATUS_ERROR,
+                .failures = failures,
+                .time = file_now() + file_ticks(chrono::milliseconds(backoff)),
+            };
+            LOG_DEBUG("chunk %d %d has failed %u times; not trying again for %ld ms", id.x, id.y,
+                      failures, backoff);
+        }
+        if (negatives.size() > negatives_prune_at)
+            prune_negatives();
+    }
+    changed(id);
+    update_gauges();
+    return err;
+}
+
+int chunk_store_negative_status(struct chunk_id id) {
+    shared_lock<shared_mutex> guard(index_guard);
+    auto it = negatives.find(chunk_id_key(&id));
+    if (it == negatives.end())
+        return CHUNK_STATUS_OK;
+
+    return negative_live(&it->second, file_now()) ? it->second.status : CHUNK_STATUS_OK;
+}
+
+void chunk_store_forget(struct chunk_id id) {
+    {
+        unique_lock<shared_mutex> guard(index_guard);
+        set_entry(id, {}, 0, 0);
+    }
+    changed(id);
+    update_gauges();
+}
+
+uint64_t chunk_store_bytes() {
+    return total_bytes;
+}
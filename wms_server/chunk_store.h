@@ -0,0 +1,83 @@
+#pragma once
+
+// in memory index of the chunk files in GEOJSON_PATH, and the disk quota kept on them
+//
+// the directory is listed once, at open, and the index kept up to date from then on as chunks are
+// fetched & evicted, so finding a chunk's files is a hash lookup rather than a listing of every
+// file in the store. each chunk's size & when it was last used (its files' modification time,
+// until it is used) are tracked, and while the store is over its quota a background thread evicts
+// the least recently used chunks until it is back under CHUNK_STORE_LOW_WATER_PERCENT of it
+//
+// lookups only take the index's lock shared, and touch a chunk with an atomic store; eviction
+// picks its victims under the shared lock too, takes the exclusive lock only to remove them from
+// the index, and deletes their files after letting go of it, so readers never wait on the disk.
+// a reader may still be handed the files of a chunk just evicted; opening them then fails, and
+// the reader calls chunk_store_forget() and treats the chunk as not stored
+//
+// chunks that can't be served from files are remembered too, so they aren't fetched from the osm
+// api again on every request: a chunk found to have nothing in it gets a tombstone (an empty
+// <chunk file base>.empty file, so it is remembered across restarts) for CHUNK_TOMBSTONE_TTL_S,
+// and a chunk that failed to fetch is given up on for a while, doubling with each failure in a
+// row from CHUNK_ERROR_BACKOFF_MS up to CHUNK_ERROR_BACKOFF_MAX_MS (this is only kept in memory)
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "wms.h"
+
+// 0 for no quota
+#define CHUNK_STORE_DEFAULT_QUOTA_MB 4096
+// eviction stops once the store is this far under its quota, so it doesn't run for every chunk
+#define CHUNK_STORE_LOW_WATER_PERCENT 90
+#define CHUNK_STORE_EVICT_INTERVAL_MS 1000
+
+#define CHUNK_TOMBSTONE_EXT ".empty"
+// osm data does change, so even empty chunks are looked at again once in a while
+#define CHUNK_TOMBSTONE_TTL_S (7 * 24 * 3600)
+#define CHUNK_ERROR_BACKOFF_MS 5000
+#define CHUNK_ERROR_BACKOFF_MAX_MS (6 * 3600 * 1000)
+// expired empty & failed chunks are dropped from memory once there are more than this many
+// remembered (& at most every time their number doubles after)
+#define CHUNK_NEGATIVE_PRUNE_MIN 4096
+
+// on_change is called with each chunk whose indexed files may have changed: once it is fetched,
+// refreshed from disk, evicted or forgotten (eg. so copies of it cached elsewhere are dropped);
+// NULL for none. it is called without any of the store's locks held
+void chunk_store_set_change_handler(void (*on_change)(struct chunk_id id));
+
+// lists GEOJSON_PATH into the index (replacing whatever was in it), and with a quota, starts the
+// thread which enforces it; quota_bytes of 0 means no quota
+// returns 0 on success, otherwise an error code
+int chunk_store_open(uint64_t quota_bytes);
+
+// stops the eviction thread, leaving the index as it is
+void chunk_store_close();
+
+// returns the names of the files of a chunk, or an empty vector if it isn't stored, and marks it
+// as used
+std::vector<std::string> chunk_store_lookup(struct chunk_id id);
+
+// looks for a chunk's files on disk (eg. written by another server sharing the directory), and
+// indexes whatever it finds in place of what was indexed for it
+// returns the files found
+std::vector<std::string> chunk_store_refresh(struct chunk_id id);
+
+// fetches a chunk from the osm api (see fetch_map_for_chunk()) & indexes the files written; no
+// chunk is evicted while it is being written, and on_layer is called with each file as it is. a
+// fetch which fails part way (eg. in gdal) has whatever files it wrote removed, so a truncated
+// chunk is never served, and is backed off from like any other failure
+// returns 0 on success, otherwise an error code as from fetch_map_for_chunk()
+int chunk_store_fetch(struct chunk_id id, std::vector<std::string>* files,
+                      const std::function<void(const std::string&)>& on_layer = nullptr);
+
+// drops a chunk from the index, eg. after its files turned out to be missing
+void chunk_store_forget(struct chunk_id id);
+
+// CHUNK_STATUS_EMPTY if the chunk has a live tombstone, CHUNK_STATUS_ERROR if it failed to fetch
+// and isn't to be tried again yet, otherwise CHUNK_STATUS_OK (see cbor.h)
+int chunk_store_negative_status(struct chunk_id id);
+
+// bytes of all the indexed chunks
+uint64_t chunk_store_bytes();
@@ -6,7 +6,22 @@
 #define GEOJSON_PATH "./wms_server/geodata/"
 
 // url up to the GET request ? of the osm api
+// can be overridden at build time (-DOSM_API_URL=...) or at run time with the OSM_API_URL
+// environment variable, eg. to point the server at a local osm_stub_server for offline testing
+#ifndef OSM_API_URL
 #define OSM_API_URL "https://api.openstreetmap.org/api/0.6/map"
+#endif
+
+// longest a request to the osm api may take, so a hung api can't hold up the loader for good
+#define OSM_API_TIMEOUT_MS 60000
+
+// nominatim style geocoding search, used to find the bounding boxes of places named in the
+// pre-warm region file; can be overridden as with OSM_API_URL
+#ifndef GEOCODE_API_URL
+#define GEOCODE_API_URL "https://nominatim.openstreetmap.org/search"
+#endif
+
+#define GEOCODE_API_TIMEOUT_MS 10000
 
 // where server stores osm info before converting to geojson
 #define TMP_OSM_FILE "./wms_server/tmp.osm"
@@ -20,6 +35,24 @@
 
 #define BBOX_PER_DEG ((float)BBOX_PER_DEG_INT)
 
+// version of the chunk data served to clients, sent along with the partition info; bump this
+// whenever the contents / format of generated geodata changes, so clients throw away chunks
+// they have cached on disk from an older version
+// 2: geometry reprojected to metres from each chunk's origin
+#define GEODATA_VERSION 2
+
+// file in GEOJSON_PATH recording the GEODATA_VERSION the files there were generated for
+#define GEODATA_VERSION_FILE "geodata_version"
+
+// projection chunk geometry is converted to when generated, filled in with the lattitude &
+// longitude of the chunk's origin (see get_chunk_origin()): a transverse mercator centred on
+// that corner, so coordinates are metres east & north of it, with negligible distortion across
+// a chunk at any lattitude
+#define CHUNK_PROJ_FORMAT "+proj=tmerc +lat_0={} +lon_0={} +k=1 +x_0=0 +y_0=0 +ellps=WGS84 +units=m +no_defs"
+
+// decimal places kept in generated coordinates, ie. centimetres
+#define CHUNK_COORD_PRECISION 2
+
 // we have a limit of 64 clients because we use a uint64_t as a bitvector
 // to encode which clients requested a particular bounding box
 // this could be changed to a uint64_t[...] to increase the allowed number
@@ -0,0 +1,215 @@
+#include <string>
+#include <cstring>
+#include <mutex>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "disk_cache.h"
+
+using namespace std;
+
+#define DISK_CACHE_MAGIC "GEOCACHE"
+// bumped whenever the layout of the file changes
+#define DISK_CACHE_FORMAT 1
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+
+struct disk_cache_header {
+    char magic[8];
+    uint32_t format;
+    uint32_t data_version;
+    uint32_t bbox_per_deg;
+    uint32_t nslots;
+    uint64_t used_slots;
+    uint64_t data_used;
+};
+
+struct disk_cache_slot {
+    uint64_t key;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t state;
+};
+
+#define DATA_OFFSET (sizeof(struct disk_cache_header) + DISK_CACHE_SLOTS * sizeof(struct disk_cache_slot))
+
+// empties the cache, leaving the version stamp as is
+static void reset_cache(struct disk_cache* cache) {
+    memset(cache->slots, 0, DISK_CACHE_SLOTS * sizeof(struct disk_cache_slot));
+    cache->header->used_slots = 0;
+    cache->header->data_used = 0;
+}
+
+static void init_cache(struct disk_cache* cache) {
+    memset(cache->header, 0, sizeof(struct disk_cache_header));
+    memcpy(cache->header->magic, DISK_CACHE_MAGIC, sizeof(cache->header->magic));
+    cache->header->format = DISK_CACHE_FORMAT;
+    cache->header->nslots = DISK_CACHE_SLOTS;
+    reset_cache(cache);
+}
+
+// finds the slot holding id, or the empty slot it would be inserted into
+static struct disk_cache_slot* find_slot(struct disk_cache* cache, uint64_t key) {
+    size_t i = (key * 0x9E3779B97F4A7C15ULL) % DISK_CACHE_SLOTS;
+    while (cache->slots[i].state != SLOT_EMPTY && cache->slots[i].key != key) {
+        i = (i + 1) % DISK_CACHE_SLOTS;
+    }
+    return &cache->slots[i];
+}
+
+int disk_cache_open(struct disk_cache* cache, const string& path, size_t size) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (cache->map)
+        return -1;
+    if (size <= DATA_OFFSET)
+        return -1;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    bool fresh = (size_t)st.st_size != size;
+    // sparse file: only the pages actually written take up disk space
+    if (fresh && ftruncate(fd, size) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return 1;
+    }
+
+    cache->fd = fd;
+    cache->map = map;
+    cache->map_size = size;
+    cache->header = (struct disk_cache_header*)map;
+    cache->slots = (struct disk_cache_slot*)(map + sizeof(struct disk_cache_header));
+    cache->data = map + DATA_OFFSET;
+    cache->data_capacity = size - DATA_OFFSET;
+
+    if (fresh
+        || memcmp(cache->header->magic, DISK_CACHE_MAGIC, sizeof(cache->header->magic)) != 0
+        || cache->header->format != DISK_CACHE_FORMAT
+        || cache->header->nslots != DISK_CACHE_SLOTS
+        || cache->header->data_used > cache->data_capacity) {
+        init_cache(cache);
+    }
+
+    return 0;
+}
+
+void disk_cache_close(struct disk_cache* cache) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (!cache->map)
+        return;
+
+    msync(cache->map, cache->map_size, MS_SYNC);
+    munmap(cache->map, cache->map_size);
+    close(cache->fd);
+
+    cache->fd = -1;
+    cache->map = NULL;
+    cache->map_size = 0;
+    cache->header = NULL;
+    cache->slots = NULL;
+    cache->data = NULL;
+    cache->data_capacity = 0;
+}
+
+bool disk_cache_is_open(struct disk_cache* cache) {
+    lock_guard<mutex> guard(cache->guard);
+    return cache->map != NULL;
+}
+
+bool disk_cache_validate(struct disk_cache* cache, uint32_t data_version, uint32_t bbox_per_deg) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (!cache->map)
+        return false;
+
+    if (cache->header->data_version == data_version && cache->header->bbox_per_deg == bbox_per_deg)
+        return true;
+
+    reset_cache(cache);
+    cache->header->data_version = data_version;
+    cache->header->bbox_per_deg = bbox_per_deg;
+    return false;
+}
+
+uint32_t disk_cache_bbox_per_deg(struct disk_cache* cache) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (!cache->map || cache->header->used_slots == 0)
+        return 0;
+    return cache->header->bbox_per_deg;
+}
+
+bool disk_cache_get(struct disk_cache* cache, struct chunk_id id, string* out) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (!cache->map)
+        return false;
+
+    struct disk_cache_slot* slot = find_slot(cache, chunk_id_key(&id));
+    if (slot->state != SLOT_USED)
+        return false;
+
+    out->assign(cache->data + slot->offset, slot->len);
+    return true;
+}
+
+bool disk_cache_has(struct disk_cache* cache, struct chunk_id id) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (!cache->map)
+        return false;
+
+    return find_slot(cache, chunk_id_key(&id))->state == SLOT_USED;
+}
+
+int disk_cache_put(struct disk_cache* cache, struct chunk_id id, const string& data) {
+    lock_guard<mutex> guard(cache->guard);
+
+    if (!cache->map)
+        return -1;
+    if (data.size() > cache->data_capacity || data.size() > UINT32_MAX)
+        return 1;
+
+    uint64_t key = chunk_id_key(&id);
+
+    // out of room: start again rather than trying to compact
+    if (cache->header->data_used + data.size() > cache->data_capacity
+        || (cache->header->used_slots + 1) * 4 > DISK_CACHE_SLOTS * 3) {
+        reset_cache(cache);
+    }
+
+    // contents are written before the slot points at them, so a crash part way through never
+    // leaves a slot referring to garbage
+    uint64_t offset = cache->header->data_used;
+    memcpy(cache->data + offset, data.data(), data.size());
+    cache->header->data_used += data.size();
+
+    struct disk_cache_slot* slot = find_slot(cache, key);
+    if (slot->state != SLOT_USED)
+        cache->header->used_slots++;
+    slot->key = key;
+    slot->offset = offset;
+    slot->len = data.size();
+    slot->state = SLOT_USED;
+
+    return 0;
+}
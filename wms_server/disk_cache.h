@@ -0,0 +1,70 @@
+#pragma once
+
+// persistent on-disk chunk cache for the client, so chunks fetched in one session are available
+// immediately (and offline) in the next
+//
+// the cache is a single memory mapped file laid out as a header, an open addressed table of
+// chunk slots keyed by chunk id, and a data region which chunk contents are appended to. the
+// header records which server data version & partition resolution the contents belong to; if
+// they no longer match what the server reports, the whole cache is discarded. when either the
+// slot table or the data region fills up the cache is likewise cleared and refilled from scratch,
+// which keeps the format trivial (no compaction / fragmentation to deal with)
+
+#include <mutex>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "wms.h"
+
+// default size of the cache file; the file is sparse, so this is an upper bound on disk usage
+#define DISK_CACHE_DEFAULT_BYTES (256ULL << 20)
+// number of chunk slots in the table; the cache is cleared once it is 3/4 full
+#define DISK_CACHE_SLOTS 16384
+
+struct disk_cache_header;
+struct disk_cache_slot;
+
+struct disk_cache {
+    std::mutex guard;
+    int fd = -1;
+    // whole mapped file, and views of the sections within it
+    char* map = NULL;
+    size_t map_size = 0;
+    struct disk_cache_header* header = NULL;
+    struct disk_cache_slot* slots = NULL;
+    char* data = NULL;
+    size_t data_capacity = 0;
+};
+
+// opens (creating if needed) the cache file at path, of size bytes; an existing cache is kept
+// as is, whatever server version it was created for, so it may be read before a connection to
+// the server has been established
+// returns 0 on success, otherwise an error code
+int disk_cache_open(struct disk_cache* cache, const std::string& path, size_t size);
+
+// flushes & unmaps the cache
+void disk_cache_close(struct disk_cache* cache);
+
+// whether the cache is open
+bool disk_cache_is_open(struct disk_cache* cache);
+
+// checks the cache belongs to the server data version & partition resolution given, clearing it
+// (and stamping it with the new values) if not
+// returns true if the existing contents were kept
+bool disk_cache_validate(struct disk_cache* cache, uint32_t data_version, uint32_t bbox_per_deg);
+
+// partition resolution the cached chunks were stored with, or 0 if the cache is empty / closed;
+// lets the client work out chunk coordinates while it is offline
+uint32_t disk_cache_bbox_per_deg(struct disk_cache* cache);
+
+// copies the stored contents of a chunk into out
+// returns false if the chunk is not in the cache
+bool disk_cache_get(struct disk_cache* cache, struct chunk_id id, std::string* out);
+
+// whether a chunk is in the cache
+bool disk_cache_has(struct disk_cache* cache, struct chunk_id id);
+
+// stores (or replaces) the contents of a chunk
+// returns 0 on success, otherwise an error code
+int disk_cache_put(struct disk_cache* cache, struct chunk_id id, const std::string& data);
@@ -1,5 +1,5 @@
+#include <functional>
 #include <string>
-#include <iostream>
 #include <format>
 
 #include <gdal.h>
@@ -7,41 +7,65 @@
 
 #include "osm_api.h"
 #include "constants.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 
 using namespace std;
 
 GDALDatasetH load_osm_to_gdal(string osm_file_loc) {
+    TRACE_SPAN("load_osm_to_gdal");
     int err;
 
     GDALDatasetH dat = GDALOpenEx(osm_file_loc.c_str(), GDAL_OF_VECTOR, NULL, NULL, NULL);
 
     if (dat == NULL) {
-        cerr << "could not open tmp osm file " << osm_file_loc << endl;
+        LOG_ERROR("could not open tmp osm file %s", osm_file_loc.c_str());
     }
     return dat;
 }
 
-int write_osm_to_geojson(string osm_file_name, string out_file_loc) {
+int write_osm_to_geojson(string osm_file_name, string out_file_loc, struct chunk_origin origin,
+                         const function<void(const string&)>& on_layer) {
+    struct stats_timer timer(STAT_HIST_OSM_CONVERT);
+    TRACE_SPAN("write_osm_to_geojson");
+
+    // gdal transforms each geometry's whole coordinate array at once as it is translated
+    string srs = format(CHUNK_PROJ_FORMAT, origin.lat, origin.lon);
+    string precision = format("COORDINATE_PRECISION={}", CHUNK_COORD_PRECISION);
+
     GDALDatasetH dat = load_osm_to_gdal(osm_file_name);
-    if (!dat)
+    if (!dat) {
+        stats_add(STAT_CONVERT_ERRORS);
         return -1;
+    }
 
     size_t layers = GDALDatasetGetLayerCount(dat);
 
     for (int i = 0; i < layers; i++) {
         OGRLayerH layer = GDALDatasetGetLayer(dat, i);
-        const char* opts_txt[2] = {OGR_L_GetName(layer), NULL};
+        const char* opts_txt[] = {
+            OGR_L_GetName(layer),
+            "-t_srs", srs.c_str(),
+            "-lco", precision.c_str(),
+            NULL
+        };
         GDALVectorTranslateOptions* opts =
             GDALVectorTranslateOptionsNew((char**)opts_txt, NULL);
-        string out_file = format(GEOJSON_PATH "{}_{}.geojson", out_file_loc, OGR_L_GetName(layer));
+        string layer_file = format("{}_{}.geojson", out_file_loc, OGR_L_GetName(layer));
+        string out_file = GEOJSON_PATH + layer_file;
         int err = 0;
+        TRACE_SPAN("convert_layer");
         GDALDatasetH out_dat = GDALVectorTranslate(out_file.c_str(), NULL, 1, &dat, opts, &err);
         GDALVectorTranslateOptionsFree(opts);
         if (err) {
+            stats_add(STAT_CONVERT_ERRORS);
             return err;
         }
         if (out_dat) {
             GDALClose(out_dat);
+            if (on_layer)
+                on_layer(layer_file);
         }
 
         // for some reason if I try to output multiple
@@ -55,6 +79,7 @@ int write_osm_to_geojson(string osm_file_name, string out_file_loc) {
         if (i < layers - 1) {
             dat = load_osm_to_gdal(osm_file_name);
             if (!dat) {
+                stats_add(STAT_CONVERT_ERRORS);
                 return -1;
             }
         }
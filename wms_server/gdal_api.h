@@ -1,10 +1,21 @@
 #pragma once
 
+#include <functional>
+#include <string>
 #include <gdal.h>
 
+#include "wms.h"
+
 // converts an osm file into geojson format files (each osm file will result in multiple
 // geojson files, because each feature must be stored seperately)
 
 GDALDatasetH load_osm_to_gdal(std::string osm_file_loc);
 
-int write_osm_to_geojson(std::string osm_file_loc, std::string out_file_loc);
+// the geometry is reprojected as it is converted, into metres from origin (see CHUNK_PROJ_FORMAT
+// in constants.h), so clients can use the coordinates as they are
+// on_layer, if given, is called with the name (in GEOJSON_PATH) of each layer's file as soon as
+// it has been written, in the order gdal lists the layers (points, lines, multilinestrings,
+// multipolygons, other relations), so the layers can be used before the whole chunk is converted
+int write_osm_to_geojson(std::string osm_file_loc, std::string out_file_loc,
+                         struct chunk_origin origin,
+                         const std::function<void(const std::string&)>& on_layer = nullptr);
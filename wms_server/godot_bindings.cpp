@@ -1,15 +1,21 @@
 #include <iostream>
+#include <fstream>
+#include <cstring>
 
 #ifndef NO_GODOT
 #include <gdextension_interface.h>
 
 #include <godot_cpp/core/defs.hpp>
 #include <godot_cpp/godot.hpp>
+#include <godot_cpp/variant/variant.hpp>
+#include <godot_cpp/classes/array_mesh.hpp>
+#include <godot_cpp/classes/mesh.hpp>
 #endif
 
 #include "godot_bindings.h"
 #include "cbor.h"
 #include "socket.h"
+#include "log.h"
 
 using namespace std;
 using namespace godot;
@@ -18,27 +24,31 @@ using json = nlohmann::json;
 #define CLIENT_TIMEOUT 10s
 
 // convert row and column indicies to actual array index (as an lval)
-#define CHUNK_LVAL_RC(X, Y) (this->chunks[(X) + (Y) * LAZY_DIM])
+#define CHUNK_LVAL_RC(X, Y) (this->chunks[(X) + (Y) * this->lazy_dim])
 // convert chunk x and y coordinates to element of chunk array
 // chunk coords are lattitude / longitude coordinates multiplied by the bbox per degree resolution
 // (from get_partition_info()) and rounded (floor) to ingegers
 #define CHUNK_LVAL_UNCHECKED(X, Y)                                      \
-    (CHUNK_LVAL_RC(((X) - this->chunkx + this->offx + LAZY_DIM) % LAZY_DIM, \
-                   ((Y) - this->chunky + this->offy + LAZY_DIM) % LAZY_DIM))
+    (CHUNK_LVAL_RC(((X) - this->chunkx + this->offx + this->lazy_dim) % this->lazy_dim, \
+                   ((Y) - this->chunky + this->offy + this->lazy_dim) % this->lazy_dim))
 // determine whether a requested chunk is close enough to the player position to be inside the cache
 #define CHUNK_IS_STORED(X, Y)                                           \
-    ((X) >= this->chunkx - LAZY_DIST && (X) <= this->chunkx + LAZY_DIST && \
-     (Y) >= this->chunky - LAZY_DIST && (Y) <= this->chunky + LAZY_DIST)
+    ((X) >= this->chunkx - this->lazy_dist && (X) <= this->chunkx + this->lazy_dist && \
+     (Y) >= this->chunky - this->lazy_dist && (Y) <= this->chunky + this->lazy_dist)
 // convert an index of the chunk array to the geospatial x chunk coordinate corresponding to
 // the chunk at that position
 //
 // (eg. `chunks[i]` refers to a chunk with x coord 11.43; then `CHUNK_INDEX_TO_X(i)`
 // returns `floor(11.43 * get_partition_info())` so maybe 1143 if resolution is 100)
 #define CHUNK_INDEX_TO_X(I)                                             \
-    ((((I) % LAZY_DIM) - this->offx + LAZY_DIST + LAZY_DIM) % LAZY_DIM - LAZY_DIST + this->chunkx)
+    ((((I) % this->lazy_dim) - this->offx + this->lazy_dist + this->lazy_dim) % this->lazy_dim \
+     - this->lazy_dist + this->chunkx)
 // as above, for y coord
 #define CHUNK_INDEX_TO_Y(I)                                             \
-    ((((I) / LAZY_DIM) - this->offy + LAZY_DIST + LAZY_DIM) % LAZY_DIM - LAZY_DIST + this->chunky)
+    ((((I) / this->lazy_dim) - this->offy + this->lazy_dist + this->lazy_dim) % this->lazy_dim \
+     - this->lazy_dist + this->chunky)
+// chunk id for the chunk at integer chunk coords X, Y
+#define CHUNK_ID(X, Y) ((struct chunk_id){ .x = (int32_t)(X), .y = (int32_t)(Y) })
 #define min(A, B) ({                            \
     __typeof__(A) _a = (A);                     \
     __typeof__(B) _b = (B);                     \
@@ -56,69 +66,611 @@ void GDClient::_bind_methods() {
     ClassDB::bind_method(D_METHOD("connect_to_server", "host", "port"), &GDClient::connect_to_server);
     ClassDB::bind_method(D_METHOD("disconnect"), &GDClient::disconnect);
     ClassDB::bind_method(D_METHOD("get_partition_info"), &GDClient::get_partition_info);
+    ClassDB::bind_method(D_METHOD("set_chunk_distances", "render_dist", "lazy_dist"), &GDClient::set_chunk_distances);
+    ClassDB::bind_method(D_METHOD("set_spill_cache_bytes", "bytes"), &GDClient::set_spill_cache_bytes);
+    ClassDB::bind_method(D_METHOD("open_disk_cache", "path", "max_bytes"), &GDClient::open_disk_cache);
+    ClassDB::bind_method(D_METHOD("close_disk_cache"), &GDClient::close_disk_cache);
+    ClassDB::bind_method(D_METHOD("set_mesh_options", "units_per_metre", "default_height", "ground_offset", "point_size"), &GDClient::set_mesh_options);
+    ClassDB::bind_method(D_METHOD("set_fetch_workers", "count"), &GDClient::set_fetch_workers);
+    ClassDB::bind_method(D_METHOD("set_mesh_workers", "count"), &GDClient::set_mesh_workers);
+    ClassDB::bind_method(D_METHOD("set_prefetch", "budget", "lookahead_seconds"), &GDClient::set_prefetch);
+    ClassDB::bind_method(D_METHOD("set_request_deadline", "ms"), &GDClient::set_request_deadline);
+    ClassDB::bind_method(D_METHOD("get_prefetch_requested"), &GDClient::get_prefetch_requested);
+    ClassDB::bind_method(D_METHOD("get_prefetch_hits"), &GDClient::get_prefetch_hits);
+    ClassDB::bind_method(D_METHOD("get_prefetch_wasted"), &GDClient::get_prefetch_wasted);
+    ClassDB::bind_method(D_METHOD("get_fetch_errors"), &GDClient::get_fetch_errors);
+    ClassDB::bind_method(D_METHOD("set_tracing", "enabled"), &GDClient::set_tracing);
+    ClassDB::bind_method(D_METHOD("write_trace", "path"), &GDClient::write_trace);
     ClassDB::bind_method(D_METHOD("has_chunk", "x", "y"), &GDClient::has_chunk);
     ClassDB::bind_method(D_METHOD("get_chunk_info", "x", "y"), &GDClient::get_chunk_info);
     ClassDB::bind_method(D_METHOD("get_cached_chunk_info", "x", "y"), &GDClient::get_cached_chunk_info);
     ClassDB::bind_method(D_METHOD("queue_fetch_chunk", "x", "y"), &GDClient::queue_fetch_chunk);
     ClassDB::bind_method(D_METHOD("queue_fetch_bbox", "minx", "miny", "maxx", "maxy"), &GDClient::queue_fetch_bbox);
     ClassDB::bind_method(D_METHOD("move_chunk_center", "x", "y"), &GDClient::move_chunk_center);
-
-    ADD_SIGNAL(MethodInfo("chunk_loaded", PropertyInfo(Variant::FLOAT, "x"), PropertyInfo(Variant::FLOAT, "y"), PropertyInfo(Variant::STRING, "data")));
+    ClassDB::bind_method(D_METHOD("drain_chunks", "max_chunks", "max_bytes"), &GDClient::drain_chunks);
+    ClassDB::bind_method(D_METHOD("get_ready_chunk_count"), &GDClient::get_ready_chunk_count);
+    ClassDB::bind_method(D_METHOD("get_ready_chunk_bytes"), &GDClient::get_ready_chunk_bytes);
 }
 #endif
 
-// run loop for fetch worker thread
-void GDClient::spin_handle() {
-    while (run_thread) {
-        this->fetch_queue_guard.lock();
-        while (this->fetch_queue.empty()) {
-            this->fetch_queue_guard.unlock();
+// run loop for fetch worker threads
+void GDClient::spin_handle(struct server_connection* c) {
+    trace_set_thread_name("fetch worker");
+    while (true) {
+        unique_lock<mutex> lock(this->fetch_queue_guard);
+        // several workers may be idle at once, so they sleep rather than spin while waiting, only
+        // waking now and then to pick up chunks the server has pushed since
+        auto ready = [this]() {
+            return !this->fetch_queue.empty() || !this->prefetch_queue.empty() || !run_thread;
+        };
+        while (!this->fetch_queue_cv.wait_for(lock, chrono::milliseconds(PUSH_POLL_MS), ready)) {
+            lock.unlock();
+            read_pushes(c);
+            lock.lock();
+        }
+        if (!run_thread)
+            return;
 
-            if (!run_thread) {
-                return;
+        // prefetches only go out when nothing the player needs right now is waiting
+        std::queue<struct fetch_task>& from =
+            !this->fetch_queue.empty() ? this->fetch_queue : this->prefetch_queue;
+        struct fetch_task task = std::move(from.front());
+        from.pop();
+        lock.unlock();
+
+        struct trace_request_scope request(task.request_id);
+        TRACE_SPAN(task.cached ? "decode_cached_chunk" : task.prefetch ? "prefetch_task" : "fetch_task");
+
+        // chunk already held locally, godot just needs to be sent it
+        if (task.cached) {
+            unique_ptr<struct chunk_geometry> geom = make_unique<struct chunk_geometry>();
+            json datj = json::parse(*task.cached, NULL, false);
+            if (decode_chunk_geometry(datj, geom.get())) {
+                LOG_WARN("could not decode cached chunk (%d, %d)", task.ids[0].x, task.ids[0].y);
+                this->fetch_errors++;
+                continue;
             }
-            std::this_thread::yield();
+            queue_mesh_build(std::move(geom), task.ids[0], task.seq, datj.size() - 1);
+            continue;
+        }
 
-            this->fetch_queue_guard.lock();
+        LOG_DEBUG("fetching %zu chunks from (%d, %d)", task.ids.size(), task.ids[0].x, task.ids[0].y);
+
+        // each chunk is handled as it arrives, rather than once the whole request is answered
+        int err;
+        {
+            TRACE_SPAN("fetch_chunks");
+            err = this->fetch_chunks(task.ids, [this, &task](struct fetched_chunk* f) {
+                if (f->status == CHUNK_STATUS_ERROR)
+                    this->fetch_errors++;
+                if (f->status != CHUNK_STATUS_OK)
+                    return;
+
+                // prefetched chunks may never be shown, so aren't worth meshing a layer at a time
+                if (task.prefetch) {
+                    if (!f->partial)
+                        finish_prefetch(f, task.seq);
+                    return;
+                }
+                // godot already has this chunk from the disk cache, or from its last layer
+                if (f->unchanged || f->streamed)
+                    return;
+
+                TRACE_SPAN("decode_chunk_geometry");
+                unique_ptr<struct chunk_geometry> geom = make_unique<struct chunk_geometry>();
+                if (decode_chunk_geometry(f->data, geom.get())) {
+                    LOG_WARN("could not decode chunk geometry");
+                    this->fetch_errors++;
+                    return;
+                }
+                queue_mesh_build(std::move(geom), f->id, task.seq, f->data.size() - 1);
+            }, c, task.prefetch ? 0 : this->request_deadline_ms.load());
         }
+        if (err)
+            this->fetch_errors++;
 
-        struct bbox pp = this->fetch_queue.front();
-        this->fetch_queue.pop();
+        // the results (if any) are in the cache now, so later moves will find them there; on
+        // failure this also lets them be requested again
+        this->fetch_queue_guard.lock();
+        for (const struct chunk_id& id : task.ids) {
+            auto it = this->in_flight.find(chunk_id_key(&id));
+            if (it != this->in_flight.end() && --it->second == 0)
+                this->in_flight.erase(it);
+        }
         this->fetch_queue_guard.unlock();
 
-        printf("fetched point form work queue %f %f\n", pp.minx, pp.miny);
+        if (task.prefetch)
+            this->prefetch_outstanding--;
+    }
+}
+
+void GDClient::push_fetch_task(struct fetch_task task) {
+    task.seq = this->fetch_seq++;
+    task.request_id = trace_new_request_id();
+
+    this->fetch_queue_guard.lock();
+    if (!task.cached) {
+        for (const struct chunk_id& id : task.ids)
+            this->in_flight[chunk_id_key(&id)]++;
+    }
+    if (task.prefetch)
+        this->prefetch_queue.push(std::move(task));
+    else
+        this->fetch_queue.push(std::move(task));
+    this->fetch_queue_guard.unlock();
+    this->fetch_queue_cv.notify_one();
+}
+
+bool GDClient::record_position(float x, float y) {
+    auto now = chrono::steady_clock::now();
+
+    if (position_count > 0) {
+        const struct position_sample& last = position_history[(position_count - 1) % PREFETCH_HISTORY];
+        if (now - last.time < PREFETCH_SAMPLE_INTERVAL)
+            return false;
+    }
+
+    position_history[position_count % PREFETCH_HISTORY] = { .x = x, .y = y, .time = now };
+    position_count++;
+    return true;
+}
+
+bool GDClient::chunk_in_render(struct chunk_id id) {
+    return pos_set && abs(id.x - chunkx) <= render_dist && abs(id.y - chunky) <= render_dist;
+}
+
+void GDClient::plan_prefetch(int res) {
+    // drop prefetches that haven't gone out yet; the path they were planned for may be stale
+    this->fetch_queue_guard.lock();
+    while (!this->prefetch_queue.empty()) {
+        struct fetch_task& old = this->prefetch_queue.front();
+        for (const struct chunk_id& id : old.ids) {
+            auto it = this->in_flight.find(chunk_id_key(&id));
+            if (it != this->in_flight.end() && --it->second == 0)
+                this->in_flight.erase(it);
+        }
+        this->prefetch_outstanding--;
+        this->prefetch_queue.pop();
+    }
+    this->fetch_queue_guard.unlock();
+
+    if (prefetch_budget <= 0 || position_count < 2 || !pos_set)
+        return;
+
+    // velocity from the newest sample and the oldest one still within the history window
+    size_t newest = (position_count - 1) % PREFETCH_HISTORY;
+    size_t oldest = newest;
+    for (size_t i = 1; i < min(position_count, (size_t)PREFETCH_HISTORY); i++) {
+        size_t j = (position_count - 1 - i) % PREFETCH_HISTORY;
+        if (position_history[newest].time - position_history[j].time > PREFETCH_HISTORY_WINDOW)
+            break;
+        oldest = j;
+    }
+    float dt = chrono::duration<float>(position_history[newest].time
+                                       - position_history[oldest].time).count();
+    if (dt <= 0)
+        return;
+
+    float vx = (position_history[newest].x - position_history[oldest].x) / dt;
+    float vy = (position_history[newest].y - position_history[oldest].y) / dt;
+    float px = position_history[newest].x, py = position_history[newest].y;
+
+    // how far ahead the path goes, in chunks; standing (nearly) still needs no prefetching
+    float ahead = sqrtf(vx * vx + vy * vy) * prefetch_seconds * res;
+    if (ahead < 0.5f)
+        return;
+
+    int available = prefetch_budget - this->prefetch_outstanding;
+    vector<struct chunk_id> wanted;
+    unordered_set<uint64_t> seen;
+
+    // walk the path in half chunk steps, nearest first, wanting the render window the player
+    // would need at each point
+    int steps = min((int)ceilf(ahead * 2), MAX_LAZY_DIST * 4);
+    for (int step = 1; step <= steps && (int)wanted.size() < available; step++) {
+        float t = prefetch_seconds * step / steps;
+        int cx = floor((px + vx * t) * res), cy = floor((py + vy * t) * res);
+
+        for (int dx = -render_dist; dx <= render_dist && (int)wanted.size() < available; dx++) {
+            for (int dy = -render_dist; dy <= render_dist && (int)wanted.size() < available; dy++) {
+                struct chunk_id id = CHUNK_ID(cx + dx, cy + dy);
+                if (!seen.insert(chunk_id_key(&id)).second || chunk_in_render(id))
+                    continue;
+                if (CHUNK_IS_STORED(id.x, id.y) && CHUNK_LVAL_UNCHECKED(id.x, id.y))
+                    continue;
+                if (spill_index.count(chunk_id_key(&id)) || disk_cache_has(&this->disk_cache, id))
+                    continue;
+                wanted.push_back(id);
+            }
+        }
+    }
+
+    if (wanted.empty())
+        return;
+
+    this->fetch_queue_guard.lock();
+    for (struct chunk_id id : wanted) {
+        if (chunk_in_flight(id))
+            continue;
+
+        // one request per chunk, so prefetches can be dropped individually when replanned
+        this->in_flight[chunk_id_key(&id)]++;
+        this->prefetch_outstanding++;
+        this->prefetch_requested++;
+        this->prefetch_queue.push({ .ids = { id }, .cached = NULL, .seq = this->fetch_seq++,
+                                    .prefetch = true, .request_id = trace_new_request_id() });
+    }
+    this->fetch_queue_guard.unlock();
+    this->fetch_queue_cv.notify_all();
+}
+
+void GDClient::finish_prefetch(const struct fetched_chunk* f, uint64_t seq) {
+    // the player may have reached the chunk while it was in flight, in which case
+    // move_chunk_center() skipped it and it has to be sent to godot now
+    this->cache_mutex.lock();
+    bool deliver = chunk_in_render(f->id);
+    if (deliver)
+        this->prefetch_hits++;
+    else
+        prefetched.insert(chunk_id_key(&f->id));
+    this->cache_mutex.unlock();
 
-        uint64_t nbb;
-        unique_ptr<json[]> res = this->get_bbox_info(pp, &nbb);
+    if (!deliver)
+        return;
 
-        if (res == NULL || nbb == 0) {
+    unique_ptr<struct chunk_geometry> geom = make_unique<struct chunk_geometry>();
+    if (decode_chunk_geometry(f->data, geom.get())) {
+        LOG_WARN("could not decode chunk geometry");
+        this->fetch_errors++;
+        return;
+    }
+    queue_mesh_build(std::move(geom), f->id, seq, f->data.size() - 1);
+}
+
+bool GDClient::chunk_in_flight(struct chunk_id id) {
+    return this->in_flight.count(chunk_id_key(&id)) != 0;
+}
+
+void GDClient::queue_fetch_ids(const vector<struct chunk_id>& ids) {
+    for (size_t i = 0; i < ids.size(); i += MAX_CHUNK_REQUEST_IDS) {
+        size_t end = min(i + MAX_CHUNK_REQUEST_IDS, ids.size());
+        push_fetch_task({ .ids = vector<struct chunk_id>(ids.begin() + i, ids.begin() + end),
+                          .cached = NULL });
+    }
+}
+
+void GDClient::queue_mesh_build(unique_ptr<struct chunk_geometry> geom, struct chunk_id id,
+                                uint64_t seq, uint32_t layers) {
+    this->mesh_queue_guard.lock();
+    this->mesh_queue.push({ .geom = std::move(geom), .id = id, .seq = seq,
+                            .request_id = trace_current_request(), .layers = layers });
+    this->mesh_queue_guard.unlock();
+    this->mesh_queue_cv.notify_one();
+}
+
+// run loop for mesh worker threads
+void GDClient::mesh_handle() {
+    struct chunk_mesh mesh;
+    trace_set_thread_name("mesh worker");
+
+    while (true) {
+        unique_lock<mutex> lock(this->mesh_queue_guard);
+        // several of these may be idle at once, so they sleep rather than spin while waiting
+        this->mesh_queue_cv.wait(lock, [this]() {
+            return !this->mesh_queue.empty() || !run_thread;
+        });
+        if (!run_thread)
             return;
+
+        struct mesh_task task = std::move(this->mesh_queue.front());
+        this->mesh_queue.pop();
+        struct mesh_build_options opts = this->mesh_options;
+        lock.unlock();
+
+        struct trace_request_scope request(task.request_id);
+        TRACE_SPAN("mesh_task");
+        build_chunk_mesh(*task.geom, &opts, &mesh);
+
+        lock_guard<mutex> delivery(this->delivered_guard);
+        pair<uint64_t, uint32_t>& newest = this->delivered[chunk_id_key(&task.id)];
+        pair<uint64_t, uint32_t> version = { task.seq, task.layers };
+        if (version < newest) {
+            LOG_DEBUG("dropping outdated copy of chunk (%d, %d)", task.id.x, task.id.y);
+            continue;
         }
+        newest = version;
+        notify_chunk_loaded(*task.geom, mesh);
+    }
+}
+
+void GDClient::stop_workers() {
+    // both queue locks are taken so a worker can't miss the wake up between checking
+    // run_thread and sleeping
+    this->fetch_queue_guard.lock();
+    this->mesh_queue_guard.lock();
+    this->run_thread = false;
+    this->mesh_queue_guard.unlock();
+    this->fetch_queue_guard.unlock();
+    this->fetch_queue_cv.notify_all();
+    this->mesh_queue_cv.notify_all();
+
+    for (thread& worker : this->fetch_workers)
+        worker.join();
+    this->fetch_workers.clear();
+    for (thread& worker : this->mesh_workers)
+        worker.join();
+    this->mesh_workers.clear();
+
+    this->mesh_queue_guard.lock();
+    while (!this->mesh_queue.empty())
+        this->mesh_queue.pop();
+    this->mesh_queue_guard.unlock();
+}
 
-        for (uint64_t i = 0; i < nbb; i++) {
 #ifndef NO_GODOT
-            emit_signal("chunk_loaded",
-                        (float)res[i][0]["minx"],
-                        (float)res[i][0]["miny"],
-                        (String)res[i].dump().c_str());
+// copies a vector of x, y pairs into a godot array of Vector2
+static PackedVector2Array to_packed_coords(const vector<float>& coords) {
+    PackedVector2Array arr;
+    arr.resize(coords.size() / 2);
+    Vector2* dst = arr.ptrw();
+    for (size_t i = 0; i < coords.size() / 2; i++)
+        dst[i] = Vector2(coords[i * 2], coords[i * 2 + 1]);
+    return arr;
+}
+
+static PackedInt32Array to_packed(const vector<int32_t>& v) {
+    PackedInt32Array arr;
+    arr.resize(v.size());
+    if (!v.empty())
+        memcpy(arr.ptrw(), v.data(), v.size() * sizeof(int32_t));
+    return arr;
+}
+
+static PackedInt64Array to_packed(const vector<int64_t>& v) {
+    PackedInt64Array arr;
+    arr.resize(v.size());
+    if (!v.empty())
+        memcpy(arr.ptrw(), v.data(), v.size() * sizeof(int64_t));
+    return arr;
+}
+
+static PackedFloat32Array to_packed(const vector<float>& v) {
+    PackedFloat32Array arr;
+    arr.resize(v.size());
+    if (!v.empty())
+        memcpy(arr.ptrw(), v.data(), v.size() * sizeof(float));
+    return arr;
+}
+
+// copies a vector of x, y, z triples into a godot array of Vector3
+static PackedVector3Array to_packed_vec3(const vector<float>& v) {
+    PackedVector3Array arr;
+    arr.resize(v.size() / 3);
+    Vector3* dst = arr.ptrw();
+    for (size_t i = 0; i < v.size() / 3; i++)
+        dst[i] = Vector3(v[i * 3], v[i * 3 + 1], v[i * 3 + 2]);
+    return arr;
+}
+
+static PackedStringArray to_packed(const vector<string>& v) {
+    PackedStringArray arr;
+    arr.resize(v.size());
+    for (size_t i = 0; i < v.size(); i++)
+        arr.set(i, String(v[i].c_str()));
+    return arr;
+}
+
+// uploads a built mesh as one ArrayMesh surface per material, recording the material of each
+static Ref<ArrayMesh> chunk_mesh_to_array_mesh(const struct chunk_mesh& mesh,
+                                               PackedInt32Array* materials) {
+    Ref<ArrayMesh> out;
+    out.instantiate();
+
+    for (const struct mesh_surface& s : mesh.surfaces) {
+        Array arrays;
+        arrays.resize(Mesh::ARRAY_MAX);
+        arrays[Mesh::ARRAY_VERTEX] = to_packed_vec3(s.vertices);
+        arrays[Mesh::ARRAY_NORMAL] = to_packed_vec3(s.normals);
+        arrays[Mesh::ARRAY_INDEX] = to_packed(s.indices);
+
+        Mesh::PrimitiveType primitive = s.primitive == mesh_primitive::MESH_PRIMITIVE_LINES
+            ? Mesh::PRIMITIVE_LINES : Mesh::PRIMITIVE_TRIANGLES;
+        out->add_surface_from_arrays(primitive, arrays);
+        materials->push_back(s.material);
+    }
+
+    return out;
+}
+
+// layout of the dictionary is documented with queue_fetch_chunk() in godot_bindings.h
+static Dictionary chunk_geometry_to_dictionary(const struct chunk_geometry& geom,
+                                               const struct chunk_mesh& mesh) {
+    Dictionary points, lines, polygons, features, d;
+
+    points["coords"] = to_packed_coords(geom.point_coords);
+    points["features"] = to_packed(geom.point_features);
+
+    lines["coords"] = to_packed_coords(geom.line_coords);
+    lines["offsets"] = to_packed(geom.line_offsets);
+    lines["features"] = to_packed(geom.line_features);
+
+    polygons["coords"] = to_packed_coords(geom.polygon_coords);
+    polygons["ring_offsets"] = to_packed(geom.ring_offsets);
+    polygons["polygon_offsets"] = to_packed(geom.polygon_offsets);
+    polygons["features"] = to_packed(geom.polygon_features);
+
+    features["osm_ids"] = to_packed(geom.features.osm_ids);
+    features["kinds"] = to_packed(geom.features.kinds);
+    features["heights"] = to_packed(geom.features.heights);
+
+    d["minx"] = geom.bbox.minx;
+    d["miny"] = geom.bbox.miny;
+    d["maxx"] = geom.bbox.maxx;
+    d["maxy"] = geom.bbox.maxy;
+    d["origin_lon"] = geom.origin.lon;
+    d["origin_lat"] = geom.origin.lat;
+    d["points"] = points;
+    d["lines"] = lines;
+    d["polygons"] = polygons;
+    d["features"] = features;
+
+    PackedInt32Array materials;
+    d["mesh"] = chunk_mesh_to_array_mesh(mesh, &materials);
+    d["surface_materials"] = materials;
+    return d;
+}
+#endif
+
+void GDClient::notify_chunk_loaded(const struct chunk_geometry& geom, const struct chunk_mesh& mesh) {
+    struct ready_chunk* c = new struct ready_chunk;
+    c->x = geom.bbox.minx;
+    c->y = geom.bbox.miny;
+    c->bytes = chunk_geometry_bytes(&geom) + chunk_mesh_bytes(&mesh);
+#ifndef NO_GODOT
+    // converted here, on the worker, so draining is cheap for godot's thread
+    c->geometry = chunk_geometry_to_dictionary(geom, mesh);
 #else
-            printf("mocking godot signal emit:\tchunk_loaded, %f, %f, ...\n",
-                   (float)res[i][0]["minx"],
-                   (float)res[i][0]["miny"]);
+    c->summary = {
+        .x = c->x,
+        .y = c->y,
+        .bytes = c->bytes,
+        .points = geom.point_features.size(),
+        .lines = geom.line_features.size(),
+        .polygons = geom.polygon_features.size(),
+        .surfaces = mesh.surfaces.size(),
+    };
+    LOG_DEBUG("mocking godot delivery:\tchunk %f, %f ready, %zu points, %zu lines, %zu polygons, "
+              "%zu surfaces (%zu bytes)",
+              c->x, c->y, c->summary.points, c->summary.lines, c->summary.polygons,
+              c->summary.surfaces, c->bytes);
 #endif
-        }
+
+    this->ready_count++;
+    this->ready_bytes += c->bytes;
+    mpsc_push(&this->ready_queue, c);
+}
+
+ChunkArray GDClient::drain_chunks(int max_chunks, int64_t max_bytes) {
+    if (max_bytes <= 0)
+        max_bytes = DEFAULT_DRAIN_BYTES;
+
+    ChunkArray out;
+    int64_t bytes = 0;
+    int count = 0;
+
+    while (max_chunks <= 0 || count < max_chunks) {
+        struct mpsc_node* n = mpsc_pop(&this->ready_queue);
+        if (n == NULL)
+            break;
+        struct ready_chunk* c = static_cast<struct ready_chunk*>(n);
+
+#ifndef NO_GODOT
+        Dictionary d;
+        d["x"] = c->x;
+        d["y"] = c->y;
+        d["bytes"] = (int64_t)c->bytes;
+        d["geometry"] = c->geometry;
+        out.push_back(d);
+#else
+        out.push_back(c->summary);
+#endif
+        bytes += c->bytes;
+        count++;
+        this->ready_count--;
+        this->ready_bytes -= c->bytes;
+        delete c;
+
+        if (bytes >= max_bytes)
+            break;
     }
+
+    return out;
+}
+
+int64_t GDClient::get_ready_chunk_count() {
+    return this->ready_count;
+}
+
+int64_t GDClient::get_ready_chunk_bytes() {
+    return this->ready_bytes;
+}
+
+void GDClient::clear_ready_chunks() {
+    while (struct mpsc_node* n = mpsc_pop(&this->ready_queue)) {
+        struct ready_chunk* c = static_cast<struct ready_chunk*>(n);
+        this->ready_count--;
+        this->ready_bytes -= c->bytes;
+        delete c;
+    }
+}
+
+// converts chunk json text to a godot string for returning to scripts
+static String to_godot_string(const string& s) {
+#ifndef NO_GODOT
+    String out;
+    out.parse_utf8(s.c_str(), s.size());
+    return out;
+#else
+    return s;
+#endif
+}
+
+void GDClient::spill_trim() {
+    while (spill_bytes > spill_budget && !spill_lru.empty()) {
+        struct spill_entry& old = spill_lru.back();
+        if (prefetched.erase(chunk_id_key(&old.id)))
+            this->prefetch_wasted++;
+        spill_bytes -= old.data->size();
+        spill_index.erase(chunk_id_key(&old.id));
+        spill_lru.pop_back();
+    }
+}
+
+void GDClient::spill_put(struct chunk_id id, shared_ptr<const string> data) {
+    if (!data || spill_budget == 0)
+        return;
+
+    // replace any older copy of the same chunk
+    spill_take(id);
+
+    spill_bytes += data->size();
+    spill_lru.push_front({ .id = id, .data = std::move(data) });
+    spill_index[chunk_id_key(&id)] = spill_lru.begin();
+
+    spill_trim();
+}
+
+shared_ptr<const string> GDClient::spill_take(struct chunk_id id) {
+    auto it = spill_index.find(chunk_id_key(&id));
+    if (it == spill_index.end())
+        return NULL;
+
+    shared_ptr<const string> data = std::move(it->second->data);
+    spill_bytes -= data->size();
+    spill_lru.erase(it->second);
+    spill_index.erase(it);
+    return data;
+}
+
+shared_ptr<const string> GDClient::spill_peek(struct chunk_id id) {
+    auto it = spill_index.find(chunk_id_key(&id));
+    if (it == spill_index.end())
+        return NULL;
+
+    spill_lru.splice(spill_lru.begin(), spill_lru, it->second);
+    return spill_lru.front().data;
 }
 
 
 GDClient::GDClient() {
+    chunks.resize(lazy_dim * lazy_dim);
 }
 
 GDClient::~GDClient() {
-    this->run_thread = false;
+    stop_workers();
+    clear_ready_chunks();
 
-    if (this->fetch_handler.joinable())
-        this->fetch_handler.join();
+    disk_cache_close(&this->disk_cache);
 }
 
 int GDClient::connect_to_server(String host, in_port_t port) {
@@ -140,75 +692,165 @@ int GDClient::connect_to_server(String host, in_port_t port) {
     part_res = -1;
 
     sockpp::initialize();
-    sockpp::result res = this->conn.connect(this->host, port, CLIENT_TIMEOUT);
 
-    if (!res) {
-        printf("could not connect:\n");
-        printf("\t%s\n", res.error_message().c_str());
-        this->socket_mutex.unlock();
-        return 1;
+    this->connections.clear();
+    for (int i = 0; i < this->fetch_worker_count; i++) {
+        unique_ptr<struct server_connection> c = make_unique<struct server_connection>();
+        sockpp::result res = c->conn.connect(this->host, port, CLIENT_TIMEOUT);
+
+        if (!res) {
+            LOG_WARN("could not connect: %s", res.error_message().c_str());
+            // a smaller pool still works, as long as there is at least one connection
+            if (i == 0) {
+                this->socket_mutex.unlock();
+                return 1;
+            }
+            break;
+        }
+        this->connections.push_back(std::move(c));
     }
 
     connected = true;
 
     this->socket_mutex.unlock();
 
-    this->fetch_handler = thread(&GDClient::spin_handle, this);
+    this->run_thread = true;
+    for (unique_ptr<struct server_connection>& c : this->connections)
+        this->fetch_workers.push_back(thread(&GDClient::spin_handle, this, c.get()));
+    for (int i = 0; i < this->mesh_worker_count; i++)
+        this->mesh_workers.push_back(thread(&GDClient::mesh_handle, this));
 
     return 0;
 }
 
 void GDClient::disconnect() {
-    this->run_thread = false;
-    if (this->fetch_handler.joinable())
-        this->fetch_handler.join();
+    stop_workers();
 
     this->socket_mutex.lock();
     pos_set = false;
     part_res = -1;
 
     if (connected) {
-        this->conn.close();
+        // the pool itself is kept until the next connect, as godot's thread may still be
+        // holding connections[0]
+        for (unique_ptr<struct server_connection>& c : this->connections) {
+            c->guard.lock();
+            c->conn.close();
+            c->guard.unlock();
+
+            c->shards_guard.lock();
+            for (auto& [name, sc] : c->shards) {
+                sc->guard.lock();
+                sc->conn.close();
+                sc->guard.unlock();
+            }
+            c->shards.clear();
+            c->shards_guard.unlock();
+        }
     }
     connected = false;
     this->socket_mutex.unlock();
 
+    this->shard_guard.lock();
+    this->shard_ring = make_shared<const struct shard_map>();
+    this->shard_guard.unlock();
+
     this->fetch_queue_guard.lock();
     while (!this->fetch_queue.empty())
         fetch_queue.pop();
+    while (!this->prefetch_queue.empty())
+        prefetch_queue.pop();
+    in_flight.clear();
+    prefetch_outstanding = 0;
     this->fetch_queue_guard.unlock();
+
+    this->delivered_guard.lock();
+    delivered.clear();
+    this->delivered_guard.unlock();
+
+    clear_ready_chunks();
+
+    this->cache_mutex.lock();
+    for (shared_ptr<const string>& chunk : chunks)
+        chunk = NULL;
+    spill_lru.clear();
+    spill_index.clear();
+    spill_bytes = 0;
+    revalidating.clear();
+    prefetched.clear();
+    position_count = 0;
+    this->cache_mutex.unlock();
 }
 
 int GDClient::get_partition_info() {
     if (part_res > 0)
         return part_res;
 
-    struct packet packet;
-    encode_packet_partition_info_query(&packet);
-
     this->socket_mutex.lock();
 
-    if (!connected) {
+    // when the server can't be reached, fall back on the resolution the disk cache was filled
+    // with so previously visited chunks can still be found
+    int res = -1;
+    if (connected) {
+        struct server_connection* c = this->connections[0].get();
+        this->socket_mutex.unlock();
+        res = query_partition_info(c);
+    } else {
         this->socket_mutex.unlock();
-        return -1;
     }
 
-    if (send_packet(this->conn, &packet)) {
-        this->socket_mutex.unlock();
-        printf("sending packet returned error\n");
+    if (res < 0) {
+        uint32_t cached_res = disk_cache_bbox_per_deg(&this->disk_cache);
+        return cached_res ? (int)cached_res : -1;
+    }
+    return res;
+}
+
+int GDClient::query_partition_info(struct server_connection* c) {
+    struct packet packet;
+    encode_packet_partition_info_query(&packet);
+
+    c->guard.lock();
+    if (send_packet(c->conn, &packet)) {
+        c->guard.unlock();
+        LOG_WARN("sending packet returned error");
         return -1;
     }
 
-    read_packet(this->conn, &packet);
-    this->socket_mutex.unlock();
+    // chunks pushed on this connection may be ahead of the answer
+    int err = read_packet(c->conn, &packet);
+    while (!err && (packet.header.type == packet_type_enum::PACKET_TYPE_CHUNK_PUSH
+                    || packet.header.type == packet_type_enum::PACKET_TYPE_CHUNK_LAYER)) {
+        struct fetched_chunk f;
+        enum chunk_packet_kind kind;
+        if (!decode_chunk_packet(c, &packet, &f, &kind))
+            handle_pushed_chunk(&f);
+        err = read_packet(c->conn, &packet);
+    }
+    c->guard.unlock();
 
     struct partition_info p;
     if (packet.header.type != packet_type_enum::PACKET_TYPE_PARTITION_INFO
         || decode_packet_partition_info(&packet, &p)) {
-        printf("could not decode packet as partition info\n");
+        LOG_WARN("could not decode packet as partition info");
         return -1;
     }
 
+    data_version = p.data_version;
+    if (!disk_cache_validate(&this->disk_cache, p.data_version, p.bbox_per_deg)
+        && disk_cache_is_open(&this->disk_cache)) {
+        LOG_INFO("disk cache was for a different server version; cleared");
+    }
+
+    shared_ptr<struct shard_map> ring = make_shared<struct shard_map>();
+    shard_map_build(ring.get(), p.shards);
+    this->shard_guard.lock();
+    if (ring->epoch != this->shard_ring->epoch) {
+        LOG_INFO("routing chunks over %zu shards (epoch %08x)", ring->shards.size(), ring->epoch);
+        this->shard_ring = std::move(ring);
+    }
+    this->shard_guard.unlock();
+
     part_res = p.bbox_per_deg;
 
     return p.bbox_per_deg;
@@ -216,74 +858,269 @@ int GDClient::get_partition_info() {
     // return res;
 }
 
-unique_ptr<json[]> GDClient::get_chunk_info_unchecked(struct bbox bbox, uint64_t* nbb) {
-    // struct bbox bbox = {.minx = x, .miny = y, .maxx = x, .maxy = y};
-    *nbb = 0;
+shared_ptr<const struct shard_map> GDClient::get_shard_map() {
+    lock_guard<mutex> guard(this->shard_guard);
+    return this->shard_ring;
+}
 
-    struct packet packet;
-    if (encode_packet_bbox(&bbox, &packet)) {
-        printf("could not encode bbox packet\n");
-        return NULL;
-    }
+shared_ptr<struct GDClient::server_connection> GDClient::shard_connection(struct server_connection* c,
+                                                                          const struct shard_address& shard) {
+    // the aliasing constructor, so c is used without being owned
+    if (shard.host == this->host && shard.port == this->port)
+        return shared_ptr<struct server_connection>(shared_ptr<struct server_connection>(), c);
 
-    this->socket_mutex.lock();
+    string name = shard_name(&shard);
+    lock_guard<mutex> guard(c->shards_guard);
+    auto it = c->shards.find(name);
+    if (it != c->shards.end())
+        return it->second;
 
-    if (send_packet(this->conn, &packet)) {
-        printf("could not send bbox packet\n");
-        this->socket_mutex.unlock();
+    shared_ptr<struct server_connection> sc = make_shared<struct server_connection>();
+    sockpp::result res = sc->conn.connect(shard.host, shard.port, CLIENT_TIMEOUT);
+    if (!res) {
+        LOG_WARN("could not connect to shard %s: %s", name.c_str(), res.error_message().c_str());
         return NULL;
     }
+    c->shards[name] = sc;
+    return sc;
+}
 
-    read_packet(this->conn, &packet);
+void GDClient::drop_shard_connection(struct server_connection* c, struct server_connection* shard) {
+    lock_guard<mutex> guard(c->shards_guard);
+    erase_if(c->shards, [shard](const auto& entry) {
+        return entry.second.get() == shard;
+    });
+}
 
-    if (packet.header.type == packet_type_enum::PACKET_TYPE_GEOJSON) {
-        this->socket_mutex.unlock();
+int GDClient::request_chunks_unchecked(struct server_connection* c, const vector<struct chunk_id>& ids,
+                                       const function<void(struct fetched_chunk*)>& on_chunk,
+                                       uint32_t deadline_ms) {
+    c->guard.lock();
+    int err = send_chunk_request(c, ids, deadline_ms);
+    if (!err)
+        err = read_chunk_answers(c, ids.size(), on_chunk);
+    c->guard.unlock();
 
-        json datj = decode_packet_geojson(&packet);
-        *nbb = 1;
+    return err;
+}
 
-        unique_ptr<json[]> chunks = make_unique<json[]>(*nbb);
-        chunks[0] = datj;
-        return chunks;
-    } else if (packet.header.type == packet_type_enum::PACKET_TYPE_GEOJSON_COUNT) {
-        if (decode_packet_geojson_count(nbb, &packet)) {
-            this->socket_mutex.unlock();
+int GDClient::send_chunk_request(struct server_connection* c, const vector<struct chunk_id>& ids,
+                                 uint32_t deadline_ms) {
+    struct packet packet;
+    // the server tags its spans with the same id, if we are tracing
+    uint64_t request_id = trace_enabled ? trace_current_request() : 0;
+    if (encode_packet_chunk_request(ids.data(), ids.size(), &packet, request_id,
+                                    CHUNK_REQUEST_STREAM_LAYERS, deadline_ms)) {
+        LOG_WARN("could not encode chunk request");
+        return 1;
+    }
+
+    if (send_packet(c->conn, &packet)) {
+        LOG_WARN("could not send chunk request");
+        return 2;
+    }
+    return 0;
+}
 
-            printf("failed to decode geojson_count_packet\n");
-            return NULL;
+int GDClient::read_chunk_answers(struct server_connection* c, size_t n,
+                                 const function<void(struct fetched_chunk*)>& on_chunk) {
+    struct packet packet;
+
+    // one CHUNK per id, in whatever order the server has them ready, with the CHUNK_LAYERs of
+    // chunks it has to fetch first ahead of them, and chunks pushed from earlier requests mixed in
+    for (size_t i = 0; i < n;) {
+        if (read_packet(c->conn, &packet)) {
+            LOG_WARN("connection lost after %zu of %zu chunks", i, n);
+            c->pending.clear();
+            c->streaming.clear();
+            c->awaiting_pushes = false;
+            return 3;
         }
-        if (*nbb == 0) {
-            this->socket_mutex.unlock();
 
-            printf("server returned 0 chunks of geojson for query\n");
-            return NULL;
+        struct fetched_chunk f;
+        enum chunk_packet_kind kind;
+        int err = decode_chunk_packet(c, &packet, &f, &kind);
+        if (err)
+            return err;
+        if (kind == CHUNK_PACKET_PUSH) {
+            handle_pushed_chunk(&f);
+            continue;
         }
+        on_chunk(&f);
+        if (kind == CHUNK_PACKET_ANSWER)
+            i++;
+    }
+    return 0;
+}
 
-        unique_ptr<json[]> chunks = make_unique<json[]>(*nbb);
+int GDClient::decode_chunk_packet(struct server_connection* c, struct packet* packet,
+                                  struct fetched_chunk* f, enum chunk_packet_kind* kind) {
+    *f = { .status = CHUNK_STATUS_ERROR, .unchanged = false, .partial = false, .streamed = false,
+           .stale = false };
+    if (packet->header.type == packet_type_enum::PACKET_TYPE_CHUNK_LAYER) {
+        json header, layer;
+        if (decode_packet_chunk_layer(packet, &f->id, &header, &layer)) {
+            LOG_WARN("could not decode chunk layer");
+            return 4;
+        }
+        uint64_t key = chunk_id_key(&f->id);
+        json& parts = c->streaming[key];
+        if (parts.is_null())
+            parts = json::array({ std::move(header) });
+        parts.push_back(std::move(layer));
+
+        f->status = CHUNK_STATUS_OK;
+        f->data = parts;
+        f->partial = true;
+        *kind = c->pending.contains(key) ? CHUNK_PACKET_PUSH : CHUNK_PACKET_PARTIAL;
+        return 0;
+    }
 
-        for (uint64_t i = 0; i < *nbb; i++) {
-            read_packet(this->conn, &packet);
+    if (decode_packet_chunk(packet, &f->id, &f->status, &f->data)) {
+        LOG_WARN("expected CHUNK, got %hhu", static_cast<uint8_t>(packet->header.type));
+        return 4;
+    }
+    uint64_t key = chunk_id_key(&f->id);
+    *kind = CHUNK_PACKET_ANSWER;
+    if (packet->header.type == packet_type_enum::PACKET_TYPE_CHUNK_PUSH) {
+        *kind = CHUNK_PACKET_PUSH;
+        c->pending.erase(key);
+    } else if (f->status == CHUNK_STATUS_PENDING || f->status == CHUNK_STATUS_STALE) {
+        c->pending.insert(key);
+        if (f->status == CHUNK_STATUS_STALE) {
+            f->status = CHUNK_STATUS_OK;
+            f->stale = true;
+        }
+    } else {
+        // answered again since, or the push overtook the pending answer
+        c->pending.erase(key);
+    }
+    c->awaiting_pushes = !c->pending.empty();
+
+    // otherwise the whole chunk is sent, eg. as the client fell behind during the stream
+    auto parts = c->streaming.find(key);
+    if (f->status == CHUNK_STATUS_STREAMED) {
+        f->status = CHUNK_STATUS_ERROR;
+        if (parts != c->streaming.end()) {
+            f->status = CHUNK_STATUS_OK;
+            f->data = std::move(parts->second);
+            f->streamed = true;
+        }
+    }
+    if (parts != c->streaming.end())
+        c->streaming.erase(parts);
+    return 0;
+}
 
-            if (packet.header.type != packet_type_enum::PACKET_TYPE_GEOJSON) {
-                this->socket_mutex.unlock();
+void GDClient::handle_pushed_chunk(struct fetched_chunk* f) {
+    TRACE_SPAN("pushed_chunk");
+    if (f->status == CHUNK_STATUS_ERROR)
+        this->fetch_errors++;
+    if (f->status != CHUNK_STATUS_OK)
+        return;
+    if (!f->partial)
+        store_fetched_chunk(f);
+    // godot already has this chunk, or has it from its last layer
+    if (f->unchanged || f->streamed)
+        return;
+
+    // the player may have moved on while the chunk was pending
+    this->cache_mutex.lock();
+    bool deliver = chunk_in_render(f->id);
+    this->cache_mutex.unlock();
+    if (!deliver)
+        return;
+
+    unique_ptr<struct chunk_geometry> geom = make_unique<struct chunk_geometry>();
+    if (decode_chunk_geometry(f->data, geom.get())) {
+        LOG_WARN("could not decode chunk geometry");
+        this->fetch_errors++;
+        return;
+    }
+    queue_mesh_build(std::move(geom), f->id, this->fetch_seq++, f->data.size() - 1);
+}
 
-                printf("expected GEOJSON, got %hhu\n", static_cast<uint8_t>(packet.header.type));
-                return NULL;
-            }
+void GDClient::read_pushes(struct server_connection* c) {
+    vector<shared_ptr<struct server_connection>> conns = {
+        shared_ptr<struct server_connection>(shared_ptr<struct server_connection>(), c)
+    };
+    c->shards_guard.lock();
+    for (const auto& [addr, shard] : c->shards)
+        conns.push_back(shard);
+    c->shards_guard.unlock();
+
+    for (const shared_ptr<struct server_connection>& sc : conns) {
+        if (!sc->awaiting_pushes || !sc->guard.try_lock())
+            continue;
+        int err = 0;
+        struct packet packet;
+        while (!err && sc->awaiting_pushes && socket_readable(sc->conn, 0)) {
+            err = read_packet(sc->conn, &packet);
+            struct fetched_chunk f;
+            enum chunk_packet_kind kind;
+            if (!err)
+                err = decode_chunk_packet(sc.get(), &packet, &f, &kind);
+            if (!err)
+                handle_pushed_chunk(&f);
+        }
+        if (err) {
+            LOG_WARN("connection lost waiting on %zu pushed chunks", sc->pending.size());
+            sc->pending.clear();
+            sc->streaming.clear();
+            sc->awaiting_pushes = false;
+        }
+        sc->guard.unlock();
+        if (err && sc.get() != c)
+            drop_shard_connection(c, sc.get());
+    }
+}
 
-            json datj = decode_packet_geojson(&packet);
-            chunks[i] = datj;
+int GDClient::request_routed_chunks(struct server_connection* c, const vector<struct chunk_id>& ids,
+                                    const function<void(struct fetched_chunk*)>& on_chunk,
+                                    uint32_t deadline_ms) {
+    shared_ptr<const struct shard_map> ring = get_shard_map();
+    if (ring->shards.empty())
+        return request_chunks_unchecked(c, ids, on_chunk, deadline_ms);
+
+    vector<vector<struct chunk_id>> parts(ring->shards.size());
+    for (const struct chunk_id& id : ids)
+        parts[shard_map_owner(ring.get(), id)].push_back(id);
+
+    // every shard is sent its part before any answers are read, so the shards work on them at
+    // the same time. connections are locked in shard order, so threads sharing some of them
+    // (worker 0 & godot's thread) can't deadlock
+    vector<shared_ptr<struct server_connection>> conns(parts.size());
+    int err = 0;
+    for (size_t s = 0; s < parts.size(); s++) {
+        if (parts[s].empty())
+            continue;
+        conns[s] = shard_connection(c, ring->shards[s]);
+        if (!conns[s]) {
+            err = 5;
+            continue;
         }
-        this->socket_mutex.unlock();
 
-        return chunks;
+        conns[s]->guard.lock();
+        int send_err = send_chunk_request(conns[s].get(), parts[s], deadline_ms);
+        if (send_err) {
+            conns[s]->guard.unlock();
+            drop_shard_connection(c, conns[s].get());
+            conns[s] = NULL;
+            err = send_err;
+        }
     }
-    this->socket_mutex.unlock();
-
-    printf("expected GEOJSON or GEOJSON_COUNT, got %hhu\n",
-           static_cast<uint8_t>(packet.header.type));
-    return NULL;
 
+    for (size_t s = 0; s < parts.size(); s++) {
+        if (!conns[s])
+            continue;
+        int read_err = read_chunk_answers(conns[s].get(), parts[s].size(), on_chunk);
+        conns[s]->guard.unlock();
+        if (read_err) {
+            drop_shard_connection(c, conns[s].get());
+            err = read_err;
+        }
+    }
+    return err;
 }
 
 String GDClient::get_chunk_info(float x, float y) {
@@ -299,72 +1136,186 @@ String GDClient::get_chunk_info(float x, float y) {
     // if the request was for a single chunk, check if it was stored
     if (this->pos_set && CHUNK_IS_STORED(checkx, checky) && CHUNK_LVAL_UNCHECKED(checkx, checky)) {
 
-        String c_val = *CHUNK_LVAL_UNCHECKED(checkx, checky);
+        shared_ptr<const string> c_val = CHUNK_LVAL_UNCHECKED(checkx, checky);
         this->cache_mutex.unlock();
 
-        printf("stored chunk found\n");
-        return c_val;
+        LOG_DEBUG("stored chunk found");
+        return to_godot_string(*c_val);
     }
-    this->cache_mutex.unlock();
+    if (shared_ptr<const string> spilled = spill_peek(CHUNK_ID(checkx, checky))) {
+        this->cache_mutex.unlock();
 
-    struct bbox bbox = { .minx = x,
-                         .miny = y,
-                         .maxx = x,
-                         .maxy = y };
+        LOG_DEBUG("spilled chunk found");
+        return to_godot_string(*spilled);
+    }
+    string on_disk;
+    if (disk_cache_get(&this->disk_cache, CHUNK_ID(checkx, checky), &on_disk)) {
+        queue_revalidate(checkx, checky);
+        this->cache_mutex.unlock();
 
-    uint64_t nbb;
-    unique_ptr<json[]> v = get_bbox_info(bbox, &nbb);
+        LOG_DEBUG("chunk found in disk cache");
+        return to_godot_string(on_disk);
+    }
+    this->cache_mutex.unlock();
+
+    string found;
+    bool ok = false;
+    fetch_chunks({ CHUNK_ID(checkx, checky) }, [&found, &ok](struct fetched_chunk* f) {
+        if (f->status != CHUNK_STATUS_OK || f->partial)
+            return;
+        found = f->data.dump();
+        ok = true;
+    });
 
-    if (v == NULL || nbb == 0) {
+    if (!ok) {
         return (char*)NULL;
     }
 
-    return (String)v[0].dump().c_str();
+    return to_godot_string(found);
 }
 
-unique_ptr<json[]> GDClient::get_bbox_info(struct bbox bbox, uint64_t* nbb) {
-    int res = get_partition_info();
-
-    if (res < 0) {
-        return NULL;
+int GDClient::fetch_chunks(const vector<struct chunk_id>& ids,
+                           const function<void(struct fetched_chunk*)>& on_chunk,
+                           struct server_connection* c, uint32_t deadline_ms) {
+    if (c == NULL) {
+        this->socket_mutex.lock();
+        if (!connected) {
+            this->socket_mutex.unlock();
+            return 1;
+        }
+        c = this->connections[0].get();
+        this->socket_mutex.unlock();
     }
 
-    unique_ptr<json[]> v = get_chunk_info_unchecked(bbox, nbb);
+    auto store = [this, &on_chunk](struct fetched_chunk* f) {
+        if (f->status == CHUNK_STATUS_OK && !f->partial)
+            store_fetched_chunk(f);
+        on_chunk(f);
+    };
+
+    vector<struct chunk_id> moved;
+    int err = request_routed_chunks(c, ids, [&moved, &store](struct fetched_chunk* f) {
+        if (f->status == CHUNK_STATUS_MOVED)
+            moved.push_back(f->id);
+        else
+            store(f);
+    }, deadline_ms);
+    if (moved.empty())
+        return err;
+
+    // shards have been added or removed since the shard list was fetched; chunks that still
+    // aren't where the new list says are given up on
+    LOG_INFO("%zu chunks have moved shard; fetching the shard list again", moved.size());
+    query_partition_info(c);
+    int retry_err = request_routed_chunks(c, moved, [&store](struct fetched_chunk* f) {
+        if (f->status == CHUNK_STATUS_MOVED)
+            f->status = CHUNK_STATUS_ERROR;
+        store(f);
+    }, deadline_ms);
+    return err ? err : retry_err;
+}
 
-    if (v == NULL || *nbb == 0) {
-        return NULL;
+void GDClient::store_fetched_chunk(struct fetched_chunk* f) {
+    this->cache_mutex.lock();
+    bool revalidated = revalidating.erase(chunk_id_key(&f->id));
+    this->cache_mutex.unlock();
+
+    // the serializing & disk cache work is done outside of cache_mutex, which is only held
+    // briefly, so other workers (and godot's thread) aren't held up merging their own results
+    string dumped = f->data.dump();
+
+    // a background refetch of a chunk read from disk; only worth storing & reporting if
+    // the server has something different
+    f->unchanged = false;
+    if (revalidated) {
+        string on_disk;
+        f->unchanged = disk_cache_get(&this->disk_cache, f->id, &on_disk) && on_disk == dumped;
     }
+    // a stale copy is only kept in memory, until the fresh chunk pushed after it replaces it
+    if (!f->unchanged && !f->stale)
+        disk_cache_put(&this->disk_cache, f->id, dumped);
+
+    shared_ptr<const string> data = make_shared<const string>(std::move(dumped));
 
     this->cache_mutex.lock();
-    for (uint64_t i = 0; i < *nbb; i++) {
-        int checkx = round((float)v[i][0]["minx"] * res),
-            checky = round((float)v[i][0]["miny"] * res);
+    if (pos_set && CHUNK_IS_STORED(f->id.x, f->id.y)) {
+        CHUNK_LVAL_UNCHECKED(f->id.x, f->id.y) = std::move(data);
+    } else {
+        // outside of the window, but still worth keeping in case the player comes this way
+        spill_put(f->id, std::move(data));
+    }
+    this->cache_mutex.unlock();
+}
 
-        if (CHUNK_IS_STORED(checkx, checky)) {
-            CHUNK_LVAL_UNCHECKED(checkx, checky) = make_unique<String>();
-            *CHUNK_LVAL_UNCHECKED(checkx, checky) = (String)v[i].dump().c_str();
-        }
+void GDClient::queue_revalidate(int x, int y) {
+    struct chunk_id id = CHUNK_ID(x, y);
+    if (!revalidating.insert(chunk_id_key(&id)).second)
+        return;
+
+    // not skipped when the chunk is already in flight: that fetch may have been sent before
+    // the copy on disk was handed to godot, and its result would then be dropped as outdated
+    queue_fetch_ids({ id });
+}
+
+int GDClient::open_disk_cache(String path, int64_t max_bytes) {
+#ifndef NO_GODOT
+    string p = path.utf8().get_data();
+#else
+    string p = path;
+#endif
+    int res = disk_cache_open(&this->disk_cache, p,
+                              max_bytes > 0 ? max_bytes : DISK_CACHE_DEFAULT_BYTES);
+    if (res) {
+        LOG_WARN("could not open disk cache %s", p.c_str());
+        return res;
     }
 
-    this->cache_mutex.unlock();
+    // if the server has already been queried, make sure the cache matches it
+    if (part_res > 0)
+        disk_cache_validate(&this->disk_cache, data_version, part_res);
 
-    return v;
+    return 0;
+}
+
+void GDClient::close_disk_cache() {
+    disk_cache_close(&this->disk_cache);
 }
 
 void GDClient::queue_fetch_bbox(float minx, float miny, float maxx, float maxy) {
+    int res = get_partition_info();
+
+    if (res < 0) {
+        LOG_WARN("could not get the server's chunk size");
+        return;
+    }
+
     struct bbox pp = { .minx = minx,
                        .miny = miny,
                        .maxx = maxx,
                        .maxy = maxy };
 
-    this->fetch_queue_guard.lock();
-    this->fetch_queue.push(pp);
-    this->fetch_queue_guard.unlock();
-
+    vector<struct chunk_id> ids;
+    get_bbox_chunk_ids(&pp, res, &ids);
+    queue_fetch_ids(ids);
 }
 
 void GDClient::queue_fetch_chunk(float x, float y) {
-    queue_fetch_bbox(x, y, x, y);
+    int res = get_partition_info();
+
+    if (res < 0) {
+        LOG_WARN("could not get the server's chunk size");
+        return;
+    }
+
+    // deduplicated against other fetches of the same chunk
+    struct chunk_id id = CHUNK_ID(floor(x * res), floor(y * res));
+
+    this->fetch_queue_guard.lock();
+    bool pending = chunk_in_flight(id);
+    this->fetch_queue_guard.unlock();
+
+    if (!pending)
+        queue_fetch_ids({ id });
 }
 
 bool GDClient::has_chunk(float x, float y) {
@@ -377,9 +1328,11 @@ bool GDClient::has_chunk(float x, float y) {
 
     this->cache_mutex.lock();
 
-    bool chunk_loaded = this->pos_set
-        && CHUNK_IS_STORED(checkx, checky)
-        && CHUNK_LVAL_UNCHECKED(checkx, checky);
+    bool chunk_loaded = (this->pos_set
+                         && CHUNK_IS_STORED(checkx, checky)
+                         && CHUNK_LVAL_UNCHECKED(checkx, checky))
+        || spill_peek(CHUNK_ID(checkx, checky))
+        || disk_cache_has(&this->disk_cache, CHUNK_ID(checkx, checky));
 
     this->cache_mutex.unlock();
 
@@ -396,26 +1349,130 @@ String GDClient::get_cached_chunk_info(float x, float y) {
 
     this->cache_mutex.lock();
 
-    if (!this->pos_set || !CHUNK_IS_STORED(checkx, checky)) {
+    if (this->pos_set && CHUNK_IS_STORED(checkx, checky) && CHUNK_LVAL_UNCHECKED(checkx, checky)) {
+        shared_ptr<const string> c_val = CHUNK_LVAL_UNCHECKED(checkx, checky);
         this->cache_mutex.unlock();
-        return (char*)NULL;
+        return to_godot_string(*c_val);
     }
 
-    if (CHUNK_LVAL_UNCHECKED(checkx, checky)) {
-        String c_val = *CHUNK_LVAL_UNCHECKED(checkx, checky);
+    if (shared_ptr<const string> spilled = spill_peek(CHUNK_ID(checkx, checky))) {
         this->cache_mutex.unlock();
-        return c_val;
+        return to_godot_string(*spilled);
     }
 
     this->cache_mutex.unlock();
     return (char*)NULL;
 }
 
+bool GDClient::set_chunk_distances(int render_dist, int lazy_dist) {
+    if (render_dist < 0 || lazy_dist < render_dist || lazy_dist > MAX_LAZY_DIST)
+        return false;
+
+    this->cache_mutex.lock();
+
+    // keep everything currently in the window in the spill cache, so the resized window can be
+    // refilled from it
+    if (pos_set) {
+        for (int i = 0; i < lazy_dim * lazy_dim; i++) {
+            spill_put(CHUNK_ID(CHUNK_INDEX_TO_X(i), CHUNK_INDEX_TO_Y(i)), std::move(chunks[i]));
+        }
+    }
+
+    this->render_dist = render_dist;
+    this->lazy_dist = lazy_dist;
+    this->lazy_dim = lazy_dist * 2 + 1;
+    chunks.clear();
+    chunks.resize(lazy_dim * lazy_dim);
+    pos_set = false;
+
+    this->cache_mutex.unlock();
+    return true;
+}
+
+void GDClient::set_spill_cache_bytes(int64_t bytes) {
+    this->cache_mutex.lock();
+    spill_budget = bytes > 0 ? bytes : 0;
+    spill_trim();
+    this->cache_mutex.unlock();
+}
+
+void GDClient::set_mesh_options(float units_per_metre, float default_height, float ground_offset,
+                                float point_size) {
+    this->mesh_queue_guard.lock();
+    this->mesh_options = {
+        .units_per_metre = units_per_metre,
+        .default_height = default_height,
+        .ground_offset = ground_offset,
+        .point_size = point_size,
+    };
+    this->mesh_queue_guard.unlock();
+}
+
+bool GDClient::set_fetch_workers(int count) {
+    if (count < 1 || count > MAX_FETCH_WORKERS)
+        return false;
+
+    this->fetch_worker_count = count;
+    return true;
+}
+
+void GDClient::set_prefetch(int budget, float lookahead_seconds) {
+    this->cache_mutex.lock();
+    prefetch_budget = budget > 0 ? budget : 0;
+    prefetch_seconds = lookahead_seconds > 0 ? lookahead_seconds : 0;
+    this->cache_mutex.unlock();
+}
+
+void GDClient::set_request_deadline(int ms) {
+    this->request_deadline_ms = ms > 0 ? ms : 0;
+}
+
+int64_t GDClient::get_prefetch_requested() {
+    return this->prefetch_requested;
+}
+
+int64_t GDClient::get_prefetch_hits() {
+    return this->prefetch_hits;
+}
+
+int64_t GDClient::get_prefetch_wasted() {
+    return this->prefetch_wasted;
+}
+
+int64_t GDClient::get_fetch_errors() {
+    return this->fetch_errors;
+}
+
+void GDClient::set_tracing(bool enabled) {
+    trace_set_enabled(enabled);
+}
+
+int GDClient::write_trace(String path) {
+#ifndef NO_GODOT
+    string p = path.utf8().get_data();
+#else
+    string p = path;
+#endif
+    ofstream f(p, ios::trunc);
+    if (!f)
+        return 1;
+    f << trace_dump_json();
+    return f.good() ? 0 : 2;
+}
+
+bool GDClient::set_mesh_workers(int count) {
+    if (count < 1 || count > MAX_MESH_WORKERS)
+        return false;
+
+    this->mesh_worker_count = count;
+    return true;
+}
+
 bool GDClient::move_chunk_center(float xx, float yy) {
     int res = get_partition_info();
 
     if (res < 0) {
-        printf("could not get chunk resolution\n");
+        LOG_WARN("could not get chunk resolution");
         return false;
     }
 
@@ -423,41 +1480,49 @@ bool GDClient::move_chunk_center(float xx, float yy) {
 
 
     this->cache_mutex.lock();
+    bool sampled = record_position(xx, yy);
     if (pos_set && chunkx == newx && chunky == newy) {
+        // the heading may still have changed
+        if (sampled)
+            plan_prefetch(res);
         this->cache_mutex.unlock();
         return false;
     }
-    printf("indeed setting center to %f %f\n", xx, yy);
+    LOG_DEBUG("indeed setting center to %f %f", xx, yy);
     // check if there was a previous player position and the new position was close
     // enough that some old chunks can be retained
-    if (pos_set && abs(newx - chunkx) < LAZY_DIM && abs(newy - chunky) < LAZY_DIM) {
-        int minx = max(chunkx - LAZY_DIST, newx - LAZY_DIST),
-            maxx = min(chunkx + LAZY_DIST, newx + LAZY_DIST),
-            miny = max(chunky - LAZY_DIST, newy - LAZY_DIST),
-            maxy = min(chunky + LAZY_DIST, newy + LAZY_DIST);
+    if (pos_set && abs(newx - chunkx) < lazy_dim && abs(newy - chunky) < lazy_dim) {
+        int minx = max(chunkx - lazy_dist, newx - lazy_dist),
+            maxx = min(chunkx + lazy_dist, newx + lazy_dist),
+            miny = max(chunky - lazy_dist, newy - lazy_dist),
+            maxy = min(chunky + lazy_dist, newy + lazy_dist);
 
-        for (int i = 0; i < N_CHUNKS; i++) {
+        for (int i = 0; i < lazy_dim * lazy_dim; i++) {
             int x = CHUNK_INDEX_TO_X(i),
                 y = CHUNK_INDEX_TO_Y(i);
-            if (x < minx || x > miny || y < miny || y > maxy) {
-                printf("got rid of chunk at (%d, %d)\n", x, y);
+            if (x < minx || x > maxx || y < miny || y > maxy) {
+                if (chunks[i])
+                    LOG_DEBUG("spilling chunk at (%d, %d)", x, y);
+                spill_put(CHUNK_ID(x, y), std::move(chunks[i]));
                 chunks[i] = NULL;
             }
 
         }
 
-        offx = (offx + newx - chunkx + LAZY_DIM) % LAZY_DIM;
-        offy = (offy + newy - chunky + LAZY_DIM) % LAZY_DIM;
+        offx = (offx + newx - chunkx + lazy_dim) % lazy_dim;
+        offy = (offy + newy - chunky + lazy_dim) % lazy_dim;
 
     } else {
-        printf("clearing chunks store\n");
-        // otherwise clear chunks of all stored info
-        for (int i = 0; i < N_CHUNKS; i++) {
+        LOG_DEBUG("clearing chunks store");
+        // otherwise move all stored chunks to the spill cache
+        for (int i = 0; i < lazy_dim * lazy_dim; i++) {
+            if (pos_set)
+                spill_put(CHUNK_ID(CHUNK_INDEX_TO_X(i), CHUNK_INDEX_TO_Y(i)), std::move(chunks[i]));
             chunks[i] = NULL;
         }
         // and reset offself values
-        offx = LAZY_DIST;
-        offy = LAZY_DIST;
+        offx = lazy_dist;
+        offy = lazy_dist;
 
         pos_set = true;
     }
@@ -465,27 +1530,90 @@ bool GDClient::move_chunk_center(float xx, float yy) {
     chunkx = newx;
     chunky = newy;
 
-    for (int x = chunkx - RENDER_DIST; x <= chunkx + RENDER_DIST; x++) {
-        for (int y = chunky - RENDER_DIST; y <= chunky + RENDER_DIST; y++) {
-            if (CHUNK_LVAL_UNCHECKED(x, y) == NULL) {
-                printf("loading chunk at (%d, %d)\n", x, y);
-
-                struct bbox pp = { .minx = (float)(((double)x + 0.5) / (double)res),
-                                   .miny = (float)(((double)y + 0.5) / (double)res),
-                                   .maxx = (float)(((double)x + 0.5) / (double)res),
-                                   .maxy = (float)(((double)y + 0.5) / (double)res) };
+    // chunks of the render window that have to come from the server, indexed relative to its
+    // minimum corner
+    int render_dim = render_dist * 2 + 1;
+    vector<bool> missing(render_dim * render_dim, false);
+    bool any_missing = false;
 
-                this->fetch_queue_guard.lock();
-                this->fetch_queue.push(pp);
-                this->fetch_queue_guard.unlock();
+    for (int x = chunkx - render_dist; x <= chunkx + render_dist; x++) {
+        for (int y = chunky - render_dist; y <= chunky + render_dist; y++) {
+            if (CHUNK_LVAL_UNCHECKED(x, y) == NULL) {
+                // promoted chunks are handed to the worker thread to be decoded & sent to godot
+                struct chunk_id id = CHUNK_ID(x, y);
+                shared_ptr<const string> local = spill_take(id);
+                bool from_disk = false;
+                if (local) {
+                    LOG_DEBUG("promoting spilled chunk at (%d, %d)", x, y);
+                    if (prefetched.erase(chunk_id_key(&id)))
+                        this->prefetch_hits++;
+                } else {
+                    string on_disk;
+                    if (disk_cache_get(&this->disk_cache, CHUNK_ID(x, y), &on_disk)) {
+                        LOG_DEBUG("loading chunk at (%d, %d) from disk cache", x, y);
+                        local = make_shared<const string>(std::move(on_disk));
+                        from_disk = true;
+                    }
+                }
+                if (local) {
+                    CHUNK_LVAL_UNCHECKED(x, y) = local;
+                    push_fetch_task({ .ids = { id }, .cached = local });
+                    // queued after the cached copy, so a changed chunk is always sent last
+                    if (from_disk)
+                        queue_revalidate(x, y);
+                    continue;
+                }
+
+                missing[(x - chunkx + render_dist) + (y - chunky + render_dist) * render_dim] = true;
+                any_missing = true;
+            } else {
+                // prefetched into the lazy window ahead of the player, but not yet sent to godot
+                struct chunk_id id = CHUNK_ID(x, y);
+                if (prefetched.erase(chunk_id_key(&id))) {
+                    this->prefetch_hits++;
+                    shared_ptr<const string> local = CHUNK_LVAL_UNCHECKED(x, y);
+                    push_fetch_task({ .ids = { id }, .cached = local });
+                }
             }
         }
     }
 
+    if (any_missing)
+        queue_missing_chunks(&missing, render_dim, chunkx - render_dist, chunky - render_dist);
+
+    // planned after the window's own requests so those are queued first
+    plan_prefetch(res);
+
     this->cache_mutex.unlock();
     return true;
 }
 
+void GDClient::queue_missing_chunks(vector<bool>* missing, int dim, int minx, int miny) {
+    vector<struct chunk_id> ids;
+
+    // chunks requested by an earlier move which haven't arrived yet will still arrive
+    this->fetch_queue_guard.lock();
+    for (int i = 0; i < dim * dim; i++) {
+        if (!(*missing)[i])
+            continue;
+
+        struct chunk_id id = CHUNK_ID(minx + i % dim, miny + i / dim);
+        if (chunk_in_flight(id)) {
+            LOG_DEBUG("chunk at (%d, %d) already in flight", id.x, id.y);
+            continue;
+        }
+        ids.push_back(id);
+    }
+    this->fetch_queue_guard.unlock();
+
+    if (ids.empty())
+        return;
+
+    // every missing chunk goes in one request, however scattered they are
+    LOG_DEBUG("loading %zu chunks around (%d, %d)", ids.size(), minx + dim / 2, miny + dim / 2);
+    queue_fetch_ids(ids);
+}
+
 
 // ------------------------------------------------------------------------- //
 // boilerplate initialization functions copied from godot c++ extension docs //
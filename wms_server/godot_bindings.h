@@ -5,8 +5,16 @@
 
 #include <memory>
 #include <queue>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 
 #include <nlohmann/json.hpp>
 
@@ -15,32 +23,98 @@
 #ifndef NO_GODOT
 #include <godot_cpp/core/class_db.hpp>
 #include <godot_cpp/classes/ref.hpp>
+#include <godot_cpp/variant/array.hpp>
+#include <godot_cpp/variant/dictionary.hpp>
 #endif
 
 #include "sockpp/tcp_connector.h"
 #include "wms.h"
+#include "cbor.h"
+#include "shard_map.h"
+#include "disk_cache.h"
+#include "chunk_geometry.h"
+#include "mesh_builder.h"
+#include "mpsc_queue.h"
+#include "trace.h"
 
+// default distances for the chunk window around the player; both can be changed at runtime with
+// set_chunk_distances()
+//
 // how many chunks around the player will be actively fetched from the server
 // these should be the chunks the client attempts to render, or a superset of them
-#define RENDER_DIST 1
+#define DEFAULT_RENDER_DIST 1
 // how many chunks around the player will not be actively fetched, but will remain in cached
 // in memory if previously fetched
-#define LAZY_DIST 2
-// so with RENDER_DIST 1 and LAZY_DIST 2 it would look like this around the player (X):
+#define DEFAULT_LAZY_DIST 2
+// so with a render distance of 1 and a lazy distance of 2 it would look like this around the
+// player (X):
 // LLLLL
 // LRRRL
 // LRXRL
 // LRRRL
 // LLLLL
+// the total 1 dimensional length of the chunk store array (lazy_dim) is then 5, for 25 chunks
 
-// derived values, LAZY_DIM is the total 1 dimensional length of the chunk store array
-// see the example above: it is a 5x5 grid total because LAZY_DIM is 5
-#define LAZY_DIM (LAZY_DIST * 2 + 1)
-// & the total number elements
-#define N_CHUNKS (LAZY_DIM * LAZY_DIM)
+// upper bound on the lazy distance, to stop a script accidentally asking for a huge window
+#define MAX_LAZY_DIST 64
+
+// default byte budget for the spill cache of chunks which have left the lazy window; can be
+// changed at runtime with set_spill_cache_bytes()
+#define DEFAULT_SPILL_CACHE_BYTES (64LL << 20)
+
+// number of connections to the server, each with its own fetch worker thread; can be changed with
+// set_fetch_workers() before connecting. note each connection takes up one of the server's
+// MAX_CLIENTS slots
+#define DEFAULT_FETCH_WORKERS 4
+#define MAX_FETCH_WORKERS 16
+
+// predictive prefetch defaults; both can be changed with set_prefetch()
+//
+// most chunks that may be queued or in flight for prefetching at once (0 disables prefetching)
+#define DEFAULT_PREFETCH_BUDGET 8
+// how far ahead along the player's path to prefetch, in seconds of travel at the current speed
+#define DEFAULT_PREFETCH_SECONDS 3.0f
+
+// how long the server is given to answer the chunks the player needs, in ms, before it answers
+// the ones it hasn't finished with an older copy or as pending, and pushes them once they are
+// done; can be changed with set_request_deadline()
+#define DEFAULT_REQUEST_DEADLINE_MS 200
+// how often idle fetch workers look for chunks pushed to their connections
+#define PUSH_POLL_MS 50
+// how many positions are kept to estimate the player's velocity, how far apart they are sampled,
+// and how far back the estimate looks
+#define PREFETCH_HISTORY 16
+#define PREFETCH_SAMPLE_INTERVAL std::chrono::milliseconds(50)
+#define PREFETCH_HISTORY_WINDOW std::chrono::milliseconds(1000)
+
+// number of threads chunk meshes are built on; can be changed with set_mesh_workers() before
+// connecting
+#define DEFAULT_MESH_WORKERS 2
+#define MAX_MESH_WORKERS 16
+
+// default scales for built meshes, matching the constants in controller.gd; can be changed with
+// set_mesh_options()
+#define DEFAULT_MESH_UNITS_PER_METRE (60000.0f / 111320.0f)
+#define DEFAULT_MESH_DEFAULT_HEIGHT 10.0f
+#define DEFAULT_MESH_GROUND_OFFSET 0.01f
+#define DEFAULT_MESH_POINT_SIZE 1.0f
+
+// default per call budget of drain_chunks(); one chunk is always returned if any are ready, even
+// if it is over budget on its own
+#define DEFAULT_DRAIN_BYTES (8LL << 20)
 
 #ifdef NO_GODOT
 typedef std::string String;
+
+// stand in for the Dictionary of each chunk returned by drain_chunks()
+struct delivered_chunk {
+    float x, y;
+    size_t bytes;
+    size_t points, lines, polygons, surfaces;
+};
+typedef std::vector<struct delivered_chunk> ChunkArray;
+#else
+typedef godot::Array ChunkArray;
 #endif
 
 namespace godot {
@@ -53,57 +127,374 @@ namespace godot {
         GDCLASS(GDClient, RefCounted)
 #endif
     private:
-        // mutex for use of socket
+        // a connection to the server
         // because we expect a certain return type after making a request from the server,
-        // we enforce a socket mutex so multiple threads can't interleave sent packets
+        // each connection has its own mutex so multiple threads can't interleave sent packets
         // nor fight over recieved ones
+        struct server_connection {
+            std::mutex guard;
+            sockpp::tcp_connector conn;
+            // when the server is sharded, the connections of the same worker to the other shards
+            // by "host:port", opened the first time a chunk is routed to each; together these
+            // make up a pool of connections per shard, one from each worker
+            std::mutex shards_guard;
+            std::unordered_map<std::string, std::shared_ptr<struct server_connection>> shards;
+            // chunks the server answered as pending, which it pushes once they are done, and the
+            // layers of chunks being streamed, by key, each put together as [header, layers...];
+            // both only used with guard held
+            std::unordered_set<uint64_t> pending;
+            std::unordered_map<uint64_t, nlohmann::json> streaming;
+            // whether pending has anything in it, for checking without guard
+            std::atomic_bool awaiting_pushes = false;
+        };
+        // pool of connections to the server connected to; fetch worker i uses connections[i],
+        // and blocking calls made from godot's thread share connections[0]. the pool is only
+        // resized by connect_to_server() while no workers are running
+        std::vector<std::unique_ptr<struct server_connection>> connections;
+        int fetch_worker_count = DEFAULT_FETCH_WORKERS;
+        // protects connected & opening / closing the pool
         std::mutex socket_mutex;
-        sockpp::tcp_connector conn;
         std::string host;
         in_port_t port;
         // whether connected to the server
-        bool connected;
+        bool connected = false;
 
         // storage for the local chunk cache; we protect all cache operations with a mutex
         // to prevent worker thread writing old values to cache after the player position has
         // been moved and so on
+        //
+        // chunks are held as the json text recieved from the server, shared so they can be
+        // handed to the worker thread without copying
         std::mutex cache_mutex;
-        std::unique_ptr<String> chunks[N_CHUNKS] = { NULL };
+        // ring indexed window of lazy_dim * lazy_dim chunks around the player
+        std::vector<std::shared_ptr<const std::string>> chunks;
+        int render_dist = DEFAULT_RENDER_DIST;
+        int lazy_dist = DEFAULT_LAZY_DIST;
+        int lazy_dim = DEFAULT_LAZY_DIST * 2 + 1;
         uint32_t offx, offy;
         bool pos_set;
         int64_t chunkx, chunky;
-        int part_res = -1;
-
-        // the GDClient has a second worker thread responsible for issuing requests to the server
-        // asynchronously, so the client does not lag waiting. to this end, a producer/consumer
-        // queue of points to fetch is maintained, and once fetched the worker will attempt
-        // to update the cache with fetched points (cache will not update if the player has since
-        // moved so requested chunks are no longer loaded). the worker thread uses "chunk_loaded"
-        // signal to notify the GODOT app that updates have been recieved
-        std::thread fetch_handler;
+        // read by every worker thread, so atomic
+        std::atomic_int part_res = -1;
+
+        // second tier of the cache: chunks that leave the lazy window (or are fetched outside of
+        // it) are kept here in least recently used order, up to spill_budget bytes, and are moved
+        // back into the window when the player returns without another trip to the server
+        // (also protected by cache_mutex)
+        struct spill_entry {
+            struct chunk_id id;
+            std::shared_ptr<const std::string> data;
+        };
+        std::list<struct spill_entry> spill_lru;
+        std::unordered_map<uint64_t, std::list<struct spill_entry>::iterator> spill_index;
+        size_t spill_bytes = 0;
+        size_t spill_budget = DEFAULT_SPILL_CACHE_BYTES;
+
+        // optional third tier: chunks persisted to disk across sessions (see disk_cache.h). chunks
+        // found here are used straight away, but are also queued to be fetched again in the
+        // background; the keys of those chunks are held in revalidating (under cache_mutex) so
+        // the refetched copy only notifies godot if it differs from what was on disk
+        struct disk_cache disk_cache;
+        std::unordered_set<uint64_t> revalidating;
+        // data version reported by the server with the partition info
+        std::atomic_uint32_t data_version = 0;
+
+        // which shard each chunk is fetched from (see shard_map.h), as advertised with the
+        // partition info; empty when the server isn't sharded. replaced whole when the server
+        // reports a different shard list, so readers keep a consistent copy
+        std::mutex shard_guard;
+        std::shared_ptr<const struct shard_map> shard_ring = std::make_shared<const struct shard_map>();
+
+        std::shared_ptr<const struct shard_map> get_shard_map();
+
+        // asks the server on connection c for its partition info & shard list, updating the
+        // cache & shard map to match
+        // returns the partition resolution, or -1 on failure
+        int query_partition_info(struct server_connection* c);
+
+        // worker c's connection to a shard, connecting to it if need be; c itself if the shard is
+        // the server c is connected to. NULL if it can't be reached
+        std::shared_ptr<struct server_connection> shard_connection(struct server_connection* c,
+                                                                   const struct shard_address& shard);
+        // forgets a broken shard connection of worker c, so the next request reconnects
+        void drop_shard_connection(struct server_connection* c, struct server_connection* shard);
+
+        // spill cache helpers, cache_mutex must be held when calling these
+        //
+        // stores a chunk at the front of the lru list, evicting the oldest entries past the budget
+        void spill_put(struct chunk_id id, std::shared_ptr<const std::string> data);
+        // removes and returns a chunk from the spill cache (NULL if not present)
+        std::shared_ptr<const std::string> spill_take(struct chunk_id id);
+        // returns a chunk from the spill cache without removing it, marking it as recently used
+        std::shared_ptr<const std::string> spill_peek(struct chunk_id id);
+        // evicts from the back of the lru list until the cache is within budget
+        void spill_trim();
+
+        // chunks ready to be handed to godot. mesh workers push onto a lock-free queue (so
+        // they never wait on godot's thread), and godot takes them off in budgeted batches with
+        // drain_chunks(), so a burst of arrivals is spread over several frames instead of all
+        // being integrated in whichever frame they land in
+        struct ready_chunk : mpsc_node {
+            float x, y;
+            // rough size of the chunk's geometry & mesh, for the drain budget
+            size_t bytes;
+#ifndef NO_GODOT
+            // see queue_fetch_chunk() for the layout
+            godot::Dictionary geometry;
+#else
+            struct delivered_chunk summary;
+#endif
+        };
+        struct mpsc_queue ready_queue;
+        std::atomic_int64_t ready_count = 0;
+        std::atomic_int64_t ready_bytes = 0;
+
+        // queues a decoded chunk and its mesh for delivery to godot, converting them to godot
+        // types first; called from the mesh worker threads
+        void notify_chunk_loaded(const struct chunk_geometry& geom, const struct chunk_mesh& mesh);
+
+        // frees every chunk waiting for delivery; must not race with drain_chunks()
+        void clear_ready_chunks();
+
+        // the GDClient has a pool of worker threads responsible for issuing requests to the
+        // server asynchronously, so the client does not lag waiting, and so several chunks can be
+        // in flight at once. to this end, a producer/consumer queue of points to fetch is
+        // maintained, and once fetched the workers will attempt to update the cache with fetched
+        // points (cache will not update if the player has since moved so requested chunks are no
+        // longer loaded). the workers decode the chunks they recieve and pass them on to be built
+        // into meshes, after which they are queued for the GODOT app to collect with
+        // drain_chunks()
+        //
+        // chunks which are already held locally but which godot needs to be sent (eg. promoted
+        // from the spill / disk cache) also go through this queue, so decoding them never
+        // happens on the caller's (main) thread
+        struct fetch_task {
+            // chunks to request from the server, all in one request; server fetches are
+            // tracked in in_flight until their responses are merged. for a cached task, the one
+            // chunk it holds
+            std::vector<struct chunk_id> ids;
+            // contents of a locally held chunk to decode; NULL to request ids from the server
+            std::shared_ptr<const std::string> cached;
+            // order the task was queued in (see delivered)
+            uint64_t seq;
+            // a speculative fetch ahead of the player (see move_chunk_center()); its chunks are
+            // only sent to godot once they enter the render window
+            bool prefetch;
+            // trace request id (see trace.h), assigned when queued
+            uint64_t request_id;
+        };
+        std::vector<std::thread> fetch_workers;
         std::mutex fetch_queue_guard;
-        std::queue<struct bbox> fetch_queue;
-        // control boolean, can be set to false to halt the worker loop and allow the thread to
+        std::condition_variable fetch_queue_cv;
+        std::queue<struct fetch_task> fetch_queue;
+        // low priority queue of prefetches, only taken from when fetch_queue is empty; replaced
+        // wholesale each time the prefetch is planned again
+        std::queue<struct fetch_task> prefetch_queue;
+        // number of queued or in progress server fetches covering each chunk (by key), so chunks
+        // that are already on their way aren't requested again (under fetch_queue_guard)
+        std::unordered_map<uint64_t, uint32_t> in_flight;
+        std::atomic_uint64_t fetch_seq = 0;
+
+        // with several workers, two tasks for the same chunk (eg. a copy read from disk and its
+        // revalidation) can finish out of order; the seq of the newest task delivered for each
+        // chunk, and how many of its layers had arrived (as a streamed chunk is delivered again
+        // with each layer), is kept here so an older one arriving late is dropped instead of
+        // overwriting it. delivery happens under delivered_guard
+        std::mutex delivered_guard;
+        std::unordered_map<uint64_t, std::pair<uint64_t, uint32_t>> delivered;
+
+        // queues a task, assigning its seq and marking the chunks of server fetches in flight
+        void push_fetch_task(struct fetch_task task);
+
+        // predictive prefetch: recent player positions (under cache_mutex) are used to estimate
+        // velocity, and the chunks along the extrapolated path are fetched at low priority into
+        // the cache ahead of the player
+        struct position_sample {
+            float x, y;
+            std::chrono::steady_clock::time_point time;
+        };
+        struct position_sample position_history[PREFETCH_HISTORY];
+        size_t position_count = 0;
+        int prefetch_budget = DEFAULT_PREFETCH_BUDGET;
+        std::atomic_uint32_t request_deadline_ms = DEFAULT_REQUEST_DEADLINE_MS;
+        float prefetch_seconds = DEFAULT_PREFETCH_SECONDS;
+        // prefetches queued or in flight
+        std::atomic_int prefetch_outstanding = 0;
+        // keys of prefetched chunks held in the cache that godot hasn't been sent yet (under
+        // cache_mutex); a chunk leaves this set as a hit when the player reaches it, or as waste
+        // when it is evicted first
+        std::unordered_set<uint64_t> prefetched;
+        std::atomic_uint64_t prefetch_requested = 0;
+        std::atomic_uint64_t prefetch_hits = 0;
+        std::atomic_uint64_t prefetch_wasted = 0;
+
+        // server requests that failed (no response, or a malformed one) & chunks that could not
+        // be decoded
+        std::atomic_uint64_t fetch_errors = 0;
+
+        // records a player position, returning false if it was too soon after the last sample
+        // cache_mutex must be held when calling this
+        bool record_position(float x, float y);
+
+        // replaces the queued prefetches with the chunks along the predicted path
+        // cache_mutex must be held when calling this
+        void plan_prefetch(int res);
+
+        // whether a chunk is in the render window around the player
+        // cache_mutex must be held when calling this
+        bool chunk_in_render(struct chunk_id id);
+
+        // a chunk as answered by the server
+        //
+        // the layers of a chunk the server has to fetch first are streamed as they are converted
+        // (see CHUNK_REQUEST_STREAM_LAYERS in cbor.h); on_chunk is then also called as each one
+        // arrives, with partial set and data holding the layers so far, before the chunk's
+        // answer, which is complete
+        struct fetched_chunk {
+            struct chunk_id id;
+            // CHUNK_STATUS_* (see cbor.h); CHUNK_STATUS_STREAMED answers are passed on as
+            // CHUNK_STATUS_OK, with streamed set
+            int status;
+            // the chunk's geojson, with CHUNK_STATUS_OK
+            nlohmann::json data;
+            // whether the chunk was a revalidation of a chunk read from the disk cache that
+            // turned out to be identical
+            bool unchanged;
+            // more layers of the chunk are still to come
+            bool partial;
+            // the chunk was put together from layers already passed on as partial chunks, the
+            // last of which had all of data
+            bool streamed;
+            // an older copy of the chunk, answered as the fresh one wasn't ready by the request's
+            // deadline; the fresh chunk is pushed later, and replaces it
+            bool stale;
+        };
+
+        // called by a worker once a prefetched chunk has been merged into the cache
+        void finish_prefetch(const struct fetched_chunk* f, uint64_t seq);
+
+        // queues server requests for ids, MAX_CHUNK_REQUEST_IDS at a time
+        void queue_fetch_ids(const std::vector<struct chunk_id>& ids);
+
+        // queues a server request for the chunks flagged in missing, a dim by dim grid starting
+        // at chunk minx, miny; chunks already in flight are skipped. cache_mutex must be held
+        // when calling this
+        void queue_missing_chunks(std::vector<bool>* missing, int dim, int minx, int miny);
+
+        // whether a chunk has a server fetch queued or in progress
+        // fetch_queue_guard must be held when calling this
+        bool chunk_in_flight(struct chunk_id id);
+        // control boolean, can be set to false to halt the worker loops and allow the threads to
         // be joined
         std::atomic_bool run_thread = true;
 
+        // decoded chunks are handed from the fetch worker to a small pool of mesh workers, which
+        // triangulate / extrude them (see mesh_builder.h) and queue them for delivery;
+        // this keeps both the heavy geometry work and the network round trips off godot's main
+        // thread, and stops a large chunk from holding up fetching of the next one
+        std::vector<std::thread> mesh_workers;
+        int mesh_worker_count = DEFAULT_MESH_WORKERS;
+        std::mutex mesh_queue_guard;
+        std::condition_variable mesh_queue_cv;
+        struct mesh_task {
+            std::unique_ptr<struct chunk_geometry> geom;
+            struct chunk_id id;
+            // seq & trace request id of the fetch task the geometry came from
+            uint64_t seq;
+            uint64_t request_id;
+            // layers of the chunk in geom (see delivered)
+            uint32_t layers;
+        };
+        std::queue<struct mesh_task> mesh_queue;
+        // protected by mesh_queue_guard
+        struct mesh_build_options mesh_options = {
+            .units_per_metre = DEFAULT_MESH_UNITS_PER_METRE,
+            .default_height = DEFAULT_MESH_DEFAULT_HEIGHT,
+            .ground_offset = DEFAULT_MESH_GROUND_OFFSET,
+            .point_size = DEFAULT_MESH_POINT_SIZE,
+        };
+
+        // hands a decoded chunk, holding layers of the chunk's layers, to the mesh workers
+        void queue_mesh_build(std::unique_ptr<struct chunk_geometry> geom, struct chunk_id id,
+                              uint64_t seq, uint32_t layers);
+
+        // stops & joins the fetch and mesh worker threads
+        void stop_workers();
+
         // internal function for sending & recieving actual packets to server for chunk info,
-        // AFTER it has been verified the chunk is not already stored locally
+        // AFTER it has been verified the chunks are not already stored locally. ids must be
+        // distinct. on_chunk is called with each chunk as it arrives, in whatever order the
+        // server finishes them; the connection is held until every chunk has been answered
         // note that this function also will not make any updates to the chunk cache after fetching
         // data; this function is totally cache-ignorant
-        std::unique_ptr<nlohmann::json[]> get_chunk_info_unchecked(struct bbox bbox,
-                                                                   uint64_t* nbb);
+        // returns 0 once every chunk has been answered, otherwise an error code
+        // with a deadline_ms (0 for none), chunks the server can't finish in time are answered
+        // with an older copy or as CHUNK_STATUS_PENDING, and pushed later (see handle_pushed_chunk)
+        int request_chunks_unchecked(struct server_connection* c,
+                                     const std::vector<struct chunk_id>& ids,
+                                     const std::function<void(struct fetched_chunk*)>& on_chunk,
+                                     uint32_t deadline_ms = 0);
+
+        // the two halves of request_chunks_unchecked, for when several requests are in flight at
+        // once; c->guard must be held from sending a request until its answers have been read
+        int send_chunk_request(struct server_connection* c, const std::vector<struct chunk_id>& ids,
+                               uint32_t deadline_ms = 0);
+        int read_chunk_answers(struct server_connection* c, size_t n,
+                               const std::function<void(struct fetched_chunk*)>& on_chunk);
+
+        // what decode_chunk_packet() found
+        enum chunk_packet_kind {
+            // the answer for a chunk of the request being read
+            CHUNK_PACKET_ANSWER,
+            // a layer of a chunk of the request being read
+            CHUNK_PACKET_PARTIAL,
+            // a chunk (or a layer of one) answered as pending earlier, pushed by the server
+            CHUNK_PACKET_PUSH,
+        };
+        // decodes a CHUNK, CHUNK_LAYER or CHUNK_PUSH packet read from c into f, keeping track of
+        // the chunks c is streaming & has pending; c->guard must be held
+        // returns 0 on success, otherwise an error code
+        int decode_chunk_packet(struct server_connection* c, struct packet* packet,
+                                struct fetched_chunk* f, enum chunk_packet_kind* kind);
 
-        // wraper around get_chunk_info_unchecked that will also check cache & update it after
-        // recieving results
-        std::unique_ptr<nlohmann::json[]> get_bbox_info(struct bbox bbox, uint64_t* nbb);
+        // caches a pushed chunk, and sends it to godot if it is still in the render window
+        void handle_pushed_chunk(struct fetched_chunk* f);
 
-        // loop method for worker thread
+        // reads whatever chunks have been pushed to c and its shard connections, without waiting;
+        // connections in use by another thread are skipped, as it reads their pushes itself
+        void read_pushes(struct server_connection* c);
+
+        // as request_chunks_unchecked, but splits the ids between the shards owning them and
+        // requests each part from its shard, all at once, over worker c's connections
+        int request_routed_chunks(struct server_connection* c,
+                                  const std::vector<struct chunk_id>& ids,
+                                  const std::function<void(struct fetched_chunk*)>& on_chunk,
+                                  uint32_t deadline_ms = 0);
+
+        // wraper around request_routed_chunks that will also update the cache with each chunk
+        // before it is passed to on_chunk. chunks a shard says have moved are asked for again
+        // once the shard list has been refreshed
+        // the request is sent on connection c, or on connections[0] if c is NULL
+        int fetch_chunks(const std::vector<struct chunk_id>& ids,
+                         const std::function<void(struct fetched_chunk*)>& on_chunk,
+                         struct server_connection* c = NULL, uint32_t deadline_ms = 0);
+
+        // merges a chunk recieved from the server into the cache, setting f->unchanged
+        void store_fetched_chunk(struct fetched_chunk* f);
+
+        // queues a background refetch of a chunk that was served from the disk cache
+        // cache_mutex must be held when calling this
+        void queue_revalidate(int x, int y);
+
+        // loop method for fetch worker threads, each sending requests on its own connection c
         //
-        // the GDClient will create and handle a second thread responsible for sending requests
-        // to the connected geosdata server; after processing each request, the GDClient will
-        // issue the "chunk_loaded" signal, which should be handled by godot.
-        void spin_handle();
+        // the GDClient will create and handle these threads, responsible for sending requests
+        // to the connected geosdata server; the chunks of each request end up being queued for
+        // godot to collect with drain_chunks().
+        void spin_handle(struct server_connection* c);
+
+        // loop method for the mesh worker threads
+        void mesh_handle();
 
     protected:
 
@@ -129,9 +520,71 @@ namespace godot {
         // of lattitude or longitude (division by unit area is this squared)
         //
         // eg. a result of 100 indicates chunk bounding boxes of 0.01 by 0.01 degrees
+        //
+        // if the server can't be reached, the resolution recorded in the disk cache is used
         int get_partition_info();
 
-        // return whether a chunk is currently stored locally in cache
+        // changes how many chunks around the player are fetched (render_dist) and kept in the
+        // window (lazy_dist); lazy_dist must be at least render_dist. chunks currently in the
+        // window are moved to the spill cache, and the window is refilled from it on the next
+        // call to move_chunk_center()
+        // returns false if the distances are invalid
+        bool set_chunk_distances(int render_dist, int lazy_dist);
+
+        // sets the byte budget of the spill cache behind the chunk window; 0 disables it
+        void set_spill_cache_bytes(int64_t bytes);
+
+        // opens (or creates) a persistent chunk cache at path, of at most max_bytes (0 for the
+        // default size); chunks fetched from the server are saved to it, and it is checked before
+        // fetching chunks, including when the server can't be reached
+        // returns 0 on success, otherwise an error code
+        int open_disk_cache(String path, int64_t max_bytes);
+
+        // flushes & closes the persistent chunk cache
+        void close_disk_cache();
+
+        // sets the scales used when building chunk meshes (see mesh_build_options in
+        // mesh_builder.h); applies to chunks built after the call
+        void set_mesh_options(float units_per_metre, float default_height, float ground_offset,
+                              float point_size);
+
+        // sets how many connections / fetch workers are used; takes effect on the next
+        // connect_to_server()
+        // returns false if count is out of range
+        bool set_fetch_workers(int count);
+
+        // sets the predictive prefetch budget (most chunks queued or in flight at once, 0 to
+        // disable) and how many seconds of travel ahead of the player to prefetch
+        void set_prefetch(int budget, float lookahead_seconds);
+
+        // sets how long, in ms, the server is given to answer the chunks the player needs before
+        // it sends what it has and pushes the rest later; 0 waits for every chunk
+        void set_request_deadline(int ms);
+
+        // prefetch counters: chunks requested, chunks that the player went on to reach (hits),
+        // and chunks evicted from the cache before being reached (wasted)
+        int64_t get_prefetch_requested();
+        int64_t get_prefetch_hits();
+        int64_t get_prefetch_wasted();
+
+        // number of server requests that failed and chunks that could not be decoded since the
+        // client was created; failed chunks are requested again the next time they are needed
+        int64_t get_fetch_errors();
+
+        // starts / stops recording spans of the client's work (see trace.h); while enabled,
+        // requests sent to the server carry their trace id, so they can be matched up with a
+        // trace from the server (see server_trace.cpp)
+        void set_tracing(bool enabled);
+
+        // writes the spans recorded so far to path as chrome trace json
+        // returns 0 on success, otherwise an error code
+        int write_trace(String path);
+
+        // sets how many threads build chunk meshes; takes effect on the next connect_to_server()
+        // returns false if count is out of range
+        bool set_mesh_workers(int count);
+
+        // return whether a chunk is currently stored locally in cache (in memory or on disk)
         bool has_chunk(float x, float y);
 
         // attempts to fetch info on the chunk which encloses the point provided
@@ -146,24 +599,58 @@ namespace godot {
         // if the chunk is not stored locally, will immediately return a NULL string
         String get_cached_chunk_info(float x, float y);
 
+        // takes chunks that are ready off the delivery queue, oldest first, stopping once their
+        // total size reaches max_bytes (0 for DEFAULT_DRAIN_BYTES) or at max_chunks chunks (0 for
+        // no limit). at least one chunk is returned whenever any are ready. meant to be
+        // called from godot's main thread every frame, with budgets sized to spread integration
+        // of bursts over several frames; must not be called from more than one thread at a time
+        //
+        // each chunk is a Dictionary of { "x", "y": minimum corner, "bytes": rough size,
+        // "geometry": Dictionary }, see queue_fetch_chunk() for the geometry layout
+        ChunkArray drain_chunks(int max_chunks, int64_t max_bytes);
+
+        // number & total rough size of chunks waiting to be drained
+        int64_t get_ready_chunk_count();
+        int64_t get_ready_chunk_bytes();
+
         // adds a chunk to the fetch queue; the chunk will be fetched asynchronously
-        // and a signal will be sent to "chunk_loaded" once the queue entry has been dealt with
+        // and queued for delivery (see drain_chunks()) once the queue entry has been dealt with
+        //
+        // delivered chunks come with their minimum x & y and a Dictionary of their geometry
+        // decoded into packed arrays (see chunk_geometry.h for the layout):
+        //   "minx", "miny", "maxx", "maxy": bounds of the chunk, in degrees
+        //   "origin_lon", "origin_lat": the point coordinates are relative to, in degrees
+        //   "points":   { "coords": PackedVector2Array of metres east & north of the origin,
+        //                 "features": PackedInt32Array }
+        //   "lines":    { "coords", "offsets": PackedInt32Array, "features" }
+        //   "polygons": { "coords", "ring_offsets", "polygon_offsets", "features" }
+        //   "features": { "osm_ids": PackedInt64Array, "kinds": PackedStringArray,
+        //                 "heights": PackedFloat32Array }
+        //   "mesh": ArrayMesh of the whole chunk, with vertices relative to the origin (see
+        //           mesh_builder.h)
+        //   "surface_materials": PackedInt32Array, material index of each surface of "mesh"
         //
         // note that if the client is unable to establish a connection to the server
-        // or if the player center has moved before the request is processed, the "chunk_loaded"
-        // signal may return NULL data. the client can reissue / ignore the request as needed
+        // or if the player center has moved before the request is processed, the chunk may
+        // never be delivered. the client can reissue / ignore the request as needed
         void queue_fetch_chunk(float x, float y);
 
         // as above, but for an arbitrary bounding box that may result in any number or
-        // chunk update signals being issued
+        // chunks being delivered (every chunk overlapping the box, sent as a single request)
         void queue_fetch_bbox(float minx, float miny, float maxx, float maxy);
 
         // updates the chunk store around a new player centre location
         // because x and y are rounded (floor) to the nearest chunk, values at the very edge
         // of the chunk should not be specified to avoid floating point rounding problems
-        // this function will discard chunk values no longer in the lazy box around the player,
-        // and attempt to fetch chunks in the render box around the player
-        // fetching is done asynchronously and will send the "chunk_loaded" signal when done
+        // this function will move chunk values no longer in the lazy box around the player into
+        // the spill cache, and attempt to fetch chunks in the render box around the player that
+        // are not already in either cache (chunks promoted from the spill cache are queued for
+        // delivery immediately)
+        // chunks that still have to be fetched are batched into a single server request of
+        // their ids, skipping any requested by an earlier move that are still in flight
+        // meant to be called every frame with the player's position: positions are also sampled
+        // to predict where the player is heading, and chunks along that path are prefetched
+        // fetching is done asynchronously and chunks are queued for delivery when done
         bool move_chunk_center(float x, float y);
     };
 }
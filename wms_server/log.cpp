@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <strings.h>
+#include <time.h>
+
+#include "log.h"
+
+using namespace std;
+
+struct log_entry {
+    // microseconds since the epoch
+    uint64_t time;
+    int level;
+    char msg[LOG_MESSAGE_MAX];
+};
+
+// single producer (the owning thread), single consumer (whichever thread is draining, one at a
+// time under drain_guard) ring of messages
+struct log_buffer {
+    // number of messages ever written; only the owning thread stores to it
+    atomic_uint64_t head = 0;
+    // number of messages ever drained; only the draining thread stores to it
+    atomic_uint64_t tail = 0;
+    // set once the owning thread has exited, after which the buffer is freed once drained
+    atomic_bool retired = false;
+    uint32_t tid;
+    struct log_entry entries[LOG_THREAD_BUFFER_MESSAGES];
+};
+
+// frees a thread's buffer (once drained) when the thread exits
+struct log_thread {
+    struct log_buffer* buffer = NULL;
+
+    ~log_thread() {
+        if (buffer)
+            buffer->retired.store(true, memory_order_release);
+    }
+};
+
+static const char* const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static int initial_log_level() {
+    const char* env = getenv("GEO_LOG_LEVEL");
+    if (!env)
+        return LOG_LEVEL_INFO;
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++)
+        if (!strcasecmp(env, level_names[i]))
+            return i;
+    return atoi(env);
+}
+
+atomic_int log_level = initial_log_level();
+
+// these are deliberately never freed, so the drain thread (which is never joined) & the flush at
+// exit can still use them while static objects are being destroyed
+static mutex& buffers_guard = *new mutex;
+static vector<struct log_buffer*>& buffers = *new vector<struct log_buffer*>;
+static mutex& drain_guard = *new mutex;
+
+static atomic_uint64_t dropped = 0;
+// dropped count as of the last drain, so each drain can report how many it missed
+static uint64_t dropped_reported = 0;
+static uint32_t next_tid = 1;
+static once_flag drain_thread_started;
+
+static thread_local struct log_thread this_thread_log;
+
+static void drain_thread() {
+    while (1) {
+        this_thread::sleep_for(chrono::milliseconds(LOG_DRAIN_INTERVAL_MS));
+        log_flush();
+    }
+}
+
+static struct log_buffer* get_buffer() {
+    if (this_thread_log.buffer)
+        return this_thread_log.buffer;
+
+    struct log_buffer* buffer = new struct log_buffer;
+    buffers_guard.lock();
+    buffer->tid = next_tid++;
+    buffers.push_back(buffer);
+    buffers_guard.unlock();
+    this_thread_log.buffer = buffer;
+
+    call_once(drain_thread_started, []() {
+        atexit(log_flush);
+        thread(drain_thread).detach();
+    });
+    return buffer;
+}
+
+void log_set_level(int level) {
+    log_level = level;
+}
+
+void log_message(int level, const char* fmt, ...) {
+    struct log_buffer* buffer = get_buffer();
+
+    uint64_t head = buffer->head.load(memory_order_relaxed);
+    if (head - buffer->tail.load(memory_order_acquire) >= LOG_THREAD_BUFFER_MESSAGES) {
+        dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_entry* e = &buffer->entries[head & (LOG_THREAD_BUFFER_MESSAGES - 1)];
+    e->time = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    e->level = clamp(level, LOG_LEVEL_DEBUG, LOG_LEVEL_ERROR);
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(e->msg, LOG_MESSAGE_MAX, fmt, args);
+    va_end(args);
+
+    buffer->head.store(head + 1, memory_order_release);
+}
+
+uint64_t log_dropped() {
+    return dropped.load(memory_order_relaxed);
+}
+
+// appends e to out as a line
+static void format_entry(string* out, const struct log_entry* e, uint32_t tid) {
+    time_t secs = e->time / 1000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+
+    char prefix[64];
+    int n = snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03d %-5s [%u] ", tm.tm_hour, tm.tm_min,
+                     tm.tm_sec, (int)(e->time % 1000000 / 1000), level_names[e->level], tid);
+    out->append(prefix, n);
+    out->append(e->msg);
+    // messages may or may not end in a newline of their own
+    if (out->back() != '\n')
+        out->push_back('\n');
+}
+
+void log_flush() {
+    // entries to write, with the buffer each came from
+    vector<pair<struct log_entry*, struct log_buffer*>> pending;
+    // each buffer's head as of the start of the drain
+    vector<pair<struct log_buffer*, uint64_t>> drained;
+    vector<struct log_buffer*> finished;
+
+    lock_guard<mutex> guard(drain_guard);
+
+    buffers_guard.lock();
+    for (size_t i = 0; i < buffers.size();) {
+        struct log_buffer* b = buffers[i];
+        // checked before reading the head, so a retired buffer's last messages are seen
+        bool retired = b->retired.load(memory_order_acquire);
+        uint64_t head = b->head.load(memory_order_acquire);
+        uint64_t tail = b->tail.load(memory_order_relaxed);
+
+        for (uint64_t n = tail; n < head; n++)
+            pending.push_back({ &b->entries[n & (LOG_THREAD_BUFFER_MESSAGES - 1)], b });
+        if (head != tail)
+            drained.push_back({ b, head });
+
+        if (retired) {
+            finished.push_back(b);
+            buffers[i] = buffers.back();
+            buffers.pop_back();
+        } else
+            i++;
+    }
+    buffers_guard.unlock();
+
+    // each buffer is already in order, but messages from different threads are interleaved
+    stable_sort(pending.begin(), pending.end(), [](const auto& a, const auto& b) {
+        return a.first->time < b.first->time;
+    });
+
+    string out;
+    for (const auto& [e, b] : pending)
+        format_entry(&out, e, b->tid);
+
+    uint64_t d = dropped.load(memory_order_relaxed);
+    if (d != dropped_reported) {
+        char msg[64];
+        out.append(msg, snprintf(msg, sizeof(msg), "log: dropped %lu messages\n", d - dropped_reported));
+        dropped_reported = d;
+    }
+
+    // the entries have been copied out, so the threads can reuse their slots
+    for (const auto& [b, head] : drained)
+        b->tail.store(head, memory_order_release);
+    for (struct log_buffer* b : finished)
+        delete b;
+
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+// leveled, asynchronous logging
+//
+//   LOG_INFO("connection with %s", peer.c_str());
+//
+// logging a message formats it into a buffer owned by the calling thread and returns; nothing is
+// written to stdout on the calling thread. each thread's buffer is a single producer, single
+// consumer ring, so logging never locks, allocates (past the first message on a thread) or waits
+// on the terminal, and is safe to do while holding locks other threads are waiting on. a
+// background thread drains every thread's buffer every LOG_DRAIN_INTERVAL_MS, writing the messages
+// out in the order they were logged. if a thread logs faster than that its buffer fills, and
+// further messages are dropped (and counted) rather than blocking it
+//
+// messages below LOG_COMPILE_LEVEL are removed at compile time, arguments and all, so debug
+// logging costs nothing in normal builds; build with -DLOG_COMPILE_LEVEL=LOG_LEVEL_DEBUG (0) to
+// keep it. above that, messages below the runtime level (log_set_level(), or the GEO_LOG_LEVEL env
+// var, eg. GEO_LOG_LEVEL=debug) are skipped before being formatted
+
+#include <atomic>
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+// longest message kept, including the terminator; longer messages are truncated
+#define LOG_MESSAGE_MAX 256
+// messages each thread can have waiting to be written; must be a power of two
+#define LOG_THREAD_BUFFER_MESSAGES 256
+#define LOG_DRAIN_INTERVAL_MS 10
+
+extern std::atomic_int log_level;
+
+void log_set_level(int level);
+
+// formats & queues a message; use the LOG_* macros rather than calling this directly
+void log_message(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// writes every queued message out on the calling thread, eg. before exiting. called automatically
+// at exit
+void log_flush();
+
+// number of messages dropped because their thread's buffer was full
+uint64_t log_dropped();
+
+#define LOG_AT(LEVEL, ...) \
+    do { \
+        if ((LEVEL) >= log_level.load(std::memory_order_relaxed)) \
+            log_message(LEVEL, __VA_ARGS__); \
+    } while (0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
@@ -0,0 +1,359 @@
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#include "mesh_builder.h"
+
+using namespace std;
+
+struct vec3 {
+    float x, y, z;
+};
+
+static inline double cross2(double ax, double ay, double bx, double by, double cx, double cy) {
+    return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+}
+
+// twice the signed area of a ring, positive when counter clockwise
+static double ring_area(const float* coords, const vector<int32_t>& ring) {
+    double area = 0;
+    for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+        area += (double)coords[ring[j] * 2] * coords[ring[i] * 2 + 1]
+            - (double)coords[ring[i] * 2] * coords[ring[j] * 2 + 1];
+    }
+    return area;
+}
+
+static bool point_in_triangle(const float* coords, int32_t a, int32_t b, int32_t c, int32_t p) {
+    double px = coords[p * 2], py = coords[p * 2 + 1];
+    double ax = coords[a * 2], ay = coords[a * 2 + 1];
+    double bx = coords[b * 2], by = coords[b * 2 + 1];
+    double cx = coords[c * 2], cy = coords[c * 2 + 1];
+    return cross2(ax, ay, bx, by, px, py) >= 0
+        && cross2(bx, by, cx, cy, px, py) >= 0
+        && cross2(cx, cy, ax, ay, px, py) >= 0;
+}
+
+static bool same_point(const float* coords, int32_t a, int32_t b) {
+    return coords[a * 2] == coords[b * 2] && coords[a * 2 + 1] == coords[b * 2 + 1];
+}
+
+// joins a (clockwise) hole into the (counter clockwise) outer polygon with a pair of coincident
+// bridge edges, from the hole's rightmost vertex to a vertex of the outer polygon visible from it
+static void eliminate_hole(const float* coords, vector<int32_t>* poly, const vector<int32_t>& hole) {
+    size_t m = 0;
+    for (size_t i = 1; i < hole.size(); i++) {
+        if (coords[hole[i] * 2] > coords[hole[m] * 2])
+            m = i;
+    }
+    double mx = coords[hole[m] * 2], my = coords[hole[m] * 2 + 1];
+
+    // cast a ray from m towards +x and find the closest edge it hits
+    double best_x = INFINITY;
+    ptrdiff_t bridge = -1;
+    for (size_t i = 0, n = poly->size(); i < n; i++) {
+        int32_t a = (*poly)[i], b = (*poly)[(i + 1) % n];
+        double ax = coords[a * 2], ay = coords[a * 2 + 1];
+        double bx = coords[b * 2], by = coords[b * 2 + 1];
+        if ((ay > my) == (by > my) || ay == by)
+            continue;
+        double x = ax + (my - ay) * (bx - ax) / (by - ay);
+        if (x < mx || x >= best_x)
+            continue;
+        best_x = x;
+        bridge = ax > bx ? i : (i + 1) % n;
+    }
+    if (bridge < 0)
+        return;
+
+    // a reflex vertex of the outer polygon may hide the chosen one; if any lie inside the
+    // triangle (m, hit point, bridge), use the one making the smallest angle with the ray
+    int32_t bv = (*poly)[bridge];
+    double bx = coords[bv * 2], by = coords[bv * 2 + 1];
+    double best_tan = INFINITY;
+    for (size_t i = 0, n = poly->size(); i < n; i++) {
+        int32_t v = (*poly)[i];
+        double vx = coords[v * 2], vy = coords[v * 2 + 1];
+        if (v == bv || vx < mx)
+            continue;
+        int32_t prev = (*poly)[(i + n - 1) % n], next = (*poly)[(i + 1) % n];
+        bool reflex = cross2(coords[prev * 2], coords[prev * 2 + 1], vx, vy,
+                             coords[next * 2], coords[next * 2 + 1]) < 0;
+        if (!reflex)
+            continue;
+        // inside triangle (m, (best_x, my), b), with the winding depending on which side b is
+        double s1 = cross2(mx, my, best_x, my, vx, vy);
+        double s2 = cross2(best_x, my, bx, by, vx, vy);
+        double s3 = cross2(bx, by, mx, my, vx, vy);
+        bool inside = (s1 >= 0 && s2 >= 0 && s3 >= 0) || (s1 <= 0 && s2 <= 0 && s3 <= 0);
+        if (!inside)
+            continue;
+        double t = fabs(vy - my) / (vx - mx);
+        if (t < best_tan) {
+            best_tan = t;
+            bridge = i;
+        }
+    }
+    bv = (*poly)[bridge];
+
+    vector<int32_t> merged;
+    merged.reserve(poly->size() + hole.size() + 2);
+    merged.insert(merged.end(), poly->begin(), poly->begin() + bridge + 1);
+    for (size_t i = 0; i <= hole.size(); i++)
+        merged.push_back(hole[(m + i) % hole.size()]);
+    merged.push_back(bv);
+    merged.insert(merged.end(), poly->begin() + bridge + 1, poly->end());
+    *poly = std::move(merged);
+}
+
+// ear clipping on a single counter clockwise polygon (which may contain bridge edges)
+static void clip_ears(const float* coords, const vector<int32_t>& poly, vector<int32_t>* tris) {
+    size_t n = poly.size();
+    if (n < 3)
+        return;
+
+    vector<size_t> prev(n), next(n);
+    for (size_t i = 0; i < n; i++) {
+        prev[i] = (i + n - 1) % n;
+        next[i] = (i + 1) % n;
+    }
+
+    size_t cur = 0, remaining = n, stalled = 0;
+    while (remaining > 3) {
+        int32_t a = poly[prev[cur]], b = poly[cur], c = poly[next[cur]];
+
+        bool ear = cross2(coords[a * 2], coords[a * 2 + 1], coords[b * 2], coords[b * 2 + 1],
+                          coords[c * 2], coords[c * 2 + 1]) > 0;
+        if (ear) {
+            for (size_t p = next[next[cur]]; p != prev[cur]; p = next[p]) {
+                int32_t v = poly[p];
+                if (same_point(coords, v, a) || same_point(coords, v, b) || same_point(coords, v, c))
+                    continue;
+                if (point_in_triangle(coords, a, b, c, v)) {
+                    ear = false;
+                    break;
+                }
+            }
+        }
+
+        // a whole lap without finding an ear means the polygon is degenerate (self intersecting
+        // or with collinear runs); clip anyway rather than give up on it
+        if (ear || stalled > remaining) {
+            tris->push_back(a);
+            tris->push_back(b);
+            tris->push_back(c);
+            next[prev[cur]] = next[cur];
+            prev[next[cur]] = prev[cur];
+            remaining--;
+            stalled = 0;
+            cur = next[cur];
+        } else {
+            stalled++;
+            cur = next[cur];
+        }
+    }
+
+    tris->push_back(poly[prev[cur]]);
+    tris->push_back(poly[cur]);
+    tris->push_back(poly[next[cur]]);
+}
+
+void triangulate_polygon(const float* coords, const vector<vector<int32_t>>& rings,
+                         vector<int32_t>* tris) {
+    if (rings.empty() || rings[0].size() < 3)
+        return;
+
+    vector<int32_t> poly = rings[0];
+    if (ring_area(coords, poly) < 0)
+        reverse(poly.begin(), poly.end());
+
+    vector<vector<int32_t>> holes;
+    for (size_t i = 1; i < rings.size(); i++) {
+        if (rings[i].size() < 3)
+            continue;
+        holes.push_back(rings[i]);
+        if (ring_area(coords, holes.back()) > 0)
+            reverse(holes.back().begin(), holes.back().end());
+    }
+
+    // holes are bridged in from right to left so earlier bridges never cross later ones
+    auto max_x = [coords](const vector<int32_t>& r) {
+        float m = -INFINITY;
+        for (int32_t v : r)
+            m = max(m, coords[v * 2]);
+        return m;
+    };
+    sort(holes.begin(), holes.end(), [&](const vector<int32_t>& a, const vector<int32_t>& b) {
+        return max_x(a) > max_x(b);
+    });
+    for (const vector<int32_t>& hole : holes)
+        eliminate_hole(coords, &poly, hole);
+
+    clip_ears(coords, poly, tris);
+}
+
+// ----- mesh assembly -----
+
+static struct mesh_surface* get_surface(struct chunk_mesh* mesh, uint8_t material,
+                                        mesh_primitive primitive) {
+    for (struct mesh_surface& s : mesh->surfaces) {
+        if (s.material == material && s.primitive == primitive)
+            return &s;
+    }
+    mesh->surfaces.push_back({ .material = material, .primitive = primitive });
+    return &mesh->surfaces.back();
+}
+
+static int32_t add_vertex(struct mesh_surface* s, struct vec3 p, struct vec3 n) {
+    int32_t i = s->vertices.size() / 3;
+    s->vertices.insert(s->vertices.end(), { p.x, p.y, p.z });
+    s->normals.insert(s->normals.end(), { n.x, n.y, n.z });
+    return i;
+}
+
+// adds a triangle facing the direction of normal n (godot front faces are wound clockwise)
+static void add_triangle(struct mesh_surface* s, int32_t a, int32_t b, int32_t c, struct vec3 n) {
+    const float* v = s->vertices.data();
+    float ux = v[b * 3] - v[a * 3], uy = v[b * 3 + 1] - v[a * 3 + 1], uz = v[b * 3 + 2] - v[a * 3 + 2];
+    float wx = v[c * 3] - v[a * 3], wy = v[c * 3 + 1] - v[a * 3 + 1], wz = v[c * 3 + 2] - v[a * 3 + 2];
+    float cx = uy * wz - uz * wy, cy = uz * wx - ux * wz, cz = ux * wy - uy * wx;
+    // clockwise from the front means the right handed normal points away from the viewer
+    if (cx * n.x + cy * n.y + cz * n.z > 0)
+        swap(b, c);
+    s->indices.insert(s->indices.end(), { a, b, c });
+}
+
+static inline struct vec3 to_world(const struct mesh_build_options* opts,
+                                   float x, float y, float height) {
+    return {
+        .x = x * opts->units_per_metre,
+        .y = height,
+        .z = -y * opts->units_per_metre,
+    };
+}
+
+static uint8_t building_material(int64_t osm_id) {
+    return MESH_MATERIAL_BUILDING_0 + (uint64_t)osm_id % 3;
+}
+
+static void build_polygon(const struct chunk_geometry& geom, const struct mesh_build_options* opts,
+                          size_t p, struct chunk_mesh* out) {
+    const float* coords = geom.polygon_coords.data();
+    int32_t feature = geom.polygon_features[p];
+    const string& kind = geom.features.kinds[feature];
+    bool building = kind.compare(0, 9, "building=") == 0;
+
+    float height = opts->ground_offset;
+    uint8_t material = MESH_MATERIAL_AREA;
+    if (building) {
+        float tagged = geom.features.heights[feature];
+        height = tagged > 0 ? tagged * opts->units_per_metre : opts->default_height;
+        material = building_material(geom.features.osm_ids[feature]);
+    }
+
+    vector<vector<int32_t>> rings;
+    for (int32_t r = geom.polygon_offsets[p]; r < geom.polygon_offsets[p + 1]; r++) {
+        vector<int32_t> ring;
+        for (int32_t v = geom.ring_offsets[r]; v < geom.ring_offsets[r + 1]; v++)
+            ring.push_back(v);
+        rings.push_back(std::move(ring));
+    }
+
+    struct mesh_surface* s = get_surface(out, material, mesh_primitive::MESH_PRIMITIVE_TRIANGLES);
+
+    // roof (or the area itself, when flat)
+    vector<int32_t> tris;
+    triangulate_polygon(coords, rings, &tris);
+    if (tris.empty())
+        return;
+
+    int32_t base = s->vertices.size() / 3;
+    int32_t first = geom.ring_offsets[geom.polygon_offsets[p]];
+    int32_t last = geom.ring_offsets[geom.polygon_offsets[p + 1]];
+    for (int32_t v = first; v < last; v++)
+        add_vertex(s, to_world(opts, coords[v * 2], coords[v * 2 + 1], height), { 0, 1, 0 });
+    for (size_t t = 0; t < tris.size(); t += 3) {
+        add_triangle(s, base + tris[t] - first, base + tris[t + 1] - first,
+                     base + tris[t + 2] - first, { 0, 1, 0 });
+    }
+
+    if (!building)
+        return;
+
+    // walls: a quad per ring edge, with its own vertices so each wall is flat shaded
+    for (const vector<int32_t>& ring : rings) {
+        // rings are counter clockwise for the outside & clockwise for holes once normalized, so
+        // the material of the polygon is always to the left of each edge
+        bool flip = (ring_area(coords, ring) < 0) == (&ring == &rings[0]);
+        for (size_t i = 0; i < ring.size(); i++) {
+            int32_t a = ring[i], b = ring[(i + 1) % ring.size()];
+            if (flip)
+                swap(a, b);
+            struct vec3 a0 = to_world(opts, coords[a * 2], coords[a * 2 + 1], 0);
+            struct vec3 b0 = to_world(opts, coords[b * 2], coords[b * 2 + 1], 0);
+            float dx = b0.x - a0.x, dz = b0.z - a0.z;
+            float len = sqrtf(dx * dx + dz * dz);
+            if (len == 0)
+                continue;
+            // right of the edge in world space (z points south, so left / right swap vs x, y)
+            struct vec3 n = { -dz / len, 0, dx / len };
+
+            struct vec3 a1 = a0, b1 = b0;
+            a1.y = b1.y = height;
+            int32_t ia0 = add_vertex(s, a0, n), ib0 = add_vertex(s, b0, n);
+            int32_t ib1 = add_vertex(s, b1, n), ia1 = add_vertex(s, a1, n);
+            add_triangle(s, ia0, ib0, ib1, n);
+            add_triangle(s, ia0, ib1, ia1, n);
+        }
+    }
+}
+
+void build_chunk_mesh(const struct chunk_geometry& geom, const struct mesh_build_options* opts,
+                      struct chunk_mesh* out) {
+    out->surfaces.clear();
+
+    for (size_t p = 0; p < geom.polygon_features.size(); p++)
+        build_polygon(geom, opts, p, out);
+
+    if (geom.line_features.size()) {
+        struct mesh_surface* s = get_surface(out, MESH_MATERIAL_LINE, mesh_primitive::MESH_PRIMITIVE_LINES);
+        const float* coords = geom.line_coords.data();
+        for (size_t l = 0; l + 1 < geom.line_offsets.size(); l++) {
+            int32_t base = s->vertices.size() / 3;
+            for (int32_t v = geom.line_offsets[l]; v < geom.line_offsets[l + 1]; v++) {
+                add_vertex(s, to_world(opts, coords[v * 2], coords[v * 2 + 1], opts->ground_offset),
+                           { 0, 1, 0 });
+                if (v > geom.line_offsets[l]) {
+                    int32_t i = base + v - geom.line_offsets[l];
+                    s->indices.insert(s->indices.end(), { i - 1, i });
+                }
+            }
+        }
+    }
+
+    if (geom.point_features.size()) {
+        struct mesh_surface* s = get_surface(out, MESH_MATERIAL_POINT, mesh_primitive::MESH_PRIMITIVE_TRIANGLES);
+        const float* coords = geom.point_coords.data();
+        float h = opts->point_size / 2;
+        for (size_t i = 0; i < geom.point_features.size(); i++) {
+            struct vec3 c = to_world(opts, coords[i * 2], coords[i * 2 + 1], opts->ground_offset);
+            int32_t a = add_vertex(s, { c.x, c.y, c.z - h }, { 0, 1, 0 });
+            int32_t b = add_vertex(s, { c.x - h, c.y, c.z + h }, { 0, 1, 0 });
+            int32_t d = add_vertex(s, { c.x + h, c.y, c.z + h }, { 0, 1, 0 });
+            add_triangle(s, a, b, d, { 0, 1, 0 });
+        }
+    }
+
+    // drop surfaces that ended up empty (eg. only degenerate polygons)
+    erase_if(out->surfaces, [](const struct mesh_surface& s) { return s.indices.empty(); });
+}
+
+size_t chunk_mesh_bytes(const struct chunk_mesh* mesh) {
+    size_t bytes = sizeof(*mesh);
+    for (const struct mesh_surface& s : mesh->surfaces) {
+        bytes += sizeof(s) + (s.vertices.size() + s.normals.size()) * sizeof(float)
+            + s.indices.size() * sizeof(int32_t);
+    }
+    return bytes;
+}
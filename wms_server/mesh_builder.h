@@ -0,0 +1,72 @@
+#pragma once
+
+// builds render ready vertex / index arrays from the decoded geometry of a chunk
+//
+// polygons are triangulated (holes and the parts of multipolygons included) and buildings are
+// extruded to their height; lines and points become line segments and small marker triangles.
+// everything in a chunk that is drawn with the same material is merged into one surface, so a
+// whole chunk can be uploaded as a handful of surfaces rather than a draw call per feature
+//
+// vertices are in godot's world axes (x east, y up, z south) relative to the chunk's origin (its
+// minimum corner), so the chunk's mesh instance only needs to be placed at that corner; triangles are
+// wound clockwise when seen from their front, as godot expects
+
+#include <vector>
+#include <stdint.h>
+
+#include "chunk_geometry.h"
+
+// materials surfaces are drawn with; these index into color_materials in controller.gd
+#define MESH_MATERIAL_BUILDING_0 0
+#define MESH_MATERIAL_BUILDING_1 1
+#define MESH_MATERIAL_BUILDING_2 2
+#define MESH_MATERIAL_LINE 3
+#define MESH_MATERIAL_POINT 4
+#define MESH_MATERIAL_AREA 5
+#define MESH_MATERIAL_COUNT 6
+
+enum struct mesh_primitive: uint8_t {
+    MESH_PRIMITIVE_LINES = 1,
+    MESH_PRIMITIVE_TRIANGLES = 3,
+};
+
+struct mesh_surface {
+    uint8_t material;
+    mesh_primitive primitive;
+    // x, y, z of each vertex
+    std::vector<float> vertices;
+    // x, y, z normal of each vertex
+    std::vector<float> normals;
+    // vertex indices of each triangle (or each line segment)
+    std::vector<int32_t> indices;
+};
+
+struct chunk_mesh {
+    // non empty surfaces only
+    std::vector<struct mesh_surface> surfaces;
+};
+
+// scales used to convert from chunk geometry to world units
+struct mesh_build_options {
+    // world units per metre, horizontally & of feature height
+    float units_per_metre;
+    // height buildings without a height tag are extruded to, in world units
+    float default_height;
+    // height flat areas, lines & points are drawn at, to keep them above the ground plane
+    float ground_offset;
+    // size of the marker triangle drawn for each point, in world units
+    float point_size;
+};
+
+// triangulates a polygon made of an outer ring followed by any number of holes; rings are given
+// as lists of vertex indices into coords (x, y pairs), and the indices of each resulting triangle
+// are appended to tris, wound counter clockwise in x, y
+void triangulate_polygon(const float* coords, const std::vector<std::vector<int32_t>>& rings,
+                         std::vector<int32_t>* tris);
+
+// builds the mesh of a chunk, replacing the contents of out
+void build_chunk_mesh(const struct chunk_geometry& geom, const struct mesh_build_options* opts,
+                      struct chunk_mesh* out);
+
+// rough number of bytes held by a built mesh
+size_t chunk_mesh_bytes(const struct chunk_mesh* mesh);
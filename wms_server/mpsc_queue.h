@@ -0,0 +1,64 @@
+#pragma once
+
+// intrusive lock-free multi producer, single consumer queue (after Dmitry Vyukov's design)
+//
+// any number of threads may push, but only one thread may pop at a time. pushing is a single
+// atomic exchange, so producers never wait on each other or on the consumer. items are structs
+// that inherit from mpsc_node; the queue never allocates, and ownership of an item passes to the
+// queue on push and back to the caller on pop
+
+#include <atomic>
+
+struct mpsc_node {
+    std::atomic<struct mpsc_node*> next = NULL;
+};
+
+struct mpsc_queue {
+    // most recently pushed node, swapped by producers
+    std::atomic<struct mpsc_node*> head;
+    // oldest node, only touched by the consumer
+    struct mpsc_node* tail;
+    // placeholder node so the queue is never truly empty
+    struct mpsc_node stub;
+
+    mpsc_queue() : head(&stub), tail(&stub) {}
+};
+
+inline void mpsc_push(struct mpsc_queue* q, struct mpsc_node* n) {
+    n->next.store(NULL, std::memory_order_relaxed);
+    struct mpsc_node* prev = q->head.exchange(n, std::memory_order_acq_rel);
+    // between the exchange and this store the queue is briefly unlinked; the consumer sees
+    // that as empty rather than waiting
+    prev->next.store(n, std::memory_order_release);
+}
+
+// returns the oldest node, or NULL if the queue is empty (or a push is half way through)
+inline struct mpsc_node* mpsc_pop(struct mpsc_queue* q) {
+    struct mpsc_node* tail = q->tail;
+    struct mpsc_node* next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != q->head.load(std::memory_order_acquire))
+        return NULL;
+
+    // tail is the last real node; put the stub back behind it so it can be handed out
+    mpsc_push(q, &q->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
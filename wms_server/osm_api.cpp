@@ -1,41 +1,118 @@
-#include <iostream>
 #include <fstream>
+#include <functional>
 #include <string>
 #include <format>
+#include <cstdio>
 #include <cpr/cpr.h>
+#include <nlohmann/json.hpp>
+#include <unistd.h>
 
 #include "osm_api.h"
 #include "gdal_api.h"
 #include "constants.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 
 using namespace std;
+using json = nlohmann::json;
 
+// define DO_NOT_QUERY_WEB (eg. `make server_offline`) to never contact the osm api; every
+// request is then answered from whatever osm data is already in TMP_OSM_FILE, which is useful for
+// testing & load testing without a network connection
 //#define DO_NOT_QUERY_WEB
 
 mutex osm_tmp_file_mutex;
 
-int fetch_map_for_bounding_box(const struct bbox* query) {
-    string bbox = std::format("{},{},{},{}", query->minx, query->miny, query->maxx, query->maxy);
+const char* get_osm_api_url() {
+    // read once, so every request in a run goes to the same place
+    static const char* url = getenv("OSM_API_URL") ? getenv("OSM_API_URL") : OSM_API_URL;
+    return url;
+}
+
+int fetch_map_for_chunk(struct chunk_id id, const function<void(const string&)>& on_layer) {
+    struct stats_timer timer(STAT_HIST_OSM_FETCH);
+    TRACE_SPAN("fetch_map_for_chunk");
+    stats_add(STAT_OSM_FETCHES);
+    struct bbox query = get_chunk_bbox(id, BBOX_PER_DEG_INT);
+    string bbox = std::format("{},{},{},{}", query.minx, query.miny, query.maxx, query.maxy);
 #ifndef DO_NOT_QUERY_WEB
-    cpr::Response r = cpr::Get(cpr::Url{OSM_API_URL}, cpr::Parameters{{"bbox", bbox}});
+    uint64_t get_start = trace_now_us();
+    cpr::Response r = cpr::Get(cpr::Url{get_osm_api_url()}, cpr::Parameters{{"bbox", bbox}},
+                               cpr::Timeout{OSM_API_TIMEOUT_MS});
+    trace_record("osm_http_get", get_start, trace_now_us());
 
-    cout << r.status_code << "\t" << r.header["content-type"] // << "\n" << r.text
-         << endl;
+    LOG_DEBUG("%ld\t%s", r.status_code, r.header["content-type"].c_str());
 
-    if (r.status_code != 200)
+    if (r.status_code == 0) {
+        LOG_WARN("could not reach osm api for bbox %s: %s", bbox.c_str(), r.error.message.c_str());
+        stats_add(STAT_OSM_ERRORS);
+        return OSM_API_UNREACHABLE;
+    }
+    if (r.status_code != 200) {
+        LOG_WARN("osm api returned %ld for bbox %s", r.status_code, bbox.c_str());
+        stats_add(STAT_OSM_ERRORS);
         return r.status_code;
+    }
 #endif
     lock_guard<mutex> guard(osm_tmp_file_mutex);
 #ifndef DO_NOT_QUERY_WEB
-    ofstream outfile; // TODO ? it would be nicer if we could use virtual memeory here instead of creating a temp file but that would require more effort
-    outfile.open(TMP_OSM_FILE, ios::trunc);
-    outfile << r.text;
-    outfile.close();
-#endif
+    // written to a file of this process's own, as several servers (eg. shards) may be run from
+    // the same directory, then moved over TMP_OSM_FILE so it holds the latest data for
+    // DO_NOT_QUERY_WEB builds to use
+    string tmp_file = std::format("{}.{}", TMP_OSM_FILE, getpid());
+    {
+        TRACE_SPAN("write_tmp_osm");
+        ofstream outfile; // TODO ? it would be nicer if we could use virtual memeory here instead of creating a temp file but that would require more effort
+        outfile.open(tmp_file, ios::trunc);
+        outfile << r.text;
+        outfile.close();
+    }
 
-    return write_osm_to_geojson(TMP_OSM_FILE, get_bbox_filename(query));
+    int err = write_osm_to_geojson(tmp_file, get_chunk_filename(id),
+                                   get_chunk_origin(id, BBOX_PER_DEG_INT), on_layer);
+    rename(tmp_file.c_str(), TMP_OSM_FILE);
+    return err;
+#else
+    return write_osm_to_geojson(TMP_OSM_FILE, get_chunk_filename(id),
+                                get_chunk_origin(id, BBOX_PER_DEG_INT), on_layer);
+#endif
 }
 
-void fetch_bounding_box_for_city(string city_name, struct bbox* query) {
-    return; // TODO ?
+int fetch_bounding_box_for_city(string city_name, struct bbox* query) {
+    TRACE_SPAN("fetch_bounding_box_for_city");
+#ifndef DO_NOT_QUERY_WEB
+    static const char* url = getenv("GEOCODE_API_URL") ? getenv("GEOCODE_API_URL") : GEOCODE_API_URL;
+    // nominatim asks that every client identifies itself
+    cpr::Response r = cpr::Get(cpr::Url{url},
+                               cpr::Parameters{{"q", city_name}, {"format", "json"}, {"limit", "1"}},
+                               cpr::Header{{"User-Agent", "Geo-Framework"}},
+                               cpr::Timeout{GEOCODE_API_TIMEOUT_MS});
+    if (r.status_code == 0) {
+        LOG_WARN("could not reach geocoding api for %s: %s", city_name.c_str(), r.error.message.c_str());
+        return OSM_API_UNREACHABLE;
+    }
+    if (r.status_code != 200) {
+        LOG_WARN("geocoding api returned %ld for %s", r.status_code, city_name.c_str());
+        return r.status_code;
+    }
+
+    // [{..., "boundingbox": ["minlat", "maxlat", "minlon", "maxlon"]}]
+    json places = json::parse(r.text, nullptr, false);
+    if (places.is_discarded() || !places.is_array() || places.empty())
+        return 1;
+    try {
+        const json& bb = places[0].at("boundingbox");
+        query->miny = stof(bb.at(0).get<string>());
+        query->maxy = stof(bb.at(1).get<string>());
+        query->minx = stof(bb.at(2).get<string>());
+        query->maxx = stof(bb.at(3).get<string>());
+    } catch (const exception& e) {
+        LOG_WARN("unexpected geocoding answer for %s: %s", city_name.c_str(), e.what());
+        return 2;
+    }
+    return 0;
+#else
+    return 1;
+#endif
 }
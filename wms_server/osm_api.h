@@ -1,10 +1,29 @@
 #pragma once
 
 // #include <gdal.h>
+#include <functional>
+#include <string>
 
 #include "wms.h"
 
 
-int fetch_map_for_bounding_box(const struct bbox* query);
+// returned in place of an http status when an api couldn't be reached at all (eg. connection
+// refused, dns failure, or timed out), which cpr reports as status 0
+#define OSM_API_UNREACHABLE -1
 
-void fetch_bounding_box_for_city(std::string city_name, struct bbox* query);
+// url osm data is fetched from: the OSM_API_URL environment variable if it is set, otherwise
+// OSM_API_URL from constants.h
+const char* get_osm_api_url();
+
+// downloads the osm data of a chunk and converts it into the chunk's geojson files
+// on_layer is called with each layer's file as it is written (see write_osm_to_geojson())
+// returns 0 on success, otherwise an error code (the http status if the osm api refused, or
+// OSM_API_UNREACHABLE)
+int fetch_map_for_chunk(struct chunk_id id,
+                        const std::function<void(const std::string&)>& on_layer = nullptr);
+
+// looks up the bounding box of a named place (eg. "Lisbon, Portugal") with the geocoding api
+// (GEOCODE_API_URL, or the GEOCODE_API_URL environment variable), taking its best match
+// returns 0 on success, otherwise an error code (the http status if the api refused, or
+// OSM_API_UNREACHABLE)
+int fetch_bounding_box_for_city(std::string city_name, struct bbox* query);
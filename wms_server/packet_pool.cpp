@@ -0,0 +1,170 @@
+#include <atomic>
+#include <bit>
+#include <stdint.h>
+
+#include "packet_pool.h"
+
+using namespace std;
+
+static_assert((1 << PACKET_POOL_MIN_SHIFT) >= sizeof(char*),
+              "smallest pool class must be able to hold a free list link");
+static_assert(PACKET_POOL_CLASSES < PACKET_POOL_NO_CLASS, "too many pool classes");
+
+atomic_uint64_t pool_heap_allocs = 0;
+atomic_uint64_t pool_reuses = 0;
+atomic_uint64_t pool_heap_frees = 0;
+atomic_uint64_t pool_remote_returns = 0;
+
+// the part of a thread's pool other threads hand its buffers back through; kept on the heap, so
+// it outlives the thread for as long as any of its buffers are still out
+struct packet_pool_owner {
+    // buffers released by other threads, linked through the buffers as in the free lists. any
+    // thread pushes, and only the owning thread takes them, the whole list at once, so there is
+    // no ABA problem
+    atomic<char*> returned[PACKET_POOL_CLASSES];
+    // the pool's buffers handed out & not yet released, plus one while the thread is running;
+    // whoever drops it to 0 frees the owner & whatever was returned to it
+    atomic_uint64_t refs;
+};
+
+// per thread pool state; kept trivially destructible so it remains usable while other
+// thread_local objects are being torn down (a packet may well be freed after the pool is flushed)
+struct thread_pool {
+    // singly linked free lists, the link to the next free buffer is stored in the buffer itself
+    char* free_lists[PACKET_POOL_CLASSES];
+    uint64_t held_bytes;
+    // set once the thread is exiting; any buffer released afterwards goes straight to the heap
+    bool closed;
+    // created with the first pooled buffer the thread draws
+    struct packet_pool_owner* owner;
+};
+
+thread_local struct thread_pool pool = {};
+
+static inline size_t class_size(uint8_t size_class) {
+    return (size_t)1 << (size_class + PACKET_POOL_MIN_SHIFT);
+}
+
+static inline char*& free_link(char* buf) {
+    return *(char**)buf;
+}
+
+static void free_chain(char* buf) {
+    while (buf) {
+        char* next = free_link(buf);
+        delete[] buf;
+        buf = next;
+    }
+}
+
+// drops a reference to an owner, freeing it once its thread has exited & all its buffers are back
+static void release_owner(struct packet_pool_owner* owner) {
+    if (owner->refs.fetch_sub(1, memory_order_acq_rel) != 1)
+        return;
+    for (int i = 0; i < PACKET_POOL_CLASSES; i++)
+        free_chain(owner->returned[i].exchange(NULL, memory_order_acquire));
+    delete owner;
+}
+
+// frees all of the thread's pooled buffers when the thread exits
+struct thread_pool_flusher {
+    ~thread_pool_flusher() {
+        for (int i = 0; i < PACKET_POOL_CLASSES; i++) {
+            free_chain(pool.free_lists[i]);
+            pool.free_lists[i] = NULL;
+        }
+        pool.held_bytes = 0;
+        pool.closed = true;
+        if (pool.owner) {
+            for (int i = 0; i < PACKET_POOL_CLASSES; i++)
+                free_chain(pool.owner->returned[i].exchange(NULL, memory_order_acquire));
+            // kept, so buffers the thread frees from now on are still counted off it
+            release_owner(pool.owner);
+        }
+    }
+};
+
+thread_local struct thread_pool_flusher pool_flusher;
+
+void packet_buffer_deleter::operator()(char* buf) const {
+    if (!buf)
+        return;
+
+    if (size_class == PACKET_POOL_NO_CLASS || !owner) {
+        pool_heap_frees.fetch_add(1, memory_order::relaxed);
+        delete[] buf;
+        return;
+    }
+
+    // another thread's buffer (or this thread's, once its pool is closed) goes back to its own pool
+    if (owner != pool.owner || pool.closed) {
+        char* head = owner->returned[size_class].load(memory_order_relaxed);
+        do {
+            free_link(buf) = head;
+        } while (!owner->returned[size_class].compare_exchange_weak(head, buf, memory_order_release,
+                                                                    memory_order_relaxed));
+        pool_remote_returns.fetch_add(1, memory_order::relaxed);
+        release_owner(owner);
+        return;
+    }
+
+    // the thread itself holds a reference, so this never drops the owner's to 0
+    owner->refs.fetch_sub(1, memory_order_relaxed);
+    if (pool.held_bytes + class_size(size_class) > PACKET_POOL_MAX_THREAD_BYTES) {
+        pool_heap_frees.fetch_add(1, memory_order::relaxed);
+        delete[] buf;
+        return;
+    }
+
+    free_link(buf) = pool.free_lists[size_class];
+    pool.free_lists[size_class] = buf;
+    pool.held_bytes += class_size(size_class);
+}
+
+// moves the buffers other threads have handed back of a size class into the thread's free list,
+// which must be empty
+static void take_returned(uint8_t size_class) {
+    char* buf = pool.owner->returned[size_class].exchange(NULL, memory_order_acquire);
+    pool.free_lists[size_class] = buf;
+    for (; buf; buf = free_link(buf))
+        pool.held_bytes += class_size(size_class);
+}
+
+packet_buffer acquire_packet_buffer(size_t size) {
+    size_t rounded = bit_ceil(max(size, (size_t)1 << PACKET_POOL_MIN_SHIFT));
+    size_t size_class = countr_zero(rounded) - PACKET_POOL_MIN_SHIFT;
+
+    // nothing is pooled for a thread that is exiting, as its pool has already been flushed
+    if (size_class >= PACKET_POOL_CLASSES || pool.closed) {
+        pool_heap_allocs.fetch_add(1, memory_order::relaxed);
+        return packet_buffer(new char[size], packet_buffer_deleter{});
+    }
+
+    if (!pool.owner) {
+        // touch the flusher so this thread's pool is emptied on exit
+        (void)&pool_flusher;
+        pool.owner = new packet_pool_owner{ .returned = {}, .refs = 1 };
+    }
+    pool.owner->refs.fetch_add(1, memory_order_relaxed);
+    packet_buffer_deleter del = { .size_class = (uint8_t)size_class, .owner = pool.owner };
+
+    if (!pool.free_lists[size_class])
+        take_returned(size_class);
+    char* buf = pool.free_lists[size_class];
+    if (buf) {
+        pool.free_lists[size_class] = free_link(buf);
+        pool.held_bytes -= rounded;
+        pool_reuses.fetch_add(1, memory_order::relaxed);
+        return packet_buffer(buf, del);
+    }
+
+    pool_heap_allocs.fetch_add(1, memory_order::relaxed);
+    return packet_buffer(new char[rounded], del);
+}
+
+void get_packet_pool_stats(struct packet_pool_stats* stats) {
+    stats->heap_allocs = pool_heap_allocs.load(memory_order::relaxed);
+    stats->reuses = pool_reuses.load(memory_order::relaxed);
+    stats->heap_frees = pool_heap_frees.load(memory_order::relaxed);
+    stats->remote_returns = pool_remote_returns.load(memory_order::relaxed);
+}
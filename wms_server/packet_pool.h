@@ -0,0 +1,61 @@
+#pragma once
+
+// size-classed, thread-local pool of buffers used for packet payloads
+//
+// almost every packet sent or recieved needs a payload buffer, and most of them are tiny (a count
+// packet is 9 bytes, a bbox packet 37); rather than going to the heap for each one, payloads are
+// drawn from per-thread free lists bucketed by power of two size, and go back to the pool of the
+// thread they were drawn from when released. a buffer released by another thread (eg. a payload
+// the handler encodes & the client's writer thread frees once it is sent) is pushed onto a
+// lock-free return list of its pool, which that thread takes back into its free lists once they
+// run dry. once a connection has warmed up, sending & recieving packets of sizes it has already
+// seen performs no heap allocation, on whichever threads they are encoded & freed
+
+#include <memory>
+#include <stdint.h>
+#include <stddef.h>
+
+// smallest size class is 1 << PACKET_POOL_MIN_SHIFT bytes; must be able to hold a pointer, as
+// free buffers store the free list link in their first bytes
+#define PACKET_POOL_MIN_SHIFT 4
+// number of power of two size classes, so the largest pooled buffer is
+// 1 << (PACKET_POOL_MIN_SHIFT + PACKET_POOL_CLASSES - 1) bytes (16MiB); larger payloads go
+// straight to the heap
+#define PACKET_POOL_CLASSES 21
+// upper bound on how many bytes of free buffers each thread may hold on to; buffers released
+// past this limit are freed instead of pooled
+#define PACKET_POOL_MAX_THREAD_BYTES (32ULL << 20)
+
+// marks buffers that are not part of any size class (too large / default constructed)
+#define PACKET_POOL_NO_CLASS 0xff
+
+struct packet_pool_owner;
+
+struct packet_buffer_deleter {
+    uint8_t size_class = PACKET_POOL_NO_CLASS;
+    // pool the buffer was drawn from; NULL if it isn't pooled
+    struct packet_pool_owner* owner = NULL;
+
+    void operator()(char* buf) const;
+};
+
+typedef std::unique_ptr<char[], packet_buffer_deleter> packet_buffer;
+
+// returns a buffer of at least size bytes; its contents are uninitialized
+packet_buffer acquire_packet_buffer(size_t size);
+
+// process-wide counters for how the pool is behaving; heap_allocs should stop increasing once
+// steady state is reached
+struct packet_pool_stats {
+    // buffers that had to be allocated from the heap (pool miss or oversized)
+    uint64_t heap_allocs;
+    // buffers handed out from a free list
+    uint64_t reuses;
+    // buffers freed back to the heap because the thread's pool was full
+    uint64_t heap_frees;
+    // buffers released by another thread than the one they were drawn from, & handed back to its
+    // pool
+    uint64_t remote_returns;
+};
+
+void get_packet_pool_stats(struct packet_pool_stats* stats);
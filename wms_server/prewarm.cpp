@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "prewarm.h"
+#include "chunk_manager.h"
+#include "chunk_store.h"
+#include "osm_api.h"
+#include "cbor.h"
+#include "constants.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+using namespace std;
+
+struct access_entry {
+    struct chunk_id id;
+    // decayed access count as of last
+    double score;
+    double last;
+};
+
+static mutex access_guard;
+static unordered_map<uint64_t, struct access_entry> accesses;
+
+static atomic_bool enabled = true;
+static bool (*owner_filter)(struct chunk_id id) = NULL;
+
+// bounding boxes of the places named in the region file, looked up by a thread of their own;
+// kept for the life of the process, so each name is only looked up once. names that couldn't be
+// found are kept with their error until the file next changes, when they are tried again
+struct named_region {
+    struct bbox bbox;
+    int err;
+};
+
+static mutex named_guard;
+static unordered_map<string, struct named_region> named_regions;
+// set while a lookup thread is running
+static atomic_bool resolving = false;
+// set by the lookup thread once it is done, so the region file is read again with what it found
+static atomic_bool named_changed = false;
+
+// everything below is only used by the loader thread
+static string regions_file = PREWARM_REGIONS_FILE;
+static filesystem::file_time_type regions_file_time;
+static vector<struct chunk_id> region_chunks;
+// how far through region_chunks pre-warming has got
+static size_t region_next = 0;
+
+static deque<struct chunk_id> candidates;
+// chunks already tried, so chunks which are empty or fail aren't fetched over & over
+static unordered_set<uint64_t> attempted;
+static chrono::steady_clock::time_point last_refresh;
+static chrono::steady_clock::time_point last_fetch;
+
+static double now_s() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double decayed(const struct access_entry* e, double now) {
+    return e->score * exp2((e->last - now) / PREWARM_HALF_LIFE_S);
+}
+
+// forgets the coldest chunks until a quarter of the map is free; access_guard must be held
+static void forget_cold_chunks(double now) {
+    vector<double> scores;
+    scores.reserve(accesses.size());
+    for (const auto& [key, e] : accesses)
+        scores.push_back(decayed(&e, now));
+    size_t keep = PREWARM_MAX_TRACKED * 3 / 4;
+    nth_element(scores.begin(), scores.end() - keep, scores.end());
+    double cutoff = *(scores.end() - keep);
+    erase_if(accesses, [cutoff, now](const auto& kv) {
+        return decayed(&kv.second, now) < cutoff;
+    });
+}
+
+void prewarm_record_access(const struct chunk_id* ids, size_t n) {
+    double now = now_s();
+    lock_guard<mutex> guard(access_guard);
+    for (size_t i = 0; i < n; i++) {
+        auto [it, inserted] = accesses.try_emplace(chunk_id_key(&ids[i]), access_entry{ ids[i], 0.0, now });
+        it->second.score = decayed(&it->second, now) + 1;
+        it->second.last = now;
+    }
+    if (accesses.size() > PREWARM_MAX_TRACKED)
+        forget_cold_chunks(now);
+}
+
+void prewarm_set_regions_file(const string& path) {
+    regions_file = path;
+}
+
+void prewarm_set_enabled(bool e) {
+    enabled = e;
+}
+
+void prewarm_set_owner_filter(bool (*owns)(struct chunk_id id)) {
+    owner_filter = owns;
+}
+
+static void resolve_names(vector<string> names) {
+    trace_set_thread_name("prewarm geocoder");
+    for (const string& name : names) {
+        struct named_region r = {};
+        r.err = fetch_bounding_box_for_city(name, &r.bbox);
+        if (r.err)
+            LOG_WARN("could not find pre-warm region %s: error %d", name.c_str(), r.err);
+        lock_guard<mutex> guard(named_guard);
+        named_regions[name] = r;
+    }
+    named_changed = true;
+    resolving = false;
+}
+
+// appends the chunks of a region to ids, or if it has more than PREWARM_MAX_REGION_CHUNKS, those
+// of a window around its centre
+// returns false if the region isn't a valid bounding box
+static bool get_region_chunk_ids(const string& name, struct bbox region, vector<struct chunk_id>* ids) {
+    if (!isfinite(region.minx) || !isfinite(region.miny) || !isfinite(region.maxx)
+        || !isfinite(region.maxy) || region.minx > region.maxx || region.miny > region.maxy)
+        return false;
+    int64_t minx = floor(clamp((double)region.minx, -180.0, 180.0) * BBOX_PER_DEG_INT);
+    int64_t miny = floor(clamp((double)region.miny, -90.0, 90.0) * BBOX_PER_DEG_INT);
+    int64_t maxx = floor(clamp((double)region.maxx, -180.0, 180.0) * BBOX_PER_DEG_INT);
+    int64_t maxy = floor(clamp((double)region.maxy, -90.0, 90.0) * BBOX_PER_DEG_INT);
+    int64_t w = maxx - minx + 1, h = maxy - miny + 1;
+
+    if (w * h > PREWARM_MAX_REGION_CHUNKS) {
+        // as square as the region allows
+        int64_t side = sqrt((double)PREWARM_MAX_REGION_CHUNKS);
+        int64_t cw = w, ch = h;
+        if (cw > side && ch > side)
+            cw = ch = side;
+        else if (cw > side)
+            cw = PREWARM_MAX_REGION_CHUNKS / ch;
+        else
+            ch = PREWARM_MAX_REGION_CHUNKS / cw;
+        LOG_WARN("pre-warm region %s has %ld chunks; only the %ld around its centre will be pre-warmed",
+                 name.c_str(), w * h, cw * ch);
+        minx += (w - cw) / 2;
+        miny += (h - ch) / 2;
+        w = cw;
+        h = ch;
+    }
+
+    for (int64_t x = minx; x < minx + w; x++)
+        for (int64_t y = miny; y < miny + h; y++)
+            ids->push_back({ .x = (int32_t)x, .y = (int32_t)y });
+    return true;
+}
+
+// reads the region file again if it has changed since it was last read, or more of the places it
+// names have been found
+static void reload_regions() {
+    if (regions_file.empty())
+        return;
+    bool found_more = named_changed.exchange(false);
+    error_code ec;
+    filesystem::file_time_type t = filesystem::last_write_time(regions_file, ec);
+    if (ec || (t == regions_file_time && !found_more))
+        return;
+    if (t != regions_file_time) {
+        regions_file_time = t;
+        lock_guard<mutex> guard(named_guard);
+        erase_if(named_regions, [](const auto& kv) { return kv.second.err != 0; });
+    }
+
+    ifstream f(regions_file);
+    vector<struct chunk_id> chunks;
+    // names not looked up yet
+    vector<string> unnamed;
+    string line;
+    while (getline(f, line)) {
+        while (!line.empty() && isspace((unsigned char)line.back()))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        struct bbox region;
+        char rest;
+        if (sscanf(line.c_str(), "%f %f %f %f %c", &region.minx, &region.miny, &region.maxx,
+                   &region.maxy, &rest) != 4) {
+            lock_guard<mutex> guard(named_guard);
+            auto it = named_regions.find(line);
+            if (it == named_regions.end())
+                unnamed.push_back(line);
+            if (it == named_regions.end() || it->second.err)
+                continue;
+            region = it->second.bbox;
+        }
+
+        if (!get_region_chunk_ids(line, region, &chunks))
+            LOG_WARN("pre-warm region %s isn't a valid bounding box", line.c_str());
+    }
+    LOG_INFO("pre-warming %zu chunks of the regions in %s%s", chunks.size(), regions_file.c_str(),
+             unnamed.empty() ? "" : format(" (looking up {} more)", unnamed.size()).c_str());
+    region_chunks = std::move(chunks);
+    region_next = 0;
+
+    // names the lookup thread is already busy with are looked up again once it is done, if it
+    // didn't get to them
+    if (!unnamed.empty() && !resolving.exchange(true))
+        thread(resolve_names, std::move(unnamed)).detach();
+}
+
+// refills the candidates with the neighbours of the hottest chunks, or failing any, the next of
+// the region chunks
+static void refresh_candidates() {
+    TRACE_SPAN("prewarm_refresh");
+    reload_regions();
+
+    vector<pair<double, struct chunk_id>> hot;
+    double now = now_s();
+    access_guard.lock();
+    for (const auto& [key, e] : accesses) {
+        double score = decayed(&e, now);
+        if (score >= PREWARM_MIN_SCORE)
+            hot.push_back({ score, e.id });
+    }
+    access_guard.unlock();
+    stats_gauge_set(STAT_GAUGE_HOT_CHUNKS, hot.size());
+
+    size_t n = min(hot.size(), (size_t)PREWARM_HOT_CHUNKS);
+    partial_sort(hot.begin(), hot.begin() + n, hot.end(), [](const auto& a, const auto& b) {
+        return a.first > b.first;
+    });
+    for (size_t i = 0; i < n; i++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                struct chunk_id id = { hot[i].second.x + dx, hot[i].second.y + dy };
+                if ((dx || dy) && !attempted.contains(chunk_id_key(&id)))
+                    candidates.push_back(id);
+            }
+        }
+    }
+
+    for (; candidates.empty() && region_next < region_chunks.size(); region_next++) {
+        if (!attempted.contains(chunk_id_key(&region_chunks[region_next])))
+            candidates.push_back(region_chunks[region_next]);
+    }
+}
+
+// next candidate which isn't stored yet; false if none were found within PREWARM_CHECKS_PER_IDLE
+static bool next_candidate(struct chunk_id* out) {
+    for (int checks = 0; checks < PREWARM_CHECKS_PER_IDLE && !candidates.empty();) {
+        struct chunk_id id = candidates.front();
+        candidates.pop_front();
+        if (!attempted.insert(chunk_id_key(&id)).second)
+            continue;
+        if (owner_filter && !owner_filter(id))
+            continue;
+        checks++;
+        if (check_chunk_local_file(id).empty() && chunk_store_negative_status(id) == CHUNK_STATUS_OK) {
+            *out = id;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool prewarm_run_idle(chrono::steady_clock::time_point idle_since) {
+    if (!enabled)
+        return false;
+    auto now = chrono::steady_clock::now();
+    if (now - idle_since < chrono::milliseconds(PREWARM_IDLE_MS)
+        || now - last_fetch < chrono::milliseconds(PREWARM_INTERVAL_MS))
+        return false;
+
+    if (candidates.empty()) {
+        if (now - last_refresh < chrono::milliseconds(PREWARM_REFRESH_MS))
+            return false;
+        last_refresh = now;
+        // chunks tried long enough ago may be worth trying again
+        if (attempted.size() > PREWARM_MAX_TRACKED)
+            attempted.clear();
+        refresh_candidates();
+    }
+
+    struct chunk_id id;
+    if (!next_candidate(&id))
+        return false;
+
+    struct trace_request_scope request(trace_new_request_id());
+    TRACE_SPAN("prewarm_chunk");
+    LOG_DEBUG("pre-warming chunk %d %d", id.x, id.y);
+    vector<string> files;
+    int err = chunk_store_fetch(id, &files);
+    if (err)
+        LOG_DEBUG("could not pre-warm chunk %d %d: error %d", id.x, id.y, err);
+    stats_add(STAT_PREWARM_FETCHES);
+    last_fetch = chrono::steady_clock::now();
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// background pre-warming of chunks before any client asks for them
+//
+// every chunk clients ask for is counted in an access map, with counts decaying exponentially
+// (halving every PREWARM_HALF_LIFE_S), so the hottest chunks are the ones asked for most, lately.
+// once the loader has had nothing to do for PREWARM_IDLE_MS it fetches, one at a time, the
+// neighbours of the hottest chunks which aren't stored yet (the areas clients are likely to pan
+// into next), then the chunks of the regions listed in the region file. client requests always
+// come first: the loader only pre-warms with an empty work queue, and checks it again after every
+// chunk, so a request waits behind at most one pre-warm fetch
+//
+// the region file has one region per line (blank lines & lines starting with # are skipped),
+// either a bounding box in degrees, "minlon minlat maxlon maxlat", or the name of a place, which
+// is looked up with fetch_bounding_box_for_city() on a thread of its own, so the loader never
+// waits on the geocoding api (the region is pre-warmed once it has been found). it is read again
+// when it changes. a region of more than PREWARM_MAX_REGION_CHUNKS chunks is cut down to a window
+// of them around its centre
+
+#include <chrono>
+#include <string>
+#include <stddef.h>
+
+#include "wms.h"
+
+#define PREWARM_REGIONS_FILE "./prewarm_regions.txt"
+#define PREWARM_HALF_LIFE_S 600.0
+// decayed accesses a chunk needs before its neighbours are pre-warmed
+#define PREWARM_MIN_SCORE 2.0
+// hottest chunks whose neighbours are pre-warmed, per refresh of the candidates
+#define PREWARM_HOT_CHUNKS 64
+// chunks kept in the access map; the coldest are forgotten past this
+#define PREWARM_MAX_TRACKED 16384
+// how long the loader must be idle before pre-warming, and the least time between pre-warm fetches
+// (so an idle server doesn't hammer the osm api)
+#define PREWARM_IDLE_MS 2000
+#define PREWARM_INTERVAL_MS 1000
+// how often the candidates are rebuilt from the access map & region file, at most
+#define PREWARM_REFRESH_MS 5000
+// chunks of any one region pre-warmed, at most; the window is cut before any chunk ids are made,
+// so a country costs no more than a city
+#define PREWARM_MAX_REGION_CHUNKS 4096
+// candidates checked against the store each time the loader is idle
+#define PREWARM_CHECKS_PER_IDLE 16
+
+// counts accesses to chunks; called for every chunk clients ask for
+void prewarm_record_access(const struct chunk_id* ids, size_t n);
+
+// region file to pre-warm, or "" for none (the default is PREWARM_REGIONS_FILE, which need not exist)
+void prewarm_set_regions_file(const std::string& path);
+
+// turns pre-warming on or off (on by default); chunks are counted either way
+void prewarm_set_enabled(bool enabled);
+
+// only chunks owns() returns true for are pre-warmed, eg. those of this shard; NULL for all
+void prewarm_set_owner_filter(bool (*owns)(struct chunk_id id));
+
+// called by the loader while its work queue is empty, with when it last had work; fetches at most
+// one chunk, and only once the loader has been idle long enough
+// returns true if a chunk was fetched
+bool prewarm_run_idle(std::chrono::steady_clock::time_point idle_since);
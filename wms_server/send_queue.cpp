@@ -0,0 +1,165 @@
+#include <chrono>
+#include <mutex>
+#include <utility>
+
+#include "send_queue.h"
+#include "socket.h"
+#include "constants.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+using namespace std;
+
+static size_t packet_bytes(const struct packet* packet) {
+    return CBOR_HEADER_BYTES + packet->header.payload_len;
+}
+
+// i-th queued packet, from the oldest; q->guard must be held
+static struct queued_packet* queued(struct send_queue* q, size_t i) {
+    return &q->ring[(q->first + i) % q->ring.size()];
+}
+
+// whether a packet of size bytes fits; an empty queue takes anything, so a chunk bigger than the
+// whole queue is still sent
+static bool has_room(const struct send_queue* q, size_t size) {
+    return !q->count || q->bytes + size <= SEND_QUEUE_MAX_BYTES;
+}
+
+// adds a packet to the back of the queue; q->guard must be held
+static void enqueue(struct send_queue* q, struct queued_packet&& p) {
+    size_t size = packet_bytes(&p.packet);
+    if (q->count == q->ring.size()) {
+        vector<struct queued_packet> ring(max(q->ring.size() * 2, (size_t)16));
+        for (size_t i = 0; i < q->count; i++)
+            ring[i] = std::move(*queued(q, i));
+        q->ring = std::move(ring);
+        q->first = 0;
+    }
+    *queued(q, q->count++) = std::move(p);
+    q->bytes += size;
+    stats_gauge_add(STAT_GAUGE_SEND_QUEUE_BYTES, size);
+    if (q->bytes > q->high_water) {
+        q->high_water = q->bytes;
+        stats_gauge_max(STAT_GAUGE_SEND_QUEUE_HIGH_WATER, q->bytes);
+    }
+    q->changed.notify_all();
+}
+
+// replaces a chunk packet with a dropped answer for the same chunk, keeping it a push if it was one
+static void encode_dropped(struct packet* packet, struct chunk_id id) {
+    packet_type_enum type = packet->header.type;
+    encode_packet_chunk_cbor(packet, id, CHUNK_STATUS_DROPPED);
+    packet->header.type = type;
+}
+
+// replaces a queued chunk's packet with a dropped answer; q->guard must be held
+static void drop(struct send_queue* q, struct queued_packet* p) {
+    size_t before = packet_bytes(&p->packet);
+    encode_dropped(&p->packet, p->id);
+    p->droppable = false;
+    size_t after = packet_bytes(&p->packet);
+    q->bytes -= before - after;
+    stats_gauge_add(STAT_GAUGE_SEND_QUEUE_BYTES, (int64_t)after - (int64_t)before);
+    stats_add(STAT_CHUNKS_DROPPED);
+}
+
+// waits for room for size bytes; q->guard must be held by lock
+// returns false if the queue was closed or no room was made in time
+static bool wait_for_room(struct send_queue* q, unique_lock<mutex>& lock, size_t size) {
+    bool room = q->changed.wait_for(lock, chrono::milliseconds(SEND_QUEUE_STALL_MS), [q, size]() {
+        return q->closed || has_room(q, size);
+    });
+    if (q->closed)
+        return false;
+    if (!room) {
+        LOG_WARN("client hasn't read anything in %d ms; disconnecting it", SEND_QUEUE_STALL_MS);
+        stats_add(STAT_SLOW_DISCONNECTS);
+        return false;
+    }
+    return true;
+}
+
+int send_queue_push(struct send_queue* q, struct packet* packet) {
+    unique_lock<mutex> lock(q->guard);
+    if (!has_room(q, packet_bytes(packet)) && !wait_for_room(q, lock, packet_bytes(packet)))
+        return 1;
+    if (q->closed)
+        return 1;
+    enqueue(q, { .packet = std::move(*packet), .droppable = false });
+    return 0;
+}
+
+int send_queue_try_push(struct send_queue* q, struct packet* packet) {
+    lock_guard<mutex> guard(q->guard);
+    if (q->closed || !has_room(q, packet_bytes(packet)))
+        return 1;
+    enqueue(q, { .packet = std::move(*packet), .droppable = false });
+    return 0;
+}
+
+int send_queue_push_chunk(struct send_queue* q, struct packet* packet, struct chunk_id id,
+                          enum slow_client_policy policy) {
+    TRACE_SPAN("send_queue_push_chunk");
+    size_t size = packet_bytes(packet);
+    unique_lock<mutex> lock(q->guard);
+    if (q->closed)
+        return 1;
+
+    if (!has_room(q, size)) {
+        if (policy == SLOW_CLIENT_DISCONNECT) {
+            if (!wait_for_room(q, lock, size))
+                return 1;
+        } else {
+            // the oldest chunks first; the writer has already taken whatever it is sending
+            for (size_t i = 0; i < q->count && !has_room(q, size); i++) {
+                if (queued(q, i)->droppable)
+                    drop(q, queued(q, i));
+            }
+        }
+    }
+
+    struct queued_packet p = { .packet = std::move(*packet), .droppable = true, .id = id };
+    if (!has_room(q, size)) {
+        p.droppable = false;
+        encode_dropped(&p.packet, id);
+        stats_add(STAT_CHUNKS_DROPPED);
+    }
+    enqueue(q, std::move(p));
+    return 0;
+}
+
+void send_queue_close(struct send_queue* q) {
+    lock_guard<mutex> guard(q->guard);
+    q->closed = true;
+    stats_gauge_add(STAT_GAUGE_SEND_QUEUE_BYTES, -(int64_t)q->bytes);
+    for (size_t i = 0; i < q->count; i++)
+        queued(q, i)->packet.payload.reset();
+    q->count = 0;
+    q->bytes = 0;
+    q->changed.notify_all();
+}
+
+void send_queue_run(struct send_queue* q, sockpp::stream_socket* sock) {
+    trace_set_thread_name("client writer");
+    while (1) {
+        unique_lock<mutex> lock(q->guard);
+        q->changed.wait(lock, [q]() { return q->closed || q->count; });
+        if (q->closed)
+            return;
+        struct packet packet = std::move(queued(q, 0)->packet);
+        q->first = (q->first + 1) % q->ring.size();
+        q->count--;
+        size_t size = packet_bytes(&packet);
+        q->bytes -= size;
+        stats_gauge_add(STAT_GAUGE_SEND_QUEUE_BYTES, -(int64_t)size);
+        q->changed.notify_all();
+        lock.unlock();
+
+        TRACE_SPAN("send_packet");
+        if (send_packet(*sock, &packet) != 0) {
+            send_queue_close(q);
+            return;
+        }
+    }
+}
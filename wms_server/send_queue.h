@@ -0,0 +1,86 @@
+#pragma once
+
+// bounded queue of packets waiting to be sent to one client, written out by a thread of its own
+//
+// the client's handler thread queues its answers and goes straight back to work, rather than
+// blocking on the socket, and the queue holds at most SEND_QUEUE_MAX_BYTES of payload, so a
+// client which stops reading can't make the server hold an unbounded amount of data for it. when
+// a chunk doesn't fit, the slow client policy decides what happens:
+//
+// - SLOW_CLIENT_DROP: the oldest chunks still waiting (then if need be the new one) are replaced
+//   by CHUNK_STATUS_DROPPED answers, a few bytes each; by then the client has most likely moved on
+//   from them, and will ask again for any it still wants. every chunk asked for is still
+//   answered exactly once
+// - SLOW_CLIENT_DISCONNECT: the handler waits up to SEND_QUEUE_STALL_MS for room, then the
+//   client is disconnected
+//
+// packets which must be delivered as they are (everything but chunk packets, eg. the geojson
+// packets of a bbox request, which older clients count) always wait for room, up to
+// SEND_QUEUE_STALL_MS, under either policy
+//
+// packets can also be queued from other threads than the handler, eg. chunk layers by the
+// loader as it converts them (see chunk_manager.h); those are only queued if there is room
+// straight away, so one slow client can't hold up the thread for everyone else
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+
+#include "sockpp/tcp_acceptor.h"
+
+#include "cbor.h"
+#include "wms.h"
+
+#define SEND_QUEUE_MAX_BYTES (8 << 20)
+#define SEND_QUEUE_STALL_MS 10000
+
+enum slow_client_policy {
+    SLOW_CLIENT_DROP,
+    SLOW_CLIENT_DISCONNECT,
+};
+
+struct queued_packet {
+    struct packet packet;
+    // chunk the packet answers, if it may be dropped
+    bool droppable;
+    struct chunk_id id;
+};
+
+struct send_queue {
+    std::mutex guard;
+    // signalled when packets are queued or sent, and when the queue is closed
+    std::condition_variable changed;
+    // ring of the queued packets, count of them from first; it only ever grows, so once the
+    // connection has warmed up queuing a packet makes no heap allocation (a deque allocates & frees
+    // a block every few packets as they pass through it)
+    std::vector<struct queued_packet> ring;
+    size_t first = 0;
+    size_t count = 0;
+    // payload bytes queued, and the most ever queued
+    size_t bytes = 0;
+    size_t high_water = 0;
+    // set once the client is being disconnected; nothing more is queued or sent
+    bool closed = false;
+};
+
+// queues a packet which must be delivered, waiting for room if need be
+// returns 0 on success, or 1 if the client should be disconnected (the queue is closed, or the
+// client didn't make room in time)
+int send_queue_push(struct send_queue* q, struct packet* packet);
+
+// queues a packet if there is room for it right now, without waiting or dropping anything
+// returns 0 if it was queued, or 1 if there was no room or the queue is closed
+int send_queue_try_push(struct send_queue* q, struct packet* packet);
+
+// queues the answer for a chunk (a CHUNK or CHUNK_PUSH packet), applying policy if it doesn't fit
+// returns 0 on success (even if a chunk was dropped), or 1 if the client should be disconnected
+int send_queue_push_chunk(struct send_queue* q, struct packet* packet, struct chunk_id id,
+                          enum slow_client_policy policy);
+
+// stops the queue, throwing away whatever is still queued
+void send_queue_close(struct send_queue* q);
+
+// sends the queued packets to sock until the queue is closed or sending fails (closing the queue);
+// run on a thread of its own for each client
+void send_queue_run(struct send_queue* q, sockpp::stream_socket* sock);
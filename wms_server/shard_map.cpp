@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "shard_map.h"
+
+using namespace std;
+
+// finalizer of splitmix64; spreads nearby chunk ids (which differ in only a few bits) over the
+// whole ring
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// fnv-1a, mixed; must give the same result on every machine, so std::hash can't be used
+static uint64_t hash_string(const string& s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return mix64(h);
+}
+
+string shard_name(const struct shard_address* shard) {
+    return shard->host + ":" + to_string(shard->port);
+}
+
+void shard_map_build(struct shard_map* map, const vector<struct shard_address>& shards) {
+    map->shards = shards;
+    map->ring.clear();
+    map->ring.reserve(shards.size() * SHARD_VNODES);
+
+    vector<string> names;
+    for (size_t s = 0; s < shards.size(); s++) {
+        string name = shard_name(&shards[s]);
+        for (int v = 0; v < SHARD_VNODES; v++)
+            map->ring.push_back({ hash_string(name + "#" + to_string(v)), (uint16_t)s });
+        names.push_back(std::move(name));
+    }
+    sort(map->ring.begin(), map->ring.end());
+
+    map->epoch = 0;
+    if (shards.empty())
+        return;
+    sort(names.begin(), names.end());
+    string all;
+    for (const string& name : names)
+        all += name + "\n";
+    // 0 is kept for "not sharded"
+    map->epoch = (uint32_t)hash_string(all) | 1;
+}
+
+int shard_map_owner(const struct shard_map* map, struct chunk_id id) {
+    if (map->ring.empty())
+        return -1;
+
+    uint64_t h = mix64(chunk_id_key(&id));
+    auto it = lower_bound(map->ring.begin(), map->ring.end(), h,
+                          [](const pair<uint64_t, uint16_t>& point, uint64_t h) {
+                              return point.first < h;
+                          });
+    if (it == map->ring.end())
+        it = map->ring.begin();
+    return it->second;
+}
+
+int shard_map_find(const struct shard_map* map, const string& host, uint16_t port) {
+    for (size_t s = 0; s < map->shards.size(); s++) {
+        if (map->shards[s].host == host && map->shards[s].port == port)
+            return s;
+    }
+    return -1;
+}
+
+int parse_shard_address(const string& text, struct shard_address* out) {
+    size_t colon = text.rfind(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == text.size())
+        return 1;
+
+    char* end;
+    long port = strtol(text.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535)
+        return 2;
+
+    out->host = text.substr(0, colon);
+    out->port = port;
+    return 0;
+}
+
+int shard_map_load_file(const string& path, struct shard_map* map) {
+    ifstream f(path);
+    if (!f.is_open())
+        return 1;
+
+    vector<struct shard_address> shards;
+    string line;
+    while (getline(f, line)) {
+        // trailing whitespace (& windows line endings)
+        while (!line.empty() && isspace((unsigned char)line.back()))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        struct shard_address shard;
+        if (parse_shard_address(line, &shard))
+            return 2;
+        bool listed = any_of(shards.begin(), shards.end(), [&shard](const struct shard_address& s) {
+            return s.host == shard.host && s.port == shard.port;
+        });
+        if (listed)
+            continue;
+        if (shards.size() == MAX_SHARDS)
+            return 3;
+        shards.push_back(std::move(shard));
+    }
+
+    shard_map_build(map, shards);
+    return 0;
+}
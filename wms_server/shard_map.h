@@ -0,0 +1,54 @@
+#pragma once
+
+// consistent hash ring mapping chunks to the servers of a sharded deployment
+//
+// each shard is placed on a 64 bit ring at SHARD_VNODES points, hashed from its "host:port", and
+// a chunk belongs to the shard at the first point at or after the hash of its id (wrapping
+// around). points depend only on a shard's own address, so adding or removing one of N shards
+// only moves the chunks between its points and the points before them, about 1 / N of the
+// chunks, and the order shards are listed in doesn't matter. the many points per shard even out
+// how much of the ring each one owns
+//
+// every server of a deployment is given the same shard list, advertises it with its partition
+// info, and answers requests for chunks it doesn't own with CHUNK_STATUS_MOVED; clients route
+// each chunk to its owner, and fetch the list again when told a chunk has moved
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+#include "wms.h"
+
+// points on the ring per shard
+#define SHARD_VNODES 128
+#define MAX_SHARDS 64
+
+struct shard_map {
+    std::vector<struct shard_address> shards;
+    // (hash, index into shards) of every point, sorted by hash
+    std::vector<std::pair<uint64_t, uint16_t>> ring;
+    // hash of the shard list, independent of its order; 0 with no shards
+    uint32_t epoch = 0;
+};
+
+// "host:port", as shards are named on the ring
+std::string shard_name(const struct shard_address* shard);
+
+// replaces the shards of map and rebuilds its ring
+void shard_map_build(struct shard_map* map, const std::vector<struct shard_address>& shards);
+
+// index of the shard owning a chunk, or -1 if map has no shards
+int shard_map_owner(const struct shard_map* map, struct chunk_id id);
+
+// index of a shard by address, or -1 if it isn't in map
+int shard_map_find(const struct shard_map* map, const std::string& host, uint16_t port);
+
+// parses a "host:port" address
+// returns 0 on success, otherwise an error code
+int parse_shard_address(const std::string& text, struct shard_address* out);
+
+// reads a shard list from a file of "host:port" lines (blank lines & lines starting with # are
+// skipped) and builds map from it
+// returns 0 on success, otherwise an error code (map is left untouched)
+int shard_map_load_file(const std::string& path, struct shard_map* map);
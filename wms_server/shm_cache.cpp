@@ -0,0 +1,340 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <format>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_cache.h"
+#include "constants.h"
+#include "log.h"
+
+using namespace std;
+
+// slot states, in the low bits of shm_cache_slot::state, then SLOT_STALE; the pid of the process
+// filling a slot is kept in the bits above
+#define SLOT_EMPTY 0
+#define SLOT_FILLING 1
+#define SLOT_READY 2
+#define SLOT_STATE_MASK 3ULL
+// set on a filling or ready slot whose chunk's files have changed since it was (or is being) loaded
+#define SLOT_STALE 4ULL
+#define SLOT_STATE_BITS 3
+
+// keys are flipped so the key of no real chunk is 0, which marks an unclaimed slot
+#define SLOT_KEY_FLIP 0x8000000080000000ULL
+
+// a freshly created segment is all zeros, which is a valid empty cache, so nothing ever has to
+// initialise it (& no process can die part way through doing so)
+struct shm_cache_header {
+    // bytes ever written to the arena; chunk data lives at its offset modulo the arena size
+    atomic_uint64_t head;
+};
+
+struct shm_cache_slot {
+    // key of the chunk the slot holds, flipped; 0 until claimed, and only changed after by a
+    // process reclaiming the slot, which holds it filling & has seq odd while doing so
+    atomic_uint64_t key;
+    // SLOT_* | SLOT_STALE | pid << SLOT_STATE_BITS
+    atomic_uint64_t state;
+    // odd while key, offset & len are being changed
+    atomic_uint64_t seq;
+    atomic_uint64_t offset;
+    atomic_uint64_t len;
+};
+
+#define SLOTS_OFFSET 64
+#define ARENA_OFFSET (SLOTS_OFFSET + SHM_CACHE_SLOTS * sizeof(struct shm_cache_slot))
+#define SEGMENT_BYTES (ARENA_OFFSET + SHM_CACHE_ARENA_BYTES)
+
+static_assert(sizeof(struct shm_cache_header) <= SLOTS_OFFSET);
+static_assert((SHM_CACHE_SLOTS & (SHM_CACHE_SLOTS - 1)) == 0);
+
+static uint64_t filling_state() {
+    return SLOT_FILLING | ((uint64_t)getpid() << SLOT_STATE_BITS);
+}
+
+static bool process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// copies between the arena & a buffer, wrapping around the end of the arena
+static void arena_write(uint8_t* arena, uint64_t offset, const uint8_t* data, size_t len) {
+    size_t pos = offset % SHM_CACHE_ARENA_BYTES;
+    size_t first = min((size_t)(SHM_CACHE_ARENA_BYTES - pos), len);
+    memcpy(arena + pos, data, first);
+    memcpy(arena, data + first, len - first);
+}
+
+static void arena_read(const uint8_t* arena, uint64_t offset, uint8_t* data, size_t len) {
+    size_t pos = offset % SHM_CACHE_ARENA_BYTES;
+    size_t first = min((size_t)(SHM_CACHE_ARENA_BYTES - pos), len);
+    memcpy(data, arena + pos, first);
+    memcpy(data + first, arena, len - first);
+}
+
+// whether the data at offset hasn't been overwritten yet: nothing past offset + the arena size
+// has been claimed
+static bool arena_holds(const struct shm_cache* cache, uint64_t offset) {
+    return cache->header->head.load(memory_order_acquire) <= offset + SHM_CACHE_ARENA_BYTES;
+}
+
+// copies a ready slot's chunk into out
+// returns false if it has been overwritten, reclaimed for another chunk than key, or changed while
+// being read
+static bool read_slot(struct shm_cache* cache, struct shm_cache_slot* slot, uint64_t key,
+                      vector<uint8_t>* out) {
+    uint64_t seq = slot->seq.load(memory_order_acquire);
+    if (seq & 1 || slot->key.load(memory_order_relaxed) != key)
+        return false;
+    uint64_t offset = slot->offset.load(memory_order_relaxed);
+    uint64_t len = slot->len.load(memory_order_relaxed);
+    if (!arena_holds(cache, offset))
+        return false;
+
+    out->resize(len);
+    arena_read(cache->arena, offset, out->data(), len);
+
+    atomic_thread_fence(memory_order_acquire);
+    return slot->seq.load(memory_order_relaxed) == seq && arena_holds(cache, offset);
+}
+
+static uint64_t slot_key(struct chunk_id id) {
+    return chunk_id_key(&id) ^ SLOT_KEY_FLIP;
+}
+
+static size_t first_slot(struct chunk_id id) {
+    return (chunk_id_key(&id) * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+// finds the slot of a chunk, claiming a free one for it if it has none yet and claim is set; NULL
+// if it has none, or with claim, every slot it may use is taken
+static struct shm_cache_slot* find_slot(struct shm_cache* cache, struct chunk_id id, bool claim) {
+    uint64_t key = slot_key(id);
+    size_t i = first_slot(id);
+    for (int probe = 0; probe < SHM_CACHE_MAX_PROBE; probe++, i++) {
+        struct shm_cache_slot* slot = &cache->slots[i & (SHM_CACHE_SLOTS - 1)];
+        uint64_t k = slot->key.load(memory_order_acquire);
+        // keys are never cleared, so the chunk can't be further along
+        if (k == 0 && !claim)
+            return NULL;
+        if (k == 0) {
+            // another process may claim it first, possibly for the same chunk
+            if (slot->key.compare_exchange_strong(k, key, memory_order_acq_rel))
+                return slot;
+        }
+        if (k == key)
+            return slot;
+    }
+    return NULL;
+}
+
+// takes over a slot a chunk may use from whichever chunk holds it, if that chunk's data has been
+// overwritten in the arena (or it was never filled), so a full table doesn't stop new chunks being
+// cached for good. the slot is returned filling, for the caller to fill; NULL if none could be
+// taken
+static struct shm_cache_slot* reclaim_slot(struct shm_cache* cache, struct chunk_id id) {
+    size_t i = first_slot(id);
+    for (int probe = 0; probe < SHM_CACHE_MAX_PROBE; probe++, i++) {
+        struct shm_cache_slot* slot = &cache->slots[i & (SHM_CACHE_SLOTS - 1)];
+        uint64_t state = slot->state.load(memory_order_acquire);
+        if ((state & SLOT_STATE_MASK) == SLOT_FILLING)
+            continue;
+        // the head only moves forward, so data found overwritten stays that way
+        if ((state & SLOT_STATE_MASK) == SLOT_READY
+            && arena_holds(cache, slot->offset.load(memory_order_relaxed)))
+            continue;
+        // holding the slot filling keeps every other process off it while its key changes
+        if (!slot->state.compare_exchange_strong(state, filling_state(), memory_order_acq_rel))
+            continue;
+
+        uint64_t seq = slot->seq.load(memory_order_relaxed);
+        slot->seq.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot->key.store(slot_key(id), memory_order_relaxed);
+        slot->seq.store(seq + 2, memory_order_release);
+        return slot;
+    }
+    return NULL;
+}
+
+int shm_cache_open(struct shm_cache* cache, const string& name) {
+    if (cache->map)
+        return -1;
+
+    string full_name = format("{}_f{}_v{}", name, SHM_CACHE_FORMAT, GEODATA_VERSION);
+    int fd = shm_open(full_name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        LOG_WARN("could not open shared chunk cache %s: %s", full_name.c_str(), strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 2;
+    }
+    // processes racing to create the segment all size it the same, so that is harmless
+    if (st.st_size == 0 && ftruncate(fd, SEGMENT_BYTES) != 0) {
+        LOG_WARN("could not size shared chunk cache %s: %s", full_name.c_str(), strerror(errno));
+        close(fd);
+        return 3;
+    } else if (st.st_size != 0 && (size_t)st.st_size != SEGMENT_BYTES) {
+        LOG_WARN("shared chunk cache %s has the wrong size; remove it to recreate it", full_name.c_str());
+        close(fd);
+        return 4;
+    }
+
+    void* map = mmap(NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return 5;
+    }
+
+    cache->fd = fd;
+    cache->name = full_name;
+    cache->map = (char*)map;
+    cache->map_size = SEGMENT_BYTES;
+    cache->header = (struct shm_cache_header*)cache->map;
+    cache->slots = (struct shm_cache_slot*)(cache->map + SLOTS_OFFSET);
+    cache->arena = (uint8_t*)(cache->map + ARENA_OFFSET);
+    return 0;
+}
+
+void shm_cache_close(struct shm_cache* cache) {
+    if (!cache->map)
+        return;
+    munmap(cache->map, cache->map_size);
+    close(cache->fd);
+    cache->map = NULL;
+    cache->fd = -1;
+}
+
+bool shm_cache_is_open(const struct shm_cache* cache) {
+    return cache->map != NULL;
+}
+
+enum shm_cache_lookup shm_cache_acquire(struct shm_cache* cache, struct chunk_id id,
+                                        vector<uint8_t>* out, struct shm_cache_ticket* ticket) {
+    if (!cache->map)
+        return SHM_CACHE_UNCACHED;
+
+    struct shm_cache_slot* slot = find_slot(cache, id, true);
+    if (!slot) {
+        slot = reclaim_slot(cache, id);
+        if (!slot)
+            return SHM_CACHE_UNCACHED;
+        ticket->slot = slot;
+        return SHM_CACHE_FILL;
+    }
+
+    uint64_t key = slot_key(id);
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(SHM_CACHE_FILL_WAIT_MS);
+    while (1) {
+        uint64_t state = slot->state.load(memory_order_acquire);
+        // reclaimed by another process since it was found
+        if (slot->key.load(memory_order_acquire) != key)
+            return SHM_CACHE_UNCACHED;
+
+        switch (state & SLOT_STATE_MASK) {
+        case SLOT_READY:
+            if (!(state & SLOT_STALE) && read_slot(cache, slot, key, out))
+                return SHM_CACHE_HIT;
+            // overwritten by newer chunks, or stale; whoever notices first loads it again
+            break;
+        case SLOT_EMPTY:
+            break;
+        case SLOT_FILLING: {
+            pid_t pid = state >> SLOT_STATE_BITS;
+            if (!process_alive(pid)) {
+                LOG_WARN("taking over chunk (%d, %d) from exited process %d", id.x, id.y, pid);
+                break;
+            }
+            if (chrono::steady_clock::now() > deadline)
+                return SHM_CACHE_UNCACHED;
+            this_thread::sleep_for(chrono::microseconds(100));
+            continue;
+        }
+        }
+
+        // a failed swap means another process got there first, so look again
+        if (slot->state.compare_exchange_strong(state, filling_state(), memory_order_acq_rel)) {
+            // the slot may have been reclaimed & filled again between checking its key & the swap
+            if (slot->key.load(memory_order_acquire) != key) {
+                slot->state.store(state, memory_order_release);
+                return SHM_CACHE_UNCACHED;
+            }
+            ticket->slot = slot;
+            ticket->stale = state == (SLOT_READY | SLOT_STALE)
+                && arena_holds(cache, slot->offset.load(memory_order_relaxed));
+            return SHM_CACHE_FILL;
+        }
+    }
+}
+
+bool shm_cache_peek(struct shm_cache* cache, struct chunk_id id, vector<uint8_t>* out) {
+    if (!cache->map)
+        return false;
+    struct shm_cache_slot* slot = find_slot(cache, id, false);
+    return slot && (slot->state.load(memory_order_acquire) & SLOT_STATE_MASK) == SLOT_READY
+        && read_slot(cache, slot, slot_key(id), out);
+}
+
+void shm_cache_fill(struct shm_cache* cache, struct shm_cache_ticket* ticket,
+                    const uint8_t* data, size_t len) {
+    struct shm_cache_slot* slot = ticket->slot;
+    if (len > SHM_CACHE_MAX_ENTRY_BYTES) {
+        shm_cache_abandon(cache, ticket);
+        return;
+    }
+
+    // claimed before writing, so readers of whatever this overwrites see the head has passed it
+    uint64_t offset = cache->header->head.fetch_add(len, memory_order_acq_rel);
+    atomic_thread_fence(memory_order_release);
+    arena_write(cache->arena, offset, data, len);
+
+    uint64_t seq = slot->seq.load(memory_order_relaxed);
+    slot->seq.store(seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->offset.store(offset, memory_order_relaxed);
+    slot->len.store(len, memory_order_relaxed);
+    slot->seq.store(seq + 2, memory_order_release);
+
+    // marked stale while it was being loaded, in which case it may have been loaded from old files
+    uint64_t filling = filling_state();
+    if (!slot->state.compare_exchange_strong(filling, SLOT_READY, memory_order_acq_rel))
+        slot->state.store(SLOT_READY | SLOT_STALE, memory_order_release);
+    ticket->slot = NULL;
+}
+
+void shm_cache_abandon(struct shm_cache* cache, struct shm_cache_ticket* ticket) {
+    ticket->slot->state.store(ticket->stale ? SLOT_READY | SLOT_STALE : SLOT_EMPTY, memory_order_release);
+    ticket->slot = NULL;
+}
+
+void shm_cache_invalidate(struct shm_cache* cache, struct chunk_id id) {
+    if (!cache->map)
+        return;
+    struct shm_cache_slot* slot = find_slot(cache, id, false);
+    if (!slot)
+        return;
+    uint64_t key = slot_key(id);
+    uint64_t state = slot->state.load(memory_order_acquire);
+    // a failed swap reloads state, so this retries until the slot is empty, already stale, or
+    // marked; an empty slot has nothing to go stale, and whoever fills it reads the new files
+    while ((state & SLOT_STATE_MASK) != SLOT_EMPTY && !(state & SLOT_STALE)) {
+        // reclaimed for another chunk since it was found
+        if (slot->key.load(memory_order_acquire) != key)
+            return;
+        if (slot->state.compare_exchange_weak(state, state | SLOT_STALE, memory_order_acq_rel))
+            return;
+    }
+}
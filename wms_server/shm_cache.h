@@ -0,0 +1,112 @@
+#pragma once
+
+// cache of encoded chunks in posix shared memory, shared by every server process on the machine
+// (eg. several shards, or servers run side by side for isolation), so each chunk's geojson is
+// parsed & encoded once per machine rather than once per process
+//
+// the segment holds a fixed open addressed table of slots keyed by chunk id, followed by a ring
+// arena the encoded chunks are written into. nothing in it is locked:
+//
+// - a slot is claimed for a chunk by compare & swapping its key in. keys are never cleared, but
+//   once every slot a chunk may use is taken, a slot whose chunk has been overwritten in the arena
+//   (or was never filled) is reclaimed for it: the reclaiming process holds the slot filling while
+//   it changes the key, and readers check the key along with the seqlock below, so nobody takes
+//   the new chunk's data for the old one's
+// - a slot's state is compare & swapped from empty to filling (recording the pid of the process
+//   doing so), so only one process loads each chunk; others wait for it to become ready. a slot
+//   left filling by a process which has since died is taken over by the next process to find it
+// - data is appended to the arena by atomically advancing its head, wrapping around & overwriting
+//   the oldest chunks. readers copy a chunk out then check the head hasn't since passed over it,
+//   and each slot's offset & length are guarded seqlock style, so a chunk being overwritten or
+//   refilled is never returned half written; an overwritten chunk is just loaded again
+// - a chunk invalidated (eg. because its files changed) is marked stale rather than removed. a stale chunk is loaded again by the next process to acquire it, as if it had been
+//   overwritten, but is still given out by shm_cache_peek() until then. a chunk marked stale while
+//   it is being filled (from the files it had before) is stored stale
+//
+// the segment outlives the processes using it, so a server that restarts finds the cache as it
+// left it. its name includes the format & GEODATA_VERSION, so servers of different versions
+// never share one. remove it with `rm /dev/shm/<name>` (or shm_unlink()) to start from scratch
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "wms.h"
+
+// bumped whenever the layout of the segment, or how processes use it, changes
+#define SHM_CACHE_FORMAT 3
+#define SHM_CACHE_DEFAULT_NAME "/geo_chunk_cache"
+
+// number of slots in the table; must be a power of two. once the slots a chunk may go in are all
+// taken by other chunks still in the arena it is simply not cached
+#define SHM_CACHE_SLOTS (1 << 16)
+// slots looked at for each chunk
+#define SHM_CACHE_MAX_PROBE 64
+#define SHM_CACHE_ARENA_BYTES (256ULL << 20)
+// chunks bigger than this aren't cached, so one chunk can't flush most of the arena
+#define SHM_CACHE_MAX_ENTRY_BYTES (SHM_CACHE_ARENA_BYTES / 16)
+// how long to wait for another process to fill a chunk before loading it without the cache
+#define SHM_CACHE_FILL_WAIT_MS 2000
+
+struct shm_cache_header;
+struct shm_cache_slot;
+
+struct shm_cache {
+    int fd = -1;
+    std::string name;
+    char* map = NULL;
+    size_t map_size = 0;
+    struct shm_cache_header* header = NULL;
+    struct shm_cache_slot* slots = NULL;
+    uint8_t* arena = NULL;
+};
+
+// outcome of shm_cache_acquire()
+enum shm_cache_lookup {
+    // the chunk was copied out of the cache
+    SHM_CACHE_HIT,
+    // the caller now has the job of filling the chunk's slot, and must call shm_cache_fill() or
+    // shm_cache_abandon()
+    SHM_CACHE_FILL,
+    // the chunk can't be cached (no free slot, or another process is taking too long to fill it);
+    // the caller should load it without the cache
+    SHM_CACHE_UNCACHED,
+};
+
+// slot the caller is filling, from shm_cache_acquire()
+struct shm_cache_ticket {
+    struct shm_cache_slot* slot = NULL;
+    // the slot still holds a stale copy of the chunk, which is kept if filling is abandoned
+    bool stale = false;
+};
+
+// opens the cache segment name (with the format & data version appended), creating it if no
+// other process has yet
+// returns 0 on success, otherwise an error code
+int shm_cache_open(struct shm_cache* cache, const std::string& name);
+
+// unmaps the segment; it is left for other processes (& later runs) to use
+void shm_cache_close(struct shm_cache* cache);
+
+bool shm_cache_is_open(const struct shm_cache* cache);
+
+// looks a chunk up, copying it into out if it is cached; otherwise the caller may be given the
+// job of filling it (see shm_cache_lookup). always SHM_CACHE_UNCACHED if the cache isn't open
+enum shm_cache_lookup shm_cache_acquire(struct shm_cache* cache, struct chunk_id id,
+                                        std::vector<uint8_t>* out, struct shm_cache_ticket* ticket);
+
+// copies a chunk into out if it is cached & ready (stale or not), without waiting on a process filling it or
+// taking on the job of filling it
+// returns false if it isn't
+bool shm_cache_peek(struct shm_cache* cache, struct chunk_id id, std::vector<uint8_t>* out);
+
+// stores the chunk a ticket was given for, making it available to every process
+void shm_cache_fill(struct shm_cache* cache, struct shm_cache_ticket* ticket,
+                    const uint8_t* data, size_t len);
+
+// gives up filling a chunk (eg. because it couldn't be loaded), so another process can try
+void shm_cache_abandon(struct shm_cache* cache, struct shm_cache_ticket* ticket);
+
+// marks a chunk stale, so the next process to acquire it loads it again
+void shm_cache_invalidate(struct shm_cache* cache, struct chunk_id id);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <poll.h>
 
 #include "sockpp/tcp_acceptor.h"
 
@@ -45,7 +46,7 @@ int read_packet(sockpp::stream_socket & sock, struct packet* packet) {
     // cout << "read head, waiting to read " << packet->header.payload_len << endl;
 
     if (packet->header.payload_len > 0) {
-        packet->payload = make_unique<char[]>(packet->header.payload_len);
+        packet->payload = acquire_packet_buffer(packet->header.payload_len);
         res = sock.read_n(packet->payload.get(), packet->header.payload_len);
         if (!res)
             return -1;
@@ -53,3 +54,8 @@ int read_packet(sockpp::stream_socket & sock, struct packet* packet) {
 
     return 0;
 }
+
+bool socket_readable(sockpp::stream_socket & sock, int timeout_ms) {
+    struct pollfd p = { .fd = sock.handle(), .events = POLLIN, .revents = 0 };
+    return poll(&p, 1, timeout_ms) > 0;
+}
@@ -17,3 +17,7 @@ int send_packet(sockpp::stream_socket & sock, const struct packet* packet);
 // packet type and length
 // returns 0 on success, otherwise an error code
 int read_packet(sockpp::stream_socket & sock, struct packet* packet);
+
+// whether there is something to read on the socket (or it has been closed), waiting up to
+// timeout_ms for it
+bool socket_readable(sockpp::stream_socket & sock, int timeout_ms);
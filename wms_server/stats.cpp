@@ -0,0 +1,170 @@
+#include <atomic>
+#include <chrono>
+
+#include "stats.h"
+#include "constants.h"
+
+using namespace std;
+
+static const char* const counter_names[STAT_COUNTER_COUNT] = {
+    "packets_recieved",
+    "bbox_requests",
+    "chunk_requests",
+    "chunks_requested",
+    "chunks_local",
+    "chunks_queued",
+    "chunks_known_missing",
+    "chunks_sent",
+    "chunks_failed",
+    "chunks_moved",
+    "chunks_stale",
+    "chunks_pending",
+    "chunks_pushed",
+    "chunks_dropped",
+    "slow_disconnects",
+    "shm_cache_hits",
+    "shm_cache_fills",
+    "layers_streamed",
+    "bytes_sent",
+    "loader_tasks",
+    "loader_already_stored",
+    "osm_fetches",
+    "prewarm_fetches",
+    "osm_errors",
+    "convert_errors",
+    "store_evictions",
+    "connections",
+    "disconnects",
+};
+
+static const char* const gauge_names[STAT_GAUGE_COUNT] = {
+    "clients",
+    "work_queue",
+    "hot_chunks",
+    "store_bytes",
+    "send_queue_bytes",
+    "send_queue_high_water",
+};
+
+static const char* const histogram_names[STAT_HISTOGRAM_COUNT] = {
+    "bbox_request_us",
+    "chunk_request_us",
+    "load_chunks_us",
+    "queue_wait_us",
+    "loader_task_us",
+    "osm_fetch_us",
+    "osm_convert_us",
+};
+
+struct histogram {
+    atomic_uint64_t count;
+    atomic_uint64_t sum;
+    atomic_uint64_t max;
+    atomic_uint64_t buckets[STATS_BUCKETS];
+};
+
+static const chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+
+static atomic_uint64_t counters[STAT_COUNTER_COUNT];
+static atomic_int64_t gauges[STAT_GAUGE_COUNT];
+static atomic_int64_t client_backlog[MAX_CLIENTS];
+static struct histogram histograms[STAT_HISTOGRAM_COUNT];
+
+void stats_add(enum stat_counter c, uint64_t n) {
+    counters[c].fetch_add(n, memory_order_relaxed);
+}
+
+void stats_gauge_add(enum stat_gauge g, int64_t delta) {
+    gauges[g].fetch_add(delta, memory_order_relaxed);
+}
+
+void stats_gauge_set(enum stat_gauge g, int64_t value) {
+    gauges[g].store(value, memory_order_relaxed);
+}
+
+void stats_gauge_max(enum stat_gauge g, int64_t value) {
+    int64_t cur = gauges[g].load(memory_order_relaxed);
+    while (cur < value && !gauges[g].compare_exchange_weak(cur, value, memory_order_relaxed))
+        ;
+}
+
+void stats_client_backlog_add(uint8_t client, int64_t delta) {
+    if (client < MAX_CLIENTS)
+        client_backlog[client].fetch_add(delta, memory_order_relaxed);
+}
+
+void stats_client_backlog_set(uint8_t client, int64_t value) {
+    if (client < MAX_CLIENTS)
+        client_backlog[client].store(value, memory_order_relaxed);
+}
+
+void stats_record(enum stat_histogram h, uint64_t us) {
+    struct histogram* hist = &histograms[h];
+    hist->buckets[stats_bucket_index(us)].fetch_add(1, memory_order_relaxed);
+    hist->count.fetch_add(1, memory_order_relaxed);
+    hist->sum.fetch_add(us, memory_order_relaxed);
+
+    uint64_t max = hist->max.load(memory_order_relaxed);
+    while (us > max && !hist->max.compare_exchange_weak(max, us, memory_order_relaxed))
+        ;
+}
+
+void stats_record_since(enum stat_histogram h, chrono::steady_clock::time_point start) {
+    auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    stats_record(h, us.count());
+}
+
+void stats_snapshot(struct server_stats* out) {
+    out->uptime_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count();
+
+    out->counters.clear();
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+        out->counters.push_back({ .name = counter_names[i], .value = (int64_t)counters[i].load(memory_order_relaxed) });
+
+    out->gauges.clear();
+    for (int i = 0; i < STAT_GAUGE_COUNT; i++)
+        out->gauges.push_back({ .name = gauge_names[i], .value = gauges[i].load(memory_order_relaxed) });
+
+    out->client_backlog.clear();
+    for (uint32_t i = 0; i < MAX_CLIENTS; i++) {
+        int64_t backlog = client_backlog[i].load(memory_order_relaxed);
+        if (backlog)
+            out->client_backlog.push_back({ i, backlog });
+    }
+
+    out->histograms.clear();
+    for (int i = 0; i < STAT_HISTOGRAM_COUNT; i++) {
+        struct histogram* hist = &histograms[i];
+        struct stats_histogram h = {
+            .name = histogram_names[i],
+            .count = hist->count.load(memory_order_relaxed),
+            .sum = hist->sum.load(memory_order_relaxed),
+            .max = hist->max.load(memory_order_relaxed),
+            .buckets = {},
+        };
+        for (uint32_t b = 0; b < STATS_BUCKETS; b++) {
+            uint64_t n = hist->buckets[b].load(memory_order_relaxed);
+            if (n)
+                h.buckets.push_back({ stats_bucket_max(b), n });
+        }
+        out->histograms.push_back(std::move(h));
+    }
+}
+
+uint64_t stats_percentile(const struct stats_histogram* h, double p) {
+    uint64_t total = 0;
+    for (const pair<uint64_t, uint64_t>& b : h->buckets)
+        total += b.second;
+    if (!total)
+        return 0;
+
+    // rank of the value wanted, counting from 1
+    uint64_t rank = max<uint64_t>(1, (uint64_t)(p / 100 * total + 0.5));
+    uint64_t seen = 0;
+    for (const pair<uint64_t, uint64_t>& b : h->buckets) {
+        seen += b.second;
+        if (seen >= rank)
+            return min(b.first, h->max);
+    }
+    return h->max;
+}
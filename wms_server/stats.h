@@ -0,0 +1,186 @@
+#pragma once
+
+// server statistics: counters, gauges and latency histograms, recorded on the hot paths of the
+// server and sent to anyone who asks with a PACKET_TYPE_STATS_QUERY (see server_stats.cpp for a
+// cli which polls them)
+//
+// everything is recorded with relaxed atomic operations on fixed, statically allocated slots, so
+// recording never takes a lock or allocates, and never makes one thread wait for another.
+// snapshots are not atomic as a whole; counters read a little apart may be off by a few events
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+// monotonically increasing event counts
+enum stat_counter {
+    // packets of any type recieved from clients
+    STAT_PACKETS_RECIEVED,
+    STAT_BBOX_REQUESTS,
+    STAT_CHUNK_REQUESTS,
+    // chunks covered by bbox & chunk requests, and how many of those were already stored on disk (hits)
+    // or had to go through the loader's work queue (misses)
+    STAT_CHUNKS_REQUESTED,
+    STAT_CHUNKS_LOCAL,
+    STAT_CHUNKS_QUEUED,
+    // chunks answered straight away as known to be empty, or to have failed too recently to retry
+    STAT_CHUNKS_NEGATIVE,
+    STAT_CHUNKS_SENT,
+    // chunks answered with CHUNK_STATUS_ERROR
+    STAT_CHUNKS_FAILED,
+    // chunks answered with CHUNK_STATUS_MOVED, as another shard owns them
+    STAT_CHUNKS_MOVED,
+    // chunks not ready by their request's deadline: answered as CHUNK_STATUS_STALE with a copy
+    // from the shared chunk cache, or as CHUNK_STATUS_PENDING, and how many were pushed once ready
+    STAT_CHUNKS_STALE,
+    STAT_CHUNKS_PENDING,
+    STAT_CHUNKS_PUSHED,
+    // chunks replaced by CHUNK_STATUS_DROPPED as their client wasn't keeping up, and clients
+    // disconnected for not keeping up
+    STAT_CHUNKS_DROPPED,
+    STAT_SLOW_DISCONNECTS,
+    // chunks found already encoded in the shared chunk cache, and chunks this process encoded &
+    // added to it
+    STAT_SHM_HITS,
+    STAT_SHM_FILLS,
+    // chunk layers streamed to clients by the loader as they were converted
+    STAT_LAYERS_STREAMED,
+    STAT_BYTES_SENT,
+    // tasks taken off the work queue by the loader, and how many of those turned out to be
+    // stored already by the time it got to them
+    STAT_LOADER_TASKS,
+    STAT_LOADER_ALREADY_STORED,
+    STAT_OSM_FETCHES,
+    // chunks fetched by the loader while idle, before any client asked for them (see prewarm.h)
+    STAT_PREWARM_FETCHES,
+    // osm api requests that failed, and osm data that could not be converted by gdal
+    STAT_OSM_ERRORS,
+    STAT_CONVERT_ERRORS,
+    // chunks evicted from the store to keep it under its quota
+    STAT_STORE_EVICTIONS,
+    STAT_CONNECTIONS,
+    STAT_DISCONNECTS,
+    STAT_COUNTER_COUNT,
+};
+
+// current levels
+enum stat_gauge {
+    STAT_GAUGE_CLIENTS,
+    // chunks waiting on the loader's work queue
+    STAT_GAUGE_WORK_QUEUE,
+    // chunks hot enough for their neighbours to be pre-warmed, as of the last refresh
+    STAT_GAUGE_HOT_CHUNKS,
+    // bytes of chunk files in the store
+    STAT_GAUGE_STORE_BYTES,
+    // bytes queued to be sent to all clients, and the most ever queued for any one client
+    STAT_GAUGE_SEND_QUEUE_BYTES,
+    STAT_GAUGE_SEND_QUEUE_HIGH_WATER,
+    STAT_GAUGE_COUNT,
+};
+
+// latencies, in microseconds
+enum stat_histogram {
+    // a bbox / chunk request in handler(), from recieving it to sending its last chunk
+    STAT_HIST_BBOX_REQUEST,
+    STAT_HIST_CHUNK_REQUEST,
+    STAT_HIST_LOAD_CHUNKS,
+    // how long chunks wait on the work queue before the loader takes them
+    STAT_HIST_QUEUE_WAIT,
+    // one task of server_chunk_loader_handler(), including notifying clients
+    STAT_HIST_LOADER_TASK,
+    // fetch_map_for_chunk(), ie. downloading & converting a chunk
+    STAT_HIST_OSM_FETCH,
+    // write_osm_to_geojson(), the conversion part of the above
+    STAT_HIST_OSM_CONVERT,
+    STAT_HISTOGRAM_COUNT,
+};
+
+// histograms use hdr style log-linear buckets: values below STATS_SUB_BUCKETS each have a bucket
+// of their own, and every power of two above that is split into STATS_SUB_BUCKETS equal buckets,
+// so any recorded value is within 1 / STATS_SUB_BUCKETS (6.25%) of its bucket's bounds
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+// values are clamped to below 1 << STATS_MAX_VALUE_BITS (~12 days in microseconds)
+#define STATS_MAX_VALUE_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_VALUE_BITS - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+// bucket a value is counted in
+inline uint32_t stats_bucket_index(uint64_t v) {
+    if (v >= 1ULL << STATS_MAX_VALUE_BITS)
+        v = (1ULL << STATS_MAX_VALUE_BITS) - 1;
+    if (v < STATS_SUB_BUCKETS)
+        return v;
+    uint32_t e = 63 - __builtin_clzll(v);
+    uint32_t sub = (v >> (e - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (e - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+// largest value counted in a bucket
+inline uint64_t stats_bucket_max(uint32_t i) {
+    if (i < STATS_SUB_BUCKETS)
+        return i;
+    uint32_t e = i / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (e - STATS_SUB_BUCKET_BITS);
+    return (STATS_SUB_BUCKETS + i % STATS_SUB_BUCKETS) * width + width - 1;
+}
+
+// ----- recording -----
+
+void stats_add(enum stat_counter c, uint64_t n = 1);
+
+void stats_gauge_add(enum stat_gauge g, int64_t delta);
+void stats_gauge_set(enum stat_gauge g, int64_t value);
+// raises g to value if it is lower, for high water marks
+void stats_gauge_max(enum stat_gauge g, int64_t value);
+
+// chunks a client has requested but not yet been sent
+void stats_client_backlog_add(uint8_t client, int64_t delta);
+void stats_client_backlog_set(uint8_t client, int64_t value);
+
+void stats_record(enum stat_histogram h, uint64_t us);
+
+// records the time since start into h
+void stats_record_since(enum stat_histogram h, std::chrono::steady_clock::time_point start);
+
+// records the lifetime of the timer into h, for timing functions with several ways out
+struct stats_timer {
+    enum stat_histogram histogram;
+    std::chrono::steady_clock::time_point start;
+
+    stats_timer(enum stat_histogram h) : histogram(h), start(std::chrono::steady_clock::now()) {}
+    ~stats_timer() { stats_record_since(histogram, start); }
+};
+
+// ----- snapshots -----
+
+struct stats_value {
+    std::string name;
+    int64_t value;
+};
+
+struct stats_histogram {
+    std::string name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    // (largest value in bucket, count) of every non-empty bucket, in ascending order
+    std::vector<std::pair<uint64_t, uint64_t>> buckets;
+};
+
+// everything recorded so far, as sent in a PACKET_TYPE_STATS packet; entries are named, so a cli
+// can show the stats of a server with more or fewer of them than it knows about
+struct server_stats {
+    uint64_t uptime_us;
+    std::vector<struct stats_value> counters;
+    std::vector<struct stats_value> gauges;
+    // (client, backlog) of every client with a backlog
+    std::vector<std::pair<uint32_t, int64_t>> client_backlog;
+    std::vector<struct stats_histogram> histograms;
+};
+
+void stats_snapshot(struct server_stats* out);
+
+// value below which p percent (0 to 100) of the histogram's values lie, to within its bucket
+uint64_t stats_percentile(const struct stats_histogram* h, double p);
@@ -0,0 +1,144 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <nlohmann/json.hpp>
+
+#include "trace.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+struct trace_event {
+    // 2 * n + 1 while the nth span to be written to the ring is being written to this slot,
+    // 2 * n + 2 once it is complete
+    atomic_uint64_t seq;
+    atomic<const char*> name;
+    atomic_uint64_t start;
+    atomic_uint64_t dur;
+    atomic_uint64_t request;
+    atomic_uint32_t tid;
+};
+
+atomic_bool trace_enabled = false;
+
+static struct trace_event ring[TRACE_RING_EVENTS];
+// number of spans ever written
+static atomic_uint64_t ring_next = 0;
+
+static atomic_uint32_t next_tid = 1;
+static atomic_uint32_t next_request = 0;
+
+static thread_local uint32_t thread_tid = 0;
+static thread_local uint64_t thread_request = 0;
+
+static mutex thread_names_guard;
+static unordered_map<uint32_t, const char*> thread_names;
+
+static uint32_t get_tid() {
+    if (!thread_tid)
+        thread_tid = next_tid++;
+    return thread_tid;
+}
+
+void trace_set_enabled(bool enabled) {
+    trace_enabled = enabled;
+}
+
+uint64_t trace_now_us() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_record(const char* name, uint64_t start_us, uint64_t end_us) {
+    if (!trace_enabled.load(memory_order_relaxed))
+        return;
+
+    uint64_t n = ring_next.fetch_add(1, memory_order_relaxed);
+    struct trace_event* e = &ring[n & (TRACE_RING_EVENTS - 1)];
+
+    e->seq.store(2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->name.store(name, memory_order_relaxed);
+    e->start.store(start_us, memory_order_relaxed);
+    e->dur.store(end_us > start_us ? end_us - start_us : 0, memory_order_relaxed);
+    e->request.store(thread_request, memory_order_relaxed);
+    e->tid.store(get_tid(), memory_order_relaxed);
+    e->seq.store(2 * n + 2, memory_order_release);
+}
+
+void trace_set_thread_name(const char* name) {
+    lock_guard<mutex> guard(thread_names_guard);
+    thread_names[get_tid()] = name;
+}
+
+uint64_t trace_current_request() {
+    return thread_request;
+}
+
+uint64_t trace_new_request_id() {
+    // the pid keeps ids from the client & server apart when their traces are loaded together
+    return ((uint64_t)getpid() << 32) | ++next_request;
+}
+
+trace_request_scope::trace_request_scope(uint64_t request_id) {
+    prev = thread_request;
+    thread_request = request_id;
+}
+
+trace_request_scope::~trace_request_scope() {
+    thread_request = prev;
+}
+
+string trace_dump_json() {
+    json events = json::array();
+    int pid = getpid();
+
+    uint64_t end = ring_next.load(memory_order_acquire);
+    uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+    for (uint64_t n = begin; n < end; n++) {
+        struct trace_event* e = &ring[n & (TRACE_RING_EVENTS - 1)];
+
+        uint64_t seq = e->seq.load(memory_order_acquire);
+        // still being written, or already overwritten by a newer span
+        if (seq != 2 * n + 2)
+            continue;
+        const char* name = e->name.load(memory_order_relaxed);
+        uint64_t start = e->start.load(memory_order_relaxed);
+        uint64_t dur = e->dur.load(memory_order_relaxed);
+        uint64_t request = e->request.load(memory_order_relaxed);
+        uint32_t tid = e->tid.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (e->seq.load(memory_order_relaxed) != seq)
+            continue;
+
+        json event = {
+            {"name", name},
+            {"cat", "geo"},
+            {"ph", "X"},
+            {"ts", start},
+            {"dur", dur},
+            {"pid", pid},
+            {"tid", tid},
+        };
+        if (request)
+            event["args"] = {{"request", request}};
+        events.push_back(std::move(event));
+    }
+
+    thread_names_guard.lock();
+    for (const auto& [tid, name] : thread_names)
+        events.push_back({
+                {"name", "thread_name"}, {"ph", "M"}, {"pid", pid}, {"tid", tid},
+                {"args", {{"name", name}}},
+            });
+    thread_names_guard.unlock();
+
+    json trace = {
+        {"traceEvents", std::move(events)},
+        {"displayTimeUnit", "ms"},
+    };
+    return trace.dump();
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+// scoped span tracing, exported as chrome trace json (open in chrome://tracing or
+// https://ui.perfetto.dev)
+//
+// a span times the scope it is declared in:
+//
+//   void load_something() {
+//       TRACE_SPAN("load_something");
+//       ...
+//   }
+//
+// finished spans are written to a fixed size ring buffer shared by every thread, so only the most
+// recent TRACE_RING_EVENTS spans are kept. writing a span is a single atomic increment to claim a
+// slot plus a few relaxed stores (each slot is guarded seqlock style, so a dump taken while spans
+// are being written skips half written ones rather than waiting); nothing locks or allocates.
+// tracing starts disabled, in which case a span costs one relaxed load and a branch. defining
+// NO_TRACING removes spans entirely at compile time
+//
+// each span is tagged with the id of the request the thread is working on, set with a
+// trace_request_scope; ids are carried across threads (in work queue entries) and to the server
+// (in chunk request packets), so every span of one chunk request can be picked out, from the client's
+// fetch through to the server's conversion of its osm data
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+
+// number of spans kept; must be a power of two
+#define TRACE_RING_EVENTS (1 << 16)
+
+extern std::atomic_bool trace_enabled;
+
+void trace_set_enabled(bool enabled);
+
+// microseconds on the steady clock, which is shared by every process on the machine, so traces
+// from the client & server can be loaded together
+uint64_t trace_now_us();
+
+// records a finished span directly, for spans which don't correspond to a scope (eg. time spent
+// waiting on a queue)
+void trace_record(const char* name, uint64_t start_us, uint64_t end_us);
+
+// names the calling thread in dumped traces; name must outlive the program (eg. a literal)
+void trace_set_thread_name(const char* name);
+
+// id of the request the calling thread is working on, 0 for none
+uint64_t trace_current_request();
+
+// a new request id, unique across processes on the machine
+uint64_t trace_new_request_id();
+
+// sets the calling thread's request id for the lifetime of the scope
+struct trace_request_scope {
+    uint64_t prev;
+
+    trace_request_scope(uint64_t request_id);
+    ~trace_request_scope();
+};
+
+struct trace_span {
+    const char* name;
+    // 0 if tracing was disabled when the span started
+    uint64_t start;
+
+    trace_span(const char* name) : name(name), start(0) {
+        if (trace_enabled.load(std::memory_order_relaxed))
+            start = trace_now_us();
+    }
+    ~trace_span() {
+        if (start)
+            trace_record(name, start, trace_now_us());
+    }
+};
+
+#define TRACE_CONCAT_(A, B) A##B
+#define TRACE_CONCAT(A, B) TRACE_CONCAT_(A, B)
+#ifndef NO_TRACING
+#define TRACE_SPAN(NAME) struct trace_span TRACE_CONCAT(trace_span_, __LINE__)(NAME)
+#else
+#define TRACE_SPAN(NAME) do {} while (0)
+#endif
+
+// the spans currently in the ring buffer, oldest first, as chrome trace json
+std::string trace_dump_json();
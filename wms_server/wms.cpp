@@ -1,4 +1,3 @@
-#include <iostream>
 #include <format>
 #include <cmath>
 #include <memory>
@@ -6,49 +5,46 @@
 
 #include "wms.h"
 #include "constants.h"
+#include "log.h"
 
 using namespace std;
 
 void print_bbox(const struct bbox* query) {
-    cout << "getmap\n\tminx: " << query->minx
-         << "\n\tminy: " << query->miny
-         << "\n\tmaxx: " << query->maxx
-         << "\n\tmaxy: " << query->maxy << endl;
+    LOG_DEBUG("getmap minx: %f miny: %f maxx: %f maxy: %f", query->minx, query->miny, query->maxx,
+              query->maxy);
 }
 
-// file base for various features corresponding to a specific bounding box
-// generally files will then be suffixed ased on feature information eg.
-// map_bbox_0_0_1_1_points.geojson would be a complete file name
-string get_bbox_filename(const struct bbox* query) {
-    return format("map_bbox_{}_{}_{}_{}",
-                  round(query->minx * BBOX_PER_DEG),
-                  round(query->miny * BBOX_PER_DEG),
-                  round(query->maxx * BBOX_PER_DEG),
-                  round(query->maxy * BBOX_PER_DEG));
+// file base for the layers of a chunk, named after its corners in the partition grid; files are
+// then suffixed based on feature information eg. map_bbox_0_0_1_1_points.geojson would be a
+// complete file name
+string get_chunk_filename(struct chunk_id id) {
+    return format("map_bbox_{}_{}_{}_{}", id.x, id.y, id.x + 1, id.y + 1);
 }
 
-// splits a bbox into a grid of regularly sized bounding boxes, as defined by the server partition
-// resolution. NOTE set of gridded bboxes will always be a superset of the provided user input,
-// so every point in the outer bbox will be returned, but if it partially fills a square of the
-// partition grid, the whole grid tile will be returned
-size_t create_normalized_bbox(const struct bbox* outer, unique_ptr<struct bbox[]>* arr) {
-    float minx = floor(outer->minx * BBOX_PER_DEG) / BBOX_PER_DEG;
-    float miny = floor(outer->miny * BBOX_PER_DEG) / BBOX_PER_DEG;
-    float maxx = (floor(outer->maxx * BBOX_PER_DEG) + 1) / BBOX_PER_DEG;
-    float maxy = (floor(outer->maxy * BBOX_PER_DEG) + 1) / BBOX_PER_DEG;
-
-    size_t bboxes_x = (size_t)round(abs(maxx-minx) * BBOX_PER_DEG),
-        bboxes_y = (size_t)round(abs(maxy-miny) * BBOX_PER_DEG);
-
-    *arr = make_unique<struct bbox[]>(bboxes_x * bboxes_y);
-
-    for (size_t x = 0; x < bboxes_x; x++)
-        for (size_t y = 0; y < bboxes_y; y++)
-            (*arr)[x * bboxes_y + y] = (struct bbox){
-                .minx = minx + (float)x / BBOX_PER_DEG,
-                .miny = miny + (float)y / BBOX_PER_DEG,
-                .maxx = minx + (float)(x+1) / BBOX_PER_DEG,
-                .maxy = miny + (float)(y+1) / BBOX_PER_DEG,
-            };
-    return bboxes_x * bboxes_y;
+struct bbox get_chunk_bbox(struct chunk_id id, int bbox_per_deg) {
+    // divided in double precision so the corners shared by neighbouring chunks come out the same
+    return (struct bbox){
+        .minx = (float)((double)id.x / bbox_per_deg),
+        .miny = (float)((double)id.y / bbox_per_deg),
+        .maxx = (float)((double)(id.x + 1) / bbox_per_deg),
+        .maxy = (float)((double)(id.y + 1) / bbox_per_deg),
+    };
+}
+
+struct chunk_origin get_chunk_origin(struct chunk_id id, int bbox_per_deg) {
+    return (struct chunk_origin){
+        .lon = (double)id.x / bbox_per_deg,
+        .lat = (double)id.y / bbox_per_deg,
+    };
+}
+
+void get_bbox_chunk_ids(const struct bbox* outer, int bbox_per_deg, vector<struct chunk_id>* ids) {
+    int32_t minx = floor((double)outer->minx * bbox_per_deg);
+    int32_t miny = floor((double)outer->miny * bbox_per_deg);
+    int32_t maxx = floor((double)outer->maxx * bbox_per_deg);
+    int32_t maxy = floor((double)outer->maxy * bbox_per_deg);
+
+    for (int32_t x = minx; x <= maxx; x++)
+        for (int32_t y = miny; y <= maxy; y++)
+            ids->push_back({ .x = x, .y = y });
 }
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <string>
 #include <memory>
+#include <vector>
 
 #define CBOR_BBOX_BYTES 37
 struct bbox {
@@ -14,17 +15,73 @@ struct bbox {
     float maxy;
 };
 
+// address of one server of a sharded deployment (see shard_map.h)
+struct shard_address {
+    std::string host;
+    uint16_t port;
+};
+
 // result returned from query to server about chunking resolution capabilities
 // (& and other general server info to add as necessary?...)
-#define CBOR_PARTITION_INFO_BYTES 3
-// because we assume 3 byte packet length, bbox_per_deg must be 2 bytes ie. 2^16
+// encoded as an array: 1 byte array header, 3 bytes for bbox_per_deg & 5 for data_version, then
+// for sharded servers 5 for shard_epoch & the shard list (see CBOR_SHARD_ADDRESS_BYTES)
+#define CBOR_PARTITION_INFO_BYTES 9
+#define CBOR_SHARDED_PARTITION_INFO_BYTES (CBOR_PARTITION_INFO_BYTES + 5 + 5)
+// most bytes an encoded shard address takes, past the length of its host
+#define CBOR_SHARD_ADDRESS_BYTES 15
+// because we assume 3 bytes for it, bbox_per_deg must be 2 bytes ie. 2^16
 #define MAX_ENCODABLE_BBOX_PER_DEG (1<<16)
 struct partition_info {
     uint32_t bbox_per_deg;
+    // version of the data served for each chunk (see GEODATA_VERSION); clients use this to tell
+    // whether chunks they have persisted are still valid. older servers don't send it, in which
+    // case it is decoded as 0
+    uint32_t data_version;
+    // identifies the shard list, so clients can tell when it has changed; 0 with no shards
+    uint32_t shard_epoch = 0;
+    // every server chunks are spread over, empty if this server serves every chunk itself.
+    // which shard owns a chunk is worked out from this list with a shard_map
+    std::vector<struct shard_address> shards;
 };
 
+// integer coordinates of a chunk in the server partition grid, ie. the lattitude / longitude of
+// the chunk's minimum corner multiplied by the partition resolution and rounded (floor)
+struct chunk_id {
+    int32_t x;
+    int32_t y;
+    // level of detail; 0 is the grid given by the partition resolution, and is the only level
+    // served at the moment
+    uint8_t level = 0;
+};
+
+// packs a chunk id into a single integer which can be used as a hash / map key
+// NOTE the level isn't part of the key, so ids of different levels shouldn't share a map
+inline uint64_t chunk_id_key(const struct chunk_id* id) {
+    return ((uint64_t)(uint32_t)id->x << 32) | (uint32_t)id->y;
+}
+
+inline bool operator==(const struct chunk_id& a, const struct chunk_id& b) {
+    return a.x == b.x && a.y == b.y && a.level == b.level;
+}
+
 void print_bbox(const struct bbox* query);
 
-std::string get_bbox_filename(const struct bbox* query);
+// file base for the layers of a chunk (see get_chunk_filename() in wms.cpp)
+std::string get_chunk_filename(struct chunk_id id);
+
+// bounds of a chunk in degrees, for a partition of bbox_per_deg chunks per degree
+struct bbox get_chunk_bbox(struct chunk_id id, int bbox_per_deg);
+
+// origin of a chunk's local coordinate frame: its minimum (south west) corner, in degrees. chunk
+// geometry is served in metres east & north of this point (see CHUNK_PROJ_FORMAT in constants.h)
+struct chunk_origin {
+    double lon;
+    double lat;
+};
+
+struct chunk_origin get_chunk_origin(struct chunk_id id, int bbox_per_deg);
 
-size_t create_normalized_bbox(const struct bbox* outer, std::unique_ptr<struct bbox[]>* arr);
+// appends the ids of every chunk which overlaps outer to ids, for a partition of bbox_per_deg
+// chunks per degree. NOTE the set of chunks will always cover the whole of outer, so if outer
+// partially covers a chunk, the whole chunk is included
+void get_bbox_chunk_ids(const struct bbox* outer, int bbox_per_deg, std::vector<struct chunk_id>* ids);